@@ -0,0 +1,977 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <memory>
+#include <numeric>
+#include <algorithm>
+#include <set>
+#include <atomic>
+#include <unordered_map>
+#include <cuda.h>
+#include "../utilities.h"
+#include "../Collision/AABB.h"
+#include "../scene.h"
+#include "../intersections.cuh"
+#include "../threadPool.h"
+
+/// <summary>
+/// node of a flattened, depth-first ordered BVH
+/// the first child of an interior node is always the next node in the array
+/// </summary>
+struct bvhNode {
+	AABB bounds;
+	int offset; // leaf: index of the first primitive; interior: index of the second child
+	int count;  // leaf: number of primitives; interior: -(split axis + 1)
+
+	HOST DEVICE INLINE bool is_leaf() const {
+		return count > 0;
+	}
+	HOST DEVICE INLINE int axis() const {
+		return -count - 1;
+	}
+};
+
+/// <summary>
+/// header of the linear image of a BVH, followed by the node array and then the primitive array
+/// </summary>
+struct bvhImageHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_nodes;
+	uint32_t num_prims;
+	uint32_t depth;
+	uint32_t size; // of the whole image in bytes
+};
+static constexpr uint32_t BVH_IMAGE_MAGIC = 0x48425642; // "BVHB"
+static constexpr uint32_t BVH_IMAGE_VERSION = 1;
+
+/// <summary>
+/// finds the closest hit along the ray, children are visited front to back
+/// </summary>
+/// <param name="nodes"> flattened node array </param>
+/// <param name="root"> index of the root of the tree in the node array </param>
+/// <param name="ray"> ray, its direction does not have to be normalized </param>
+/// <param name="hit"> closest hit, only overwritten by closer hits </param>
+/// <param name="stats"> optional traversal counters </param>
+/// <param name="leaf"> tests the primitives of a leaf, via leaf.intersect_leaf(node, ray, hit, stats, occlusion) </param>
+/// <param name="occlusion"> stop at the first hit closer than hit.t instead of looking for the closest one </param>
+/// <returns> whether there is any closer hit </returns>
+template<typename Leaf>
+__host__ __device__ bool bvhTraverse(bvhNode const* nodes, int root, Ray const& ray, HitInfo& hit, TraversalStats* stats, Leaf const& leaf,
+	bool occlusion = false) {
+	TraversalRay box_ray = makeTraversalRay(ray);
+	float t_near, t_far;
+	if (!AABBRayRange(nodes[root].bounds, box_ray, t_near, t_far) || t_near >= hit.t) {
+		return false;
+	}
+
+	bool any_hit = false;
+	int stack[BVH_MAX_DEPTH];
+	float stack_t[BVH_MAX_DEPTH];
+	int sp = 0;
+	int cur = root;
+
+	while (true) {
+		bvhNode const& node = nodes[cur];
+		if (stats) {
+			++stats->nodes_visited;
+		}
+
+		if (node.is_leaf()) {
+			if (leaf.intersect_leaf(node, ray, hit, stats, occlusion)) {
+				if (occlusion) {
+					return true;
+				}
+				any_hit = true;
+			}
+		} else {
+			int near_child = cur + 1, far_child = node.offset;
+			if (box_ray.sign[node.axis()]) {
+				near_child = node.offset;
+				far_child = cur + 1;
+			}
+
+			float t_near_child, t_far_child;
+			bool hit_near = AABBRayRange(nodes[near_child].bounds, box_ray, t_near_child, t_far) && t_near_child < hit.t;
+			bool hit_far = AABBRayRange(nodes[far_child].bounds, box_ray, t_far_child, t_far) && t_far_child < hit.t;
+
+			if (hit_near && hit_far) {
+				if (t_far_child < t_near_child) {
+					int tmp = near_child;
+					near_child = far_child;
+					far_child = tmp;
+					t_far_child = t_near_child;
+				}
+				stack[sp] = far_child;
+				stack_t[sp] = t_far_child;
+				++sp;
+				cur = near_child;
+				continue;
+			} else if (hit_near) {
+				cur = near_child;
+				continue;
+			} else if (hit_far) {
+				cur = far_child;
+				continue;
+			}
+		}
+
+		// pop the next node that may still contain a closer hit
+		do {
+			if (!sp) {
+				return any_hit;
+			}
+			--sp;
+		} while (stack_t[sp] >= hit.t);
+		cur = stack[sp];
+	}
+}
+
+/// <summary>
+/// raw pointers to everything a BVH traversal touches
+/// all pointers are either host or device pointers
+/// </summary>
+struct bvhView {
+	bvhNode const* nodes;
+	leaf_data const* prims;
+	BakedTriangle const* baked; // optional, parallel to prims
+	int num_nodes;
+	Geom const* geoms;
+	CompactPrim const* compact; // parallel to geoms
+	Triangle const* tris;
+	Vertex const* verts;
+
+	__host__ __device__ bool intersect_leaf(bvhNode const& node, Ray const& ray, HitInfo& hit, TraversalStats* stats, bool occlusion) const {
+		bool any_hit = false;
+		for (int i = node.offset; i < node.offset + node.count && !(any_hit && occlusion); ++i) {
+			if (stats) {
+				++stats->prims_tested;
+			}
+			any_hit |= leafHitTest(prims[i], geoms, compact, tris, verts, ray, hit, baked ? baked + i : nullptr);
+		}
+		return any_hit;
+	}
+	__host__ __device__ bool intersect(Ray const& ray, HitInfo& hit, TraversalStats* stats) const {
+		return num_nodes && bvhTraverse(nodes, 0, ray, hit, stats, *this);
+	}
+	// whether anything is hit before tmax, stops at the first hit found
+	__host__ __device__ bool occluded(Ray const& ray, float tmax, TraversalStats* stats) const {
+		HitInfo hit;
+		hit.t = tmax;
+		return num_nodes && bvhTraverse(nodes, 0, ray, hit, stats, *this, true);
+	}
+};
+
+/// <summary>
+/// BVH built with a binned surface area heuristic
+/// either over every primitive of the scene, with triangles bounded in world space,
+/// or over the triangles of one mesh in object space;
+/// the scene can also be built with spatial splits (SBVH), which clip large triangles into several leaves
+/// </summary>
+class bvh {
+	friend struct bvhGPU;
+private:
+	struct build_prim {
+		AABB bounds;
+		glm::vec3 centroid;
+	};
+	struct build_node {
+		AABB bounds;
+		int begin, end;
+		int axis;
+		std::unique_ptr<build_node> children[2];
+		std::vector<leaf_data> prims; // references of a leaf, only used by the spatial split build
+	};
+	struct bin {
+		AABB bounds = AABB::empty();
+		int count = 0;
+	};
+	struct object_split {
+		float cost = FLT_MAX; // sum of the child areas weighted by their reference counts
+		int axis = -1;
+		int bin = -1;         // last centroid bin of the first child
+		AABB left, right;
+	};
+
+	// a possibly clipped reference to a primitive, in the spatial split build
+	struct spatial_ref {
+		build_prim box;
+		int prim; // index into the source primitives
+	};
+	struct spatial_bin {
+		AABB bounds = AABB::empty();
+		int enter = 0; // references starting in this bin
+		int exit = 0;  // references ending in this bin
+	};
+	struct spatial_split {
+		float cost = FLT_MAX;
+		int axis = -1;
+		int bin = -1; // the split plane is the upper boundary of this bin
+		float pos = 0;
+		AABB left, right;
+		int left_count = 0, right_count = 0;
+	};
+	struct spatial_build {
+		std::vector<leaf_data> const& prims;
+		std::vector<glm::vec3> const& verts; // world space vertices, 3 per primitive, unused for non-triangles
+		float min_overlap_area;
+		std::atomic<long long> budget; // extra references that may still be created
+		std::atomic<int> splits;
+
+		spatial_build(std::vector<leaf_data> const& prims, std::vector<glm::vec3> const& verts, float min_overlap_area, long long budget)
+			: prims(prims), verts(verts), min_overlap_area(min_overlap_area), budget(budget), splits(0) { }
+	};
+
+	std::vector<bvhNode> _nodes;
+	std::vector<leaf_data> _prims;
+	int _depth;
+	float _built_sah; // SAH cost right after the build, refits are measured against it
+	int _spatial_splits; // only known right after a spatial split build
+
+	// only filled on the first refit
+	std::vector<int> _parents;
+	std::unordered_map<int, std::vector<int>> _geom_leaves; // leaves referencing each geom
+
+	static int bin_index(glm::vec3 const& centroid, AABB const& centroid_bounds, int axis) {
+		float lo = centroid_bounds.min()[axis];
+		float ext = centroid_bounds.max()[axis] - lo;
+		int b = (int)(BVH_NUM_BINS * ((centroid[axis] - lo) / ext));
+		return glm::clamp(b, 0, BVH_NUM_BINS - 1);
+	}
+
+	// evaluates the SAH at every centroid bin boundary on all 3 axes
+	// get(i) returns the i-th of the count references of the node
+	template<typename Get>
+	static object_split find_object_split(Get const& get, int count, AABB const& centroid_bounds) {
+		object_split best;
+		for (int axis = 0; axis < 3; ++axis) {
+			if (centroid_bounds.max()[axis] - centroid_bounds.min()[axis] <= EPSILON) {
+				continue;
+			}
+
+			bin bins[BVH_NUM_BINS];
+			for (int i = 0; i < count; ++i) {
+				build_prim const& ref = get(i);
+				bin& b = bins[bin_index(ref.centroid, centroid_bounds, axis)];
+				b.bounds.expand(ref.bounds);
+				++b.count;
+			}
+
+			// sweep from the right to get the suffix bounds and counts
+			AABB right_bounds[BVH_NUM_BINS];
+			int right_count[BVH_NUM_BINS];
+			AABB acc = AABB::empty();
+			int acc_count = 0;
+			for (int i = BVH_NUM_BINS - 1; i > 0; --i) {
+				acc.expand(bins[i].bounds);
+				acc_count += bins[i].count;
+				right_bounds[i] = acc;
+				right_count[i] = acc_count;
+			}
+
+			acc = AABB::empty();
+			acc_count = 0;
+			for (int i = 0; i < BVH_NUM_BINS - 1; ++i) {
+				acc.expand(bins[i].bounds);
+				acc_count += bins[i].count;
+				if (!acc_count || !right_count[i + 1]) {
+					continue;
+				}
+				float cost = acc.surface_area() * acc_count + right_bounds[i + 1].surface_area() * right_count[i + 1];
+				if (cost < best.cost) {
+					best.cost = cost;
+					best.axis = axis;
+					best.bin = i;
+					best.left = acc;
+					best.right = right_bounds[i + 1];
+				}
+			}
+		}
+		return best;
+	}
+
+	void build(build_node& node, std::vector<build_prim> const& refs, int* order, int begin, int end, int depth) {
+		AABB bounds = AABB::empty(), centroid_bounds = AABB::empty();
+		for (int i = begin; i < end; ++i) {
+			bounds.expand(refs[order[i]].bounds);
+			centroid_bounds.expand(refs[order[i]].centroid);
+		}
+		node.bounds = bounds;
+		node.begin = begin;
+		node.end = end;
+		node.axis = -1;
+
+		int count = end - begin;
+		if (count == 1 || depth >= BVH_MAX_DEPTH - 1) {
+			return;
+		}
+
+		object_split split = find_object_split([&](int i) -> build_prim const& {
+			return refs[order[begin + i]];
+		}, count, centroid_bounds);
+		int best_axis = split.axis, best_split = split.bin;
+		float best_cost = split.cost;
+
+		int mid;
+		float area = bounds.surface_area();
+		if (best_axis == -1) {
+			// all centroids coincide, fall back to an object median split
+			if (count <= BVH_MAX_LEAF_SIZE) {
+				return;
+			}
+			best_axis = 0;
+			mid = begin + count / 2;
+		} else {
+			best_cost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST * best_cost / glm::max(area, EPSILON);
+			if (count <= BVH_MAX_LEAF_SIZE && BVH_INTERSECT_COST * count <= best_cost) {
+				return;
+			}
+			mid = std::partition(order + begin, order + end, [&](int i) {
+				return bin_index(refs[i].centroid, centroid_bounds, best_axis) <= best_split;
+			}) - order;
+		}
+
+		node.axis = best_axis;
+		node.children[0] = std::make_unique<build_node>();
+		node.children[1] = std::make_unique<build_node>();
+		if (count >= BVH_PARALLEL_THRESHOLD) {
+			TaskGroup group;
+			group.run([&]() {
+				build(*node.children[0], refs, order, begin, mid, depth + 1);
+			});
+			build(*node.children[1], refs, order, mid, end, depth + 1);
+			group.wait();
+		} else {
+			build(*node.children[0], refs, order, begin, mid, depth + 1);
+			build(*node.children[1], refs, order, mid, end, depth + 1);
+		}
+	}
+
+	static bool is_valid(AABB const& box) {
+		return box.min().x <= box.max().x && box.min().y <= box.max().y && box.min().z <= box.max().z;
+	}
+	static spatial_ref make_ref(AABB const& bounds, int prim) {
+		spatial_ref ref;
+		ref.box.bounds = bounds;
+		ref.box.centroid = bounds.center();
+		ref.prim = prim;
+		return ref;
+	}
+
+	// bounds of the part of a reference between two planes along an axis, invalid if nothing is left
+	static AABB clip_ref(spatial_build const& ctx, spatial_ref const& ref, int axis, float lo, float hi) {
+		glm::vec3 const* tri = ctx.prims[ref.prim].triangle_id != -1 ? &ctx.verts[3 * ref.prim] : nullptr;
+		return AABB::clip_slab(tri, ref.box.bounds, axis, lo, hi);
+	}
+
+	static int spatial_bin_index(float x, float lo, float bin_width) {
+		return glm::clamp((int)((x - lo) / bin_width), 0, BVH_NUM_BINS - 1);
+	}
+
+	// bins the references along every axis of the node bounds, clipping each one into all the bins it overlaps
+	static spatial_split find_spatial_split(spatial_build const& ctx, std::vector<spatial_ref> const& refs, AABB const& bounds) {
+		spatial_split best;
+		for (int axis = 0; axis < 3; ++axis) {
+			float lo = bounds.min()[axis];
+			float bin_width = (bounds.max()[axis] - lo) / BVH_NUM_BINS;
+			if (bin_width * BVH_NUM_BINS <= EPSILON) {
+				continue;
+			}
+
+			spatial_bin bins[BVH_NUM_BINS];
+			for (spatial_ref const& ref : refs) {
+				int first = spatial_bin_index(ref.box.bounds.min()[axis], lo, bin_width);
+				int last = spatial_bin_index(ref.box.bounds.max()[axis], lo, bin_width);
+				if (first == last) {
+					bins[first].bounds.expand(ref.box.bounds);
+				} else {
+					for (int b = first; b <= last; ++b) {
+						float bin_lo = b == first ? ref.box.bounds.min()[axis] : lo + b * bin_width;
+						float bin_hi = b == last ? ref.box.bounds.max()[axis] : lo + (b + 1) * bin_width;
+						AABB part = clip_ref(ctx, ref, axis, bin_lo, bin_hi);
+						if (is_valid(part)) {
+							bins[b].bounds.expand(part);
+						}
+					}
+				}
+				++bins[first].enter;
+				++bins[last].exit;
+			}
+
+			AABB right_bounds[BVH_NUM_BINS];
+			int right_count[BVH_NUM_BINS];
+			AABB acc = AABB::empty();
+			int acc_count = 0;
+			for (int i = BVH_NUM_BINS - 1; i > 0; --i) {
+				acc.expand(bins[i].bounds);
+				acc_count += bins[i].exit;
+				right_bounds[i] = acc;
+				right_count[i] = acc_count;
+			}
+
+			acc = AABB::empty();
+			acc_count = 0;
+			for (int i = 0; i < BVH_NUM_BINS - 1; ++i) {
+				acc.expand(bins[i].bounds);
+				acc_count += bins[i].enter;
+				if (!acc_count || !right_count[i + 1]) {
+					continue;
+				}
+				float cost = acc.surface_area() * acc_count + right_bounds[i + 1].surface_area() * right_count[i + 1];
+				if (cost < best.cost) {
+					best.cost = cost;
+					best.axis = axis;
+					best.bin = i;
+					best.pos = lo + (i + 1) * bin_width;
+					best.left = acc;
+					best.right = right_bounds[i + 1];
+					best.left_count = acc_count;
+					best.right_count = right_count[i + 1];
+				}
+			}
+		}
+		return best;
+	}
+
+	/// <summary>
+	/// distributes the references of a node to the two sides of a spatial split plane,
+	/// straddling references are clipped into both sides unless keeping them whole on one side is cheaper
+	/// </summary>
+	/// <returns> false if the budget is exhausted or one of the sides would be empty </returns>
+	static bool apply_spatial_split(spatial_build& ctx, std::vector<spatial_ref> const& refs, AABB const& bounds, spatial_split const& split,
+		std::vector<spatial_ref>& left, std::vector<spatial_ref>& right) {
+		float lo = bounds.min()[split.axis];
+		float bin_width = (bounds.max()[split.axis] - lo) / BVH_NUM_BINS;
+
+		// classify with the same bins the split was evaluated with
+		long long straddling = 0;
+		for (spatial_ref const& ref : refs) {
+			if (spatial_bin_index(ref.box.bounds.min()[split.axis], lo, bin_width) <= split.bin
+				&& spatial_bin_index(ref.box.bounds.max()[split.axis], lo, bin_width) > split.bin) {
+				++straddling;
+			}
+		}
+		// reserve the worst case up front, so that concurrent subtrees never exceed the budget
+		if (ctx.budget.fetch_sub(straddling) < straddling) {
+			ctx.budget.fetch_add(straddling);
+			return false;
+		}
+
+		long long duplicated = 0;
+		float left_area = split.left.surface_area(), right_area = split.right.surface_area();
+		for (spatial_ref const& ref : refs) {
+			int first = spatial_bin_index(ref.box.bounds.min()[split.axis], lo, bin_width);
+			int last = spatial_bin_index(ref.box.bounds.max()[split.axis], lo, bin_width);
+			if (last <= split.bin) {
+				left.push_back(ref);
+				continue;
+			}
+			if (first > split.bin) {
+				right.push_back(ref);
+				continue;
+			}
+
+			// unsplitting: compare the cost of the split against moving the whole reference to either side
+			AABB left_whole = split.left, right_whole = split.right;
+			left_whole.expand(ref.box.bounds);
+			right_whole.expand(ref.box.bounds);
+			float split_cost = left_area * split.left_count + right_area * split.right_count;
+			float left_cost = left_whole.surface_area() * split.left_count + right_area * (split.right_count - 1);
+			float right_cost = left_area * (split.left_count - 1) + right_whole.surface_area() * split.right_count;
+
+			AABB left_part = clip_ref(ctx, ref, split.axis, ref.box.bounds.min()[split.axis], split.pos);
+			AABB right_part = clip_ref(ctx, ref, split.axis, split.pos, ref.box.bounds.max()[split.axis]);
+			bool left_valid = is_valid(left_part), right_valid = is_valid(right_part);
+			if (left_valid && right_valid && split_cost < left_cost && split_cost < right_cost) {
+				left.push_back(make_ref(left_part, ref.prim));
+				right.push_back(make_ref(right_part, ref.prim));
+				++duplicated;
+			} else if (!right_valid || (left_valid && left_cost <= right_cost)) {
+				left.push_back(ref);
+			} else {
+				right.push_back(ref);
+			}
+		}
+		ctx.budget.fetch_add(straddling - duplicated);
+
+		if (left.empty() || right.empty()) {
+			ctx.budget.fetch_add(duplicated);
+			left.clear();
+			right.clear();
+			return false;
+		}
+		ctx.splits.fetch_add(1);
+		return true;
+	}
+
+	// the SBVH build of Stich et al., each node chooses the cheaper of the best object split and the best spatial split
+	void build_spatial(build_node& node, spatial_build& ctx, std::vector<spatial_ref>& refs, int depth) {
+		AABB bounds = AABB::empty(), centroid_bounds = AABB::empty();
+		for (spatial_ref const& ref : refs) {
+			bounds.expand(ref.box.bounds);
+			centroid_bounds.expand(ref.box.centroid);
+		}
+		node.bounds = bounds;
+		node.axis = -1;
+
+		int count = refs.size();
+		auto make_leaf = [&]() {
+			for (spatial_ref const& ref : refs) {
+				node.prims.push_back(ctx.prims[ref.prim]);
+			}
+		};
+		if (count == 1 || depth >= BVH_MAX_DEPTH - 1) {
+			make_leaf();
+			return;
+		}
+
+		object_split split = find_object_split([&](int i) -> build_prim const& {
+			return refs[i].box;
+		}, count, centroid_bounds);
+
+		// spatial splits only pay off where the children of the object split overlap
+		spatial_split spatial;
+		bool try_spatial = ctx.budget.load() > 0;
+		if (try_spatial && split.axis != -1) {
+			AABB overlap(glm::max(split.left.min(), split.right.min()), glm::min(split.left.max(), split.right.max()));
+			try_spatial = is_valid(overlap) && overlap.surface_area() > ctx.min_overlap_area;
+		}
+		if (try_spatial) {
+			spatial = find_spatial_split(ctx, refs, bounds);
+		}
+
+		float area = glm::max(bounds.surface_area(), EPSILON);
+		float best_cost = glm::min(split.cost, spatial.cost);
+		if (best_cost < FLT_MAX) {
+			best_cost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST * best_cost / area;
+			if (count <= BVH_MAX_LEAF_SIZE && BVH_INTERSECT_COST * count <= best_cost) {
+				make_leaf();
+				return;
+			}
+		} else if (count <= BVH_MAX_LEAF_SIZE) {
+			make_leaf();
+			return;
+		}
+
+		std::vector<spatial_ref> left, right;
+		if (spatial.cost < split.cost && apply_spatial_split(ctx, refs, bounds, spatial, left, right)) {
+			node.axis = spatial.axis;
+		} else if (split.axis != -1) {
+			node.axis = split.axis;
+			for (spatial_ref const& ref : refs) {
+				(bin_index(ref.box.centroid, centroid_bounds, split.axis) <= split.bin ? left : right).push_back(ref);
+			}
+		} else {
+			// all centroids coincide, fall back to an object median split
+			node.axis = 0;
+			left.assign(refs.begin(), refs.begin() + count / 2);
+			right.assign(refs.begin() + count / 2, refs.end());
+		}
+		// the children hold their own copies of the references
+		std::vector<spatial_ref>().swap(refs);
+
+		node.children[0] = std::make_unique<build_node>();
+		node.children[1] = std::make_unique<build_node>();
+		if (count >= BVH_PARALLEL_THRESHOLD) {
+			TaskGroup group;
+			group.run([&]() {
+				build_spatial(*node.children[0], ctx, left, depth + 1);
+			});
+			build_spatial(*node.children[1], ctx, right, depth + 1);
+			group.wait();
+		} else {
+			build_spatial(*node.children[0], ctx, left, depth + 1);
+			build_spatial(*node.children[1], ctx, right, depth + 1);
+		}
+	}
+
+	// lays out the subtree depth-first, returns the index of its root
+	int flatten(build_node const& node, int depth) {
+		int idx = _nodes.size();
+		_nodes.emplace_back();
+		_nodes[idx].bounds = node.bounds;
+		_depth = std::max(_depth, depth);
+
+		if (node.axis == -1 && node.prims.size()) {
+			// the spatial split build keeps the references in the leaves
+			_nodes[idx].offset = _prims.size();
+			_nodes[idx].count = node.prims.size();
+			_prims.insert(_prims.end(), node.prims.begin(), node.prims.end());
+		} else if (node.axis == -1) {
+			_nodes[idx].offset = node.begin;
+			_nodes[idx].count = node.end - node.begin;
+		} else {
+			flatten(*node.children[0], depth + 1);
+			int second = flatten(*node.children[1], depth + 1);
+			_nodes[idx].offset = second;
+			_nodes[idx].count = -(node.axis + 1);
+		}
+		return idx;
+	}
+public:
+	bvh(bvh const&) = delete;
+	bvh(bvh&&) = delete;
+
+	// builds over arbitrary primitives, given their bounds
+	bvh(std::vector<leaf_data> const& prims, std::vector<AABB> const& bounds) : _depth(0), _built_sah(0), _spatial_splits(0) {
+		if (prims.empty()) {
+			return;
+		}
+
+		std::vector<build_prim> refs(prims.size());
+		for (size_t i = 0; i < prims.size(); ++i) {
+			refs[i].bounds = bounds[i];
+			refs[i].centroid = bounds[i].center();
+		}
+		std::vector<int> order(refs.size());
+		std::iota(order.begin(), order.end(), 0);
+
+		build_node root;
+		build(root, refs, order.data(), 0, order.size(), 0);
+		flatten(root, 0);
+
+		_prims.reserve(prims.size());
+		for (int i : order) {
+			_prims.push_back(prims[i]);
+		}
+		_built_sah = sah_cost();
+	}
+
+	// builds over every primitive of the scene, triangles are bounded in world space
+	bvh(Scene const& scene) : bvh(world_prims(scene), world_bounds(scene)) { }
+
+	// builds over every primitive of the scene, with spatial splits that may reference a triangle from several leaves
+	bvh(Scene const& scene, SpatialSplitSettings const& settings) : _depth(0), _built_sah(0), _spatial_splits(0) {
+		std::vector<leaf_data> prims = world_prims(scene);
+		if (prims.empty()) {
+			return;
+		}
+
+		std::vector<glm::vec3> verts(prims.size() * 3);
+		std::vector<spatial_ref> refs(prims.size());
+		AABB root = AABB::empty();
+		for (int i = 0; i < prims.size(); ++i) {
+			if (prims[i].triangle_id != -1) {
+				Geom const& geom = scene.geoms[prims[i].geom_id];
+				for (int x = 0; x < 3; ++x) {
+					verts[3 * i + x] = glm::vec3(geom.transform * glm::vec4(scene.vertices[scene.triangles[prims[i].triangle_id].verts[x]], 1));
+				}
+			}
+			refs[i] = make_ref(world_bounds(scene, prims[i]), i);
+			root.expand(refs[i].box.bounds);
+		}
+
+		spatial_build ctx(prims, verts, settings.min_overlap * root.surface_area(), (long long)(settings.max_duplication * prims.size()));
+		build_node root_node;
+		build_spatial(root_node, ctx, refs, 0);
+		flatten(root_node, 0);
+		_spatial_splits = ctx.splits.load();
+		_built_sah = sah_cost();
+	}
+
+	// restores a tree from a valid image, image can point into a memory mapped file
+	bvh(char const* image, size_t size) : _depth(0), _built_sah(0), _spatial_splits(0) {
+		if (!validate_image(image, size)) {
+			return;
+		}
+		bvhImageHeader header;
+		memcpy(&header, image, sizeof(header));
+		bvhNode const* nodes = reinterpret_cast<bvhNode const*>(image + sizeof(header));
+		leaf_data const* prims = reinterpret_cast<leaf_data const*>(nodes + header.num_nodes);
+		_nodes.assign(nodes, nodes + header.num_nodes);
+		_prims.assign(prims, prims + header.num_prims);
+		_depth = header.depth;
+		_built_sah = sah_cost();
+	}
+
+	// adopts a tree laid out by another builder, e.g. buildLBVH
+	bvh(std::vector<bvhNode>&& nodes, std::vector<leaf_data>&& prims, int depth)
+		: _nodes(std::move(nodes)), _prims(std::move(prims)), _depth(depth), _built_sah(0), _spatial_splits(0) {
+		_built_sah = sah_cost();
+	}
+
+	// builds over the triangles of one mesh in object space, the geom ids of the primitives are -1
+	bvh(Scene const& scene, int mesh_id) : bvh(mesh_prims(scene, mesh_id), mesh_bounds(scene, mesh_id)) { }
+
+	static size_t num_world_prims(Scene const& scene) {
+		size_t ret = 0;
+		for (Geom const& geom : scene.geoms) {
+			ret += geom.type == MESH ? scene.meshes[geom.meshid].tri_end - scene.meshes[geom.meshid].tri_start : 1;
+		}
+		return ret;
+	}
+	static std::vector<leaf_data> world_prims(Scene const& scene) {
+		std::vector<leaf_data> prims;
+		for (int geom_id = 0; geom_id < scene.geoms.size(); ++geom_id) {
+			auto const& geom = scene.geoms[geom_id];
+			if (geom.type != MESH) {
+				prims.emplace_back(-1, geom_id);
+				continue;
+			}
+			for (int i = scene.meshes[geom.meshid].tri_start; i < scene.meshes[geom.meshid].tri_end; ++i) {
+				prims.emplace_back(i, geom_id);
+			}
+		}
+		return prims;
+	}
+	static std::vector<AABB> world_bounds(Scene const& scene) {
+		std::vector<AABB> bounds;
+		for (leaf_data const& prim : world_prims(scene)) {
+			bounds.push_back(world_bounds(scene, prim));
+		}
+		return bounds;
+	}
+	// world bounds of a triangle, or of a whole geom if triangle_id is -1
+	static AABB world_bounds(Scene const& scene, leaf_data const& prim) {
+		Geom const& geom = scene.geoms[prim.geom_id];
+		if (prim.triangle_id == -1) {
+			return geom.bounds;
+		}
+		AABB box = AABB::empty();
+		for (int x = 0; x < 3; ++x) {
+			box.expand(glm::vec3(geom.transform * glm::vec4(scene.vertices[scene.triangles[prim.triangle_id].verts[x]], 1)));
+		}
+		return box;
+	}
+	static std::vector<leaf_data> mesh_prims(Scene const& scene, int mesh_id) {
+		std::vector<leaf_data> prims;
+		for (int i = scene.meshes[mesh_id].tri_start; i < scene.meshes[mesh_id].tri_end; ++i) {
+			prims.emplace_back(i, -1);
+		}
+		return prims;
+	}
+	static std::vector<AABB> mesh_bounds(Scene const& scene, int mesh_id) {
+		std::vector<AABB> bounds;
+		for (int i = scene.meshes[mesh_id].tri_start; i < scene.meshes[mesh_id].tri_end; ++i) {
+			AABB box = AABB::empty();
+			for (int x = 0; x < 3; ++x) {
+				box.expand(scene.vertices[scene.triangles[i].verts[x]]);
+			}
+			bounds.push_back(box);
+		}
+		return bounds;
+	}
+
+	bvhView view(Scene const& scene, BakedTriangle const* baked = nullptr) const {
+		bvhView ret;
+		ret.nodes = _nodes.data();
+		ret.prims = _prims.data();
+		ret.baked = baked;
+		ret.num_nodes = _nodes.size();
+		ret.geoms = scene.geoms.data();
+		ret.compact = scene.compact_prims.data();
+		ret.tris = scene.triangles.data();
+		ret.verts = scene.vertices.data();
+		return ret;
+	}
+
+	// host traversal, used to measure and verify the tree without a GPU
+	bool intersect(Scene const& scene, Ray const& ray, HitInfo& hit, TraversalStats* stats = nullptr) const {
+		return view(scene).intersect(ray, hit, stats);
+	}
+	bool occluded(Scene const& scene, Ray const& ray, float tmax, TraversalStats* stats = nullptr) const {
+		return view(scene).occluded(ray, tmax, stats);
+	}
+
+	// lays the tree out in a linear format, header + nodes + primitives
+	std::vector<char> image() const {
+		bvhImageHeader header;
+		header.magic = BVH_IMAGE_MAGIC;
+		header.version = BVH_IMAGE_VERSION;
+		header.num_nodes = _nodes.size();
+		header.num_prims = _prims.size();
+		header.depth = _depth;
+		header.size = sizeof(header) + _nodes.size() * sizeof(bvhNode) + _prims.size() * sizeof(leaf_data);
+
+		std::vector<char> ret(header.size, 0);
+		memcpy(ret.data(), &header, sizeof(header));
+		if (_nodes.size()) {
+			memcpy(ret.data() + sizeof(header), _nodes.data(), _nodes.size() * sizeof(bvhNode));
+		}
+		if (_prims.size()) {
+			memcpy(ret.data() + sizeof(header) + _nodes.size() * sizeof(bvhNode), _prims.data(), _prims.size() * sizeof(leaf_data));
+		}
+		return ret;
+	}
+
+	// checks that an image is well formed before it is used
+	static bool validate_image(char const* data, size_t size) {
+		bvhImageHeader header;
+		if (size < sizeof(header)) {
+			return false;
+		}
+		memcpy(&header, data, sizeof(header));
+		if (header.magic != BVH_IMAGE_MAGIC || header.version != BVH_IMAGE_VERSION || header.size != size
+			|| header.depth > BVH_MAX_DEPTH
+			|| header.size != sizeof(header) + (uint64_t)header.num_nodes * sizeof(bvhNode) + (uint64_t)header.num_prims * sizeof(leaf_data)) {
+			return false;
+		}
+
+		bvhNode const* nodes = reinterpret_cast<bvhNode const*>(data + sizeof(header));
+		for (uint32_t i = 0; i < header.num_nodes; ++i) {
+			if (nodes[i].is_leaf()) {
+				if ((uint64_t)nodes[i].offset + nodes[i].count > header.num_prims || nodes[i].offset < 0) {
+					return false;
+				}
+			} else if (nodes[i].axis() < 0 || nodes[i].axis() > 2 || i + 1 >= header.num_nodes
+				|| nodes[i].offset <= (int)i + 1 || (uint32_t)nodes[i].offset >= header.num_nodes) {
+				// children come after their parent in depth-first order
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::vector<bvhNode> const& nodes() const {
+		return _nodes;
+	}
+	std::vector<leaf_data> const& prims() const {
+		return _prims;
+	}
+	size_t num_prims() const {
+		return _prims.size();
+	}
+	int depth() const {
+		return _depth;
+	}
+	// number of nodes split by a plane rather than by sorting the references, 0 for trees restored from an image
+	int spatial_splits() const {
+		return _spatial_splits;
+	}
+	/// <summary>
+	/// recomputes the bounds of the leaves referencing a geom and of their ancestors after the geom moved,
+	/// the topology is kept; only for trees over world space primitives, i.e. bvh(scene) or a top level
+	/// </summary>
+	/// <returns> number of nodes whose bounds were recomputed </returns>
+	int refit(Scene const& scene, int geom_id) {
+		if (_nodes.empty()) {
+			return 0;
+		}
+		if (_parents.empty()) {
+			_parents.assign(_nodes.size(), -1);
+			for (int i = 0; i < _nodes.size(); ++i) {
+				if (_nodes[i].is_leaf()) {
+					for (int j = _nodes[i].offset; j < _nodes[i].offset + _nodes[i].count; ++j) {
+						std::vector<int>& leaves = _geom_leaves[_prims[j].geom_id];
+						if (leaves.empty() || leaves.back() != i) {
+							leaves.push_back(i);
+						}
+					}
+				} else {
+					_parents[i + 1] = _parents[_nodes[i].offset] = i;
+				}
+			}
+		}
+
+		auto it = _geom_leaves.find(geom_id);
+		if (it == _geom_leaves.end()) {
+			return 0;
+		}
+		// children always come after their parent, so refitting from the back visits them first
+		std::set<int, std::greater<int>> dirty;
+		int touched = 0;
+		for (int leaf : it->second) {
+			bvhNode& node = _nodes[leaf];
+			node.bounds = AABB::empty();
+			for (int j = node.offset; j < node.offset + node.count; ++j) {
+				node.bounds.expand(world_bounds(scene, _prims[j]));
+			}
+			++touched;
+			if (_parents[leaf] != -1) {
+				dirty.insert(_parents[leaf]);
+			}
+		}
+		while (!dirty.empty()) {
+			int cur = *dirty.begin();
+			dirty.erase(dirty.begin());
+			bvhNode& node = _nodes[cur];
+			node.bounds = _nodes[cur + 1].bounds;
+			node.bounds.expand(_nodes[node.offset].bounds);
+			++touched;
+			if (_parents[cur] != -1) {
+				dirty.insert(_parents[cur]);
+			}
+		}
+		return touched;
+	}
+
+	// how much more expensive the tree is now than right after it was built, 1 means no change
+	float sah_drift() const {
+		return _built_sah > 0 ? sah_cost() / _built_sah : 1.f;
+	}
+
+	// expected cost of a random ray according to the SAH, relative to the root
+	float sah_cost() const {
+		if (_nodes.empty()) {
+			return 0;
+		}
+		float root_area = glm::max(_nodes[0].bounds.surface_area(), EPSILON);
+		float cost = 0;
+		for (bvhNode const& node : _nodes) {
+			float p = node.bounds.surface_area() / root_area;
+			if (node.is_leaf()) {
+				cost += p * BVH_INTERSECT_COST * node.count;
+			} else {
+				cost += p * BVH_TRAVERSAL_COST;
+			}
+		}
+		return cost;
+	}
+};
+
+/// <summary>
+/// GPU side view of the BVH
+/// the owner must call free() when the tree is no longer needed
+/// </summary>
+struct bvhGPU {
+	Span<bvhNode> _nodes;
+	Span<leaf_data> _prims;
+	Span<BakedTriangle> _baked; // empty if the triangles are not baked
+	MeshInfo _mesh_info;
+	Span<Geom> _geoms;
+
+	bvhGPU() : _mesh_info() { }
+	/// <param name="baked"> optional, Scene::bakeTriangles(tree.prims()) </param>
+	__host__ bvhGPU(bvh const& tree, MeshInfo mesh_info, Span<Geom> geoms, std::vector<BakedTriangle> const& baked = {})
+		: _nodes(make_span(tree._nodes)), _prims(make_span(tree._prims)), _baked(make_span(baked)),
+		_mesh_info(mesh_info), _geoms(geoms) { }
+
+	__host__ void free() {
+		FREE(_nodes);
+		FREE(_prims);
+		FREE(_baked);
+		_nodes = Span<bvhNode>();
+		_prims = Span<leaf_data>();
+		_baked = Span<BakedTriangle>();
+	}
+
+	// uploads the node bounds again after a refit, and the rebaked triangles if the tree has them
+	__host__ void update(bvh const& tree, std::vector<BakedTriangle> const& baked = {}) {
+		H2D(_nodes.get(), tree._nodes.data(), _nodes.size());
+		if (_baked.size() && baked.size() == _baked.size()) {
+			H2D(_baked.get(), baked.data(), _baked.size());
+		}
+	}
+
+	__host__ __device__ bvhView view() const {
+		bvhView ret;
+		ret.nodes = _nodes.get();
+		ret.prims = _prims.get();
+		ret.baked = _baked.get();
+		ret.num_nodes = _nodes.size();
+		ret.geoms = _geoms.get();
+		ret.compact = _mesh_info.compact_prims;
+		ret.tris = _mesh_info.tris;
+		ret.verts = _mesh_info.vertices;
+		return ret;
+	}
+
+	// only records the closest hit, its surface attributes are resolved by intersFromHit afterwards
+	__device__ bool search(HitInfo& hit, Ray const& ray, TraversalStats* stats = nullptr) const {
+		return view().intersect(ray, hit, stats);
+	}
+	// visibility test for shadow & ambient occlusion rays, no hit is recorded
+	__device__ bool occluded(Ray const& ray, float tmax, TraversalStats* stats = nullptr) const {
+		return view().occluded(ray, tmax, stats);
+	}
+};
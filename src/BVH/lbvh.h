@@ -0,0 +1,310 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif // _MSC_VER
+#include "../scene.h"
+#include "../threadPool.h"
+#include "bvh.h"
+
+/// <summary>
+/// linear BVH (LBVH) builder:
+/// primitives are sorted along a Morton curve and the hierarchy is emitted from the sorted codes as in Karras 2012;
+/// every step runs on the thread pool, the tree is worse than a SAH build but much faster to get
+/// </summary>
+namespace LBVH {
+	// number of chunks each parallel step is split into, per pool thread
+	static constexpr size_t CHUNKS_PER_THREAD = 4;
+
+	inline int clz32(uint32_t x) {
+#ifdef _MSC_VER
+		unsigned long idx;
+		return _BitScanReverse(&idx, x) ? 31 - (int)idx : 32;
+#else
+		return x ? __builtin_clz(x) : 32;
+#endif // _MSC_VER
+	}
+
+	// inserts two zeros between the lower 10 bits of v
+	HOST DEVICE inline uint32_t expandBits(uint32_t v) {
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	// 30 bit Morton code of a point, given in [0, 1]^3
+	HOST DEVICE inline uint32_t mortonCode(glm::vec3 const& p) {
+		glm::uvec3 q = glm::uvec3(glm::clamp(p * 1024.f, glm::vec3(0), glm::vec3(1023)));
+		return (expandBits(q.x) << 2) | (expandBits(q.y) << 1) | expandBits(q.z);
+	}
+
+	/// <summary>
+	/// stable LSD radix sort of key value pairs, 8 bits per pass;
+	/// each pass histograms the chunks in parallel, scans the histograms, then scatters the chunks in parallel
+	/// </summary>
+	/// <param name="key_bits"> only the lowest key_bits bits of the keys are sorted on </param>
+	inline void radixSort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values, int key_bits, ThreadPool& pool) {
+		size_t n = keys.size();
+		size_t num_chunks = pool.size() * CHUNKS_PER_THREAD;
+		std::vector<uint32_t> tmp_keys(n), tmp_values(n);
+		std::vector<size_t> offsets(num_chunks * 256);
+
+		for (int shift = 0; shift < key_bits; shift += 8) {
+			std::fill(offsets.begin(), offsets.end(), 0);
+			size_t used_chunks = parallelFor(pool, n, num_chunks, [&](size_t c, size_t begin, size_t end) {
+				size_t* hist = &offsets[c * 256];
+				for (size_t i = begin; i < end; ++i) {
+					++hist[(keys[i] >> shift) & 0xFF];
+				}
+			});
+
+			// a digit of an earlier chunk goes before the same digit of a later chunk, which keeps the sort stable
+			size_t sum = 0;
+			for (int digit = 0; digit < 256; ++digit) {
+				for (size_t c = 0; c < used_chunks; ++c) {
+					size_t count = offsets[c * 256 + digit];
+					offsets[c * 256 + digit] = sum;
+					sum += count;
+				}
+			}
+
+			parallelFor(pool, n, num_chunks, [&](size_t c, size_t begin, size_t end) {
+				size_t* offset = &offsets[c * 256];
+				for (size_t i = begin; i < end; ++i) {
+					size_t dst = offset[(keys[i] >> shift) & 0xFF]++;
+					tmp_keys[dst] = keys[i];
+					tmp_values[dst] = values[i];
+				}
+			});
+			keys.swap(tmp_keys);
+			values.swap(tmp_values);
+		}
+	}
+
+	// internal node of the Karras hierarchy, covering the sorted primitives [first, last]
+	struct karrasNode {
+		int first, last;
+		int children[2];
+		bool child_is_leaf[2];
+		int parent;
+		AABB bounds;
+		int size; // number of nodes in the flattened subtree
+	};
+
+	/// <summary>
+	/// length of the common prefix of the codes of two sorted primitives,
+	/// equal codes are told apart by their indices so that every prefix is unique
+	/// </summary>
+	/// <returns> -1 if j is out of range </returns>
+	inline int commonPrefix(std::vector<uint32_t> const& codes, int i, int j) {
+		if (j < 0 || j >= (int)codes.size()) {
+			return -1;
+		}
+		if (codes[i] == codes[j]) {
+			return 32 + clz32((uint32_t)i ^ (uint32_t)j);
+		}
+		return clz32(codes[i] ^ codes[j]);
+	}
+
+	// finds the range and the split of internal node i, independently of every other node
+	inline void emitNode(std::vector<uint32_t> const& codes, std::vector<karrasNode>& nodes, std::vector<int>& leaf_parents, int i) {
+		int d = commonPrefix(codes, i, i + 1) > commonPrefix(codes, i, i - 1) ? 1 : -1;
+
+		// grow the range away from the neighbor with the shorter common prefix, then binary search its end
+		int min_prefix = commonPrefix(codes, i, i - d);
+		int max_len = 2;
+		while (commonPrefix(codes, i, i + max_len * d) > min_prefix) {
+			max_len *= 2;
+		}
+		int len = 0;
+		for (int t = max_len / 2; t >= 1; t /= 2) {
+			if (commonPrefix(codes, i, i + (len + t) * d) > min_prefix) {
+				len += t;
+			}
+		}
+		int j = i + len * d;
+
+		// the split is where the common prefix of the whole range ends
+		int node_prefix = commonPrefix(codes, i, j);
+		int s = 0;
+		int step = len;
+		do {
+			step = (step + 1) / 2;
+			if (commonPrefix(codes, i, i + (s + step) * d) > node_prefix) {
+				s += step;
+			}
+		} while (step > 1);
+		int split = i + s * d + glm::min(d, 0);
+
+		karrasNode& node = nodes[i];
+		node.first = glm::min(i, j);
+		node.last = glm::max(i, j);
+		node.children[0] = split;
+		node.children[1] = split + 1;
+		node.child_is_leaf[0] = node.first == split;
+		node.child_is_leaf[1] = node.last == split + 1;
+		for (int c = 0; c < 2; ++c) {
+			(node.child_is_leaf[c] ? leaf_parents[node.children[c]] : nodes[node.children[c]].parent) = i;
+		}
+	}
+
+	// lays a subtree out depth-first starting at idx, big subtrees are laid out on other threads
+	inline void flatten(std::vector<karrasNode> const& nodes, std::vector<AABB> const& leaf_bounds, std::vector<bvhNode>& out,
+		int node_id, bool is_leaf, int idx, int depth, std::atomic<int>& max_depth, TaskGroup& group) {
+		int cur_max = max_depth.load();
+		while (depth > cur_max && !max_depth.compare_exchange_weak(cur_max, depth)) { }
+
+		if (is_leaf) {
+			out[idx].bounds = leaf_bounds[node_id];
+			out[idx].offset = node_id;
+			out[idx].count = 1;
+			return;
+		}
+		karrasNode const& node = nodes[node_id];
+		out[idx].bounds = node.bounds;
+		if (node.size == 1) {
+			// small ranges are collapsed into one leaf, the primitives are already contiguous
+			out[idx].offset = node.first;
+			out[idx].count = node.last - node.first + 1;
+			return;
+		}
+
+		// there is no split axis, order the children along the axis that separates them the most
+		AABB child_bounds[2];
+		int child_size[2];
+		for (int c = 0; c < 2; ++c) {
+			bool leaf = node.child_is_leaf[c];
+			child_bounds[c] = leaf ? leaf_bounds[node.children[c]] : nodes[node.children[c]].bounds;
+			child_size[c] = leaf ? 1 : nodes[node.children[c]].size;
+		}
+		glm::vec3 diff = glm::abs(child_bounds[1].center() - child_bounds[0].center());
+		int axis = diff.x > diff.y ? (diff.x > diff.z ? 0 : 2) : (diff.y > diff.z ? 1 : 2);
+		// the traversal takes the first child as the one on the low side of the axis
+		int order[2] = { 0, 1 };
+		if (child_bounds[0].center()[axis] > child_bounds[1].center()[axis]) {
+			std::swap(order[0], order[1]);
+		}
+		out[idx].offset = idx + 1 + child_size[order[0]];
+		out[idx].count = -(axis + 1);
+
+		for (int i = 0; i < 2; ++i) {
+			int c = order[i];
+			int child_idx = i ? idx + 1 + child_size[order[0]] : idx + 1;
+			int child = node.children[c];
+			bool leaf = node.child_is_leaf[c];
+			if (child_size[c] >= BVH_PARALLEL_THRESHOLD) {
+				group.run([&, child, leaf, child_idx, depth]() {
+					flatten(nodes, leaf_bounds, out, child, leaf, child_idx, depth + 1, max_depth, group);
+				});
+			} else {
+				flatten(nodes, leaf_bounds, out, child, leaf, child_idx, depth + 1, max_depth, group);
+			}
+		}
+	}
+}
+
+/// <summary>
+/// builds a BVH over every primitive of the scene with the linear builder, triangles are bounded in world space
+/// </summary>
+/// <param name="pool"> threads every step of the build runs on </param>
+inline std::unique_ptr<bvh> buildLBVH(Scene const& scene, ThreadPool& pool = ThreadPool::instance()) {
+	using namespace LBVH;
+	std::vector<leaf_data> prims = bvh::world_prims(scene);
+	int n = prims.size();
+	size_t num_chunks = pool.size() * CHUNKS_PER_THREAD;
+	if (!n) {
+		return std::make_unique<bvh>(std::vector<bvhNode>(), std::vector<leaf_data>(), 0);
+	}
+
+	// primitive bounds & the bounds of their centroids
+	std::vector<AABB> bounds(n);
+	std::vector<AABB> chunk_centroids(num_chunks, AABB::empty());
+	parallelFor(pool, n, num_chunks, [&](size_t c, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			bounds[i] = bvh::world_bounds(scene, prims[i]);
+			chunk_centroids[c].expand(bounds[i].center());
+		}
+	});
+	AABB centroid_bounds = AABB::empty();
+	for (AABB const& box : chunk_centroids) {
+		centroid_bounds.expand(box);
+	}
+
+	std::vector<uint32_t> codes(n), order(n);
+	glm::vec3 lo = centroid_bounds.min();
+	glm::vec3 inv_ext = 1.f / glm::max(centroid_bounds.max() - lo, glm::vec3(EPSILON));
+	parallelFor(pool, n, num_chunks, [&](size_t, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			codes[i] = mortonCode((bounds[i].center() - lo) * inv_ext);
+			order[i] = i;
+		}
+	});
+	radixSort(codes, order, 30, pool);
+
+	std::vector<leaf_data> sorted_prims(n);
+	std::vector<AABB> leaf_bounds(n);
+	parallelFor(pool, n, num_chunks, [&](size_t, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			sorted_prims[i] = prims[order[i]];
+			leaf_bounds[i] = bounds[order[i]];
+		}
+	});
+	std::vector<AABB>().swap(bounds);
+
+	// n - 1 internal nodes, each found independently of the others
+	std::vector<karrasNode> nodes(glm::max(n - 1, 0));
+	std::vector<int> leaf_parents(n, -1);
+	if (n > 1) {
+		nodes[0].parent = -1;
+		parallelFor(pool, n - 1, num_chunks, [&](size_t, size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				emitNode(codes, nodes, leaf_parents, i);
+			}
+		});
+	}
+
+	// bounds & flattened sizes bottom-up, the second child to arrive at a node completes it
+	std::unique_ptr<std::atomic<int>[]> arrivals(new std::atomic<int>[nodes.size() + 1]);
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		arrivals[i].store(0);
+	}
+	parallelFor(pool, n, num_chunks, [&](size_t, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			int cur = leaf_parents[i];
+			while (cur != -1 && arrivals[cur].fetch_add(1, std::memory_order_acq_rel) == 1) {
+				karrasNode& node = nodes[cur];
+				node.bounds = AABB::empty();
+				node.size = 1;
+				for (int c = 0; c < 2; ++c) {
+					if (node.child_is_leaf[c]) {
+						node.bounds.expand(leaf_bounds[node.children[c]]);
+						node.size += 1;
+					} else {
+						node.bounds.expand(nodes[node.children[c]].bounds);
+						node.size += nodes[node.children[c]].size;
+					}
+				}
+				if (node.last - node.first + 1 <= BVH_MAX_LEAF_SIZE) {
+					node.size = 1;
+				}
+				cur = node.parent;
+			}
+		}
+	});
+
+	// every internal node has a longer common prefix than its parent, at most 62 bits, so the depth stays below BVH_MAX_DEPTH
+	std::vector<bvhNode> out(n > 1 ? nodes[0].size : 1);
+	std::atomic<int> depth(0);
+	{
+		TaskGroup group(pool);
+		flatten(nodes, leaf_bounds, out, 0, n == 1, 0, 0, depth, group);
+		group.wait();
+	}
+	return std::make_unique<bvh>(std::move(out), std::move(sorted_prims), depth.load());
+}
@@ -0,0 +1,291 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <memory>
+#include <cuda.h>
+#include "../utilities.h"
+#include "../scene.h"
+#include "../intersections.cuh"
+#include "../threadPool.h"
+#include "bvh.h"
+
+/// <summary>
+/// tests the triangles of a bottom-level leaf against an object space ray
+/// </summary>
+struct blasView {
+	leaf_data const* prims;
+	BakedTriangle const* baked; // optional, parallel to prims, in object space
+	Triangle const* tris;
+	Vertex const* verts;
+
+	__host__ __device__ bool intersect_leaf(bvhNode const& node, Ray const& ray, HitInfo& hit, TraversalStats* stats, bool occlusion) const {
+		bool any_hit = false;
+		for (int i = node.offset; i < node.offset + node.count && !(any_hit && occlusion); ++i) {
+			if (stats) {
+				++stats->prims_tested;
+			}
+			float t;
+			glm::vec2 bary;
+			bool tri_hit;
+			if (baked) {
+				tri_hit = bakedTriangleHitTest(baked[i], ray, t, bary);
+			} else {
+				Triangle const& tri = tris[prims[i].triangle_id];
+				glm::vec3 barycoord;
+				tri_hit = glm::intersectRayTriangle(ray.origin, ray.direction, verts[tri.verts[0]], verts[tri.verts[1]], verts[tri.verts[2]], barycoord);
+				t = barycoord.z;
+				bary = glm::vec2(barycoord);
+			}
+			if (tri_hit && t < hit.t) {
+				hit.t = t;
+				hit.triangle_id = prims[i].triangle_id;
+				hit.bary = bary;
+				any_hit = true;
+			}
+		}
+		return any_hit;
+	}
+};
+
+/// <summary>
+/// raw pointers to everything a two-level traversal touches
+/// all pointers are either host or device pointers
+/// </summary>
+struct tlasView {
+	bvhNode const* top_nodes;
+	leaf_data const* instances;
+	int num_top_nodes;
+	bvhNode const* blas_nodes;
+	leaf_data const* blas_prims;
+	BakedTriangle const* blas_baked; // optional, parallel to blas_prims
+	int const* blas_roots; // root node of each mesh, -1 if the mesh has no triangles
+	Geom const* geoms;
+	CompactPrim const* compact; // parallel to geoms
+	Triangle const* tris;
+	Vertex const* verts;
+
+	__host__ __device__ bool intersect_leaf(bvhNode const& node, Ray const& ray, HitInfo& hit, TraversalStats* stats, bool occlusion) const {
+		bool any_hit = false;
+		for (int i = node.offset; i < node.offset + node.count && !(any_hit && occlusion); ++i) {
+			int geom_id = instances[i].geom_id;
+			if (compact[geom_id].type != COMPACT_NONE) {
+				if (stats) {
+					++stats->prims_tested;
+				}
+				float t = compactHitTest(compact[geom_id], ray);
+				if (t > 0 && t < hit.t) {
+					hit.t = t;
+					hit.geom_id = geom_id;
+					hit.triangle_id = -1;
+					any_hit = true;
+				}
+				continue;
+			}
+
+			Geom const& geom = geoms[geom_id];
+			int root = blas_roots[geom.meshid];
+			if (root == -1) {
+				continue;
+			}
+			// the local direction is left unnormalized so that t stays in world units
+			Ray local_ray;
+			local_ray.origin = multiplyMV(geom.inverseTransform, glm::vec4(ray.origin, 1.0f));
+			local_ray.direction = multiplyMV(geom.inverseTransform, glm::vec4(ray.direction, 0.0f));
+
+			blasView blas;
+			blas.prims = blas_prims;
+			blas.baked = blas_baked;
+			blas.tris = tris;
+			blas.verts = verts;
+			if (bvhTraverse(blas_nodes, root, local_ray, hit, stats, blas, occlusion)) {
+				hit.geom_id = geom_id;
+				any_hit = true;
+			}
+		}
+		return any_hit;
+	}
+	__host__ __device__ bool intersect(Ray const& ray, HitInfo& hit, TraversalStats* stats) const {
+		return num_top_nodes && bvhTraverse(top_nodes, 0, ray, hit, stats, *this);
+	}
+	// whether anything is hit before tmax, stops at the first hit found
+	__host__ __device__ bool occluded(Ray const& ray, float tmax, TraversalStats* stats) const {
+		HitInfo hit;
+		hit.t = tmax;
+		return num_top_nodes && bvhTraverse(top_nodes, 0, ray, hit, stats, *this, true);
+	}
+};
+
+/// <summary>
+/// two-level acceleration structure:
+/// one object space BVH (BLAS) per mesh, shared by all geoms instancing it,
+/// and a top-level BVH (TLAS) over the world bounds of the geoms
+/// </summary>
+class tlas {
+	friend struct tlasGPU;
+private:
+	std::unique_ptr<bvh> _top;
+	// all bottom-level trees concatenated, offsets rebased to the shared arrays
+	std::vector<bvhNode> _blas_nodes;
+	std::vector<leaf_data> _blas_prims;
+	std::vector<int> _blas_roots;
+
+public:
+	tlas(tlas const&) = delete;
+	tlas(tlas&&) = delete;
+	tlas(Scene const& scene) {
+		// only build BLASes for meshes that are actually instanced
+		std::vector<std::unique_ptr<bvh>> blases(scene.meshes.size());
+		std::vector<bool> used(scene.meshes.size(), false);
+		for (Geom const& geom : scene.geoms) {
+			if (geom.type == MESH) {
+				used[geom.meshid] = true;
+			}
+		}
+		{
+			TaskGroup group;
+			for (int mesh_id = 0; mesh_id < scene.meshes.size(); ++mesh_id) {
+				if (used[mesh_id]) {
+					group.run([&, mesh_id]() {
+						blases[mesh_id] = std::make_unique<bvh>(scene, mesh_id);
+					});
+				}
+			}
+			group.wait();
+		}
+
+		_blas_roots.assign(scene.meshes.size(), -1);
+		for (int mesh_id = 0; mesh_id < scene.meshes.size(); ++mesh_id) {
+			if (!blases[mesh_id] || blases[mesh_id]->nodes().empty()) {
+				continue;
+			}
+			int node_base = _blas_nodes.size();
+			int prim_base = _blas_prims.size();
+			_blas_roots[mesh_id] = node_base;
+			for (bvhNode node : blases[mesh_id]->nodes()) {
+				node.offset += node.is_leaf() ? prim_base : node_base;
+				_blas_nodes.push_back(node);
+			}
+			_blas_prims.insert(_blas_prims.end(), blases[mesh_id]->prims().begin(), blases[mesh_id]->prims().end());
+		}
+
+		std::vector<leaf_data> instances;
+		std::vector<AABB> bounds;
+		for (int geom_id = 0; geom_id < scene.geoms.size(); ++geom_id) {
+			instances.emplace_back(-1, geom_id);
+			bounds.push_back(scene.geoms[geom_id].bounds);
+		}
+		_top = std::make_unique<bvh>(instances, bounds);
+	}
+
+	tlasView view(Scene const& scene, BakedTriangle const* blas_baked = nullptr) const {
+		tlasView ret;
+		ret.top_nodes = _top->nodes().data();
+		ret.instances = _top->prims().data();
+		ret.num_top_nodes = _top->nodes().size();
+		ret.blas_nodes = _blas_nodes.data();
+		ret.blas_prims = _blas_prims.data();
+		ret.blas_baked = blas_baked;
+		ret.blas_roots = _blas_roots.data();
+		ret.geoms = scene.geoms.data();
+		ret.compact = scene.compact_prims.data();
+		ret.tris = scene.triangles.data();
+		ret.verts = scene.vertices.data();
+		return ret;
+	}
+
+	// host traversal, used to measure and verify the structure without a GPU
+	bool intersect(Scene const& scene, Ray const& ray, HitInfo& hit, TraversalStats* stats = nullptr) const {
+		return view(scene).intersect(ray, hit, stats);
+	}
+	bool occluded(Scene const& scene, Ray const& ray, float tmax, TraversalStats* stats = nullptr) const {
+		return view(scene).occluded(ray, tmax, stats);
+	}
+
+	// a moved geom only changes the top level, the bottom levels are in object space
+	int refit(Scene const& scene, int geom_id) {
+		return _top->refit(scene, geom_id);
+	}
+	float sah_drift() const {
+		return _top->sah_drift();
+	}
+
+	// bottom-level references of all meshes, object space triangles can be baked from them
+	std::vector<leaf_data> const& blas_prims() const {
+		return _blas_prims;
+	}
+	bvh const& top() const {
+		return *_top;
+	}
+	size_t num_nodes() const {
+		return _top->nodes().size() + _blas_nodes.size();
+	}
+	size_t num_prims() const {
+		return _top->num_prims() + _blas_prims.size();
+	}
+	size_t size_bytes() const {
+		return num_nodes() * sizeof(bvhNode) + num_prims() * sizeof(leaf_data) + _blas_roots.size() * sizeof(int);
+	}
+};
+
+/// <summary>
+/// GPU side view of the two-level structure
+/// the owner must call free() when it is no longer needed
+/// </summary>
+struct tlasGPU {
+	Span<bvhNode> _top_nodes;
+	Span<leaf_data> _instances;
+	Span<bvhNode> _blas_nodes;
+	Span<leaf_data> _blas_prims;
+	Span<BakedTriangle> _blas_baked; // empty if the triangles are not baked
+	Span<int> _blas_roots;
+	MeshInfo _mesh_info;
+	Span<Geom> _geoms;
+
+	tlasGPU() : _mesh_info() { }
+	/// <param name="blas_baked"> optional, Scene::bakeTriangles(accel.blas_prims()) </param>
+	__host__ tlasGPU(tlas const& accel, MeshInfo mesh_info, Span<Geom> geoms, std::vector<BakedTriangle> const& blas_baked = {})
+		: _top_nodes(make_span(accel._top->nodes())), _instances(make_span(accel._top->prims())),
+		_blas_nodes(make_span(accel._blas_nodes)), _blas_prims(make_span(accel._blas_prims)),
+		_blas_baked(make_span(blas_baked)), _blas_roots(make_span(accel._blas_roots)),
+		_mesh_info(mesh_info), _geoms(geoms) { }
+
+	__host__ void free() {
+		FREE(_top_nodes);
+		FREE(_instances);
+		FREE(_blas_nodes);
+		FREE(_blas_prims);
+		FREE(_blas_baked);
+		FREE(_blas_roots);
+		*this = tlasGPU();
+	}
+
+	// uploads the top level again after a refit
+	__host__ void update_top(tlas const& accel) {
+		H2D(_top_nodes.get(), accel._top->nodes().data(), _top_nodes.size());
+	}
+
+	__host__ __device__ tlasView view() const {
+		tlasView ret;
+		ret.top_nodes = _top_nodes.get();
+		ret.instances = _instances.get();
+		ret.num_top_nodes = _top_nodes.size();
+		ret.blas_nodes = _blas_nodes.get();
+		ret.blas_prims = _blas_prims.get();
+		ret.blas_baked = _blas_baked.get();
+		ret.blas_roots = _blas_roots.get();
+		ret.geoms = _geoms.get();
+		ret.compact = _mesh_info.compact_prims;
+		ret.tris = _mesh_info.tris;
+		ret.verts = _mesh_info.vertices;
+		return ret;
+	}
+
+	// only records the closest hit, its surface attributes are resolved by intersFromHit afterwards
+	__device__ bool search(HitInfo& hit, Ray const& ray, TraversalStats* stats = nullptr) const {
+		return view().intersect(ray, hit, stats);
+	}
+	// visibility test for shadow & ambient occlusion rays, no hit is recorded
+	__device__ bool occluded(Ray const& ray, float tmax, TraversalStats* stats = nullptr) const {
+		return view().occluded(ray, tmax, stats);
+	}
+};
@@ -0,0 +1,333 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include "../utilities.h"
+#include "../Collision/AABB.h"
+#include "../scene.h"
+#include "../intersections.cuh"
+#include "bvh.h"
+
+// meta values of the children of a wide node, any other value is the primitive count of a leaf child
+static constexpr uint8_t WBVH_EMPTY = 0;
+static constexpr uint8_t WBVH_INTERIOR = 0xFF;
+static constexpr int WBVH_MAX_LEAF_SIZE = 0xFE;
+// every node visited pushes at most Width - 1 entries more than it pops
+#define WBVH_STACK_SIZE(width) (((width) - 1) * BVH_MAX_DEPTH + 1)
+
+/// <summary>
+/// node of a Width-wide BVH, the child boxes are quantized to 8 bits inside the node box;
+/// the interior children are stored next to each other from child_base,
+/// and the primitives of the leaf children one after the other from prim_base
+/// </summary>
+template<int Width>
+struct wbvhNode {
+	glm::vec3 origin;        // min corner of the node box
+	uint8_t exponent[3];     // quantization step of each axis is 2^(exponent - 127)
+	uint8_t num_children;
+	int child_base;
+	int prim_base;
+	uint8_t meta[Width];     // WBVH_EMPTY, WBVH_INTERIOR or the primitive count of a leaf child
+	uint8_t qlo[3][Width];
+	uint8_t qhi[3][Width];
+
+	HOST DEVICE INLINE static float step(uint8_t exponent) {
+		return ldexpf(1.f, (int)exponent - 127);
+	}
+	// the only way quantized coordinates are decoded, the converter relies on it to keep the boxes conservative
+	HOST DEVICE INLINE static float decode(float origin, float step, uint8_t q) {
+		return origin + (float)q * step;
+	}
+	HOST DEVICE INLINE AABB child_bounds(int i) const {
+		glm::vec3 lo, hi;
+		for (int a = 0; a < 3; ++a) {
+			float s = step(exponent[a]);
+			lo[a] = decode(origin[a], s, qlo[a][i]);
+			hi[a] = decode(origin[a], s, qhi[a][i]);
+		}
+		return AABB(lo, hi);
+	}
+};
+static_assert(sizeof(wbvhNode<8>) <= 80, "8-wide nodes must fit in 80 bytes");
+static_assert(sizeof(wbvhNode<4>) <= 52, "4-wide nodes must fit in 52 bytes");
+
+/// <summary>
+/// raw pointers to everything a wide BVH traversal touches
+/// all pointers are either host or device pointers
+/// </summary>
+template<int Width>
+struct wbvhView {
+	wbvhNode<Width> const* nodes;
+	leaf_data const* prims;
+	BakedTriangle const* baked; // optional, parallel to prims
+	int num_nodes;
+	Geom const* geoms;
+	CompactPrim const* compact; // parallel to geoms
+	Triangle const* tris;
+	Vertex const* verts;
+
+	// a node to visit, or the primitives of a leaf child to test if count > 0
+	struct entry {
+		int index;
+		int count;
+		float t;
+	};
+
+	/// <summary>
+	/// finds the closest hit along the ray, the children of a node are visited front to back
+	/// </summary>
+	__host__ __device__ bool intersect(Ray const& ray, HitInfo& hit, TraversalStats* stats) const {
+		if (!num_nodes) {
+			return false;
+		}
+		bool any_hit = false;
+		TraversalRay box_ray = makeTraversalRay(ray);
+		entry stack[WBVH_STACK_SIZE(Width)];
+		int sp = 0;
+		stack[sp++] = { 0, 0, 0.f };
+
+		while (sp) {
+			entry cur = stack[--sp];
+			if (cur.t >= hit.t) {
+				continue;
+			}
+			if (cur.count) {
+				for (int i = cur.index; i < cur.index + cur.count; ++i) {
+					if (stats) {
+						++stats->prims_tested;
+					}
+					any_hit |= leafHitTest(prims[i], geoms, compact, tris, verts, ray, hit, baked ? baked + i : nullptr);
+				}
+				continue;
+			}
+
+			wbvhNode<Width> const& node = nodes[cur.index];
+			if (stats) {
+				++stats->nodes_visited;
+			}
+			// children that the ray enters, sorted from the farthest to the nearest
+			entry hits[Width];
+			int num_hits = 0;
+			int child = node.child_base, prim = node.prim_base;
+			for (int i = 0; i < node.num_children; ++i) {
+				entry e;
+				if (node.meta[i] == WBVH_INTERIOR) {
+					e.index = child++;
+					e.count = 0;
+				} else {
+					e.index = prim;
+					e.count = node.meta[i];
+					prim += node.meta[i];
+				}
+				float t_far;
+				if (!AABBRayRange(node.child_bounds(i), box_ray, e.t, t_far) || e.t >= hit.t) {
+					continue;
+				}
+				int j = num_hits++;
+				for (; j > 0 && hits[j - 1].t < e.t; --j) {
+					hits[j] = hits[j - 1];
+				}
+				hits[j] = e;
+			}
+			for (int i = 0; i < num_hits; ++i) {
+				stack[sp++] = hits[i];
+			}
+		}
+		return any_hit;
+	}
+};
+
+/// <summary>
+/// Width-wide BVH with 8 bit quantized child boxes, converted from a binary BVH;
+/// each wide node pulls in the largest interior descendants of its binary node until it has Width children
+/// </summary>
+template<int Width>
+class wbvh {
+	static_assert(Width >= 2 && Width <= 8, "a wide node has between 2 and 8 children");
+private:
+	// a binary node, or a range of primitives of the binary tree too long for one leaf child if node is -1
+	struct source {
+		int node;
+		int begin, end;
+		AABB bounds;
+	};
+
+	std::vector<wbvhNode<Width>> _nodes;
+	std::vector<leaf_data> _prims;
+	int _depth;
+
+	static source make_source(bvh const& tree, int node) {
+		bvhNode const& n = tree.nodes()[node];
+		if (n.is_leaf() && n.count > WBVH_MAX_LEAF_SIZE) {
+			return { -1, n.offset, n.offset + n.count, n.bounds };
+		}
+		return { node, 0, 0, n.bounds };
+	}
+	static bool is_leaf(bvh const& tree, source const& src) {
+		return src.node == -1 ? src.end - src.begin <= WBVH_MAX_LEAF_SIZE : tree.nodes()[src.node].is_leaf();
+	}
+	static std::vector<source> expand(bvh const& tree, source const& src) {
+		std::vector<source> ret;
+		if (src.node != -1) {
+			ret.push_back(make_source(tree, src.node + 1));
+			ret.push_back(make_source(tree, tree.nodes()[src.node].offset));
+			return ret;
+		}
+		int count = src.end - src.begin;
+		int piece = count <= WBVH_MAX_LEAF_SIZE * Width ? WBVH_MAX_LEAF_SIZE : (count + Width - 1) / Width;
+		for (int begin = src.begin; begin < src.end; begin += piece) {
+			ret.push_back({ -1, begin, std::min(src.end, begin + piece), src.bounds });
+		}
+		return ret;
+	}
+	// children of the wide node of src, the interior child with the largest box is opened while there is room
+	static std::vector<source> collapse(bvh const& tree, source const& src) {
+		if (is_leaf(tree, src)) {
+			return { src };
+		}
+		std::vector<source> children = expand(tree, src);
+		while (children.size() < Width) {
+			int best = -1;
+			float best_area = -1;
+			for (int i = 0; i < children.size(); ++i) {
+				if (is_leaf(tree, children[i])) {
+					continue;
+				}
+				int grown = children[i].node == -1 ? expand(tree, children[i]).size() : 2;
+				float area = children[i].bounds.surface_area();
+				if (children.size() - 1 + grown <= Width && area > best_area) {
+					best = i;
+					best_area = area;
+				}
+			}
+			if (best == -1) {
+				break;
+			}
+			std::vector<source> grandchildren = expand(tree, children[best]);
+			children.erase(children.begin() + best);
+			children.insert(children.end(), grandchildren.begin(), grandchildren.end());
+		}
+		return children;
+	}
+
+	// picks the smallest power of 2 step per axis for which every quantized child box contains its original box
+	static void quantize(wbvhNode<Width>& node, std::vector<source> const& children) {
+		AABB box = AABB::empty();
+		for (source const& child : children) {
+			box.expand(child.bounds);
+		}
+		node.origin = box.min();
+		for (int a = 0; a < 3; ++a) {
+			float extent = box.max()[a] - box.min()[a];
+			int e = extent > 0 ? (int)std::ceil(std::log2(extent / 255.f)) : -126;
+			for (e = glm::clamp(e, -126, 127); ; ++e) {
+				node.exponent[a] = e + 127;
+				float s = wbvhNode<Width>::step(node.exponent[a]);
+				bool fits = true;
+				for (int i = 0; i < children.size(); ++i) {
+					float lo = children[i].bounds.min()[a], hi = children[i].bounds.max()[a];
+					int qlo = glm::clamp((int)std::floor((lo - node.origin[a]) / s), 0, 255);
+					int qhi = glm::clamp((int)std::ceil((hi - node.origin[a]) / s), 0, 255);
+					// fix up rounding of the division so that the decoded box is conservative
+					while (qlo > 0 && wbvhNode<Width>::decode(node.origin[a], s, qlo) > lo) {
+						--qlo;
+					}
+					while (qhi < 255 && wbvhNode<Width>::decode(node.origin[a], s, qhi) < hi) {
+						++qhi;
+					}
+					fits &= wbvhNode<Width>::decode(node.origin[a], s, qlo) <= lo && wbvhNode<Width>::decode(node.origin[a], s, qhi) >= hi;
+					node.qlo[a][i] = qlo;
+					node.qhi[a][i] = qhi;
+				}
+				if (fits || e == 127) {
+					break;
+				}
+			}
+		}
+	}
+
+	void emit(bvh const& tree, source const& src, int idx, int depth) {
+		_depth = std::max(_depth, depth);
+		std::vector<source> children = collapse(tree, src);
+
+		wbvhNode<Width> node = {};
+		node.num_children = children.size();
+		quantize(node, children);
+
+		std::vector<int> interior;
+		node.child_base = _nodes.size();
+		node.prim_base = _prims.size();
+		for (int i = 0; i < children.size(); ++i) {
+			source const& child = children[i];
+			if (!is_leaf(tree, child)) {
+				node.meta[i] = WBVH_INTERIOR;
+				interior.push_back(i);
+				continue;
+			}
+			int begin = child.begin, end = child.end;
+			if (child.node != -1) {
+				begin = tree.nodes()[child.node].offset;
+				end = begin + tree.nodes()[child.node].count;
+			}
+			node.meta[i] = end - begin;
+			_prims.insert(_prims.end(), tree.prims().begin() + begin, tree.prims().begin() + end);
+		}
+		_nodes.resize(_nodes.size() + interior.size());
+		_nodes[idx] = node;
+		for (int i = 0; i < interior.size(); ++i) {
+			emit(tree, children[interior[i]], node.child_base + i, depth + 1);
+		}
+	}
+
+public:
+	wbvh(wbvh const&) = delete;
+	wbvh(wbvh&&) = delete;
+	explicit wbvh(bvh const& tree) : _depth(0) {
+		if (tree.nodes().empty()) {
+			return;
+		}
+		_nodes.resize(1);
+		_prims.reserve(tree.num_prims());
+		emit(tree, make_source(tree, 0), 0, 0);
+		if (_depth >= BVH_MAX_DEPTH) {
+			// the traversal stack is sized for BVH_MAX_DEPTH levels
+			std::cerr << "wide BVH is too deep to traverse, depth = " << _depth << std::endl;
+			_nodes.clear();
+			_prims.clear();
+		}
+	}
+
+	wbvhView<Width> view(Scene const& scene, BakedTriangle const* baked = nullptr) const {
+		wbvhView<Width> ret;
+		ret.nodes = _nodes.data();
+		ret.prims = _prims.data();
+		ret.baked = baked;
+		ret.num_nodes = _nodes.size();
+		ret.geoms = scene.geoms.data();
+		ret.compact = scene.compact_prims.data();
+		ret.tris = scene.triangles.data();
+		ret.verts = scene.vertices.data();
+		return ret;
+	}
+
+	// host traversal, used to check the quantized boxes against the binary tree without a GPU
+	bool intersect(Scene const& scene, Ray const& ray, HitInfo& hit, TraversalStats* stats = nullptr) const {
+		return view(scene).intersect(ray, hit, stats);
+	}
+
+	std::vector<wbvhNode<Width>> const& nodes() const {
+		return _nodes;
+	}
+	std::vector<leaf_data> const& prims() const {
+		return _prims;
+	}
+	int depth() const {
+		return _depth;
+	}
+	size_t size_bytes() const {
+		return _nodes.size() * sizeof(wbvhNode<Width>) + _prims.size() * sizeof(leaf_data);
+	}
+};
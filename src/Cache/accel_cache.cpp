@@ -0,0 +1,283 @@
+#include "accel_cache.h"
+#include "../scene.h"
+#include "../utilities.h"
+#include "../Octree/octree.h"
+#include "../BVH/bvh.h"
+#include "../KDTree/kdtree.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <direct.h>
+#include <sys/utime.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utime.h>
+#endif // _WIN32
+
+static constexpr char const* CACHE_FILE_EXT = ".accel";
+
+#ifdef _WIN32
+MappedFile::MappedFile(std::string const& path) : _data(nullptr), _size(0), _file(INVALID_HANDLE_VALUE), _mapping(nullptr) {
+	_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (_file == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(_file, &size) || !size.QuadPart) {
+		return;
+	}
+	_mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!_mapping) {
+		return;
+	}
+	_data = static_cast<char const*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+	_size = _data ? size.QuadPart : 0;
+}
+
+MappedFile::~MappedFile() {
+	if (_data) {
+		UnmapViewOfFile(_data);
+	}
+	if (_mapping) {
+		CloseHandle(_mapping);
+	}
+	if (_file != INVALID_HANDLE_VALUE) {
+		CloseHandle(_file);
+	}
+}
+#else
+MappedFile::MappedFile(std::string const& path) : _data(nullptr), _size(0), _fd(-1) {
+	_fd = open(path.c_str(), O_RDONLY);
+	if (_fd == -1) {
+		return;
+	}
+	struct stat st;
+	if (fstat(_fd, &st) || !st.st_size) {
+		return;
+	}
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+	if (data == MAP_FAILED) {
+		return;
+	}
+	_data = static_cast<char const*>(data);
+	_size = st.st_size;
+}
+
+MappedFile::~MappedFile() {
+	if (_data) {
+		munmap(const_cast<char*>(_data), _size);
+	}
+	if (_fd != -1) {
+		close(_fd);
+	}
+}
+#endif // _WIN32
+
+AccelCache::AccelCache(std::string const& dir, uint64_t max_bytes) : _dir(dir), _max_bytes(max_bytes) {
+	if (_dir.size() && _dir.back() != '/' && _dir.back() != '\\') {
+		_dir += '/';
+	}
+#ifdef _WIN32
+	_mkdir(_dir.c_str());
+#else
+	mkdir(_dir.c_str(), 0755);
+#endif // _WIN32
+}
+
+AccelCache& AccelCache::shared() {
+	static AccelCache cache(ACCEL_CACHE_DIR, ACCEL_CACHE_MAX_BYTES);
+	return cache;
+}
+
+std::string AccelCache::path(uint64_t key, uint32_t kind) const {
+	std::ostringstream oss;
+	oss << _dir << std::hex << std::setw(16) << std::setfill('0') << key << "_" << kind << CACHE_FILE_EXT;
+	return oss.str();
+}
+
+uint64_t AccelCache::sceneKey(Scene const& scene) {
+	CacheHasher hasher;
+	hasher.add(scene.vertices);
+	hasher.add(scene.meshes.size());
+	for (Mesh const& mesh : scene.meshes) {
+		hasher.add(mesh.tri_start).add(mesh.tri_end);
+	}
+	// only the vertex indices affect the structures
+	hasher.add(scene.triangles.size());
+	for (Triangle const& tri : scene.triangles) {
+		hasher.add(tri.verts);
+	}
+	hasher.add(scene.geoms.size());
+	for (Geom const& geom : scene.geoms) {
+		hasher.add(geom.type).add(geom.meshid).add(geom.transform);
+	}
+	return hasher.value();
+}
+
+uint64_t AccelCache::octreeKey(Scene const& scene, OctreeSettings const& settings) {
+	CacheHasher hasher;
+	hasher.add(sceneKey(scene)).add(OCTREE_IMAGE_VERSION).add(scene.world_AABB);
+	hasher.add(settings.max_depth).add(settings.max_leaf_size).add(settings.min_extent)
+		.add(settings.sah_termination).add(settings.traversal_cost).add(settings.intersect_cost);
+	hasher.add(OCTREE_BOX_EPS);
+#ifdef OCTREE_MESH_ONLY
+	hasher.add(true);
+#endif // OCTREE_MESH_ONLY
+	return hasher.value();
+}
+
+uint64_t AccelCache::bvhKey(Scene const& scene) {
+	CacheHasher hasher;
+	hasher.add(sceneKey(scene)).add(BVH_IMAGE_VERSION);
+	hasher.add(BVH_NUM_BINS).add(BVH_MAX_LEAF_SIZE).add(BVH_MAX_DEPTH).add(BVH_TRAVERSAL_COST).add(BVH_INTERSECT_COST);
+	// large scenes are built by the linear builder
+	hasher.add(bvh::num_world_prims(scene) >= LBVH_MIN_PRIMS);
+	return hasher.value();
+}
+
+uint64_t AccelCache::sbvhKey(Scene const& scene, SpatialSplitSettings const& settings) {
+	CacheHasher hasher;
+	hasher.add(bvhKey(scene)).add(settings.max_duplication).add(settings.min_overlap);
+	return hasher.value();
+}
+
+uint64_t AccelCache::kdtreeKey(Scene const& scene) {
+	CacheHasher hasher;
+	hasher.add(sceneKey(scene)).add(KDTREE_IMAGE_VERSION);
+	hasher.add(KDTREE_TRAVERSAL_COST).add(KDTREE_INTERSECT_COST).add(KDTREE_EMPTY_BONUS).add(KDTREE_MAX_DEPTH);
+	return hasher.value();
+}
+
+std::unique_ptr<MappedFile> AccelCache::load(uint64_t key, uint32_t kind, size_t& payload_offset) const {
+	std::string file_path = path(key, kind);
+	std::unique_ptr<MappedFile> file(new MappedFile(file_path));
+	if (!file->valid()) {
+		return nullptr;
+	}
+
+	accelCacheHeader header;
+	bool ok = file->size() >= sizeof(header);
+	if (ok) {
+		memcpy(&header, file->data(), sizeof(header));
+		ok = header.magic == ACCEL_CACHE_MAGIC && header.version == ACCEL_CACHE_VERSION
+			&& header.kind == kind && header.key == key
+			&& header.size == file->size() - sizeof(header)
+			&& CacheHasher().add(file->data() + sizeof(header), header.size).value() == header.checksum;
+	}
+	if (!ok) {
+		std::cerr << "discarding invalid cache file " << file_path << std::endl;
+		file.reset();
+		std::remove(file_path.c_str());
+		return nullptr;
+	}
+
+	// mark the file as recently used
+#ifdef _WIN32
+	_utime(file_path.c_str(), nullptr);
+#else
+	utime(file_path.c_str(), nullptr);
+#endif // _WIN32
+	payload_offset = sizeof(header);
+	return file;
+}
+
+bool AccelCache::store(uint64_t key, uint32_t kind, std::vector<char> const& payload) {
+	accelCacheHeader header;
+	header.magic = ACCEL_CACHE_MAGIC;
+	header.version = ACCEL_CACHE_VERSION;
+	header.kind = kind;
+	header.reserved = 0;
+	header.key = key;
+	header.size = payload.size();
+	header.checksum = CacheHasher().add(payload.data(), payload.size()).value();
+
+	// write to a temporary file first so that a crash never leaves a truncated cache file behind
+	std::string file_path = path(key, kind);
+	std::string tmp_path = file_path + ".tmp";
+	{
+		std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+		if (!out) {
+			return false;
+		}
+		out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+		out.write(payload.data(), payload.size());
+		if (!out) {
+			out.close();
+			std::remove(tmp_path.c_str());
+			return false;
+		}
+	}
+	std::remove(file_path.c_str());
+	if (std::rename(tmp_path.c_str(), file_path.c_str())) {
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+
+	evict(file_path);
+	return true;
+}
+
+void AccelCache::remove(uint64_t key, uint32_t kind) const {
+	std::remove(path(key, kind).c_str());
+}
+
+struct CacheFileInfo {
+	std::string path;
+	uint64_t size;
+	time_t last_use;
+};
+
+static std::vector<CacheFileInfo> listCacheFiles(std::string const& dir) {
+	std::vector<CacheFileInfo> ret;
+	size_t ext_len = strlen(CACHE_FILE_EXT);
+	for (std::string const& file_path : utilityCore::getFilesInDir(dir.c_str())) {
+		if (file_path.size() < ext_len || file_path.compare(file_path.size() - ext_len, ext_len, CACHE_FILE_EXT)) {
+			continue;
+		}
+		struct stat st;
+		if (!stat(file_path.c_str(), &st)) {
+			ret.push_back({ file_path, (uint64_t)st.st_size, st.st_mtime });
+		}
+	}
+	return ret;
+}
+
+void AccelCache::evict() const {
+	evict("");
+}
+
+void AccelCache::evict(std::string const& keep) const {
+	std::vector<CacheFileInfo> files = listCacheFiles(_dir);
+	uint64_t total = 0;
+	for (CacheFileInfo const& file : files) {
+		total += file.size;
+	}
+	std::sort(files.begin(), files.end(), [](CacheFileInfo const& a, CacheFileInfo const& b) {
+		return a.last_use < b.last_use;
+	});
+	for (size_t i = 0; i < files.size() && total > _max_bytes; ++i) {
+		if (files[i].path != keep && !std::remove(files[i].path.c_str())) {
+			total -= files[i].size;
+		}
+	}
+}
+
+uint64_t AccelCache::size_bytes() const {
+	uint64_t total = 0;
+	for (CacheFileInfo const& file : listCacheFiles(_dir)) {
+		total += file.size;
+	}
+	return total;
+}
@@ -0,0 +1,144 @@
+#pragma once
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../sceneStructs.h"
+
+class Scene;
+
+/// <summary>
+/// read only view of a whole file mapped into memory
+/// </summary>
+class MappedFile {
+	char const* _data;
+	size_t _size;
+#ifdef _WIN32
+	void* _file;
+	void* _mapping;
+#else
+	int _fd;
+#endif // _WIN32
+
+public:
+	MappedFile(MappedFile const&) = delete;
+	MappedFile& operator=(MappedFile const&) = delete;
+	// check valid() before use, the file may not exist
+	explicit MappedFile(std::string const& path);
+	~MappedFile();
+
+	bool valid() const { return _data != nullptr; }
+	char const* data() const { return _data; }
+	size_t size() const { return _size; }
+};
+
+/// <summary>
+/// header of a cache file, followed by the image of the cached structure
+/// </summary>
+struct accelCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t kind;     // which structure the payload holds
+	uint32_t reserved;
+	uint64_t key;      // hash of everything the build depends on
+	uint64_t size;     // of the payload in bytes
+	uint64_t checksum; // FNV-1a of the payload
+};
+static constexpr uint32_t ACCEL_CACHE_MAGIC = 0x48434341; // "ACCH"
+static constexpr uint32_t ACCEL_CACHE_VERSION = 1;
+
+/// <summary>
+/// 64 bit FNV-1a, only used to key and check cache files
+/// </summary>
+class CacheHasher {
+	uint64_t _value;
+public:
+	CacheHasher() : _value(0xcbf29ce484222325ull) { }
+	CacheHasher& add(void const* data, size_t size) {
+		unsigned char const* bytes = static_cast<unsigned char const*>(data);
+		for (size_t i = 0; i < size; ++i) {
+			_value = (_value ^ bytes[i]) * 0x100000001b3ull;
+		}
+		return *this;
+	}
+	// only for types without padding
+	template<typename T>
+	CacheHasher& add(T const& val) {
+		return add(&val, sizeof(T));
+	}
+	template<typename T>
+	CacheHasher& add(std::vector<T> const& vals) {
+		add(vals.size());
+		return vals.empty() ? *this : add(vals.data(), vals.size() * sizeof(T));
+	}
+	uint64_t value() const {
+		return _value;
+	}
+};
+
+/// <summary>
+/// directory of built acceleration structures, one file per key
+/// files are checked before use and the least recently used ones are removed once the directory exceeds its budget
+/// </summary>
+class AccelCache {
+	std::string _dir;
+	uint64_t _max_bytes;
+
+	std::string path(uint64_t key, uint32_t kind) const;
+	// keep is never removed, even if it is over budget on its own
+	void evict(std::string const& keep) const;
+
+public:
+	AccelCache(std::string const& dir, uint64_t max_bytes);
+	// cache of the renderer in ACCEL_CACHE_DIR, shared by the CUDA & host backends
+	static AccelCache& shared();
+
+	// hash of the scene geometry the structures are built from
+	static uint64_t sceneKey(Scene const& scene);
+	static uint64_t octreeKey(Scene const& scene, OctreeSettings const& settings);
+	static uint64_t bvhKey(Scene const& scene);
+	static uint64_t sbvhKey(Scene const& scene, SpatialSplitSettings const& settings);
+	static uint64_t kdtreeKey(Scene const& scene);
+
+	/// <summary>
+	/// maps the cached payload of a key, the file is removed if it is corrupted or stale
+	/// </summary>
+	/// <param name="payload_offset"> where the payload starts in the mapping </param>
+	/// <returns> nullptr on a miss </returns>
+	std::unique_ptr<MappedFile> load(uint64_t key, uint32_t kind, size_t& payload_offset) const;
+	// writes the payload of a key then evicts old files if the budget is exceeded
+	bool store(uint64_t key, uint32_t kind, std::vector<char> const& payload);
+	void remove(uint64_t key, uint32_t kind) const;
+	// removes the least recently used files until the cache fits in its budget
+	void evict() const;
+	uint64_t size_bytes() const;
+};
+
+/// <summary>
+/// maps a previously built structure from the shared cache, or builds it and caches it
+/// Accel needs a constructor from an image, validate_image & image()
+/// </summary>
+template<typename Accel, typename Build>
+std::unique_ptr<Accel> loadOrBuild(uint64_t key, uint32_t kind, Build build) {
+#ifdef ACCEL_CACHE
+	size_t offset;
+	if (std::unique_ptr<MappedFile> file = AccelCache::shared().load(key, kind, offset)) {
+		char const* image = file->data() + offset;
+		size_t size = file->size() - offset;
+		if (Accel::validate_image(image, size)) {
+			std::cout << "loaded acceleration structure from the cache" << std::endl;
+			return std::make_unique<Accel>(image, size);
+		}
+		file.reset();
+		AccelCache::shared().remove(key, kind);
+	}
+	std::unique_ptr<Accel> ret = build();
+	if (!AccelCache::shared().store(key, kind, ret->image())) {
+		std::cerr << "failed to write the acceleration structure cache" << std::endl;
+	}
+	return ret;
+#else
+	return build();
+#endif // ACCEL_CACHE
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <glm/glm.hpp>
 #include "../utilities.h"
+#include "../consts.h"
 
 class Ray;
 class Geom;
@@ -17,6 +18,51 @@ public:
 	HOST DEVICE INLINE glm::vec3 const& max() const { return _max; }
 	HOST DEVICE INLINE glm::vec3 center() const { return (_min + _max) * 0.5f; }
 	HOST DEVICE INLINE glm::vec3 extent() const { return (_max - _min) * 0.5f; }
+	HOST DEVICE INLINE float surface_area() const {
+		glm::vec3 d = glm::max(_max - _min, glm::vec3(0));
+		return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+	// an inverted box that any expand() call will overwrite
+	HOST DEVICE INLINE static AABB empty() {
+		return AABB(glm::vec3(LARGE_FLOAT), glm::vec3(SMALL_FLOAT));
+	}
+	HOST DEVICE INLINE void expand(glm::vec3 const& p) {
+		_min = glm::min(_min, p);
+		_max = glm::max(_max, p);
+	}
+	HOST DEVICE INLINE void expand(AABB const& o) {
+		_min = glm::min(_min, o._min);
+		_max = glm::max(_max, o._max);
+	}
+	// bounds of the part of a primitive between two planes along an axis, invalid if nothing is left
+	// tri is the triangle's vertices, or null to clip the primitive bounds only;
+	// bounds may already be clipped by earlier splits, the result stays inside them
+	HOST DEVICE INLINE static AABB clip_slab(glm::vec3 const* tri, AABB const& bounds, int axis, float lo, float hi) {
+		AABB ret = bounds;
+		if (tri) {
+			// bound the vertices inside the slab and the points where the edges cross its planes
+			ret = empty();
+			for (int i = 0; i < 3; ++i) {
+				glm::vec3 const& a = tri[i];
+				glm::vec3 const& b = tri[(i + 1) % 3];
+				if (a[axis] >= lo && a[axis] <= hi) {
+					ret.expand(a);
+				}
+				for (float plane : { lo, hi }) {
+					if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+						glm::vec3 p = glm::mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+						p[axis] = plane;
+						ret.expand(p);
+					}
+				}
+			}
+		}
+		glm::vec3 lo_corner = glm::max(ret.min(), bounds.min());
+		glm::vec3 hi_corner = glm::min(ret.max(), bounds.max());
+		lo_corner[axis] = glm::max(lo_corner[axis], lo);
+		hi_corner[axis] = glm::min(hi_corner[axis], hi);
+		return AABB(lo_corner, hi_corner);
+	}
 	HOST DEVICE INLINE void vertices(glm::vec3(&out)[8], bool world) const {
 		glm::vec3 ex = extent(), ct = center();
 		int i = 0;
@@ -0,0 +1,126 @@
+#pragma once
+#include <glm/glm.hpp>
+#include "../intersections.cuh"
+
+// host only, the GPU tests one box per thread anyway
+#if defined(__AVX__)
+#include <immintrin.h>
+#define AABB_SIMD_AVX
+#endif // __AVX__
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define AABB_SIMD_SSE
+#endif // __SSE2__
+
+/// <summary>
+/// N boxes stored axis by axis, so that one slab of all the boxes is a single vector load
+/// the loads are unaligned, std::vector does not honor the alignment before C++17
+/// </summary>
+template<int N>
+struct AABBPacket {
+	alignas(32) float lo[3][N];
+	alignas(32) float hi[3][N];
+
+	void set(int i, AABB const& box) {
+		for (int a = 0; a < 3; ++a) {
+			lo[a][i] = box.min()[a];
+			hi[a][i] = box.max()[a];
+		}
+	}
+	// unused lanes get an inverted box that no ray enters
+	void clear(int i) {
+		set(i, AABB::empty());
+	}
+};
+
+/// <summary>
+/// slab test of a ray against N boxes at once, same results as AABBRayRange(AABB, TraversalRay) per box
+/// </summary>
+/// <param name="t_max"> boxes entered at or beyond t_max count as missed </param>
+/// <param name="t_near"> entry distance of each box, only meaningful for the boxes that are hit </param>
+/// <returns> bit i is set if box i is hit </returns>
+template<int N>
+inline int AABBRayRangePacket(AABBPacket<N> const& boxes, TraversalRay const& r, float t_max, float(&t_near)[N]) {
+	int mask = 0;
+	for (int i = 0; i < N; ++i) {
+		float t0 = 0, t1 = LARGE_FLOAT;
+		for (int a = 0; a < 3; ++a) {
+			float const* near_plane = r.sign[a] ? boxes.hi[a] : boxes.lo[a];
+			float const* far_plane = r.sign[a] ? boxes.lo[a] : boxes.hi[a];
+			float t_enter = (near_plane[i] - r.origin[a]) * r.inv_dir[a];
+			float t_exit = (far_plane[i] - r.origin[a]) * r.inv_dir[a];
+			t0 = t_enter > t0 ? t_enter : t0;
+			t1 = t_exit < t1 ? t_exit : t1;
+		}
+		t_near[i] = t0;
+		mask |= (t0 <= t1 && t0 < t_max) << i;
+	}
+	return mask;
+}
+
+#ifdef AABB_SIMD_SSE
+template<>
+inline int AABBRayRangePacket<4>(AABBPacket<4> const& boxes, TraversalRay const& r, float t_max, float(&t_near)[4]) {
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = _mm_set1_ps(LARGE_FLOAT);
+	for (int a = 0; a < 3; ++a) {
+		// the sign of the ray picks the plane arrays once for all 4 boxes
+		__m128 near_plane = _mm_loadu_ps(r.sign[a] ? boxes.hi[a] : boxes.lo[a]);
+		__m128 far_plane = _mm_loadu_ps(r.sign[a] ? boxes.lo[a] : boxes.hi[a]);
+		__m128 o = _mm_set1_ps(r.origin[a]);
+		__m128 inv = _mm_set1_ps(r.inv_dir[a]);
+		// the running bound is the second operand so that it is kept if the product is NaN
+		t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, o), inv), t0);
+		t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, o), inv), t1);
+	}
+	_mm_storeu_ps(t_near, t0);
+	__m128 hit = _mm_and_ps(_mm_cmple_ps(t0, t1), _mm_cmplt_ps(t0, _mm_set1_ps(t_max)));
+	return _mm_movemask_ps(hit);
+}
+#endif // AABB_SIMD_SSE
+
+#ifdef AABB_SIMD_AVX
+template<>
+inline int AABBRayRangePacket<8>(AABBPacket<8> const& boxes, TraversalRay const& r, float t_max, float(&t_near)[8]) {
+	__m256 t0 = _mm256_setzero_ps();
+	__m256 t1 = _mm256_set1_ps(LARGE_FLOAT);
+	for (int a = 0; a < 3; ++a) {
+		__m256 near_plane = _mm256_loadu_ps(r.sign[a] ? boxes.hi[a] : boxes.lo[a]);
+		__m256 far_plane = _mm256_loadu_ps(r.sign[a] ? boxes.lo[a] : boxes.hi[a]);
+		__m256 o = _mm256_set1_ps(r.origin[a]);
+		__m256 inv = _mm256_set1_ps(r.inv_dir[a]);
+		t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near_plane, o), inv), t0);
+		t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, o), inv), t1);
+	}
+	_mm256_storeu_ps(t_near, t0);
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ), _mm256_cmp_ps(t0, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+	return _mm256_movemask_ps(hit);
+}
+#elif defined(AABB_SIMD_SSE)
+// without AVX the 8 boxes are tested as two halves of 4
+template<>
+inline int AABBRayRangePacket<8>(AABBPacket<8> const& boxes, TraversalRay const& r, float t_max, float(&t_near)[8]) {
+	__m128 t0[2], t1[2];
+	for (int h = 0; h < 2; ++h) {
+		t0[h] = _mm_setzero_ps();
+		t1[h] = _mm_set1_ps(LARGE_FLOAT);
+	}
+	for (int a = 0; a < 3; ++a) {
+		float const* near_plane = r.sign[a] ? boxes.hi[a] : boxes.lo[a];
+		float const* far_plane = r.sign[a] ? boxes.lo[a] : boxes.hi[a];
+		__m128 o = _mm_set1_ps(r.origin[a]);
+		__m128 inv = _mm_set1_ps(r.inv_dir[a]);
+		for (int h = 0; h < 2; ++h) {
+			t0[h] = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_plane + 4 * h), o), inv), t0[h]);
+			t1[h] = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_plane + 4 * h), o), inv), t1[h]);
+		}
+	}
+	int mask = 0;
+	for (int h = 0; h < 2; ++h) {
+		_mm_storeu_ps(t_near + 4 * h, t0[h]);
+		__m128 hit = _mm_and_ps(_mm_cmple_ps(t0[h], t1[h]), _mm_cmplt_ps(t0[h], _mm_set1_ps(t_max)));
+		mask |= _mm_movemask_ps(hit) << (4 * h);
+	}
+	return mask;
+}
+#endif // AABB_SIMD_AVX
@@ -9,6 +9,7 @@
 #include <glm/gtx/transform.hpp>
 #include <thrust/transform.h>
 #include <thrust/execution_policy.h>
+#include <thrust/iterator/counting_iterator.h>
 
 namespace Denoiser {
 #ifdef DENOISE_GBUF_OPTIMIZATION
@@ -18,14 +19,17 @@ namespace Denoiser {
 	};
 	struct EncodeNormPos {
 		glm::mat4x4 view, proj;
-		__host__ __device__ EncodeNormPos(glm::mat4x4 const& view, glm::mat4x4 const& proj) : view(view), proj(proj) { }
-		__device__ NormPos operator()(ShadeableIntersection const& inters) const {
-			if (inters.t < 0) {
+		ShadeableIntersectionSoA inters;
+		__host__ __device__ EncodeNormPos(glm::mat4x4 const& view, glm::mat4x4 const& proj, ShadeableIntersectionSoA const& inters)
+			: view(view), proj(proj), inters(inters) { }
+		__device__ NormPos operator()(int i) const {
+			if (!inters.valid(i)) {
 				return { 0, 0, 0 };
 			}
-			glm::vec4 tmp = proj * (view * glm::vec4(inters.hitPoint, 1.f));
+			glm::vec3 const normal = inters.surfaceNormal[i];
+			glm::vec4 tmp = proj * (view * glm::vec4(inters.hitPoint[i], 1.f));
 			tmp /= tmp.w;
-			return { inters.surfaceNormal.x, inters.surfaceNormal.y, tmp.z };
+			return { normal.x, normal.y, tmp.z };
 		}
 	};
 	struct DecodeNorm {
@@ -126,41 +130,42 @@ namespace Denoiser {
 			FREE(x);
 #endif
 		}
-		void set(ShadeableIntersection const* dev_inters, Material const* materials) {
+		void set(ShadeableIntersectionSoA const& dev_inters, Material const* materials) {
+			thrust::counting_iterator<int> first(0), last(pixelcount);
 #ifdef DENOISE_GBUF_OPTIMIZATION
 			thrust::transform(
 				thrust::device,
-				dev_inters,
-				dev_inters + pixelcount,
+				first,
+				last,
 				xn,
-				Denoiser::EncodeNormPos(CamState::get_view(), CamState::get_proj())
+				Denoiser::EncodeNormPos(CamState::get_view(), CamState::get_proj(), dev_inters)
 			);
 
 #else
 			// normal
 			thrust::transform(
 				thrust::device,
-				dev_inters,
-				dev_inters + pixelcount,
+				first,
+				last,
 				n,
-				Denoiser::IntersectionToNormal());
+				Denoiser::IntersectionToNormal(dev_inters));
 
 			// position
 			thrust::transform(
 				thrust::device,
-				dev_inters,
-				dev_inters + pixelcount,
+				first,
+				last,
 				x,
-				Denoiser::IntersectionToPos());
+				Denoiser::IntersectionToPos(dev_inters));
 #endif
 
 			// diffuse
 			thrust::transform(
 				thrust::device,
-				dev_inters,
-				dev_inters + pixelcount,
+				first,
+				last,
 				d,
-				Denoiser::IntersectionToDiffuse(materials));
+				Denoiser::IntersectionToDiffuse(dev_inters, materials));
 		}
 		__host__ __device__ int size() const {
 			return pixelcount;
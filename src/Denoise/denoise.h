@@ -19,7 +19,7 @@ struct RadianceToNormalizedRGB {
 struct RadianceToRGBA {
 	int iter;
 	RadianceToRGBA(int iter) : iter(iter) { }
-	__device__ uchar4 operator()(color_t const& r) const {
+	__host__ __device__ uchar4 operator()(color_t const& r) const {
 		if (!iter) {
 			return make_uchar4(0, 0, 0, 0);
 		}
@@ -86,31 +86,40 @@ namespace Denoiser {
 		float c_phi, n_phi, p_phi;
 	};
 
-	// functors
+	// functors, called with a path index so that each one loads only the G-buffer fields it needs
 	struct IntersectionToNormal {
-		__host__ __device__ glm::vec3 operator()(ShadeableIntersection const& s) const {
-			return s.surfaceNormal;
+		ShadeableIntersectionSoA s;
+		IntersectionToNormal(ShadeableIntersectionSoA const& s) : s(s) { }
+		__host__ __device__ glm::vec3 operator()(int i) const {
+			if (!s.valid(i)) {
+				return glm::vec3(0);
+			}
+			return s.surfaceNormal[i];
 		}
 	};
 	struct IntersectionToPos {
-		__host__ __device__ glm::vec3 operator()(ShadeableIntersection const& s) const {
-			if (s.t < 0.f) {
+		ShadeableIntersectionSoA s;
+		IntersectionToPos(ShadeableIntersectionSoA const& s) : s(s) { }
+		__host__ __device__ glm::vec3 operator()(int i) const {
+			if (!s.valid(i)) {
 				return glm::vec3(0);
 			}
-			return s.hitPoint;
+			return s.hitPoint[i];
 		}
 	};
 	struct IntersectionToDiffuse {
+		ShadeableIntersectionSoA s;
 		Material const* mats;
-		IntersectionToDiffuse(Material const* mats) : mats(mats) { }
-		__host__ __device__ color_t operator()(ShadeableIntersection const& s) const {
-			if (s.t < 0.f) {
+		IntersectionToDiffuse(ShadeableIntersectionSoA const& s, Material const* mats) : s(s), mats(mats) { }
+		__host__ __device__ color_t operator()(int i) const {
+			if (!s.valid(i)) {
 				return BACKGROUND_COLOR;
 			}
-			if (mats[s.materialId].textures.diffuse != -1) {
-				return s.tex_color;
+			Material const& m = mats[s.materialId[i]];
+			if (m.textures.diffuse != -1) {
+				return s.tex_color[i];
 			} else {
-				return mats[s.materialId].diffuse;
+				return m.diffuse;
 			}
 		}
 	};
@@ -0,0 +1,616 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cuda.h>
+#include "../utilities.h"
+#include "../Collision/AABB.h"
+#include "../scene.h"
+#include "../intersections.cuh"
+#include "../threadPool.h"
+#include "../BVH/bvh.h"
+#include "../Octree/octree.h"
+
+// faces of a k-d tree cell, in the order of kdNode::ropes
+enum kdFace {
+	KD_FACE_MIN_X, KD_FACE_MAX_X,
+	KD_FACE_MIN_Y, KD_FACE_MAX_Y,
+	KD_FACE_MIN_Z, KD_FACE_MAX_Z,
+};
+
+/// <summary>
+/// node of a flattened, depth-first ordered k-d tree, 64 bytes
+/// the left child of an interior node is always the next node in the array
+/// </summary>
+struct kdNode {
+	AABB bounds;  // cell of the node, a leaf finds the face the ray leaves through from it
+	int ropes[6]; // leaf: node on the other side of each face (see kdFace), -1 if the face is on the root cell
+	float split;  // interior: position of the split plane
+	int axis;     // interior: split axis; leaf: -1
+	int offset;   // leaf: index of the first primitive; interior: index of the right child
+	int count;    // leaf: number of primitives
+
+	HOST DEVICE INLINE bool is_leaf() const {
+		return axis == -1;
+	}
+};
+static_assert(sizeof(kdNode) == 64, "kdNode is part of the k-d tree image format");
+
+/// <summary>
+/// header of the linear image of a k-d tree, followed by the node array and then the primitive array
+/// </summary>
+struct kdImageHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_nodes;
+	uint32_t num_prims;
+	uint32_t depth;
+	uint32_t size; // of the whole image in bytes
+};
+static constexpr uint32_t KDTREE_IMAGE_MAGIC = 0x4545544b; // "KTEE"
+static constexpr uint32_t KDTREE_IMAGE_VERSION = 1;
+
+/// <summary>
+/// raw pointers to everything a k-d tree traversal touches
+/// all pointers are either host or device pointers
+/// </summary>
+struct kdView {
+	kdNode const* nodes;
+	leaf_data const* prims;
+	BakedTriangle const* baked; // optional, parallel to prims
+	int num_nodes;
+	Geom const* geoms;
+	CompactPrim const* compact; // parallel to geoms
+	Triangle const* tris;
+	Vertex const* verts;
+
+	/// <summary>
+	/// finds the closest hit without a stack:
+	/// the leaves along the ray are visited in order, from each leaf the ray follows the rope of the face it leaves through
+	/// and descends from there to the leaf holding the point where it enters
+	/// </summary>
+	/// <param name="occlusion"> stop at the first hit closer than hit.t instead of looking for the closest one </param>
+	__host__ __device__ bool intersect(Ray const& ray, HitInfo& hit, TraversalStats* stats, bool occlusion = false) const {
+		if (!num_nodes) {
+			return false;
+		}
+		TraversalRay box_ray = makeTraversalRay(ray);
+		float t_entry, t_exit;
+		if (!AABBRayRange(nodes[0].bounds, box_ray, t_entry, t_exit)) {
+			return false;
+		}
+
+		bool any_hit = false;
+		triangleMailbox tested;
+		int cur = 0;
+		// the ray only moves forward, so it enters every leaf at most once
+		for (int steps = 0; cur != -1 && steps < num_nodes && t_entry < hit.t; ++steps) {
+			glm::vec3 p = ray.origin + t_entry * ray.direction;
+			while (!nodes[cur].is_leaf()) {
+				kdNode const& node = nodes[cur];
+				if (stats) {
+					++stats->nodes_visited;
+				}
+				// a point on the split plane belongs to the side the ray continues into
+				float x = p[node.axis];
+				bool right = x > node.split || (x == node.split && !box_ray.sign[node.axis]);
+				cur = right ? node.offset : cur + 1;
+			}
+
+			kdNode const& leaf = nodes[cur];
+			if (stats) {
+				++stats->nodes_visited;
+			}
+			for (int i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+				if (tested.test_and_set(prims[i])) {
+					if (stats) {
+						++stats->prims_skipped;
+					}
+					continue;
+				}
+				if (stats) {
+					++stats->prims_tested;
+				}
+				if (leafHitTest(prims[i], geoms, compact, tris, verts, ray, hit, baked ? baked + i : nullptr)) {
+					any_hit = true;
+					if (occlusion) {
+						return true;
+					}
+				}
+			}
+
+			// the face the ray leaves through is the one of the exit planes it reaches first,
+			// parallel axes give inf or NaN and are never picked
+			int face = -1;
+			float t_leave = LARGE_FLOAT;
+			for (int a = 0; a < 3; ++a) {
+				float plane = box_ray.sign[a] ? leaf.bounds.min()[a] : leaf.bounds.max()[a];
+				float t = (plane - box_ray.origin[a]) * box_ray.inv_dir[a];
+				if (t < t_leave) {
+					t_leave = t;
+					face = 2 * a + !box_ray.sign[a];
+				}
+			}
+			// a hit inside this leaf is closer than anything in the leaves after it
+			if (face == -1 || hit.t <= t_leave) {
+				break;
+			}
+			t_entry = glm::max(t_entry, t_leave);
+			cur = leaf.ropes[face];
+		}
+		return any_hit;
+	}
+	// whether anything is hit before tmax, stops at the first hit found
+	__host__ __device__ bool occluded(Ray const& ray, float tmax, TraversalStats* stats) const {
+		HitInfo hit;
+		hit.t = tmax;
+		return intersect(ray, hit, stats, true);
+	}
+};
+
+/// <summary>
+/// k-d tree over every primitive of the scene, split with the exact surface area heuristic over the primitive bounds;
+/// straddling triangles are clipped into both children (perfect splits), and every leaf has a rope per face to its neighbour
+/// meant for static scenes, a moved geom requires a rebuild
+/// </summary>
+class kdtree {
+	friend struct kdtreeGPU;
+private:
+	// a primitive clipped to the cell of a node
+	struct kd_ref {
+		AABB bounds;
+		int prim; // index into the source primitives
+	};
+	// start & end of the bounds of a reference along an axis, planar references are flat along it
+	enum event_type { EVENT_END, EVENT_PLANAR, EVENT_START };
+	struct event {
+		float pos;
+		int type;
+		bool operator<(event const& o) const {
+			return pos < o.pos || (pos == o.pos && type < o.type);
+		}
+	};
+	struct kd_split {
+		float cost = FLT_MAX;
+		int axis = -1;
+		float pos = 0;
+		bool planar_left = true; // side of the references lying in the split plane
+	};
+	struct build_node {
+		AABB cell;
+		int axis = -1;
+		float split = 0;
+		std::unique_ptr<build_node> children[2];
+		std::vector<leaf_data> prims;
+	};
+	struct build_context {
+		std::vector<leaf_data> const& prims;
+		std::vector<glm::vec3> const& verts; // world space vertices, 3 per primitive, unused for non-triangles
+		int max_depth;
+	};
+
+	std::vector<kdNode> _nodes;
+	std::vector<leaf_data> _prims;
+	int _depth;
+
+	static bool is_valid(AABB const& box) {
+		return box.min().x <= box.max().x && box.min().y <= box.max().y && box.min().z <= box.max().z;
+	}
+	static AABB with_plane(AABB const& box, int axis, float pos, bool upper) {
+		glm::vec3 lo = box.min(), hi = box.max();
+		(upper ? hi : lo)[axis] = pos;
+		return AABB(lo, hi);
+	}
+
+	// bounds of the part of a reference between two planes along an axis, invalid if nothing is left
+	static AABB clip_ref(build_context const& ctx, kd_ref const& ref, int axis, float lo, float hi) {
+		glm::vec3 const* tri = ctx.prims[ref.prim].triangle_id != -1 ? &ctx.verts[3 * ref.prim] : nullptr;
+		return AABB::clip_slab(tri, ref.bounds, axis, lo, hi);
+	}
+
+	// a ray lying in a split plane only descends into one side of it,
+	// so a reference with an edge or a face in the plane is also added to the other side, clipped to the plane
+	static void add_touching(build_context const& ctx, kd_ref const& ref, int axis, float pos, std::vector<kd_ref>& side) {
+		if (ctx.prims[ref.prim].triangle_id != -1) {
+			glm::vec3 const* v = &ctx.verts[3 * ref.prim];
+			if ((v[0][axis] == pos) + (v[1][axis] == pos) + (v[2][axis] == pos) < 2) {
+				return;
+			}
+		}
+		kd_ref part = ref;
+		part.bounds = clip_ref(ctx, ref, axis, pos, pos);
+		if (is_valid(part.bounds)) {
+			side.push_back(part);
+		}
+	}
+
+	// sweeps the sorted bounds of the references along every axis, every start and end is a candidate plane
+	static kd_split find_split(std::vector<kd_ref> const& refs, AABB const& cell) {
+		kd_split best;
+		float area = glm::max(cell.surface_area(), EPSILON);
+		int count = refs.size();
+		std::vector<event> events;
+		events.reserve(2 * refs.size());
+		for (int axis = 0; axis < 3; ++axis) {
+			float cell_lo = cell.min()[axis], cell_hi = cell.max()[axis];
+			if (cell_hi <= cell_lo) {
+				continue;
+			}
+			events.clear();
+			for (kd_ref const& ref : refs) {
+				float lo = ref.bounds.min()[axis], hi = ref.bounds.max()[axis];
+				if (lo == hi) {
+					events.push_back({ lo, EVENT_PLANAR });
+				} else {
+					events.push_back({ lo, EVENT_START });
+					events.push_back({ hi, EVENT_END });
+				}
+			}
+			std::sort(events.begin(), events.end());
+
+			// references entirely left & right of the plane, the planar ones at the plane are counted separately
+			int num_left = 0, num_right = count;
+			for (size_t i = 0; i < events.size();) {
+				float pos = events[i].pos;
+				int ends = 0, planars = 0, starts = 0;
+				for (; i < events.size() && events[i].pos == pos && events[i].type == EVENT_END; ++i) {
+					++ends;
+				}
+				for (; i < events.size() && events[i].pos == pos && events[i].type == EVENT_PLANAR; ++i) {
+					++planars;
+				}
+				for (; i < events.size() && events[i].pos == pos && events[i].type == EVENT_START; ++i) {
+					++starts;
+				}
+				num_right -= ends + planars;
+				if (pos > cell_lo && pos < cell_hi) {
+					float p_left = with_plane(cell, axis, pos, true).surface_area() / area;
+					float p_right = with_plane(cell, axis, pos, false).surface_area() / area;
+					for (bool planar_left : { true, false }) {
+						int l = num_left + (planar_left ? planars : 0);
+						int r = num_right + (planar_left ? 0 : planars);
+						float cost = KDTREE_TRAVERSAL_COST + KDTREE_INTERSECT_COST * (p_left * l + p_right * r);
+						// cutting off empty space lets rays skip it entirely
+						if (!l || !r) {
+							cost *= KDTREE_EMPTY_BONUS;
+						}
+						if (cost < best.cost) {
+							best.cost = cost;
+							best.axis = axis;
+							best.pos = pos;
+							best.planar_left = planar_left;
+						}
+					}
+				}
+				num_left += starts + planars;
+			}
+		}
+		return best;
+	}
+
+	void build(build_context const& ctx, build_node& node, std::vector<kd_ref>& refs, int depth) {
+		int count = refs.size();
+		kd_split split;
+		if (count && depth < ctx.max_depth) {
+			split = find_split(refs, node.cell);
+		}
+		if (split.axis == -1 || split.cost >= KDTREE_INTERSECT_COST * count) {
+			for (kd_ref const& ref : refs) {
+				node.prims.push_back(ctx.prims[ref.prim]);
+			}
+			return;
+		}
+
+		std::vector<kd_ref> left, right;
+		for (kd_ref const& ref : refs) {
+			float lo = ref.bounds.min()[split.axis], hi = ref.bounds.max()[split.axis];
+			if (lo == hi && lo == split.pos) {
+				(split.planar_left ? left : right).push_back(ref);
+			} else if (hi <= split.pos) {
+				left.push_back(ref);
+				if (hi == split.pos) {
+					add_touching(ctx, ref, split.axis, split.pos, right);
+				}
+			} else if (lo >= split.pos) {
+				right.push_back(ref);
+				if (lo == split.pos) {
+					add_touching(ctx, ref, split.axis, split.pos, left);
+				}
+			} else {
+				// perfect split, each side only keeps the part of the triangle inside it
+				kd_ref part = ref;
+				part.bounds = clip_ref(ctx, ref, split.axis, lo, split.pos);
+				if (is_valid(part.bounds)) {
+					left.push_back(part);
+				}
+				part.bounds = clip_ref(ctx, ref, split.axis, split.pos, hi);
+				if (is_valid(part.bounds)) {
+					right.push_back(part);
+				}
+			}
+		}
+		// the children hold their own copies of the references
+		std::vector<kd_ref>().swap(refs);
+
+		node.axis = split.axis;
+		node.split = split.pos;
+		for (int i = 0; i < 2; ++i) {
+			node.children[i] = std::make_unique<build_node>();
+			node.children[i]->cell = with_plane(node.cell, split.axis, split.pos, i == 0);
+		}
+		if (count >= KDTREE_PARALLEL_THRESHOLD) {
+			TaskGroup group;
+			group.run([&]() {
+				build(ctx, *node.children[0], left, depth + 1);
+			});
+			build(ctx, *node.children[1], right, depth + 1);
+			group.wait();
+		} else {
+			build(ctx, *node.children[0], left, depth + 1);
+			build(ctx, *node.children[1], right, depth + 1);
+		}
+	}
+
+	// lays out the subtree depth-first, returns the index of its root
+	int flatten(build_node const& node, int depth) {
+		int idx = _nodes.size();
+		_nodes.emplace_back();
+		_depth = std::max(_depth, depth);
+		kdNode& out = _nodes[idx];
+		out.bounds = node.cell;
+		std::fill(out.ropes, out.ropes + 6, -1);
+		out.split = node.split;
+		out.axis = node.axis;
+		out.count = 0;
+		if (node.axis == -1) {
+			out.offset = _prims.size();
+			out.count = node.prims.size();
+			_prims.insert(_prims.end(), node.prims.begin(), node.prims.end());
+		} else {
+			flatten(*node.children[0], depth + 1);
+			int right = flatten(*node.children[1], depth + 1);
+			_nodes[idx].offset = right;
+		}
+		return idx;
+	}
+
+	// moves a rope of a leaf down to the smallest node that still covers the whole face
+	int optimize_rope(int rope, int face, AABB const& cell) const {
+		while (rope != -1 && !_nodes[rope].is_leaf()) {
+			kdNode const& node = _nodes[rope];
+			if (node.axis == face / 2) {
+				// split parallel to the face, only the child touching the face can be entered through it
+				rope = (face & 1) ? rope + 1 : node.offset;
+			} else if (node.split <= cell.min()[node.axis]) {
+				rope = node.offset;
+			} else if (node.split >= cell.max()[node.axis]) {
+				rope = rope + 1;
+			} else {
+				break;
+			}
+		}
+		return rope;
+	}
+	// the children of a node are each other's neighbours across the split plane, the other faces keep the ropes of the node
+	void make_ropes(int cur, int const (&ropes)[6]) {
+		kdNode& node = _nodes[cur];
+		if (node.is_leaf()) {
+			for (int face = 0; face < 6; ++face) {
+				node.ropes[face] = optimize_rope(ropes[face], face, node.bounds);
+			}
+			return;
+		}
+		int left_ropes[6], right_ropes[6];
+		std::copy(ropes, ropes + 6, left_ropes);
+		std::copy(ropes, ropes + 6, right_ropes);
+		left_ropes[2 * node.axis + 1] = node.offset;
+		right_ropes[2 * node.axis] = cur + 1;
+		make_ropes(cur + 1, left_ropes);
+		make_ropes(node.offset, right_ropes);
+	}
+
+public:
+	kdtree(kdtree const&) = delete;
+	kdtree(kdtree&&) = delete;
+
+	explicit kdtree(Scene const& scene) : _depth(0) {
+		std::vector<leaf_data> prims = bvh::world_prims(scene);
+		if (prims.empty()) {
+			return;
+		}
+
+		std::vector<glm::vec3> verts(prims.size() * 3);
+		std::vector<kd_ref> refs(prims.size());
+		AABB root = AABB::empty();
+		for (int i = 0; i < prims.size(); ++i) {
+			if (prims[i].triangle_id != -1) {
+				Geom const& geom = scene.geoms[prims[i].geom_id];
+				for (int x = 0; x < 3; ++x) {
+					verts[3 * i + x] = glm::vec3(geom.transform * glm::vec4(scene.vertices[scene.triangles[prims[i].triangle_id].verts[x]], 1));
+				}
+			}
+			refs[i] = { bvh::world_bounds(scene, prims[i]), i };
+			root.expand(refs[i].bounds);
+		}
+
+		// the usual depth limit of 8 + 1.3 log2(N)
+		int max_depth = glm::min(KDTREE_MAX_DEPTH, (int)(8 + 1.3f * std::log2((float)prims.size())));
+		build_context ctx{ prims, verts, max_depth };
+		build_node root_node;
+		root_node.cell = root;
+		build(ctx, root_node, refs, 0);
+		flatten(root_node, 0);
+
+		int ropes[6] = { -1, -1, -1, -1, -1, -1 };
+		make_ropes(0, ropes);
+	}
+
+	// restores a tree from a valid image, image can point into a memory mapped file
+	kdtree(char const* image, size_t size) : _depth(0) {
+		if (!validate_image(image, size)) {
+			return;
+		}
+		kdImageHeader header;
+		memcpy(&header, image, sizeof(header));
+		kdNode const* nodes = reinterpret_cast<kdNode const*>(image + sizeof(header));
+		leaf_data const* prims = reinterpret_cast<leaf_data const*>(nodes + header.num_nodes);
+		_nodes.assign(nodes, nodes + header.num_nodes);
+		_prims.assign(prims, prims + header.num_prims);
+		_depth = header.depth;
+	}
+
+	kdView view(Scene const& scene, BakedTriangle const* baked = nullptr) const {
+		kdView ret;
+		ret.nodes = _nodes.data();
+		ret.prims = _prims.data();
+		ret.baked = baked;
+		ret.num_nodes = _nodes.size();
+		ret.geoms = scene.geoms.data();
+		ret.compact = scene.compact_prims.data();
+		ret.tris = scene.triangles.data();
+		ret.verts = scene.vertices.data();
+		return ret;
+	}
+
+	// host traversal, used to measure and verify the tree without a GPU
+	bool intersect(Scene const& scene, Ray const& ray, HitInfo& hit, TraversalStats* stats = nullptr) const {
+		return view(scene).intersect(ray, hit, stats);
+	}
+	bool occluded(Scene const& scene, Ray const& ray, float tmax, TraversalStats* stats = nullptr) const {
+		return view(scene).occluded(ray, tmax, stats);
+	}
+
+	// lays the tree out in a linear format, header + nodes + primitives
+	std::vector<char> image() const {
+		kdImageHeader header;
+		header.magic = KDTREE_IMAGE_MAGIC;
+		header.version = KDTREE_IMAGE_VERSION;
+		header.num_nodes = _nodes.size();
+		header.num_prims = _prims.size();
+		header.depth = _depth;
+		header.size = sizeof(header) + _nodes.size() * sizeof(kdNode) + _prims.size() * sizeof(leaf_data);
+
+		std::vector<char> ret(header.size, 0);
+		memcpy(ret.data(), &header, sizeof(header));
+		if (_nodes.size()) {
+			memcpy(ret.data() + sizeof(header), _nodes.data(), _nodes.size() * sizeof(kdNode));
+		}
+		if (_prims.size()) {
+			memcpy(ret.data() + sizeof(header) + _nodes.size() * sizeof(kdNode), _prims.data(), _prims.size() * sizeof(leaf_data));
+		}
+		return ret;
+	}
+
+	// checks that an image is well formed before it is used
+	static bool validate_image(char const* data, size_t size) {
+		kdImageHeader header;
+		if (size < sizeof(header)) {
+			return false;
+		}
+		memcpy(&header, data, sizeof(header));
+		if (header.magic != KDTREE_IMAGE_MAGIC || header.version != KDTREE_IMAGE_VERSION || header.size != size
+			|| header.depth > KDTREE_MAX_DEPTH
+			|| header.size != sizeof(header) + (uint64_t)header.num_nodes * sizeof(kdNode) + (uint64_t)header.num_prims * sizeof(leaf_data)) {
+			return false;
+		}
+
+		kdNode const* nodes = reinterpret_cast<kdNode const*>(data + sizeof(header));
+		for (uint32_t i = 0; i < header.num_nodes; ++i) {
+			if (nodes[i].is_leaf()) {
+				if (nodes[i].offset < 0 || nodes[i].count < 0 || (uint64_t)nodes[i].offset + nodes[i].count > header.num_prims) {
+					return false;
+				}
+				for (int rope : nodes[i].ropes) {
+					if (rope < -1 || rope >= (int)header.num_nodes) {
+						return false;
+					}
+				}
+			} else if (nodes[i].axis < 0 || nodes[i].axis > 2 || i + 1 >= header.num_nodes
+				|| nodes[i].offset <= (int)i + 1 || (uint32_t)nodes[i].offset >= header.num_nodes) {
+				// children come after their parent in depth-first order
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::vector<kdNode> const& nodes() const {
+		return _nodes;
+	}
+	std::vector<leaf_data> const& prims() const {
+		return _prims;
+	}
+	size_t num_prims() const {
+		return _prims.size();
+	}
+	int depth() const {
+		return _depth;
+	}
+
+	// expected cost of a random ray according to the SAH, relative to the root cell
+	float sah_cost() const {
+		if (_nodes.empty()) {
+			return 0;
+		}
+		float root_area = glm::max(_nodes[0].bounds.surface_area(), EPSILON);
+		float cost = 0;
+		for (kdNode const& node : _nodes) {
+			float p = node.bounds.surface_area() / root_area;
+			cost += p * (node.is_leaf() ? KDTREE_INTERSECT_COST * node.count : KDTREE_TRAVERSAL_COST);
+		}
+		return cost;
+	}
+};
+
+/// <summary>
+/// GPU side view of the k-d tree
+/// the owner must call free() when the tree is no longer needed
+/// </summary>
+struct kdtreeGPU {
+	Span<kdNode> _nodes;
+	Span<leaf_data> _prims;
+	Span<BakedTriangle> _baked; // empty if the triangles are not baked
+	MeshInfo _mesh_info;
+	Span<Geom> _geoms;
+
+	kdtreeGPU() : _mesh_info() { }
+	/// <param name="baked"> optional, Scene::bakeTriangles(tree.prims()) </param>
+	__host__ kdtreeGPU(kdtree const& tree, MeshInfo mesh_info, Span<Geom> geoms, std::vector<BakedTriangle> const& baked = {})
+		: _nodes(make_span(tree._nodes)), _prims(make_span(tree._prims)), _baked(make_span(baked)),
+		_mesh_info(mesh_info), _geoms(geoms) { }
+
+	__host__ void free() {
+		FREE(_nodes);
+		FREE(_prims);
+		FREE(_baked);
+		_nodes = Span<kdNode>();
+		_prims = Span<leaf_data>();
+		_baked = Span<BakedTriangle>();
+	}
+
+	__host__ __device__ kdView view() const {
+		kdView ret;
+		ret.nodes = _nodes.get();
+		ret.prims = _prims.get();
+		ret.baked = _baked.get();
+		ret.num_nodes = _nodes.size();
+		ret.geoms = _geoms.get();
+		ret.compact = _mesh_info.compact_prims;
+		ret.tris = _mesh_info.tris;
+		ret.verts = _mesh_info.vertices;
+		return ret;
+	}
+
+	// only records the closest hit, its surface attributes are resolved by intersFromHit afterwards
+	__device__ bool search(HitInfo& hit, Ray const& ray, TraversalStats* stats = nullptr) const {
+		return view().intersect(ray, hit, stats);
+	}
+	// visibility test for shadow & ambient occlusion rays, no hit is recorded
+	__device__ bool occluded(Ray const& ray, float tmax, TraversalStats* stats = nullptr) const {
+		return view().occluded(ray, tmax, stats);
+	}
+};
@@ -3,57 +3,212 @@
 #include <vector>
 #include <limits>
 #include <functional>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <cuda.h>
 #include "../utilities.h"
 #include "../Collision/AABB.h"
 #include "../scene.h"
 #include "../intersections.cuh"
+#include "../threadPool.h"
 
-typedef size_t node_id_t;
+typedef uint32_t node_id_t;
 static constexpr node_id_t null_id = 0;
 static constexpr node_id_t root_id = 1;
 
-struct nodeGPU;
 struct octreeGPU;
 
-struct leaf_data {
-	leaf_data(int triangle_id, int geom_id)
-		: triangle_id(triangle_id), geom_id(geom_id) {}
-	int triangle_id; // -1 if the geom is a primitive
-	int geom_id; // geom that this triangle belongs to
-};
 struct node {
 	AABB bounds;
 	node_id_t children[8];
 	std::vector<leaf_data> leaf_infos;
-	node(nodeGPU const& nodeGPU);
 	node(AABB const& bounds) : bounds(bounds) {
 		for (size_t i = 0; i < 8; ++i) {
 			children[i] = null_id;
 		}
 	}
 	bool is_leaf() const {
-		return leaf_infos.size() == 0;
+		return leaf_infos.size() != 0;
 	}
 };
+
+/// <summary>
+/// node of the linear octree image, 64 bytes
+/// its leaf entries are leaves[leaf_offset, leaf_offset + leaf_count) of the image's leaf array
+/// </summary>
 struct nodeGPU {
 	AABB bounds;
 	node_id_t children[8];
-	Span<leaf_data> leaf_infos;
+	uint32_t leaf_offset;
+	uint32_t leaf_count;
 
-	__host__ nodeGPU() {
-		for (size_t i = 0; i < 8; ++i) {
-			children[i] = null_id;
+	__host__ __device__ bool is_leaf() const {
+		return leaf_count != 0;
+	}
+};
+static_assert(sizeof(nodeGPU) == 64, "nodeGPU is part of the octree image format");
+
+/// <summary>
+/// the octree is uploaded, downloaded & serialized as one byte image:
+/// [octreeImageHeader][nodeGPU * num_nodes][leaf_data * num_leaves]
+/// node 0 is the null node and node 1 is the root
+/// </summary>
+struct octreeImageHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_nodes;
+	uint32_t num_leaves;
+	uint32_t depth;
+	uint32_t nodes_offset;  // in bytes from the start of the image
+	uint32_t leaves_offset; // in bytes from the start of the image
+	uint32_t size;          // of the whole image in bytes
+};
+static constexpr uint32_t OCTREE_IMAGE_MAGIC = 0x4545524f; // "OREE"
+static constexpr uint32_t OCTREE_IMAGE_VERSION = 2; // 2: node bounds are shrunk to their contents
+
+/// <summary>
+/// direct mapped set of the leaf entries a ray has tested recently;
+/// a triangle overlapping several leaves is referenced by each of them, but the result of its test does not depend on the leaf
+/// </summary>
+struct triangleMailbox {
+	leaf_data slots[OCTREE_MAILBOX_SIZE];
+
+	__host__ __device__ triangleMailbox() {
+		for (int i = 0; i < OCTREE_MAILBOX_SIZE; ++i) {
+			slots[i] = leaf_data(-1, -1);
 		}
 	}
-	__host__ nodeGPU(node const& o) : bounds(o.bounds) {
-		for (size_t i = 0; i < 8; ++i) {
-			children[i] = o.children[i];
+	// whether the entry was tested already, it is recorded otherwise
+	__host__ __device__ bool test_and_set(leaf_data const& prim) {
+		uint32_t h = (uint32_t)prim.triangle_id * 0x9E3779B1u ^ (uint32_t)prim.geom_id * 0x85EBCA6Bu;
+		leaf_data& slot = slots[(h >> 16) & (OCTREE_MAILBOX_SIZE - 1)];
+		if (slot.triangle_id == prim.triangle_id && slot.geom_id == prim.geom_id) {
+			return true;
 		}
-		leaf_infos = make_span(o.leaf_infos);
+		slot = prim;
+		return false;
 	}
-	__host__ __device__ bool is_leaf() const {
-		return leaf_infos.size() != 0;
+};
+static_assert((OCTREE_MAILBOX_SIZE & (OCTREE_MAILBOX_SIZE - 1)) == 0, "OCTREE_MAILBOX_SIZE must be a power of 2");
+
+/// <summary>
+/// raw pointers into an octree image & the scene
+/// all pointers are either host or device pointers
+/// </summary>
+struct octreeView {
+	nodeGPU const* nodes;
+	leaf_data const* leaves;
+	BakedTriangle const* baked; // optional, parallel to leaves
+	int num_nodes;
+	Geom const* geoms;
+	CompactPrim const* compact; // parallel to geoms
+	int num_geoms;
+	Triangle const* tris;
+	Vertex const* verts;
+	bool mailbox; // whether entries already tested by the ray in other leaves are skipped
+
+	__host__ __device__ bool intersect_leaf(nodeGPU const& node, Ray const& ray, HitInfo& hit, TraversalStats* stats, bool occlusion, triangleMailbox& tested) const {
+		bool any_hit = false;
+		for (uint32_t i = node.leaf_offset; i < node.leaf_offset + node.leaf_count && !(any_hit && occlusion); ++i) {
+			if (mailbox && tested.test_and_set(leaves[i])) {
+				if (stats) {
+					++stats->prims_skipped;
+				}
+				continue;
+			}
+			if (stats) {
+				++stats->prims_tested;
+			}
+			any_hit |= leafHitTest(leaves[i], geoms, compact, tris, verts, ray, hit, baked ? baked + i : nullptr);
+		}
+		return any_hit;
+	}
+
+	/// <summary>
+	/// finds the closest hit
+	/// </summary>
+	/// <param name="ordered"> whether to visit children front to back and skip the ones beyond the closest hit,
+	/// otherwise every node touched by the ray is visited </param>
+	/// <param name="occlusion"> stop at the first hit closer than hit.t instead of looking for the closest one </param>
+	__host__ __device__ bool intersect(Ray const& ray, HitInfo& hit, TraversalStats* stats, bool ordered = true, bool occlusion = false) const {
+		bool any_hit = false;
+#ifdef OCTREE_MESH_ONLY
+		// test primitives first, a close hit lets the traversal skip more nodes
+		for (int i = 0; i < num_geoms; ++i) {
+			if (compact[i].type == COMPACT_NONE) {
+				continue;
+			}
+			if (stats) {
+				++stats->prims_tested;
+			}
+			any_hit |= leafHitTest(leaf_data(-1, i), geoms, compact, tris, verts, ray, hit);
+			if (any_hit && occlusion) {
+				return true;
+			}
+		}
+#endif // OCTREE_MESH_ONLY
+		if (num_nodes <= root_id) {
+			return any_hit;
+		}
+
+		// each level pops one node and pushes at most 8 children,
+		// the builder never goes deeper than OCTREE_MAX_DEPTH
+		node_id_t stack[OCTREE_STACK_SIZE(OCTREE_MAX_DEPTH)];
+		float stack_t[OCTREE_STACK_SIZE(OCTREE_MAX_DEPTH)]; // entry distance of each node
+		int sp = 0;
+		triangleMailbox tested;
+		TraversalRay box_ray = makeTraversalRay(ray);
+
+		float t_near, t_far;
+		if (AABBRayRange(nodes[root_id].bounds, box_ray, t_near, t_far)) {
+			stack[sp] = root_id;
+			stack_t[sp++] = t_near;
+		}
+		while (sp) {
+			--sp;
+			if (ordered && stack_t[sp] >= hit.t) {
+				continue;
+			}
+			nodeGPU const& node = nodes[stack[sp]];
+			if (stats) {
+				++stats->nodes_visited;
+			}
+			if (node.is_leaf()) {
+				any_hit |= intersect_leaf(node, ray, hit, stats, occlusion, tested);
+				if (any_hit && occlusion) {
+					return true;
+				}
+				continue;
+			}
+
+			// insertion sort the children so that the nearest one is on top of the stack
+			int first = sp;
+			for (int i = 0; i < 8; ++i) {
+				node_id_t child = node.children[i];
+				if (child == null_id || !AABBRayRange(nodes[child].bounds, box_ray, t_near, t_far)) {
+					continue;
+				}
+				if (ordered && t_near >= hit.t) {
+					continue;
+				}
+				int j = sp++;
+				for (; ordered && j > first && stack_t[j - 1] < t_near; --j) {
+					stack[j] = stack[j - 1];
+					stack_t[j] = stack_t[j - 1];
+				}
+				stack[j] = child;
+				stack_t[j] = t_near;
+			}
+		}
+		return any_hit;
+	}
+	// whether anything is hit before tmax, stops at the first hit found
+	__host__ __device__ bool occluded(Ray const& ray, float tmax, TraversalStats* stats) const {
+		HitInfo hit;
+		hit.t = tmax;
+		return intersect(ray, hit, stats, true, true);
 	}
 };
 
@@ -61,116 +216,391 @@ class octree {
 	friend class octreeGPU;
 private:
 	std::vector<node> _nodes;
-	int _depth_lim;
-
+	OctreeSettings _settings;
+	int _depth; // depth of the deepest node actually built
+
+	// a primitive that may overlap a node, with its triangle already in world space
+	struct candidate {
+		leaf_data data;
+		glm::vec3 verts[3];
+	};
+	struct build_node {
+		AABB bounds; // the subdivision cell while the node is built, the bounds of its contents afterwards
+		std::unique_ptr<build_node> children[8];
+		std::vector<leaf_data> leaf_infos;
+	};
 
 	node_id_t new_node(AABB const& bounds) {
 		node_id_t ret = _nodes.size();
 		_nodes.emplace_back(bounds);
 		return ret;
 	}
-	// does any triangles in the scene hit the AABB?
-	// if leaf is not null, fills it with the intersection info
-	bool get_hits(Scene const& scene, AABB const& box, node_id_t leaf) {
+
+	static bool overlaps(Scene const& scene, candidate const& cand, AABB const& box) {
+		if (cand.data.triangle_id == -1) {
+			return AABBIntersect(scene.geoms[cand.data.geom_id].bounds, box);
+		}
+		return AABBTriangleIntersect(box, cand.verts);
+	}
+
+	// gathers every primitive of the scene, transforming each triangle to world space once
+	static std::vector<candidate> make_candidates(Scene const& scene) {
 		auto const& meshes = scene.meshes;
 		auto const& verts = scene.vertices;
 		auto const& tris = scene.triangles;
 		auto const& geoms = scene.geoms;
 
+		std::vector<candidate> ret;
 		for (int geom_id = 0; geom_id < geoms.size(); ++geom_id) {
 			auto const& geom = geoms[geom_id];
-			if (!AABBIntersect(geom.bounds, box)) {
-				continue;
-			}
 			if (geom.type != MESH) {
 #ifdef OCTREE_MESH_ONLY
 				continue;
 #endif // OCTREE_MESH_ONLY
+				candidate cand;
+				cand.data = leaf_data(-1, geom_id);
+				ret.push_back(cand);
+				continue;
+			}
 
-				if (leaf == null_id) {
-					return true;
-				} else {
-					_nodes[leaf].leaf_infos.emplace_back(-1, geom_id);
+			for (int i = meshes[geom.meshid].tri_start; i < meshes[geom.meshid].tri_end; ++i) {
+				candidate cand;
+				cand.data = leaf_data(i, geom_id);
+				for (int x = 0; x < 3; ++x) {
+					cand.verts[x] = glm::vec3(geom.transform * glm::vec4(verts[tris[i].verts[x]], 1));
 				}
-			} else {
-				for (int i = meshes[geom.meshid].tri_start; i < meshes[geom.meshid].tri_end; ++i) {
-					auto const& tri = tris[i];
+				ret.push_back(cand);
+			}
+		}
+		return ret;
+	}
 
-					glm::vec3 triangle_verts[3];
-					for (int x = 0; x < 3; ++x) {
-						triangle_verts[x] = glm::vec3(geom.transform * glm::vec4(verts[tri.verts[x]], 1));
+	// one of the 8 equal parts of a cell, reaching OCTREE_BOX_EPS past it; bit 2, 1, 0 of i select the upper half along x, y, z
+	static AABB child_cell(AABB const& cell, int i) {
+		glm::vec3 half_size = cell.extent();
+		glm::vec3 lo = cell.min() + half_size * glm::vec3((i >> 2) & 1, (i >> 1) & 1, i & 1);
+		return AABB(lo - OCTREE_BOX_EPS, lo + half_size + OCTREE_BOX_EPS);
+	}
+
+	// bounds of the part of a primitive inside a box, the triangle is clipped against the 6 planes of the box
+	static AABB clipped_bounds(Scene const& scene, candidate const& cand, AABB const& box) {
+		AABB ret = AABB::empty();
+		if (cand.data.triangle_id == -1) {
+			ret = scene.geoms[cand.data.geom_id].bounds;
+		} else {
+			// every plane adds at most one vertex
+			glm::vec3 poly[9], clipped[9];
+			int n = 3;
+			for (int i = 0; i < 3; ++i) {
+				poly[i] = cand.verts[i];
+			}
+			for (int plane = 0; plane < 6 && n; ++plane) {
+				int axis = plane >> 1;
+				float d = (plane & 1) ? box.max()[axis] : box.min()[axis];
+				float sign = (plane & 1) ? -1.f : 1.f; // points with sign * (p - d) >= 0 are kept
+				int m = 0;
+				for (int i = 0; i < n; ++i) {
+					glm::vec3 const& a = poly[i];
+					glm::vec3 const& b = poly[(i + 1) % n];
+					float da = sign * (a[axis] - d), db = sign * (b[axis] - d);
+					if (da >= 0) {
+						clipped[m++] = a;
 					}
-					if (AABBTriangleIntersect(box, triangle_verts)) {
-						if (leaf == null_id) {
-							return true;
-						} else {
-							_nodes[leaf].leaf_infos.emplace_back(i, geom_id);
-						}
+					if ((da < 0 && db > 0) || (da > 0 && db < 0)) {
+						clipped[m] = glm::mix(a, b, da / (da - db));
+						clipped[m++][axis] = d;
 					}
 				}
+				n = m;
+				std::copy(clipped, clipped + n, poly);
 			}
+			for (int i = 0; i < n; ++i) {
+				ret.expand(poly[i]);
+			}
+		}
+		return AABB(glm::max(ret.min(), box.min()), glm::min(ret.max(), box.max()));
+	}
+	// shrinks a built node from its cell to its contents, padded by OCTREE_BOX_EPS so that flat contents still have some volume
+	static void shrink(build_node& cur, AABB const& contents) {
+		glm::vec3 lo = glm::max(contents.min() - OCTREE_BOX_EPS, cur.bounds.min());
+		glm::vec3 hi = glm::min(contents.max() + OCTREE_BOX_EPS, cur.bounds.max());
+		if (glm::all(glm::lessThanEqual(lo, hi))) {
+			cur.bounds = AABB(lo, hi);
 		}
+	}
 
-		if (leaf == null_id) {
-			return false;
-		} else {
-			return !_nodes[leaf].leaf_infos.empty();
+	// child boxes are derived from the padded parent box and reach OCTREE_BOX_EPS past it,
+	// so the candidates of a node are the primitives overlapping its box padded once per level below it
+	AABB candidate_bounds(AABB const& box, int depth) const {
+		float pad = (_settings.max_depth - depth) * OCTREE_BOX_EPS;
+		return AABB(box.min() - pad, box.max() + pad);
+	}
+	static std::vector<candidate> filter(Scene const& scene, std::vector<candidate> const& cands, AABB const& box) {
+		std::vector<candidate> ret;
+		for (candidate const& cand : cands) {
+			if (overlaps(scene, cand, box)) {
+				ret.push_back(cand);
+			}
 		}
+		return ret;
 	}
-	void build(Scene const& scene, node_id_t const cur, int const depth) {
-		if (depth > _depth_lim) {
-			return;
-		} else if (depth == _depth_lim) {
-			// build leaf
-			get_hits(scene, _nodes[cur].bounds, cur);
-			// put prims before meshes
-			std::partition(_nodes[cur].leaf_infos.begin(), _nodes[cur].leaf_infos.end(), [](leaf_data const& data) {
-				return data.triangle_id == -1; });
+
+	void make_leaf(Scene const& scene, build_node& cur, std::vector<candidate> const& cands) {
+		AABB contents = AABB::empty();
+		for (candidate const& cand : cands) {
+			if (overlaps(scene, cand, cur.bounds)) {
+				cur.leaf_infos.push_back(cand.data);
+				contents.expand(clipped_bounds(scene, cand, cur.bounds));
+			}
+		}
+		shrink(cur, contents);
+		// put prims before meshes
+		std::partition(cur.leaf_infos.begin(), cur.leaf_infos.end(), [](leaf_data const& data) {
+			return data.triangle_id == -1; });
+	}
+
+	// each child only tests the candidates of its parent,
+	// children with enough candidates are built on the thread pool
+	void build(Scene const& scene, build_node& cur, std::vector<candidate> const& cands, int const depth) {
+		// candidates are padded, count the primitives that really overlap this node
+		int count = std::count_if(cands.begin(), cands.end(), [&](candidate const& cand) {
+			return overlaps(scene, cand, cur.bounds); });
+		if (depth >= _settings.max_depth
+			|| count <= _settings.max_leaf_size
+			|| glm::min(glm::min(cur.bounds.extent().x, cur.bounds.extent().y), cur.bounds.extent().z) < _settings.min_extent) {
+			make_leaf(scene, cur, cands);
 			return;
 		}
 
 		// recursively divide the space
-		glm::vec3 half_size = _nodes[cur].bounds.extent();
-		glm::vec3 half_X = glm::vec3(half_size.x, 0, 0);
-		glm::vec3 half_Y = glm::vec3(0, half_size.y, 0);
-		glm::vec3 half_Z = glm::vec3(0, 0, half_size.z);
-		glm::vec3 bmin = _nodes[cur].bounds.min();
-		AABB bs[8];
-		glm::vec3 mins[8]{
-			bmin,
-			bmin + half_Z,
-			bmin + half_Y,
-			bmin + half_Y + half_Z,
-			bmin + half_X,
-			bmin + half_X + half_Z,
-			bmin + half_X + half_Y,
-			bmin + half_X + half_Y + half_Z,
-		};
+		AABB boxes[8];
+		std::vector<candidate> child_cands[8];
+		int child_counts[8];
+		float split_cost = _settings.traversal_cost;
+		for (size_t i = 0; i < 8; ++i) {
+			boxes[i] = child_cell(cur.bounds, i);
+			child_cands[i] = filter(scene, cands, candidate_bounds(boxes[i], depth + 1));
+			child_counts[i] = std::count_if(child_cands[i].begin(), child_cands[i].end(), [&](candidate const& cand) {
+				return overlaps(scene, cand, boxes[i]); });
+			split_cost += _settings.intersect_cost * child_counts[i] * boxes[i].surface_area() / cur.bounds.surface_area();
+		}
+
+		// triangles straddling the children are duplicated, stop if that costs more than it saves
+		if (_settings.sah_termination && split_cost >= _settings.intersect_cost * count) {
+			make_leaf(scene, cur, cands);
+			return;
+		}
 
+		TaskGroup group;
 		for (size_t i = 0; i < 8; ++i) {
-			bs[i] = AABB(mins[i] - OCTREE_BOX_EPS, mins[i] + half_size + OCTREE_BOX_EPS);
-			if (get_hits(scene, bs[i], null_id)) {
-				node_id_t ret = new_node(bs[i]);
-				_nodes[cur].children[i] = ret;
+			if (!child_counts[i]) {
+				continue;
+			}
 
-				//_nodes[cur].children[i] = new_node(bs[i]);
-				// TODO: figure out why _nodes[cur].children[i] = new_node(bs[i]) is wrong in release with /O2 flag
-				// my mind is BLOWN by this fact
+			cur.children[i] = std::make_unique<build_node>();
+			cur.children[i]->bounds = boxes[i];
+			build_node& child = *cur.children[i];
+			if (child_cands[i].size() >= OCTREE_PARALLEL_THRESHOLD) {
+				group.run([&, i]() {
+					build(scene, child, child_cands[i], depth + 1);
+				});
+			} else {
+				build(scene, child, child_cands[i], depth + 1);
+			}
+		}
+		group.wait();
 
-				build(scene, _nodes[cur].children[i], depth + 1);
+		AABB contents = AABB::empty();
+		for (size_t i = 0; i < 8; ++i) {
+			if (cur.children[i]) {
+				contents.expand(cur.children[i]->bounds);
 			}
 		}
+		shrink(cur, contents);
+	}
+
+	// lays out the subtree in pre-order, returns the id of its root
+	node_id_t flatten(build_node& cur, int depth) {
+		node_id_t ret = new_node(cur.bounds);
+		_nodes[ret].leaf_infos = std::move(cur.leaf_infos);
+		_depth = std::max(_depth, depth);
+		for (size_t i = 0; i < 8; ++i) {
+			if (cur.children[i]) {
+				node_id_t child = flatten(*cur.children[i], depth + 1);
+				_nodes[ret].children[i] = child;
+			}
+		}
+		return ret;
 	}
 public:
 	octree(octree const&) = delete;
 	octree(octree&&) = delete;
-	octree(Scene const& scene, AABB const& root_aabb, int depth_lim) : _depth_lim(depth_lim) {
+	octree(Scene const& scene, AABB const& root_aabb, OctreeSettings const& settings) : _settings(settings), _depth(0) {
+		// the GPU traversal stack is sized for at most OCTREE_MAX_DEPTH levels
+		_settings.max_depth = glm::clamp(_settings.max_depth, 0, OCTREE_MAX_DEPTH);
 		new_node(AABB()); //dummy node
-		new_node(root_aabb); // root
-		build(scene, root_id, 0);
+
+		build_node root;
+		root.bounds = root_aabb;
+		build(scene, root, filter(scene, make_candidates(scene), candidate_bounds(root_aabb, 0)), 0);
+		flatten(root, 0); // root gets root_id
 	}
 
 	octree(octreeGPU const& treeGPU);
+	// rebuilds the host tree from a valid image
+	octree(std::vector<char> const& image) : octree(image.data(), image.size()) { }
+	// image can point into a memory mapped file
+	octree(char const* image, size_t size) : _depth(0) {
+		if (!validate_image(image, size)) {
+			// empty tree
+			new_node(AABB());
+			new_node(AABB());
+			return;
+		}
+		octreeImageHeader header;
+		memcpy(&header, image, sizeof(header));
+		nodeGPU const* nodes = reinterpret_cast<nodeGPU const*>(image + header.nodes_offset);
+		leaf_data const* leaves = reinterpret_cast<leaf_data const*>(image + header.leaves_offset);
+
+		_depth = header.depth;
+		_settings.max_depth = header.depth;
+		for (uint32_t i = 0; i < header.num_nodes; ++i) {
+			node_id_t id = new_node(nodes[i].bounds);
+			for (size_t c = 0; c < 8; ++c) {
+				_nodes[id].children[c] = nodes[i].children[c];
+			}
+			_nodes[id].leaf_infos.assign(leaves + nodes[i].leaf_offset, leaves + nodes[i].leaf_offset + nodes[i].leaf_count);
+		}
+	}
+
+	// lays the tree out in the linear format, every byte is deterministic
+	std::vector<char> image() const {
+		octreeImageHeader header;
+		header.magic = OCTREE_IMAGE_MAGIC;
+		header.version = OCTREE_IMAGE_VERSION;
+		header.num_nodes = _nodes.size();
+		header.num_leaves = num_prims();
+		header.depth = _depth;
+		header.nodes_offset = sizeof(octreeImageHeader);
+		header.leaves_offset = header.nodes_offset + header.num_nodes * sizeof(nodeGPU);
+		header.size = header.leaves_offset + header.num_leaves * sizeof(leaf_data);
+
+		std::vector<char> ret(header.size, 0);
+		memcpy(ret.data(), &header, sizeof(header));
+		uint32_t leaf_offset = 0;
+		for (size_t i = 0; i < _nodes.size(); ++i) {
+			nodeGPU n;
+			n.bounds = _nodes[i].bounds;
+			for (size_t c = 0; c < 8; ++c) {
+				n.children[c] = _nodes[i].children[c];
+			}
+			n.leaf_offset = leaf_offset;
+			n.leaf_count = _nodes[i].leaf_infos.size();
+			memcpy(ret.data() + header.nodes_offset + i * sizeof(nodeGPU), &n, sizeof(n));
+			if (n.leaf_count) {
+				memcpy(ret.data() + header.leaves_offset + leaf_offset * sizeof(leaf_data),
+					_nodes[i].leaf_infos.data(), n.leaf_count * sizeof(leaf_data));
+			}
+			leaf_offset += n.leaf_count;
+		}
+		return ret;
+	}
+
+	// host view of an image, used to measure and verify the traversal without a GPU
+	static octreeView view(std::vector<char> const& image, Scene const& scene, BakedTriangle const* baked = nullptr) {
+		octreeImageHeader header;
+		memcpy(&header, image.data(), sizeof(header));
+
+		octreeView ret;
+		ret.nodes = reinterpret_cast<nodeGPU const*>(image.data() + header.nodes_offset);
+		ret.leaves = reinterpret_cast<leaf_data const*>(image.data() + header.leaves_offset);
+		ret.baked = baked;
+		ret.num_nodes = header.num_nodes;
+		ret.geoms = scene.geoms.data();
+		ret.compact = scene.compact_prims.data();
+		ret.num_geoms = scene.geoms.size();
+		ret.tris = scene.triangles.data();
+		ret.verts = scene.vertices.data();
+		ret.mailbox = true;
+		return ret;
+	}
+
+	// checks that an image is well formed before it is used
+	static bool validate_image(char const* data, size_t size) {
+		octreeImageHeader header;
+		if (size < sizeof(header)) {
+			return false;
+		}
+		memcpy(&header, data, sizeof(header));
+		if (header.magic != OCTREE_IMAGE_MAGIC || header.version != OCTREE_IMAGE_VERSION
+			|| header.size != size || header.num_nodes <= root_id || header.depth > OCTREE_MAX_DEPTH
+			|| header.nodes_offset != sizeof(header)
+			|| header.leaves_offset != header.nodes_offset + (uint64_t)header.num_nodes * sizeof(nodeGPU)
+			|| header.size != header.leaves_offset + (uint64_t)header.num_leaves * sizeof(leaf_data)) {
+			return false;
+		}
+
+		nodeGPU const* nodes = reinterpret_cast<nodeGPU const*>(data + header.nodes_offset);
+		for (uint32_t i = 0; i < header.num_nodes; ++i) {
+			for (node_id_t child : nodes[i].children) {
+				if (child >= header.num_nodes || (child != null_id && child <= i)) {
+					return false;
+				}
+			}
+			if ((uint64_t)nodes[i].leaf_offset + nodes[i].leaf_count > header.num_leaves) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// leaf references in the order of the image, triangles can be baked from them
+	std::vector<leaf_data> leaves() const {
+		std::vector<leaf_data> ret;
+		ret.reserve(num_prims());
+		for (node const& n : _nodes) {
+			ret.insert(ret.end(), n.leaf_infos.begin(), n.leaf_infos.end());
+		}
+		return ret;
+	}
+
+	// excludes the dummy node
+	size_t num_nodes() const {
+		return _nodes.size() - 1;
+	}
+	int depth() const {
+		return _depth;
+	}
+	size_t num_prims() const {
+		size_t ret = 0;
+		for (node const& n : _nodes) {
+			ret += n.leaf_infos.size();
+		}
+		return ret;
+	}
+
+	/// <summary>
+	/// how much empty space the node bounds cut away from the subdivision cells
+	/// </summary>
+	/// <param name="root_cell"> the box the tree was built in </param>
+	/// <returns> the fraction of the summed surface area of the cells, which is what the traversal cost scales with </returns>
+	float empty_space(AABB const& root_cell) const {
+		if (_nodes.size() <= root_id) {
+			return 0;
+		}
+		double cell_area = 0, node_area = 0;
+		std::function<void(node_id_t, AABB const&)> f = [&](node_id_t cur, AABB const& cell) {
+			cell_area += cell.surface_area();
+			node_area += _nodes[cur].bounds.surface_area();
+			for (int i = 0; i < 8; ++i) {
+				if (_nodes[cur].children[i] != null_id) {
+					f(_nodes[cur].children[i], child_cell(cell, i));
+				}
+			}
+		};
+		f(root_id, root_cell);
+		return cell_area > 0 ? (float)(1 - node_area / cell_area) : 0.f;
+	}
 
 	template<typename Callback>
 	void dfs(Callback func) {
@@ -189,256 +619,78 @@ public:
 /// <summary>
 /// GPU side representation of the octree 
 /// which cannot be modified
+/// the whole tree lives in a single allocation holding the image built by octree::image()
 /// </summary>
 struct octreeGPU {
-	Span<nodeGPU> _nodes;
+	Span<char> _image;
+	Span<nodeGPU> _nodes;   // views into _image
+	Span<leaf_data> _leaves;
+	Span<BakedTriangle> _baked; // separate allocation parallel to _leaves, empty if the triangles are not baked
 	MeshInfo _mesh_info;
 	Span<Geom> _geoms;
 	bool _is_copy;
 
+	// empty placeholder used when the octree is not built
+	octreeGPU() : _mesh_info(), _is_copy(true) { }
 	octreeGPU(octreeGPU const& o) 
-		: _nodes(o._nodes), _mesh_info(o._mesh_info), _geoms(o._geoms), _is_copy(true) { }
+		: _image(o._image), _nodes(o._nodes), _leaves(o._leaves), _baked(o._baked), _mesh_info(o._mesh_info), _geoms(o._geoms),
+		_is_copy(true) { }
 	octreeGPU(octreeGPU&&) = delete;
-	octreeGPU(octree const& tree, MeshInfo mesh_info, Span<Geom> geoms) : _is_copy(false) {
+	/// <param name="baked"> optional, Scene::bakeTriangles(tree.leaves()) </param>
+	octreeGPU(octree const& tree, MeshInfo mesh_info, Span<Geom> geoms, std::vector<BakedTriangle> const& baked = {})
+		: _baked(make_span(baked)), _is_copy(false) {
+		// the traversal stack is sized for OCTREE_MAX_DEPTH, the builder & the cache loader clamp to it
+		assert(tree.depth() <= OCTREE_MAX_DEPTH);
 		// save mesh info of the scene
 		this->_mesh_info = mesh_info;
 		this->_geoms = geoms;
 
-		int num_nodes = tree._nodes.size();
-		// first form GPU representation at host side
-		std::vector<nodeGPU> hst_nodes(num_nodes);
-		for (size_t i = 0; i < num_nodes; ++i) {
-			hst_nodes[i] = nodeGPU(tree._nodes[i]);
-		}
+		std::vector<char> image = tree.image();
+		octreeImageHeader header;
+		memcpy(&header, image.data(), sizeof(header));
 
-		// upload to GPU
-		nodeGPU* tmp;
-		ALLOC(tmp, num_nodes);
-		H2D(tmp, hst_nodes.data(), num_nodes);
-		_nodes = Span<nodeGPU>(num_nodes, tmp);
+		_image = make_span(image);
+		_nodes = Span<nodeGPU>(header.num_nodes, reinterpret_cast<nodeGPU*>(_image.get() + header.nodes_offset));
+		_leaves = Span<leaf_data>(header.num_leaves, reinterpret_cast<leaf_data*>(_image.get() + header.leaves_offset));
 	}
 	~octreeGPU() {
 		if (_is_copy) {
 			return;
 		}
-
-		size_t num_nodes = _nodes.size();
-		// get data back from GPU so we can free it
-		nodeGPU* hst_nodes = new nodeGPU[num_nodes];
-		D2H(hst_nodes, _nodes, num_nodes);
-		for (size_t i = 0; i < num_nodes; ++i) {
-			FREE(hst_nodes[i].leaf_infos);
-		}
-		FREE(_nodes);
-		delete[] hst_nodes;
-	}
-
-	__device__ bool handle_leaf(node_id_t const cur, ShadeableIntersection& inters, Ray const& ray) const {
-		auto const& info = _nodes[cur].leaf_infos;
-		float t_min = inters.t;
-
-		// any closer hit?
-		bool any_hit = false;
-
-		// loop through primitives
-		int i;
-		for (i = 0; i < info.size() && info[i].triangle_id == -1; ++i) {
-			auto const& geom = _geoms[info[i].geom_id];
-
-			ShadeableIntersection tmp_inters;
-			if (geom.type == CUBE) {
-				float t = boxIntersectionTest(geom, ray, tmp_inters);
-				if (t > 0) {
-					if (t_min > t) {
-						t_min = t;
-						inters = tmp_inters;
-						any_hit = true;
-					}
-				}
-			} else if (geom.type == SPHERE) {
-				float t = sphereIntersectionTest(geom, ray, tmp_inters);
-				if (t > 0) {
-					if (t_min > t) {
-						t_min = t;
-						inters = tmp_inters;
-						any_hit = true;
-					}
-				}
-			} else {
-				return false;
-			}
-		}
-
-		// loop through triangles
-		int idx = -1;
-		glm::vec3 barycoord;
-		float t_min_tri = FLT_MAX; // use another var because t is apparently different in local space???
-		for (; i < info.size(); ++i) {
-			auto const& tri = _mesh_info.tris[info[i].triangle_id];
-			auto const& geom = _geoms[info[i].geom_id];
-			glm::vec3 ro = multiplyMV(geom.inverseTransform, glm::vec4(ray.origin, 1.0f));
-			glm::vec3 rd = glm::normalize(multiplyMV(geom.inverseTransform, glm::vec4(ray.direction, 0.0f)));
-			glm::vec3 tmp_barycoord;
-			glm::vec3 triangle_verts[3]{
-				_mesh_info.vertices[tri.verts[0]],
-				_mesh_info.vertices[tri.verts[1]],
-				_mesh_info.vertices[tri.verts[2]]
-			};
-
-			if (glm::intersectRayTriangle(ro, rd, triangle_verts[0], triangle_verts[1], triangle_verts[2], tmp_barycoord)) {
-				float t = tmp_barycoord.z;
-				if (t_min_tri > t) {
-					t_min_tri = t;
-					idx = i;
-					barycoord = tmp_barycoord;
-				}
-			}
-		}
-
-		if (idx != -1) {
-			// result is a ray-triangle intersection
-			ShadeableIntersection tmp_inters;
-			float t = intersFromTriangle(
-				tmp_inters,
-				ray,
-				t_min_tri,
-				_mesh_info,
-				_geoms[info[idx].geom_id],
-				_mesh_info.tris[info[idx].triangle_id],
-				glm::vec2(barycoord));
-
-			if (t_min > t) {
-				t_min = t;
-				inters = tmp_inters;
-				any_hit = true;
-			}
-		}
-		return any_hit;
+		FREE(_image);
+		FREE(_baked);
 	}
 
-	/// <summary>
-	/// recursively searches the octree for hits
-	/// </summary>
-	/// <param name="cur"> current node </param>
-	/// <param name="info"> hit info container </param>
-	/// <param name="ray"> ray </param>
-	/// <returns>whether there are any triangle hits </returns>
-	__device__ bool _search(node_id_t const cur, ShadeableIntersection& inters, Ray const& ray) const {
-		// FOR THE LOVE OF GOD
-		// Why can't recursion just work on GPU ????
-		/*
-		if (_nodes[cur].is_leaf()) {
-			return handle_leaf(cur, inters, ray);
-		} else {
-			for (size_t i = 0; i < 8; ++i) {
-				node_id_t child = _nodes[cur].children[i];
-				if (child != null_id && AABBRayIntersect(_nodes[child].bounds, ray, nullptr)) {
-					if (_search(child, inters, ray)) {
-						return true;
-					}
-				}
-			}
-			return false;
-		}*/
-
-		bool ret = false;
-		node_id_t stack[10 * OCTREE_DEPTH];
-		node_id_t* pstk = stack;
-		for (size_t i = 0; i < 8; ++i) {
-			node_id_t child = _nodes[root_id].children[i];
-			if (child != null_id && AABBRayIntersect(_nodes[child].bounds, ray, nullptr)) {
-				*(pstk++) = child;
-			}
-		}
-		while (pstk != stack) {
-			node_id_t id = *(--pstk);
-			if (_nodes[id].is_leaf()) {
-				ret |= handle_leaf(id, inters, ray);
-			} else {
-				for (size_t i = 0; i < 8; ++i) {
-					node_id_t child = _nodes[id].children[i];
-					if (child != null_id && AABBRayIntersect(_nodes[child].bounds, ray, nullptr)) {
-						*(pstk++) = child;
-					}
-				}
-			}
-		}
+	// copies the image back to the host
+	std::vector<char> download() const {
+		std::vector<char> ret(_image.size());
+		D2H(ret.data(), _image, _image.size());
 		return ret;
 	}
-	__device__ bool search(ShadeableIntersection& inters, Ray const& ray) const {
-		inters.t = FLT_MAX;
-		bool any_hit = false;
-#ifdef OCTREE_MESH_ONLY
-		for (int i = 0; i < _geoms.size(); i++) {
-			Geom const& geom = _geoms[i];
-#ifdef AABB_CULLING
-			if (!AABBRayIntersect(geom.bounds, ray, nullptr))
-				continue;
-#endif // AABB_CULLING
-
-			float t;
-			ShadeableIntersection tmp;
 
-			if (geom.type == CUBE) {
-				t = boxIntersectionTest(geom, ray, tmp);
-			} else if (geom.type == SPHERE) {
-				t = sphereIntersectionTest(geom, ray, tmp);
-			} else {
-				continue;
-			}
-			if (t > 0.0f && inters.t > t) {
-				inters = tmp;
-				inters.t = t;
-				any_hit = true;
-			}
-		}
-#endif // OCTREE_MESH_ONLY
-		if (_search(root_id, inters, ray)) {
-			any_hit = true;
-		}
-		return any_hit;
-	}
-};
-
-inline octree::octree(octreeGPU const& treeGPU) : _depth_lim(OCTREE_DEPTH) {
-#pragma warning(push)
-#pragma warning(push)
-#pragma warning(disable : 6385)
-#pragma warning(disable : 6011)
-
-	size_t num_nodes = treeGPU._nodes.size();
-	nodeGPU* tmp = reinterpret_cast<nodeGPU*>(malloc(num_nodes * sizeof(nodeGPU)));
-	D2H(tmp, treeGPU._nodes, num_nodes);
-	for (int i = 0; i < num_nodes; ++i) {
-		_nodes.emplace_back(tmp[i]);
+	__host__ __device__ octreeView view() const {
+		octreeView ret;
+		ret.nodes = _nodes.get();
+		ret.leaves = _leaves.get();
+		ret.baked = _baked.get();
+		ret.num_nodes = _nodes.size();
+		ret.geoms = _geoms.get();
+		ret.compact = _mesh_info.compact_prims;
+		ret.num_geoms = _geoms.size();
+		ret.tris = _mesh_info.tris;
+		ret.verts = _mesh_info.vertices;
+		ret.mailbox = true;
+		return ret;
 	}
-	free(tmp);
-
-#pragma warning(pop)
-#pragma warning(pop)
-}
-
-inline node::node(nodeGPU const& nodeGPU)
-	: bounds(nodeGPU.bounds) {
-#pragma warning(push)
-#pragma warning(push)
-#pragma warning(disable : 6385)
-#pragma warning(disable : 6011)
 
-	for (size_t i = 0; i < 8; ++i) {
-		children[i] = nodeGPU.children[i];
+	// only records the closest hit, its surface attributes are resolved by intersFromHit afterwards
+	__device__ bool search(HitInfo& hit, Ray const& ray, TraversalStats* stats = nullptr) const {
+		return view().intersect(ray, hit, stats);
 	}
-
-	size_t num_data = nodeGPU.leaf_infos.size();
-	leaf_data* tmp = reinterpret_cast<leaf_data*>(malloc(num_data * sizeof(leaf_data)));
-	D2H(tmp, nodeGPU.leaf_infos, num_data);
-	
-	for (int i = 0; i < num_data; ++i) {
-		leaf_infos.emplace_back(tmp[i].triangle_id, tmp[i].geom_id);
+	// visibility test for shadow & ambient occlusion rays, no hit is recorded
+	__device__ bool occluded(Ray const& ray, float tmax, TraversalStats* stats = nullptr) const {
+		return view().occluded(ray, tmax, stats);
 	}
-	free(tmp);
-
-#pragma warning(pop)
-#pragma warning(pop)
-}
+};
 
+inline octree::octree(octreeGPU const& treeGPU) : octree(treeGPU.download()) { }
@@ -0,0 +1,1537 @@
+#include "accel_profile.h"
+#include "timer.h"
+#include "../scene.h"
+#include "../intersections.cuh"
+#include "../interactions.h"
+#include "../shadeQueues.h"
+#include "../BVH/bvh.h"
+#include "../BVH/tlas.h"
+#include "../BVH/lbvh.h"
+#include "../BVH/wbvh.h"
+#include "../Octree/octree.h"
+#include "../KDTree/kdtree.h"
+#include "../Collision/AABBSimd.h"
+#include "../threadPool.h"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+
+std::string Profiling::AccelReport::to_string() const {
+	std::ostringstream oss;
+	oss << name << ":\n"
+		<< "build = " << build_ms << "ms\n"
+		<< "nodes = " << num_nodes << ", prim refs = " << num_prims << ", depth = " << depth << "\n"
+		<< "SAH cost = " << sah_cost << "\n"
+		<< "rays = " << num_rays << ", trace = " << trace_ms << "ms\n"
+		<< "nodes/ray = " << nodes_per_ray << ", prims/ray = " << prims_per_ray;
+	if (skipped_per_ray) {
+		oss << ", repeated tests skipped/ray = " << skipped_per_ray;
+	}
+	oss << "\nmismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::BuildReport::to_string() const {
+	std::ostringstream oss;
+	oss << name << ":\n"
+		<< "baseline = " << baseline_ms << "ms, build = " << build_ms << "ms ("
+		<< baseline_ms / glm::max(build_ms, 1e-3f) << "x, " << num_threads << " threads)\n"
+		<< "nodes = " << num_nodes << ", prim refs = " << num_prims << "\n"
+		<< (matches ? "trees match" : "trees differ") << "\n"
+		<< "image = " << image_size << " bytes, " << (image_valid ? "valid" : "invalid");
+	return oss.str();
+}
+
+std::string Profiling::ResolveReport::to_string() const {
+	std::ostringstream oss;
+	oss << "Hit Resolve:\n"
+		<< "rays = " << num_rays << ", hits = " << num_hits << "\n"
+		<< "per-geom = " << baseline_ms << "ms, closest hit = " << trace_ms << "ms + resolve = " << resolve_ms << "ms\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::TriangleReport::to_string() const {
+	std::ostringstream oss;
+	oss << "Baked Triangles:\n"
+		<< "rays = " << num_rays << ", triangles = " << num_triangles << ", baked = " << baked_bytes << " bytes\n"
+		<< "brute force: glm = " << baseline_ms << "ms, baked = " << baked_ms << "ms ("
+		<< baseline_ms / glm::max(baked_ms, 1e-3f) << "x)\n"
+		<< "BVH: glm = " << bvh_ms << "ms, baked = " << bvh_baked_ms << "ms ("
+		<< bvh_ms / glm::max(bvh_baked_ms, 1e-3f) << "x)\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::PrimitiveReport::to_string() const {
+	std::ostringstream oss;
+	oss << "Compact Primitives:\n"
+		<< "rays = " << num_rays << ", spheres = " << num_spheres << ", unrotated boxes = " << num_axis_boxes
+		<< ", transformed = " << num_affine << "\n"
+		<< "bytes/test = " << geom_bytes << " -> " << compact_bytes << "\n"
+		<< "geoms = " << baseline_ms << "ms, compact = " << compact_ms << "ms ("
+		<< baseline_ms / glm::max(compact_ms, 1e-3f) << "x)\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::SlabReport::to_string() const {
+	std::ostringstream oss;
+	oss << "Slab Tests:\n"
+		<< "rays = " << num_rays << ", boxes = " << num_boxes << ", packets = " << simd << "\n"
+		<< "boxes entered = " << num_hits << " (AABBRayIntersect " << num_intersect_hits << ")\n"
+		<< "AABBRayIntersect = " << intersect_ms << "ms, AABBRayRange = " << range_ms << "ms\n"
+		<< "traversal ray = " << traversal_ray_ms << "ms (" << range_ms / glm::max(traversal_ray_ms, 1e-3f) << "x)\n"
+		<< "4 boxes = " << packet4_ms << "ms (" << range_ms / glm::max(packet4_ms, 1e-3f) << "x), "
+		<< "8 boxes = " << packet8_ms << "ms (" << range_ms / glm::max(packet8_ms, 1e-3f) << "x)\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::RefitReport::to_string() const {
+	std::ostringstream oss;
+	oss << name << " Refit:\n"
+		<< "nodes = " << num_nodes << ", touched = " << nodes_touched << "\n"
+		<< "refit = " << refit_ms << "ms, rebuild = " << rebuild_ms << "ms\n"
+		<< "SAH refit = " << refit_sah << ", rebuilt = " << rebuilt_sah << ", drift = " << sah_drift << "\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::SpatialSplitReport::to_string() const {
+	size_t extra_refs = sbvh.num_prims - num_source_prims;
+	std::ostringstream oss;
+	oss << bvh.to_string() << "\n\n" << sbvh.to_string() << "\n\n"
+		<< "spatial splits = " << spatial_splits << ", extra refs = " << extra_refs << " ("
+		<< 100.f * extra_refs / glm::max(num_source_prims, (size_t)1) << "% of "
+		<< num_source_prims << " prims, budget " << 100.f * settings.max_duplication << "%)\n"
+		<< "SAH improvement = " << 100.f * (1.f - sbvh.sah_cost / glm::max(bvh.sah_cost, EPSILON)) << "%, "
+		<< "trace speedup = " << bvh.trace_ms / glm::max(sbvh.trace_ms, 1e-3f) << "x";
+	return oss.str();
+}
+
+std::string Profiling::LBVHReport::to_string() const {
+	std::ostringstream oss;
+	oss << sah.to_string() << "\n\n" << lbvh.to_string() << "\n\n"
+		<< "LBVH build scaling:\n";
+	for (size_t i = 0; i < num_threads.size(); ++i) {
+		oss << num_threads[i] << " threads = " << build_ms[i] << "ms ("
+			<< build_ms[0] / glm::max(build_ms[i], 1e-3f) << "x)\n";
+	}
+	oss << "LBVH against SAH: build " << sah.build_ms / glm::max(lbvh.build_ms, 1e-3f) << "x faster, SAH cost "
+		<< lbvh.sah_cost / glm::max(sah.sah_cost, EPSILON) << "x, trace " << lbvh.trace_ms / glm::max(sah.trace_ms, 1e-3f) << "x";
+	return oss.str();
+}
+
+std::string Profiling::WideBVHReport::to_string() const {
+	std::ostringstream oss;
+	oss << name << ":\n"
+		<< "convert = " << convert_ms << "ms, depth = " << depth << "\n"
+		<< "nodes = " << num_nodes << " x " << node_bytes << " bytes, binary = " << binary_nodes << " x " << sizeof(bvhNode)
+		<< " bytes (octree " << sizeof(nodeGPU) << " bytes)\n"
+		<< "total = " << total_bytes << " bytes, binary = " << binary_bytes << " bytes ("
+		<< 100.f * total_bytes / glm::max(binary_bytes, (size_t)1) << "%)\n"
+		<< "rays = " << num_rays << ", trace = " << trace_ms << "ms, binary = " << binary_trace_ms << "ms\n"
+		<< "nodes/ray = " << nodes_per_ray << ", prims/ray = " << prims_per_ray << "\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::MailboxReport::to_string() const {
+	std::ostringstream oss;
+	oss << name << " Mailboxing:\n"
+		<< "leaf entries = " << num_refs << ", distinct = " << num_unique
+		<< " (" << (float)num_refs / glm::max(num_unique, (size_t)1) << "x)\n"
+		<< "rays = " << num_rays << ", trace = " << baseline_ms << "ms -> " << mailbox_ms << "ms\n"
+		<< "prims/ray = " << baseline_prims_per_ray << " -> " << mailbox_prims_per_ray
+		<< ", repeated tests skipped/ray = " << skipped_per_ray << "\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::OcclusionReport::to_string() const {
+	std::ostringstream oss;
+	oss << name << " Occlusion:\n"
+		<< "rays = " << num_rays << ", occluded = " << num_occluded << "\n"
+		<< "closest hit = " << closest_ms << "ms, occluded = " << occlusion_ms << "ms ("
+		<< closest_ms / glm::max(occlusion_ms, 1e-3f) << "x)\n"
+		<< "nodes/ray = " << closest_nodes_per_ray << " -> " << occlusion_nodes_per_ray
+		<< ", prims/ray = " << closest_prims_per_ray << " -> " << occlusion_prims_per_ray << "\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::PathLayoutReport::to_string() const {
+	std::ostringstream oss;
+	oss << "Path Layouts:\n"
+		<< "paths = " << num_paths << ", live after compaction = " << num_live << ", materials = " << num_materials << "\n"
+		<< "AoS record = " << aos_bytes << " bytes, SoA key = " << soa_key_bytes << " bytes\n"
+		<< "compaction: AoS = " << aos_compact_ms << "ms, SoA = " << soa_compact_ms << "ms ("
+		<< aos_compact_ms / glm::max(soa_compact_ms, 1e-3f) << "x)\n"
+		<< "material sort: AoS = " << aos_sort_ms << "ms, SoA = " << soa_sort_ms << "ms ("
+		<< aos_sort_ms / glm::max(soa_sort_ms, 1e-3f) << "x)\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::MaterialSortReport::to_string() const {
+	std::ostringstream oss;
+	oss << "Material Sort (" << name << "):\n"
+		<< "paths = " << num_paths << ", materials = " << num_materials << "\n"
+		<< "record sort = " << record_sort_ms << "ms, key sort = " << key_sort_ms << "ms, gather = " << gather_ms << "ms\n"
+		<< "shading: unsorted = " << shade_unsorted_ms << "ms, gathered = " << shade_gathered_ms
+		<< "ms, through the keys = " << shade_permuted_ms << "ms\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::string Profiling::ShadeQueueReport::to_string() const {
+	static char const* queue_names[NUM_SHADE_QUEUES] = {
+		"diffuse", "glossy", "refl", "transparent", "refr", "subsurface", "finished"
+	};
+	std::ostringstream oss;
+	oss << "Shade Queues:\n"
+		<< "paths = " << num_paths << "\n";
+	for (size_t q = 0; q < queue_sizes.size(); ++q) {
+		oss << queue_names[q] << " = " << queue_sizes[q] << (q + 1 < queue_sizes.size() ? ", " : "\n");
+	}
+	oss << "binning = " << bin_ms << "ms\n"
+		<< "shading: ray order = " << shade_ms << "ms, queued = " << shade_queued_ms << "ms\n"
+		<< "mismatches = " << mismatches;
+	return oss.str();
+}
+
+std::vector<Ray> Profiling::MakeTestRays(Scene const& scene, int num_rays) {
+	std::vector<Ray> rays;
+	rays.reserve(num_rays);
+
+	// primary rays on a regular grid of the image plane
+	Camera const& cam = scene.state.camera;
+	glm::vec3 view = glm::normalize(cam.lookAt - cam.position);
+	glm::vec3 right = glm::normalize(glm::cross(view, cam.up));
+	glm::vec3 up = glm::cross(right, view);
+	float yscaled = tan(cam.fov.y * (PI / 180));
+	float xscaled = yscaled * cam.resolution.x / glm::max(cam.resolution.y, 1);
+
+	int num_cam_rays = num_rays / 2;
+	int grid = glm::max(1, (int)sqrt((float)num_cam_rays));
+	for (int i = 0; i < num_cam_rays; ++i) {
+		float u = ((i % grid) + 0.5f) / grid * 2.f - 1.f;
+		float v = ((i / grid % grid) + 0.5f) / grid * 2.f - 1.f;
+		Ray r;
+		r.origin = cam.position;
+		r.direction = glm::normalize(view + right * u * xscaled + up * v * yscaled);
+		rays.push_back(r);
+	}
+
+	// incoherent rays, similar to secondary bounces
+	std::mt19937 rng(0);
+	std::uniform_real_distribution<float> u01(0, 1);
+	AABB const& world = scene.world_AABB;
+	while (rays.size() < num_rays) {
+		Ray r;
+		r.origin = world.min() + (world.max() - world.min()) * glm::vec3(u01(rng), u01(rng), u01(rng));
+		float z = 2 * u01(rng) - 1, phi = TWO_PI * u01(rng);
+		float s = sqrt(glm::max(0.f, 1 - z * z));
+		r.direction = glm::vec3(s * cos(phi), s * sin(phi), z);
+		rays.push_back(r);
+	}
+	return rays;
+}
+
+bool Profiling::BruteForceIntersect(Scene const& scene, Ray const& ray, HitInfo& hit) {
+	bool any_hit = false;
+	for (int geom_id = 0; geom_id < scene.geoms.size(); ++geom_id) {
+		Geom const& geom = scene.geoms[geom_id];
+		if (geom.type != MESH) {
+			float t = primitiveHitTest(geom, ray);
+			if (t > 0 && t < hit.t) {
+				hit.t = t;
+				hit.geom_id = geom_id;
+				hit.triangle_id = -1;
+				any_hit = true;
+			}
+			continue;
+		}
+
+		Mesh const& mesh = scene.meshes[geom.meshid];
+		for (int i = mesh.tri_start; i < mesh.tri_end; ++i) {
+			float t;
+			glm::vec2 bary;
+			if (triangleHitTest(geom, ray, scene.vertices.data(), scene.triangles[i], t, bary) && t < hit.t) {
+				hit.t = t;
+				hit.geom_id = geom_id;
+				hit.triangle_id = i;
+				hit.bary = bary;
+				any_hit = true;
+			}
+		}
+	}
+	return any_hit;
+}
+
+bool Profiling::SameHit(HitInfo const& a, HitInfo const& b) {
+	if (a.valid() != b.valid()) {
+		return false;
+	}
+	// different triangles may tie along a shared edge, so only the distance has to match
+	return !a.valid() || glm::abs(a.t - b.t) <= 1e-4f * glm::max(1.f, a.t);
+}
+
+// traces the test rays through an acceleration structure and checks them against brute force
+template<typename Accel>
+static void TraceTestRays(Scene const& scene, Accel const& accel, int num_rays, Profiling::AccelReport& report) {
+	std::vector<Ray> rays = Profiling::MakeTestRays(scene, num_rays);
+	std::vector<HitInfo> hits(rays.size());
+	TraversalStats stats;
+
+	Profiling::Timer timer;
+	timer.startCpuTimer();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		accel.intersect(scene, rays[i], hits[i], &stats);
+	}
+	timer.endCpuTimer();
+	report.trace_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	report.num_rays = rays.size();
+	report.nodes_per_ray = (float)stats.nodes_visited / glm::max(report.num_rays, 1);
+	report.prims_per_ray = (float)stats.prims_tested / glm::max(report.num_rays, 1);
+	report.skipped_per_ray = (float)stats.prims_skipped / glm::max(report.num_rays, 1);
+	for (size_t i = 0; i < rays.size(); ++i) {
+		HitInfo ref;
+		Profiling::BruteForceIntersect(scene, rays[i], ref);
+		if (!Profiling::SameHit(ref, hits[i])) {
+			++report.mismatches;
+		}
+	}
+}
+
+Profiling::AccelReport Profiling::ProfileBVH(Scene const& scene, int num_rays) {
+	AccelReport report;
+	report.name = "BVH";
+
+	Timer timer;
+	timer.startCpuTimer();
+	bvh tree(scene);
+	timer.endCpuTimer();
+	report.build_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	report.num_nodes = tree.nodes().size();
+	report.num_prims = tree.num_prims();
+	report.depth = tree.depth();
+	report.sah_cost = tree.sah_cost();
+
+	TraceTestRays(scene, tree, num_rays, report);
+	return report;
+}
+
+Profiling::LBVHReport Profiling::ProfileLBVH(Scene const& scene, int num_rays) {
+	LBVHReport report;
+	report.sah = ProfileBVH(scene, num_rays);
+	report.lbvh.name = "LBVH";
+
+	Timer timer;
+	int max_threads = glm::max(1u, std::thread::hardware_concurrency());
+	for (int num_threads = 1; ; num_threads = glm::min(num_threads * 2, max_threads)) {
+		ThreadPool pool(num_threads);
+		timer.startCpuTimer();
+		buildLBVH(scene, pool);
+		timer.endCpuTimer();
+		report.num_threads.push_back(num_threads);
+		report.build_ms.push_back(timer.getCpuElapsedTimeForPreviousOperation());
+		if (num_threads == max_threads) {
+			break;
+		}
+	}
+
+	timer.startCpuTimer();
+	std::unique_ptr<bvh> tree = buildLBVH(scene);
+	timer.endCpuTimer();
+	report.lbvh.build_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	report.lbvh.num_nodes = tree->nodes().size();
+	report.lbvh.num_prims = tree->num_prims();
+	report.lbvh.depth = tree->depth();
+	report.lbvh.sah_cost = tree->sah_cost();
+
+	TraceTestRays(scene, *tree, num_rays, report.lbvh);
+	return report;
+}
+
+// the brute force loop with the host interface the occlusion profile expects
+struct BruteForceHostTraversal {
+	bool intersect(Scene const& scene, Ray const& ray, HitInfo& hit, TraversalStats*) const {
+		return sceneHitTest(scene.geoms.data(), scene.compact_prims.data(), scene.geoms.size(), scene.meshes.data(), scene.triangles.data(), scene.vertices.data(), ray, hit);
+	}
+	bool occluded(Scene const& scene, Ray const& ray, float tmax, TraversalStats*) const {
+		return sceneOcclusionTest(scene.geoms.data(), scene.compact_prims.data(), scene.geoms.size(), scene.meshes.data(), scene.triangles.data(), scene.vertices.data(), ray, tmax);
+	}
+};
+
+struct OctreeOcclusionHostTraversal {
+	octreeView view;
+	bool intersect(Scene const&, Ray const& ray, HitInfo& hit, TraversalStats* stats) const {
+		return view.intersect(ray, hit, stats);
+	}
+	bool occluded(Scene const&, Ray const& ray, float tmax, TraversalStats* stats) const {
+		return view.occluded(ray, tmax, stats);
+	}
+};
+
+template<typename Accel>
+static Profiling::OcclusionReport ProfileOcclusionOf(std::string const& name, Scene const& scene, Accel const& accel,
+	std::vector<Ray> const& rays, std::vector<float> const& tmax) {
+	Profiling::OcclusionReport report;
+	report.name = name;
+	report.num_rays = rays.size();
+
+	std::vector<HitInfo> hits(rays.size());
+	TraversalStats closest_stats, occlusion_stats;
+	Profiling::Timer timer;
+	timer.startCpuTimer();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		hits[i].t = tmax[i];
+		accel.intersect(scene, rays[i], hits[i], &closest_stats);
+	}
+	timer.endCpuTimer();
+	report.closest_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	std::vector<char> occluded(rays.size());
+	timer.startCpuTimer();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		occluded[i] = accel.occluded(scene, rays[i], tmax[i], &occlusion_stats);
+	}
+	timer.endCpuTimer();
+	report.occlusion_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	float n = glm::max(report.num_rays, 1);
+	report.closest_nodes_per_ray = closest_stats.nodes_visited / n;
+	report.closest_prims_per_ray = closest_stats.prims_tested / n;
+	report.occlusion_nodes_per_ray = occlusion_stats.nodes_visited / n;
+	report.occlusion_prims_per_ray = occlusion_stats.prims_tested / n;
+	for (size_t i = 0; i < rays.size(); ++i) {
+		report.num_occluded += occluded[i];
+		report.mismatches += (bool)occluded[i] != hits[i].valid();
+	}
+	return report;
+}
+
+std::vector<Profiling::OcclusionReport> Profiling::ProfileOcclusion(Scene const& scene, int num_rays) {
+	std::vector<Ray> rays = MakeTestRays(scene, num_rays);
+
+	// half of the rays are blocked before tmax, as a shadow ray towards a light behind the closest hit would be
+	std::vector<float> tmax(rays.size());
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> u01(0.f, 1.f);
+	float diag = glm::length(scene.world_AABB.max() - scene.world_AABB.min());
+	for (size_t i = 0; i < rays.size(); ++i) {
+		HitInfo hit;
+		BruteForceIntersect(scene, rays[i], hit);
+		tmax[i] = (hit.valid() ? hit.t : diag) * (0.5f + u01(rng));
+	}
+
+	bvh tree(scene);
+	tlas accel(scene);
+	octree oct(scene, scene.world_AABB, scene.octree_settings);
+	std::vector<char> image = oct.image();
+	OctreeOcclusionHostTraversal oct_traversal;
+	oct_traversal.view = octree::view(image, scene);
+
+	return {
+		ProfileOcclusionOf("Brute Force", scene, BruteForceHostTraversal(), rays, tmax),
+		ProfileOcclusionOf("BVH", scene, tree, rays, tmax),
+		ProfileOcclusionOf("BVH (Two-Level)", scene, accel, rays, tmax),
+		ProfileOcclusionOf("Octree", scene, oct_traversal, rays, tmax),
+	};
+}
+
+template<int Width>
+static Profiling::WideBVHReport ProfileWide(Scene const& scene, bvh const& tree, std::vector<Ray> const& rays,
+	std::vector<HitInfo> const& binary_hits, float binary_trace_ms) {
+	Profiling::WideBVHReport report;
+	report.name = std::to_string(Width) + "-Wide BVH";
+	report.binary_nodes = tree.nodes().size();
+	report.binary_bytes = tree.nodes().size() * sizeof(bvhNode) + tree.num_prims() * sizeof(leaf_data);
+	report.binary_trace_ms = binary_trace_ms;
+
+	Profiling::Timer timer;
+	timer.startCpuTimer();
+	wbvh<Width> wide(tree);
+	timer.endCpuTimer();
+	report.convert_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	report.num_nodes = wide.nodes().size();
+	report.node_bytes = sizeof(wbvhNode<Width>);
+	report.total_bytes = wide.size_bytes();
+	report.depth = wide.depth();
+
+	std::vector<HitInfo> hits(rays.size());
+	TraversalStats stats;
+	timer.startCpuTimer();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		wide.intersect(scene, rays[i], hits[i], &stats);
+	}
+	timer.endCpuTimer();
+	report.trace_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	report.num_rays = rays.size();
+	report.nodes_per_ray = (float)stats.nodes_visited / glm::max(report.num_rays, 1);
+	report.prims_per_ray = (float)stats.prims_tested / glm::max(report.num_rays, 1);
+
+	// the same primitive tests run on the same rays, so the closest distance has to be bit exact;
+	// only a primitive at exactly the same distance, e.g. across a shared edge, may win instead
+	for (size_t i = 0; i < rays.size(); ++i) {
+		HitInfo const& a = binary_hits[i];
+		HitInfo const& b = hits[i];
+		if (a.t != b.t) {
+			++report.mismatches;
+		} else if (a.geom_id != b.geom_id || a.triangle_id != b.triangle_id) {
+			HitInfo tie;
+			tie.t = std::nextafter(a.t, LARGE_FLOAT);
+			if (!leafHitTest(leaf_data(b.triangle_id, b.geom_id), scene.geoms.data(), scene.compact_prims.data(), scene.triangles.data(),
+				scene.vertices.data(), rays[i], tie) || tie.t != a.t) {
+				++report.mismatches;
+			}
+		}
+	}
+	return report;
+}
+
+std::vector<Profiling::WideBVHReport> Profiling::ProfileWideBVH(Scene const& scene, int num_rays) {
+	bvh tree(scene);
+	std::vector<Ray> rays = MakeTestRays(scene, num_rays);
+	std::vector<HitInfo> hits(rays.size());
+	Timer timer;
+	timer.startCpuTimer();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		tree.intersect(scene, rays[i], hits[i]);
+	}
+	timer.endCpuTimer();
+	float binary_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	return {
+		ProfileWide<4>(scene, tree, rays, hits, binary_ms),
+		ProfileWide<8>(scene, tree, rays, hits, binary_ms),
+	};
+}
+
+Profiling::SpatialSplitReport Profiling::ProfileSBVH(Scene const& scene, SpatialSplitSettings const& settings, int num_rays) {
+	SpatialSplitReport report;
+	report.settings = settings;
+	report.num_source_prims = bvh::num_world_prims(scene);
+	report.bvh = ProfileBVH(scene, num_rays);
+	report.sbvh.name = "SBVH";
+
+	Timer timer;
+	timer.startCpuTimer();
+	bvh tree(scene, settings);
+	timer.endCpuTimer();
+	report.sbvh.build_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	report.sbvh.num_nodes = tree.nodes().size();
+	report.sbvh.num_prims = tree.num_prims();
+	report.sbvh.depth = tree.depth();
+	report.sbvh.sah_cost = tree.sah_cost();
+	report.spatial_splits = tree.spatial_splits();
+
+	TraceTestRays(scene, tree, num_rays, report.sbvh);
+	return report;
+}
+
+Profiling::AccelReport Profiling::ProfileTLAS(Scene const& scene, int num_rays) {
+	AccelReport report;
+	report.name = "BVH (Two-Level)";
+
+	Timer timer;
+	timer.startCpuTimer();
+	tlas accel(scene);
+	timer.endCpuTimer();
+	report.build_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	report.num_nodes = accel.num_nodes();
+	report.num_prims = accel.num_prims();
+	// depth & SAH cost of the top level only, the bottom levels are reported through the node count
+	report.depth = accel.top().depth();
+	report.sah_cost = accel.top().sah_cost();
+
+	TraceTestRays(scene, accel, num_rays, report);
+	return report;
+}
+
+// gives the octree image the host interface TraceTestRays expects
+struct OctreeHostTraversal {
+	octreeView view;
+	bool ordered;
+	bool intersect(Scene const&, Ray const& ray, HitInfo& hit, TraversalStats* stats) const {
+		return view.intersect(ray, hit, stats, ordered);
+	}
+};
+
+Profiling::AccelReport Profiling::ProfileOctree(Scene const& scene, int num_rays, bool ordered) {
+	AccelReport report;
+	report.name = ordered ? "Octree (Front to Back)" : "Octree (Unordered)";
+
+	Timer timer;
+	timer.startCpuTimer();
+	octree tree(scene, scene.world_AABB, scene.octree_settings);
+	timer.endCpuTimer();
+	report.build_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	report.num_nodes = tree.num_nodes();
+	report.num_prims = tree.num_prims();
+	report.depth = tree.depth();
+
+	std::vector<char> image = tree.image();
+	OctreeHostTraversal traversal;
+	traversal.view = octree::view(image, scene);
+	traversal.ordered = ordered;
+	TraceTestRays(scene, traversal, num_rays, report);
+	return report;
+}
+
+Profiling::AccelReport Profiling::ProfileKDTree(Scene const& scene, int num_rays) {
+	AccelReport report;
+	report.name = "k-d Tree (Ropes)";
+
+	Timer timer;
+	timer.startCpuTimer();
+	kdtree tree(scene);
+	timer.endCpuTimer();
+	report.build_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	report.num_nodes = tree.nodes().size();
+	report.num_prims = tree.num_prims();
+	report.depth = tree.depth();
+	report.sah_cost = tree.sah_cost();
+
+	TraceTestRays(scene, tree, num_rays, report);
+	return report;
+}
+
+std::vector<Profiling::AccelReport> Profiling::ProfileStaticAccels(Scene const& scene, int num_rays) {
+	return {
+		ProfileOctree(scene, num_rays, true),
+		ProfileBVH(scene, num_rays),
+		ProfileKDTree(scene, num_rays),
+	};
+}
+
+std::vector<Profiling::MailboxReport> Profiling::ProfileMailbox(Scene const& scene, int num_rays) {
+	octree tree(scene, scene.world_AABB, scene.octree_settings);
+	std::vector<char> image = tree.image();
+
+	octreeImageHeader header;
+	memcpy(&header, image.data(), sizeof(header));
+	leaf_data const* leaves = reinterpret_cast<leaf_data const*>(image.data() + header.leaves_offset);
+	std::vector<std::pair<int, int>> unique(header.num_leaves);
+	for (uint32_t i = 0; i < header.num_leaves; ++i) {
+		unique[i] = { leaves[i].geom_id, leaves[i].triangle_id };
+	}
+	std::sort(unique.begin(), unique.end());
+	size_t num_unique = std::unique(unique.begin(), unique.end()) - unique.begin();
+
+	std::vector<MailboxReport> ret;
+	for (bool ordered : { true, false }) {
+		MailboxReport report;
+		report.name = ordered ? "Octree (Front to Back)" : "Octree (Unordered)";
+		report.num_refs = header.num_leaves;
+		report.num_unique = num_unique;
+
+		OctreeHostTraversal traversal;
+		traversal.view = octree::view(image, scene);
+		traversal.ordered = ordered;
+
+		AccelReport baseline;
+		traversal.view.mailbox = false;
+		TraceTestRays(scene, traversal, num_rays, baseline);
+
+		// traced again to count the skipped tests, TraceTestRays only keeps the averages of the other counters
+		AccelReport mailbox;
+		traversal.view.mailbox = true;
+		TraceTestRays(scene, traversal, num_rays, mailbox);
+
+		report.num_rays = mailbox.num_rays;
+		report.baseline_ms = baseline.trace_ms;
+		report.mailbox_ms = mailbox.trace_ms;
+		report.baseline_prims_per_ray = baseline.prims_per_ray;
+		report.mailbox_prims_per_ray = mailbox.prims_per_ray;
+		report.skipped_per_ray = mailbox.skipped_per_ray;
+		report.mismatches = mailbox.mismatches;
+		ret.push_back(report);
+	}
+	return ret;
+}
+
+// the original single threaded octree build: every node rescans all the triangles of the scene
+// and transforms their vertices again; only counts nodes and leaf references
+static void LegacyOctreeBuild(Scene const& scene, AABB const& box, int depth, int depth_lim, size_t& num_nodes, size_t& num_prims) {
+	auto count_hits = [&](AABB const& b, bool first_only) {
+		size_t hits = 0;
+		for (int geom_id = 0; geom_id < scene.geoms.size(); ++geom_id) {
+			auto const& geom = scene.geoms[geom_id];
+			if (!AABBIntersect(geom.bounds, b)) {
+				continue;
+			}
+			if (geom.type != MESH) {
+#ifdef OCTREE_MESH_ONLY
+				continue;
+#endif // OCTREE_MESH_ONLY
+				++hits;
+			} else {
+				for (int i = scene.meshes[geom.meshid].tri_start; i < scene.meshes[geom.meshid].tri_end; ++i) {
+					glm::vec3 triangle_verts[3];
+					for (int x = 0; x < 3; ++x) {
+						triangle_verts[x] = glm::vec3(geom.transform * glm::vec4(scene.vertices[scene.triangles[i].verts[x]], 1));
+					}
+					if (AABBTriangleIntersect(b, triangle_verts)) {
+						++hits;
+					}
+				}
+			}
+			if (hits && first_only) {
+				return hits;
+			}
+		}
+		return hits;
+	};
+
+	++num_nodes;
+	if (depth == depth_lim) {
+		num_prims += count_hits(box, false);
+		return;
+	}
+
+	glm::vec3 half_size = box.extent();
+	for (int i = 0; i < 8; ++i) {
+		glm::vec3 bmin = box.min() + half_size * glm::vec3((i >> 2) & 1, (i >> 1) & 1, i & 1);
+		AABB child(bmin - OCTREE_BOX_EPS, bmin + half_size + OCTREE_BOX_EPS);
+		if (count_hits(child, true)) {
+			LegacyOctreeBuild(scene, child, depth + 1, depth_lim, num_nodes, num_prims);
+		}
+	}
+}
+
+Profiling::BuildReport Profiling::ProfileOctreeBuild(Scene const& scene, int depth_lim) {
+	BuildReport report;
+	report.name = "Octree Build";
+	report.num_threads = ThreadPool::instance().size();
+
+	Profiling::Timer timer;
+	size_t baseline_nodes = 0, baseline_prims = 0;
+	timer.startCpuTimer();
+	LegacyOctreeBuild(scene, scene.world_AABB, 0, depth_lim, baseline_nodes, baseline_prims);
+	timer.endCpuTimer();
+	report.baseline_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	timer.startCpuTimer();
+	octree tree(scene, scene.world_AABB, OctreeSettings::fixed_depth(depth_lim));
+	timer.endCpuTimer();
+	report.build_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	report.num_nodes = tree.num_nodes();
+	report.num_prims = tree.num_prims();
+	report.matches = report.num_nodes == baseline_nodes && report.num_prims == baseline_prims;
+
+	std::vector<char> image = tree.image();
+	report.image_size = image.size();
+	report.image_valid = octree::validate_image(image.data(), image.size()) && octree(image).image() == image;
+	return report;
+}
+
+// host MeshInfo over the scene arrays, textures are left out
+static MeshInfo HostMeshInfo(Scene const& scene) {
+	MeshInfo info;
+	info.vertices = const_cast<Vertex*>(scene.vertices.data());
+	info.normals = const_cast<Normal*>(scene.normals.data());
+	info.uvs = const_cast<TexCoord*>(scene.uvs.data());
+	info.texs = nullptr;
+	info.tris = const_cast<Triangle*>(scene.triangles.data());
+	info.tangents = const_cast<glm::vec4*>(scene.tangents.data());
+	info.meshes = const_cast<Mesh*>(scene.meshes.data());
+	info.materials = const_cast<Material*>(scene.materials.data());
+	info.compact_prims = const_cast<CompactPrim*>(scene.compact_prims.data());
+	return info;
+}
+
+// on a shared edge either triangle may be picked, so normals & uvs are only compared away from the edges
+static bool SameAttributes(ShadeableIntersection const& a, ShadeableIntersection const& b, HitInfo const& hit) {
+	if ((a.t > 0) != (b.t > 0)) {
+		return false;
+	}
+	if (a.t <= 0) {
+		return true;
+	}
+	float eps = 1e-3f * glm::max(1.f, a.t);
+	if (glm::abs(a.t - b.t) > eps
+		|| glm::any(glm::greaterThan(glm::abs(a.hitPoint - b.hitPoint), glm::vec3(eps)))
+		|| a.materialId != b.materialId) {
+		return false;
+	}
+	float edge_dist = glm::min(glm::min(hit.bary.x, hit.bary.y), 1.f - hit.bary.x - hit.bary.y);
+	if (hit.triangle_id != -1 && edge_dist < 1e-3f) {
+		return true;
+	}
+	return glm::all(glm::lessThanEqual(glm::abs(a.surfaceNormal - b.surfaceNormal), glm::vec3(1e-3f)))
+		&& glm::all(glm::lessThanEqual(glm::abs(a.uv - b.uv), glm::vec2(1e-3f)));
+}
+
+Profiling::PrimitiveReport Profiling::ProfilePrimitives(Scene const& scene, int num_rays) {
+	PrimitiveReport report;
+	std::vector<Ray> rays = MakeTestRays(scene, num_rays);
+	report.num_rays = rays.size();
+	report.geom_bytes = sizeof(Geom);
+
+	std::vector<Geom> geoms;
+	std::vector<CompactPrim> compact;
+	size_t compact_bytes = 0;
+	for (size_t i = 0; i < scene.geoms.size(); ++i) {
+		CompactPrim const& prim = scene.compact_prims[i];
+		if (prim.type == COMPACT_NONE) {
+			continue;
+		}
+		geoms.push_back(scene.geoms[i]);
+		compact.push_back(prim);
+		compact_bytes += sizeof(prim.type);
+		if (prim.type == COMPACT_SPHERE) {
+			++report.num_spheres;
+			compact_bytes += sizeof(glm::vec4);
+		} else if (prim.type == COMPACT_AXIS_BOX) {
+			++report.num_axis_boxes;
+			compact_bytes += 2 * sizeof(glm::vec3);
+		} else {
+			++report.num_affine;
+			compact_bytes += 3 * sizeof(glm::vec4);
+		}
+	}
+	report.compact_bytes = (float)compact_bytes / glm::max(compact.size(), (size_t)1);
+
+	// the loops are repeated so that scenes with few primitives still take measurable time
+	static constexpr int NUM_REPEATS = 16;
+	std::vector<float> baseline(rays.size()), compact_t(rays.size());
+	Timer timer;
+	timer.startCpuTimer();
+	for (int k = 0; k < NUM_REPEATS; ++k) {
+		for (size_t i = 0; i < rays.size(); ++i) {
+			float t_min = FLT_MAX;
+			for (Geom const& geom : geoms) {
+				float t = primitiveHitTest(geom, rays[i]);
+				if (t > 0 && t < t_min) {
+					t_min = t;
+				}
+			}
+			baseline[i] = t_min;
+		}
+	}
+	timer.endCpuTimer();
+	report.baseline_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	timer.startCpuTimer();
+	for (int k = 0; k < NUM_REPEATS; ++k) {
+		for (size_t i = 0; i < rays.size(); ++i) {
+			float t_min = FLT_MAX;
+			for (CompactPrim const& prim : compact) {
+				float t = compactHitTest(prim, rays[i]);
+				if (t > 0 && t < t_min) {
+					t_min = t;
+				}
+			}
+			compact_t[i] = t_min;
+		}
+	}
+	timer.endCpuTimer();
+	report.compact_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	for (size_t i = 0; i < rays.size(); ++i) {
+		if (glm::abs(baseline[i] - compact_t[i]) > 1e-4f * glm::max(1.f, baseline[i])) {
+			++report.mismatches;
+		}
+	}
+	return report;
+}
+
+template<int N>
+static std::vector<AABBPacket<N>> MakePackets(std::vector<AABB> const& boxes) {
+	std::vector<AABBPacket<N>> packets((boxes.size() + N - 1) / N);
+	for (size_t i = 0; i < packets.size() * N; ++i) {
+		if (i < boxes.size()) {
+			packets[i / N].set(i % N, boxes[i]);
+		} else {
+			packets[i / N].clear(i % N);
+		}
+	}
+	return packets;
+}
+
+// the timed loops only count hits so that the time is spent in the tests and not in storing their results
+template<int N>
+static float TimePackets(std::vector<AABB> const& boxes, std::vector<Ray> const& rays, size_t& num_hits) {
+	std::vector<AABBPacket<N>> packets = MakePackets<N>(boxes);
+	num_hits = 0;
+	Profiling::Timer timer;
+	timer.startCpuTimer();
+	for (Ray const& r : rays) {
+		TraversalRay ray = makeTraversalRay(r);
+		for (AABBPacket<N> const& packet : packets) {
+			float t[N];
+			for (int mask = AABBRayRangePacket(packet, ray, LARGE_FLOAT, t); mask; mask &= mask - 1) {
+				++num_hits;
+			}
+		}
+	}
+	timer.endCpuTimer();
+	return timer.getCpuElapsedTimeForPreviousOperation();
+}
+
+template<int N>
+static int CountPacketMismatches(std::vector<AABB> const& boxes, std::vector<Ray> const& rays) {
+	std::vector<AABBPacket<N>> packets = MakePackets<N>(boxes);
+	int mismatches = 0;
+	for (Ray const& r : rays) {
+		TraversalRay ray = makeTraversalRay(r);
+		for (size_t j = 0; j < packets.size(); ++j) {
+			float t[N];
+			int mask = AABBRayRangePacket(packets[j], ray, LARGE_FLOAT, t);
+			for (int k = 0; k < N && j * N + k < boxes.size(); ++k) {
+				float ref_t, t_far;
+				bool ref_hit = AABBRayRange(boxes[j * N + k], r, ref_t, t_far);
+				bool hit = (mask >> k) & 1;
+				if (ref_hit != hit || (ref_hit && ref_t != t[k])) {
+					++mismatches;
+				}
+			}
+		}
+	}
+	return mismatches;
+}
+
+Profiling::SlabReport Profiling::ProfileSlabs(Scene const& scene, int num_rays) {
+	SlabReport report;
+	std::vector<Ray> rays = MakeTestRays(scene, num_rays);
+	bvh tree(scene);
+	std::vector<AABB> boxes;
+	for (bvhNode const& node : tree.nodes()) {
+		boxes.push_back(node.bounds);
+	}
+	report.num_rays = rays.size();
+	report.num_boxes = boxes.size();
+#if defined(AABB_SIMD_AVX)
+	report.simd = "AVX";
+#elif defined(AABB_SIMD_SSE)
+	report.simd = "SSE2";
+#else
+	report.simd = "scalar";
+#endif // AABB_SIMD_AVX
+
+	size_t num_hits[5] = {};
+	Timer timer;
+	timer.startCpuTimer();
+	for (Ray const& ray : rays) {
+		for (AABB const& box : boxes) {
+			num_hits[0] += AABBRayIntersect(box, ray, nullptr);
+		}
+	}
+	timer.endCpuTimer();
+	report.intersect_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	timer.startCpuTimer();
+	for (Ray const& ray : rays) {
+		for (AABB const& box : boxes) {
+			float t_near, t_far;
+			num_hits[1] += AABBRayRange(box, ray, t_near, t_far);
+		}
+	}
+	timer.endCpuTimer();
+	report.range_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	timer.startCpuTimer();
+	for (Ray const& r : rays) {
+		TraversalRay ray = makeTraversalRay(r);
+		for (AABB const& box : boxes) {
+			float t_near, t_far;
+			num_hits[2] += AABBRayRange(box, ray, t_near, t_far);
+		}
+	}
+	timer.endCpuTimer();
+	report.traversal_ray_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	report.packet4_ms = TimePackets<4>(boxes, rays, num_hits[3]);
+	report.packet8_ms = TimePackets<8>(boxes, rays, num_hits[4]);
+
+	// every box is compared on its own, the hit counts alone could hide offsetting differences
+	for (Ray const& r : rays) {
+		TraversalRay ray = makeTraversalRay(r);
+		for (AABB const& box : boxes) {
+			float ref_t, t_near, t_far;
+			bool ref_hit = AABBRayRange(box, r, ref_t, t_far);
+			bool hit = AABBRayRange(box, ray, t_near, t_far);
+			if (ref_hit != hit || (ref_hit && ref_t != t_near)) {
+				++report.mismatches;
+			}
+		}
+	}
+	report.mismatches += CountPacketMismatches<4>(boxes, rays) + CountPacketMismatches<8>(boxes, rays);
+	// the counts are used so that none of the timed loops can be optimized away
+	report.num_hits = num_hits[1];
+	report.num_intersect_hits = num_hits[0];
+	for (int i = 2; i < 5; ++i) {
+		report.mismatches += num_hits[i] != num_hits[1];
+	}
+	return report;
+}
+
+Profiling::ResolveReport Profiling::ProfileResolve(Scene const& scene, int num_rays) {
+	ResolveReport report;
+	std::vector<Ray> rays = MakeTestRays(scene, num_rays);
+	report.num_rays = rays.size();
+	MeshInfo mesh_info = HostMeshInfo(scene);
+	Geom const* geoms = scene.geoms.data();
+	int num_geoms = scene.geoms.size();
+
+	std::vector<ShadeableIntersection> baseline(rays.size());
+	Timer timer;
+	timer.startCpuTimer();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		float t_min = FLT_MAX;
+		for (int j = 0; j < num_geoms; ++j) {
+			Geom const& geom = geoms[j];
+#ifdef AABB_CULLING
+			if (!AABBRayIntersect(geom.bounds, rays[i], nullptr)) {
+				continue;
+			}
+#endif // AABB_CULLING
+			float t;
+			ShadeableIntersection tmp;
+			if (geom.type == CUBE) {
+				t = boxIntersectionTest(geom, rays[i], tmp);
+			} else if (geom.type == SPHERE) {
+				t = sphereIntersectionTest(geom, rays[i], tmp);
+			} else {
+				t = meshIntersectionTest(geom, rays[i], mesh_info, tmp);
+			}
+			if (t > 0.0f && t_min > t) {
+				t_min = t;
+				baseline[i] = tmp;
+			}
+		}
+	}
+	timer.endCpuTimer();
+	report.baseline_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	std::vector<HitInfo> hits(rays.size());
+	timer.startCpuTimer();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		sceneHitTest(geoms, mesh_info.compact_prims, num_geoms, mesh_info.meshes, mesh_info.tris, mesh_info.vertices, rays[i], hits[i]);
+	}
+	timer.endCpuTimer();
+	report.trace_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	std::vector<ShadeableIntersection> resolved(rays.size());
+	timer.startCpuTimer();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		if (hits[i].valid()) {
+			intersFromHit(resolved[i], rays[i], hits[i], mesh_info, geoms);
+		}
+	}
+	timer.endCpuTimer();
+	report.resolve_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	for (size_t i = 0; i < rays.size(); ++i) {
+		report.num_hits += hits[i].valid();
+		if (!SameAttributes(baseline[i], resolved[i], hits[i])) {
+			++report.mismatches;
+		}
+	}
+	return report;
+}
+
+Profiling::TriangleReport Profiling::ProfileBakedTriangles(Scene const& scene, int num_rays) {
+	TriangleReport report;
+	std::vector<Ray> rays = MakeTestRays(scene, num_rays);
+	report.num_rays = rays.size();
+
+	std::vector<leaf_data> refs;
+	for (leaf_data const& ref : bvh::world_prims(scene)) {
+		if (ref.triangle_id != -1) {
+			refs.push_back(ref);
+		}
+	}
+	std::vector<BakedTriangle> baked = scene.bakeTriangles(refs);
+	report.num_triangles = refs.size();
+	report.baked_bytes = baked.size() * sizeof(BakedTriangle);
+
+	std::vector<HitInfo> baseline(rays.size()), hits(rays.size());
+	Timer timer;
+	timer.startCpuTimer();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		for (leaf_data const& ref : refs) {
+			leafHitTest(ref, scene.geoms.data(), scene.compact_prims.data(), scene.triangles.data(), scene.vertices.data(), rays[i], baseline[i]);
+		}
+	}
+	timer.endCpuTimer();
+	report.baseline_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	timer.startCpuTimer();
+	for (size_t i = 0; i < rays.size(); ++i) {
+		for (size_t j = 0; j < refs.size(); ++j) {
+			leafHitTest(refs[j], scene.geoms.data(), scene.compact_prims.data(), scene.triangles.data(), scene.vertices.data(), rays[i], hits[i], &baked[j]);
+		}
+	}
+	timer.endCpuTimer();
+	report.baked_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	for (size_t i = 0; i < rays.size(); ++i) {
+		if (!SameHit(baseline[i], hits[i])) {
+			++report.mismatches;
+		}
+	}
+
+	bvh tree(scene);
+	std::vector<BakedTriangle> bvh_baked = scene.bakeTriangles(tree.prims());
+	bvhView views[] = { tree.view(scene), tree.view(scene, bvh_baked.data()) };
+	float* times[] = { &report.bvh_ms, &report.bvh_baked_ms };
+	for (int v = 0; v < 2; ++v) {
+		std::vector<HitInfo> bvh_hits(rays.size());
+		timer.startCpuTimer();
+		for (size_t i = 0; i < rays.size(); ++i) {
+			views[v].intersect(rays[i], bvh_hits[i], nullptr);
+		}
+		timer.endCpuTimer();
+		*times[v] = timer.getCpuElapsedTimeForPreviousOperation();
+
+		// primitives are not part of the brute force loops above
+		for (size_t i = 0; i < rays.size(); ++i) {
+			if (bvh_hits[i].triangle_id != -1 && !SameHit(baseline[i], bvh_hits[i])) {
+				++report.mismatches;
+			}
+		}
+	}
+	return report;
+}
+
+std::vector<Profiling::RefitReport> Profiling::ProfileRefit(Scene& scene, int geom_id, glm::vec3 const& offset, int num_rays) {
+	std::vector<RefitReport> reports(2);
+	reports[0].name = "BVH";
+	reports[1].name = "BVH (Two-Level)";
+	if (geom_id < 0 || geom_id >= scene.geoms.size()) {
+		return reports;
+	}
+	Geom const old = scene.geoms[geom_id];
+	bvh tree(scene);
+	tlas accel(scene);
+	scene.setTransform(geom_id, old.translation + offset, old.rotation, old.scale);
+
+	Timer timer;
+	timer.startCpuTimer();
+	reports[0].nodes_touched = tree.refit(scene, geom_id);
+	timer.endCpuTimer();
+	reports[0].refit_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	timer.startCpuTimer();
+	reports[1].nodes_touched = accel.refit(scene, geom_id);
+	timer.endCpuTimer();
+	reports[1].refit_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	reports[0].num_nodes = tree.nodes().size();
+	reports[0].refit_sah = tree.sah_cost();
+	reports[0].sah_drift = tree.sah_drift();
+	reports[1].num_nodes = accel.num_nodes();
+	reports[1].refit_sah = accel.top().sah_cost();
+	reports[1].sah_drift = accel.sah_drift();
+
+	timer.startCpuTimer();
+	bvh rebuilt_tree(scene);
+	timer.endCpuTimer();
+	reports[0].rebuild_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	reports[0].rebuilt_sah = rebuilt_tree.sah_cost();
+	timer.startCpuTimer();
+	tlas rebuilt_accel(scene);
+	timer.endCpuTimer();
+	reports[1].rebuild_ms = timer.getCpuElapsedTimeForPreviousOperation();
+	reports[1].rebuilt_sah = rebuilt_accel.top().sah_cost();
+
+	std::vector<Ray> rays = MakeTestRays(scene, num_rays);
+	for (Ray const& ray : rays) {
+		HitInfo ref, hit0, hit1;
+		BruteForceIntersect(scene, ray, ref);
+		tree.intersect(scene, ray, hit0);
+		accel.intersect(scene, ray, hit1);
+		reports[0].mismatches += !SameHit(ref, hit0);
+		reports[1].mismatches += !SameHit(ref, hit1);
+	}
+
+	scene.setTransform(geom_id, old.translation, old.rotation, old.scale);
+	return reports;
+}
+
+// the test rays as fresh paths & where the SBVH says they first hit, inters[i].t < 0 for the misses
+static void TraceFirstBounce(Scene const& scene, int num_paths,
+	std::vector<PathSegment>& paths, std::vector<ShadeableIntersection>& inters) {
+	std::vector<Ray> rays = Profiling::MakeTestRays(scene, num_paths);
+	int n = rays.size();
+	MeshInfo mesh_info = HostMeshInfo(scene);
+	bvh tree(scene);
+
+	paths.assign(n, PathSegment());
+	inters.assign(n, ShadeableIntersection());
+	for (int i = 0; i < n; ++i) {
+		paths[i].init(8, i, rays[i]);
+		HitInfo hit;
+		if (tree.intersect(scene, rays[i], hit)) {
+			intersFromHit(inters[i], rays[i], hit, mesh_info, scene.geoms.data());
+		}
+	}
+}
+
+// turns the times summed over the repetitions into averages
+static void AverageReps(int num_reps, std::initializer_list<float*> times) {
+	float reps = glm::max(num_reps, 1);
+	for (float* time : times) {
+		*time /= reps;
+	}
+}
+
+// slot of the i-th path of a sorted order
+static int SlotOf(std::pair<int, int> const& entry) {
+	return entry.second;
+}
+static int SlotOf(uint64_t key) {
+	return MaterialSortKey::index(key);
+}
+
+template<typename T, typename Order>
+static void GatherField(std::vector<T> const& src, std::vector<Order> const& order, std::vector<T>& dst) {
+	for (size_t i = 0; i < order.size(); ++i) {
+		dst[i] = src[SlotOf(order[i])];
+	}
+}
+
+// host arrays behind a PathSegmentSoA & a ShadeableIntersectionSoA
+struct HostPathBuffers {
+	std::vector<glm::vec3> origin, direction;
+	std::vector<color_t> color;
+	std::vector<int> pixelIndex, remainingBounces;
+	std::vector<float> t;
+	std::vector<glm::vec3> surfaceNormal, hitPoint;
+	std::vector<int> materialId;
+	std::vector<glm::vec2> uv;
+	std::vector<color_t> tex_color;
+
+	explicit HostPathBuffers(int n) : origin(n), direction(n), color(n), pixelIndex(n), remainingBounces(n),
+		t(n), surfaceNormal(n), hitPoint(n), materialId(n), uv(n), tex_color(n) { }
+
+	PathSegmentSoA paths() {
+		PathSegmentSoA ret;
+		ret.origin = origin.data();
+		ret.direction = direction.data();
+		ret.color = color.data();
+		ret.pixelIndex = pixelIndex.data();
+		ret.remainingBounces = remainingBounces.data();
+		ret.count = origin.size();
+		return ret;
+	}
+	ShadeableIntersectionSoA inters() {
+		ShadeableIntersectionSoA ret;
+		ret.t = t.data();
+		ret.surfaceNormal = surfaceNormal.data();
+		ret.hitPoint = hitPoint.data();
+		ret.materialId = materialId.data();
+		ret.uv = uv.data();
+		ret.tex_color = tex_color.data();
+		ret.count = t.size();
+		return ret;
+	}
+	// dst[i] = the path in slot SlotOf(order[i]), every field
+	template<typename Order>
+	void gather(std::vector<Order> const& order, HostPathBuffers& dst) const {
+		GatherField(origin, order, dst.origin);
+		GatherField(direction, order, dst.direction);
+		GatherField(color, order, dst.color);
+		GatherField(pixelIndex, order, dst.pixelIndex);
+		GatherField(remainingBounces, order, dst.remainingBounces);
+		GatherField(t, order, dst.t);
+		GatherField(surfaceNormal, order, dst.surfaceNormal);
+		GatherField(hitPoint, order, dst.hitPoint);
+		GatherField(materialId, order, dst.materialId);
+		GatherField(uv, order, dst.uv);
+		GatherField(tex_color, order, dst.tex_color);
+	}
+};
+
+// records moved as one, like the keys & values of the original sort_by_key
+struct PathRecord {
+	ShadeableIntersection inters;
+	PathSegment path;
+};
+
+// sorts the paths as records by material, returns the time the sort took
+static float SortRecords(std::vector<PathSegment> const& paths, std::vector<ShadeableIntersection> const& inters,
+	std::vector<PathRecord>& records) {
+	for (size_t i = 0; i < paths.size(); ++i) {
+		records[i] = { inters[i], paths[i] };
+	}
+	Profiling::Timer timer;
+	timer.startCpuTimer();
+	std::stable_sort(records.begin(), records.end(), [](PathRecord const& a, PathRecord const& b) {
+		return a.inters.materialId < b.inters.materialId;
+	});
+	timer.endCpuTimer();
+	return timer.getCpuElapsedTimeForPreviousOperation();
+}
+
+Profiling::PathLayoutReport Profiling::ProfilePathLayouts(Scene const& scene, int num_paths, int num_reps) {
+	PathLayoutReport report;
+
+	// the same paths in both layouts
+	std::vector<PathSegment> aos_paths;
+	std::vector<ShadeableIntersection> aos_inters;
+	TraceFirstBounce(scene, num_paths, aos_paths, aos_inters);
+	int n = aos_paths.size();
+	HostPathBuffers soa(n);
+	std::set<int> materials;
+	for (int i = 0; i < n; ++i) {
+		PathSegment& path = aos_paths[i];
+		ShadeableIntersection const& inters = aos_inters[i];
+		if (inters.t < 0 || scene.materials[inters.materialId].emittance > 0) {
+			path.terminate();
+		} else {
+			path.color = scene.materials[inters.materialId].diffuse;
+		}
+		materials.insert(inters.t < 0 ? -1 : inters.materialId);
+		soa.paths().store(i, path);
+		soa.inters().store(i, inters);
+	}
+	report.num_paths = n;
+	report.num_materials = materials.size();
+	report.aos_bytes = sizeof(PathSegment) + sizeof(ShadeableIntersection);
+	report.soa_key_bytes = sizeof(int);
+
+	Timer timer;
+	std::vector<PathSegment> aos_live(n);
+	HostPathBuffers soa_live(n);
+	for (int rep = 0; rep < num_reps; ++rep) {
+		timer.startCpuTimer();
+		report.num_live = std::copy_if(aos_paths.begin(), aos_paths.end(), aos_live.begin(), PathSegment::PartitionRule()) - aos_live.begin();
+		timer.endCpuTimer();
+		report.aos_compact_ms += timer.getCpuElapsedTimeForPreviousOperation();
+
+		timer.startCpuTimer();
+		PathSegmentSoA src = soa.paths(), dst = soa_live.paths();
+		int num_live = 0;
+		for (int i = 0; i < n; ++i) {
+			if (PathSegmentSoA::LiveRule()(src.remainingBounces[i])) {
+				dst.store(num_live++, src.load(i));
+			}
+		}
+		timer.endCpuTimer();
+		report.soa_compact_ms += timer.getCpuElapsedTimeForPreviousOperation();
+		report.mismatches += num_live != report.num_live;
+	}
+	for (int i = 0; i < report.num_live; ++i) {
+		report.mismatches += aos_live[i].pixelIndex != soa_live.pixelIndex[i];
+	}
+
+	std::vector<PathRecord> records(n);
+	HostPathBuffers soa_sorted(n);
+	std::vector<std::pair<int, int>> order(n);
+	for (int rep = 0; rep < num_reps; ++rep) {
+		report.aos_sort_ms += SortRecords(aos_paths, aos_inters, records);
+
+		timer.startCpuTimer();
+		for (int i = 0; i < n; ++i) {
+			order[i] = { soa.materialId[i], i };
+		}
+		std::stable_sort(order.begin(), order.end(), [](std::pair<int, int> const& a, std::pair<int, int> const& b) {
+			return a.first < b.first;
+		});
+		soa.gather(order, soa_sorted);
+		timer.endCpuTimer();
+		report.soa_sort_ms += timer.getCpuElapsedTimeForPreviousOperation();
+	}
+	for (int i = 0; i < n; ++i) {
+		report.mismatches += records[i].path.pixelIndex != soa_sorted.pixelIndex[i];
+	}
+
+	AverageReps(num_reps, { &report.aos_compact_ms, &report.soa_compact_ms, &report.aos_sort_ms, &report.soa_sort_ms });
+	return report;
+}
+
+static Profiling::MaterialSortReport ProfileMaterialSortOf(std::string const& name, Scene const& scene,
+	std::vector<PathSegment> const& paths, std::vector<ShadeableIntersection> const& inters, int num_reps) {
+	Profiling::MaterialSortReport report;
+	report.name = name;
+	int n = paths.size();
+	report.num_paths = n;
+	std::set<int> materials;
+	for (ShadeableIntersection const& i : inters) {
+		materials.insert(i.materialId);
+	}
+	report.num_materials = materials.size();
+
+	HostPathBuffers soa(n);
+	for (int i = 0; i < n; ++i) {
+		soa.paths().store(i, paths[i]);
+		soa.inters().store(i, inters[i]);
+	}
+	Material const* mats = scene.materials.data();
+	Span<Light> lights(scene.lights.size(), const_cast<Light*>(scene.lights.data()));
+
+	std::vector<PathRecord> records(n);
+	std::vector<uint64_t> keys(n);
+	HostPathBuffers sorted(n), permuted(n);
+	std::vector<PathSegment> unsorted(n);
+	Profiling::Timer timer;
+	for (int rep = 0; rep < num_reps; ++rep) {
+		report.record_sort_ms += SortRecords(paths, inters, records);
+
+		timer.startCpuTimer();
+		for (int i = 0; i < n; ++i) {
+			keys[i] = MaterialSortKey::make(soa.materialId[i], i);
+		}
+		std::sort(keys.begin(), keys.end());
+		timer.endCpuTimer();
+		report.key_sort_ms += timer.getCpuElapsedTimeForPreviousOperation();
+
+		timer.startCpuTimer();
+		soa.gather(keys, sorted);
+		timer.endCpuTimer();
+		report.gather_ms += timer.getCpuElapsedTimeForPreviousOperation();
+
+		// shading the same slot seeds the same RNG, like shadeMaterial with & without SORT_MAT_PERMUTE
+		unsorted = paths;
+		timer.startCpuTimer();
+		for (int i = 0; i < n; ++i) {
+			thrust::default_random_engine rng = makeSeededRandomEngine(0, i, 0);
+			shadeSegment(unsorted[i], inters[i], mats, lights, rng);
+		}
+		timer.endCpuTimer();
+		report.shade_unsorted_ms += timer.getCpuElapsedTimeForPreviousOperation();
+
+		PathSegmentSoA sorted_paths = sorted.paths();
+		ShadeableIntersectionSoA sorted_inters = sorted.inters();
+		timer.startCpuTimer();
+		for (int i = 0; i < n; ++i) {
+			PathSegment path = sorted_paths.load(i);
+			thrust::default_random_engine rng = makeSeededRandomEngine(0, i, 0);
+			shadeSegment(path, sorted_inters.load(i), mats, lights, rng);
+			sorted_paths.store(i, path);
+		}
+		timer.endCpuTimer();
+		report.shade_gathered_ms += timer.getCpuElapsedTimeForPreviousOperation();
+
+		permuted = soa;
+		PathSegmentSoA permuted_paths = permuted.paths();
+		ShadeableIntersectionSoA permuted_inters = permuted.inters();
+		timer.startCpuTimer();
+		for (int i = 0; i < n; ++i) {
+			int slot = MaterialSortKey::index(keys[i]);
+			PathSegment path = permuted_paths.load(slot);
+			thrust::default_random_engine rng = makeSeededRandomEngine(0, i, 0);
+			shadeSegment(path, permuted_inters.load(slot), mats, lights, rng);
+			permuted_paths.store(slot, path);
+		}
+		timer.endCpuTimer();
+		report.shade_permuted_ms += timer.getCpuElapsedTimeForPreviousOperation();
+	}
+	for (int i = 0; i < n; ++i) {
+		int slot = MaterialSortKey::index(keys[i]);
+		// misses sort last by key, first as records
+		bool out_of_order = i > 0 && (uint32_t)sorted.materialId[i - 1] > (uint32_t)sorted.materialId[i];
+		report.mismatches += out_of_order
+			|| sorted.color[i] != permuted.color[slot]
+			|| sorted.remainingBounces[i] != permuted.remainingBounces[slot]
+			|| sorted.direction[i] != permuted.direction[slot];
+	}
+
+	AverageReps(num_reps, { &report.record_sort_ms, &report.key_sort_ms, &report.gather_ms,
+		&report.shade_unsorted_ms, &report.shade_gathered_ms, &report.shade_permuted_ms });
+	return report;
+}
+
+std::vector<Profiling::MaterialSortReport> Profiling::ProfileMaterialSort(Scene const& scene, int num_paths, int num_reps) {
+	std::vector<PathSegment> paths;
+	std::vector<ShadeableIntersection> inters;
+	TraceFirstBounce(scene, num_paths, paths, inters);
+
+	// every hit given the first material that is not a light
+	int single = 0;
+	while (single + 1 < (int)scene.materials.size() && scene.materials[single].emittance > 0) {
+		++single;
+	}
+	std::vector<ShadeableIntersection> single_inters = inters;
+	for (ShadeableIntersection& i : single_inters) {
+		if (i.t >= 0) {
+			i.materialId = single;
+		}
+	}
+
+	return {
+		ProfileMaterialSortOf("scene materials", scene, paths, inters, num_reps),
+		ProfileMaterialSortOf("one material", scene, paths, single_inters, num_reps),
+	};
+}
+
+Profiling::ShadeQueueReport Profiling::ProfileShadeQueues(Scene const& scene, int num_paths, int num_reps) {
+	ShadeQueueReport report;
+	std::vector<PathSegment> paths;
+	std::vector<ShadeableIntersection> inters;
+	TraceFirstBounce(scene, num_paths, paths, inters);
+	int n = paths.size();
+	report.num_paths = n;
+
+	Material const* mats = scene.materials.data();
+	Span<Light> lights(scene.lights.size(), const_cast<Light*>(scene.lights.data()));
+	std::vector<int> queue_data(3 * NUM_SHADE_QUEUES), slots(n);
+	ShadeQueues queues;
+	queues.bind(queue_data.data(), slots.data());
+
+	std::vector<PathSegment> shaded(n), queued(n);
+	Timer timer;
+	for (int rep = 0; rep < num_reps; ++rep) {
+		timer.startCpuTimer();
+		queues.clear();
+		for (int i = 0; i < n; ++i) {
+			queues.count(ShadeQueues::queueOf(inters[i].t, inters[i].materialId, mats));
+		}
+		queues.scan();
+		for (int i = 0; i < n; ++i) {
+			queues.push(ShadeQueues::queueOf(inters[i].t, inters[i].materialId, mats), i);
+		}
+		timer.endCpuTimer();
+		report.bin_ms += timer.getCpuElapsedTimeForPreviousOperation();
+
+		// both seeded by the path slot, like shadeMaterial & shadeQueue
+		shaded = paths;
+		timer.startCpuTimer();
+		for (int i = 0; i < n; ++i) {
+			thrust::default_random_engine rng = makeSeededRandomEngine(0, i, 0);
+			shadeSegment(shaded[i], inters[i], mats, lights, rng);
+		}
+		timer.endCpuTimer();
+		report.shade_ms += timer.getCpuElapsedTimeForPreviousOperation();
+
+		queued = paths;
+		timer.startCpuTimer();
+		for (int q = 0; q < NUM_SHADE_QUEUES; ++q) {
+			for (int j = queues.offsets[q]; j < queues.offsets[q] + queues.counts[q]; ++j) {
+				int i = queues.slots[j];
+				thrust::default_random_engine rng = makeSeededRandomEngine(0, i, 0);
+				shadeQueuedSegment(q, queued[i], inters[i], mats, lights, rng);
+			}
+		}
+		timer.endCpuTimer();
+		report.shade_queued_ms += timer.getCpuElapsedTimeForPreviousOperation();
+	}
+
+	// every path is queued once, in the queue of its material type, & shaded as the uber shader does
+	std::vector<int> times_queued(n, 0);
+	for (int q = 0; q < NUM_SHADE_QUEUES; ++q) {
+		report.queue_sizes.push_back(queues.counts[q]);
+		for (int j = queues.offsets[q]; j < queues.offsets[q] + queues.counts[q]; ++j) {
+			int i = queues.slots[j];
+			++times_queued[i];
+			report.mismatches += q != ShadeQueues::queueOf(inters[i].t, inters[i].materialId, mats);
+		}
+	}
+	for (int i = 0; i < n; ++i) {
+		report.mismatches += times_queued[i] != 1
+			|| shaded[i].color != queued[i].color
+			|| shaded[i].remainingBounces != queued[i].remainingBounces
+			|| shaded[i].ray.direction != queued[i].ray.direction;
+	}
+
+	AverageReps(num_reps, { &report.bin_ms, &report.shade_ms, &report.shade_queued_ms });
+	return report;
+}
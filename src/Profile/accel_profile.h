@@ -0,0 +1,338 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "../sceneStructs.h"
+
+class Scene;
+
+namespace Profiling {
+	/// <summary>
+	/// build quality & host traversal cost of one acceleration structure
+	/// </summary>
+	struct AccelReport {
+		std::string name;
+		float build_ms;
+		size_t num_nodes;
+		size_t num_prims;    // primitive references stored in the leaves
+		int depth;
+		float sah_cost;
+		int num_rays;
+		float trace_ms;
+		float nodes_per_ray;
+		float prims_per_ray;
+		float skipped_per_ray; // repeated primitive tests skipped by the octree mailbox
+		int mismatches;      // rays whose closest hit differs from the brute force result
+
+		AccelReport() : build_ms(0), num_nodes(0), num_prims(0), depth(0), sah_cost(0),
+			num_rays(0), trace_ms(0), nodes_per_ray(0), prims_per_ray(0), skipped_per_ray(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// build time of a structure against a reference build producing the same tree
+	/// </summary>
+	struct BuildReport {
+		std::string name;
+		float baseline_ms;
+		float build_ms;
+		int num_threads;
+		size_t num_nodes;
+		size_t num_prims;
+		bool matches;        // whether both builds produced the same node & reference counts
+		size_t image_size;   // bytes of the linear GPU image
+		bool image_valid;    // whether the image validates and survives a round trip through the host tree
+
+		BuildReport() : baseline_ms(0), build_ms(0), num_threads(0), num_nodes(0), num_prims(0), matches(false),
+			image_size(0), image_valid(false) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// cost of computing surface attributes once from the closest hit,
+	/// against the original per-geom tests that compute them for every candidate hit
+	/// </summary>
+	struct ResolveReport {
+		int num_rays;
+		int num_hits;
+		float baseline_ms;   // per-geom tests with attributes
+		float trace_ms;      // closest hit only
+		float resolve_ms;    // attributes of the closest hit
+		int mismatches;      // rays whose resolved attributes differ from the per-geom result
+
+		ResolveReport() : num_rays(0), num_hits(0), baseline_ms(0), trace_ms(0), resolve_ms(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// triangle tests through the vertex buffer against the baked triangle buffer
+	/// </summary>
+	struct TriangleReport {
+		int num_rays;
+		size_t num_triangles;
+		size_t baked_bytes;
+		float baseline_ms;     // brute force, transform & glm::intersectRayTriangle per triangle
+		float baked_ms;        // brute force over the baked buffer
+		float bvh_ms;          // BVH traversal through the vertex buffer
+		float bvh_baked_ms;    // BVH traversal over the baked buffer
+		int mismatches;        // rays whose closest hit differs between the baked and original tests
+
+		TriangleReport() : num_rays(0), num_triangles(0), baked_bytes(0), baseline_ms(0), baked_ms(0),
+			bvh_ms(0), bvh_baked_ms(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// refitting a structure after one geom moved, against rebuilding it
+	/// </summary>
+	struct RefitReport {
+		std::string name;
+		size_t num_nodes;
+		int nodes_touched;
+		float refit_ms;
+		float rebuild_ms;
+		float refit_sah;     // SAH cost of the refit tree
+		float rebuilt_sah;   // SAH cost of a tree built from scratch after the move
+		float sah_drift;     // refit SAH against the SAH right after the original build
+		int mismatches;      // rays whose closest hit through the refit tree differs from brute force
+
+		RefitReport() : num_nodes(0), nodes_touched(0), refit_ms(0), rebuild_ms(0), refit_sah(0), rebuilt_sah(0),
+			sah_drift(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// spatial split BVH against the BVH built with object splits only
+	/// </summary>
+	struct SpatialSplitReport {
+		AccelReport bvh;
+		AccelReport sbvh;
+		SpatialSplitSettings settings;
+		size_t num_source_prims;
+		int spatial_splits;
+
+		SpatialSplitReport() : num_source_prims(0), spatial_splits(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// linear BVH against the binned SAH build, with the linear build timed on pools of increasing size
+	/// </summary>
+	struct LBVHReport {
+		AccelReport sah;
+		AccelReport lbvh;
+		std::vector<int> num_threads;
+		std::vector<float> build_ms; // per thread count
+
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// memory & host traversal of a wide BVH with quantized boxes, against the binary BVH it was converted from
+	/// </summary>
+	struct WideBVHReport {
+		std::string name;
+		size_t num_nodes;
+		size_t node_bytes;
+		size_t total_bytes;   // nodes & primitive references
+		size_t binary_nodes;
+		size_t binary_bytes;
+		float convert_ms;
+		int depth;
+		int num_rays;
+		float trace_ms;
+		float binary_trace_ms;
+		float nodes_per_ray;
+		float prims_per_ray;
+		int mismatches;       // rays whose hit distance differs from the binary BVH, or whose primitive does away from a tie
+
+		WideBVHReport() : num_nodes(0), node_bytes(0), total_bytes(0), binary_nodes(0), binary_bytes(0), convert_ms(0), depth(0),
+			num_rays(0), trace_ms(0), binary_trace_ms(0), nodes_per_ray(0), prims_per_ray(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// sphere & cube tests through the Geom transforms against the compact world space table
+	/// </summary>
+	struct PrimitiveReport {
+		int num_rays;
+		int num_spheres, num_axis_boxes, num_affine; // compact forms of the sphere & cube geoms
+		size_t geom_bytes;      // size of the Geom the original test reads from
+		float compact_bytes;    // average bytes of the CompactPrim read by a compact test
+		float baseline_ms;      // primitiveHitTest over the Geoms
+		float compact_ms;       // compactHitTest over the table
+		int mismatches;         // rays whose closest primitive hit differs
+
+		PrimitiveReport() : num_rays(0), num_spheres(0), num_axis_boxes(0), num_affine(0), geom_bytes(0), compact_bytes(0),
+			baseline_ms(0), compact_ms(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// ray-box slab tests on the boxes of the scene BVH, one box at a time & in packets of 4 and 8
+	/// </summary>
+	struct SlabReport {
+		int num_rays;
+		int num_boxes;
+		std::string simd;        // instruction set of the packet tests
+		size_t num_hits;         // ray-box pairs entered according to AABBRayRange
+		size_t num_intersect_hits; // according to AABBRayIntersect
+		float intersect_ms;      // AABBRayIntersect(AABB, Ray)
+		float range_ms;          // AABBRayRange(AABB, Ray)
+		float traversal_ray_ms;  // AABBRayRange(AABB, TraversalRay), including makeTraversalRay
+		float packet4_ms;
+		float packet8_ms;
+		int mismatches;          // box tests whose hit or entry distance differs from AABBRayRange(AABB, Ray)
+
+		SlabReport() : num_rays(0), num_boxes(0), num_hits(0), num_intersect_hits(0), intersect_ms(0), range_ms(0), traversal_ray_ms(0), packet4_ms(0), packet8_ms(0),
+			mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// octree traversal with and without skipping the leaf entries a ray has already tested in another leaf
+	/// </summary>
+	struct MailboxReport {
+		std::string name;
+		int num_rays;
+		size_t num_refs;          // leaf entries of the octree
+		size_t num_unique;        // distinct primitives among them
+		float baseline_ms;
+		float mailbox_ms;
+		float baseline_prims_per_ray;
+		float mailbox_prims_per_ray;
+		float skipped_per_ray;    // repeated tests removed by the mailbox
+		int mismatches;           // rays whose closest hit with the mailbox differs from the brute force result
+
+		MailboxReport() : num_rays(0), num_refs(0), num_unique(0), baseline_ms(0), mailbox_ms(0), baseline_prims_per_ray(0),
+			mailbox_prims_per_ray(0), skipped_per_ray(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// any-hit visibility queries against closest hit queries on the same rays
+	/// </summary>
+	struct OcclusionReport {
+		std::string name;
+		int num_rays;
+		int num_occluded;
+		float closest_ms;
+		float occlusion_ms;
+		float closest_nodes_per_ray, occlusion_nodes_per_ray;
+		float closest_prims_per_ray, occlusion_prims_per_ray;
+		int mismatches;  // rays where the query disagrees with whether the closest hit is before tmax
+
+		OcclusionReport() : num_rays(0), num_occluded(0), closest_ms(0), occlusion_ms(0), closest_nodes_per_ray(0), occlusion_nodes_per_ray(0),
+			closest_prims_per_ray(0), occlusion_prims_per_ray(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// compaction & material sort passes over array of structs path buffers against the structure of arrays buffers
+	/// </summary>
+	struct PathLayoutReport {
+		int num_paths;
+		int num_live;            // paths kept by compaction
+		int num_materials;       // distinct material ids among the paths, -1 for misses included
+		size_t aos_bytes;        // sizeof(PathSegment) + sizeof(ShadeableIntersection)
+		size_t soa_key_bytes;    // bytes per path the SoA passes read to decide, remainingBounces or materialId
+		float aos_compact_ms;    // copy_if over whole PathSegments
+		float soa_compact_ms;    // copy_if on the remainingBounces stencil
+		float aos_sort_ms;       // stable sort of whole records by material
+		float soa_sort_ms;       // sort of (material, index) pairs, then a gather of every field
+		int mismatches;          // paths whose order differs between the layouts after a pass
+
+		PathLayoutReport() : num_paths(0), num_live(0), num_materials(0), aos_bytes(0), soa_key_bytes(0), aos_compact_ms(0), soa_compact_ms(0),
+			aos_sort_ms(0), soa_sort_ms(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// ways to shade the paths in material order: sorting whole records, or sorting packed (material, slot) keys
+	/// then either gathering the paths once or shading through the sorted keys
+	/// </summary>
+	struct MaterialSortReport {
+		std::string name;
+		int num_paths;
+		int num_materials;       // distinct material ids among the paths, -1 for misses included
+		float record_sort_ms;    // stable sort of whole intersection & path records by material
+		float key_sort_ms;       // sort of the packed 8 byte keys
+		float gather_ms;         // gather of every SoA field through the sorted keys
+		float shade_unsorted_ms; // shading in ray order
+		float shade_gathered_ms; // shading the gathered paths
+		float shade_permuted_ms; // shading the unsorted paths through the sorted keys
+		int mismatches;          // paths shaded differently when gathered & through the keys
+
+		MaterialSortReport() : num_paths(0), num_materials(0), record_sort_ms(0), key_sort_ms(0), gather_ms(0),
+			shade_unsorted_ms(0), shade_gathered_ms(0), shade_permuted_ms(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	/// <summary>
+	/// wavefront shading through the per material type ShadeQueues against shadeSegment in ray order
+	/// </summary>
+	struct ShadeQueueReport {
+		int num_paths;
+		std::vector<int> queue_sizes; // NUM_SHADE_QUEUES
+		float bin_ms;                 // counting, scan & push
+		float shade_ms;               // shadeSegment in ray order
+		float shade_queued_ms;        // the queues one after the other, each with its specialized shading
+		int mismatches;               // paths queued wrongly or shaded differently
+
+		ShadeQueueReport() : num_paths(0), bin_ms(0), shade_ms(0), shade_queued_ms(0), mismatches(0) { }
+		std::string to_string() const;
+	};
+
+	// deterministic mix of camera rays and random rays inside the world AABB
+	std::vector<Ray> MakeTestRays(Scene const& scene, int num_rays);
+
+	// reference closest hit, tests every primitive of the scene
+	bool BruteForceIntersect(Scene const& scene, Ray const& ray, HitInfo& hit);
+
+	// whether two hits agree up to floating point noise
+	bool SameHit(HitInfo const& a, HitInfo const& b);
+
+	AccelReport ProfileBVH(Scene const& scene, int num_rays);
+	AccelReport ProfileTLAS(Scene const& scene, int num_rays);
+	// thread counts go up in powers of 2 to the hardware concurrency
+	LBVHReport ProfileLBVH(Scene const& scene, int num_rays);
+	// front to back & unordered octree traversal with and without mailboxing
+	std::vector<MailboxReport> ProfileMailbox(Scene const& scene, int num_rays);
+	// brute force, BVH, two-level BVH & octree occluded(ray, tmax); tmax is spread around the closest hit distance of each ray
+	std::vector<OcclusionReport> ProfileOcclusion(Scene const& scene, int num_rays);
+	// 4 and 8 wide BVHs converted from the scene BVH
+	std::vector<WideBVHReport> ProfileWideBVH(Scene const& scene, int num_rays);
+	// scene BVH with & without spatial splits
+	SpatialSplitReport ProfileSBVH(Scene const& scene, SpatialSplitSettings const& settings, int num_rays);
+	// octree built with the scene's settings, traversed front to back or visiting every node the ray touches
+	AccelReport ProfileOctree(Scene const& scene, int num_rays, bool ordered);
+	// SAH k-d tree with rope traversal
+	AccelReport ProfileKDTree(Scene const& scene, int num_rays);
+	// the structures meant for static scenes on the same rays: front to back octree, scene BVH & k-d tree
+	std::vector<AccelReport> ProfileStaticAccels(Scene const& scene, int num_rays);
+
+	// brute force traversal followed by intersFromHit, against the per-geom intersection tests
+	// textures are only sampled on the GPU, so tex_color is not compared
+	ResolveReport ProfileResolve(Scene const& scene, int num_rays);
+
+	// world space baked triangles against the original per triangle transform, by brute force & through a BVH
+	TriangleReport ProfileBakedTriangles(Scene const& scene, int num_rays);
+
+	// closest hit among the sphere & cube geoms only, through the Geoms & through Scene::compact_prims
+	PrimitiveReport ProfilePrimitives(Scene const& scene, int num_rays);
+
+	// every ray against every box of the scene BVH, with each slab test
+	SlabReport ProfileSlabs(Scene const& scene, int num_rays);
+
+	// moves a geom by offset, refits the scene BVH & the two-level BVH, then moves it back
+	std::vector<RefitReport> ProfileRefit(Scene& scene, int geom_id, glm::vec3 const& offset, int num_rays);
+
+	// candidate list octree build against the original build that rescans the scene at every node
+	BuildReport ProfileOctreeBuild(Scene const& scene, int depth_lim);
+
+	// paths after the first bounce of the test rays, misses & emissive hits are finished; averaged over num_reps runs
+	PathLayoutReport ProfilePathLayouts(Scene const& scene, int num_paths, int num_reps);
+	// the first bounce of the test rays with the scene materials & with every hit given one material; averaged over num_reps runs
+	std::vector<MaterialSortReport> ProfileMaterialSort(Scene const& scene, int num_paths, int num_reps);
+	// the first bounce of the test rays; averaged over num_reps runs
+	ShadeQueueReport ProfileShadeQueues(Scene const& scene, int num_paths, int num_reps);
+}
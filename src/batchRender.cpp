@@ -0,0 +1,212 @@
+// headless entry point for batch jobs, renders one scene to a file without GLFW, GL or the GUI
+// usage: cis565_path_tracer_batch <scene file> [--iterations N] [--output file.png|file.hdr]
+//                                 [--backend cuda|cpu] [--accel octree|bvh|tlas|sbvh|kdtree]
+
+#include <cuda_runtime.h>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "scene.h"
+#include "image.h"
+#include "pathtrace.h"
+#include "camState.h"
+#include "Profile/timer.h"
+
+// exit codes reported to the job scheduler
+enum BatchExitCode {
+	BATCH_OK = 0,
+	BATCH_BAD_ARGS = 1,
+	BATCH_SCENE_ERROR = 2,
+	BATCH_NO_DEVICE = 3,
+	BATCH_WRITE_ERROR = 4,
+};
+
+// the renderer reads the camera through the globals of the interactive viewer, see camState.h
+RenderState* g_renderState;
+JunksFromMain g_mainJunks;
+int width;
+int height;
+
+struct BatchArgs {
+	std::string scene;
+	std::string output;  // scene FILE name + .png if empty
+	int iterations = -1; // scene ITERATIONS if negative
+	RenderBackend backend = CUDA_BACKEND;
+	AccelType accel = OCTREE;
+};
+
+static void printUsage(char const* exe) {
+	std::cerr << "usage: " << exe << " <scene file> [--iterations N] [--output file.png|file.hdr]\n"
+		<< "       [--backend cuda|cpu] [--accel octree|bvh|tlas|sbvh|kdtree]" << std::endl;
+}
+
+static bool parseArgs(int argc, char** argv, BatchArgs& args) {
+	static char const* accel_names[AccelType::NUM_ACCEL_TYPES] = { "octree", "bvh", "tlas", "sbvh", "kdtree" };
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg[0] != '-') {
+			if (!args.scene.empty()) {
+				std::cerr << "more than one scene file given: " << arg << std::endl;
+				return false;
+			}
+			args.scene = arg;
+			continue;
+		}
+		if (i + 1 == argc) {
+			std::cerr << arg << " needs a value" << std::endl;
+			return false;
+		}
+		char const* value = argv[++i];
+		if (arg == "--iterations" || arg == "-i") {
+			char* end;
+			long n = strtol(value, &end, 10);
+			if (*end || n <= 0 || n > INT_MAX) {
+				std::cerr << "invalid iteration count: " << value << std::endl;
+				return false;
+			}
+			args.iterations = (int)n;
+		} else if (arg == "--output" || arg == "-o") {
+			args.output = value;
+		} else if (arg == "--backend" || arg == "-b") {
+			if (!strcmp(value, "cuda")) {
+				args.backend = CUDA_BACKEND;
+			} else if (!strcmp(value, "cpu")) {
+				args.backend = HOST_BACKEND;
+			} else {
+				std::cerr << "unknown backend: " << value << std::endl;
+				return false;
+			}
+		} else if (arg == "--accel" || arg == "-a") {
+			int type = 0;
+			while (type < AccelType::NUM_ACCEL_TYPES && strcmp(value, accel_names[type])) {
+				++type;
+			}
+			if (type == AccelType::NUM_ACCEL_TYPES) {
+				std::cerr << "unknown acceleration structure: " << value << std::endl;
+				return false;
+			}
+			args.accel = (AccelType)type;
+		} else {
+			std::cerr << "unknown option: " << arg << std::endl;
+			return false;
+		}
+	}
+	if (args.scene.empty()) {
+		std::cerr << "no scene file given" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static bool hasExtension(std::string const& path, char const* ext) {
+	size_t n = strlen(ext);
+	return path.size() > n && !path.compare(path.size() - n, n, ext);
+}
+
+// averages the accumulated radiance & writes it flipped like ImageUtils::SaveImage, the format follows the extension
+static bool saveImage(RenderState const& state, int samples, std::string const& path) {
+	int w = state.camera.resolution.x, h = state.camera.resolution.y;
+	Image img(w, h);
+	for (int x = 0; x < w; ++x) {
+		for (int y = 0; y < h; ++y) {
+			img.setPixel(w - 1 - x, y, state.image[x + y * w] / (float)samples);
+		}
+	}
+	std::string base = path.substr(0, path.size() - 4);
+	return hasExtension(path, ".hdr") ? img.saveHDR(base) : img.savePNG(base);
+}
+
+int main(int argc, char** argv) {
+	BatchArgs args;
+	if (!parseArgs(argc, argv, args)) {
+		printUsage(argv[0]);
+		return BATCH_BAD_ARGS;
+	}
+	if (!args.output.empty() && !hasExtension(args.output, ".png") && !hasExtension(args.output, ".hdr")) {
+		std::cerr << "output must end in .png or .hdr: " << args.output << std::endl;
+		return BATCH_BAD_ARGS;
+	}
+	if (args.backend == CUDA_BACKEND) {
+		int num_devices = 0;
+		if (cudaGetDeviceCount(&num_devices) != cudaSuccess || !num_devices) {
+			std::cerr << "no CUDA device found, use --backend cpu" << std::endl;
+			return BATCH_NO_DEVICE;
+		}
+	}
+
+	Profiling::Timer timer;
+	timer.startCpuTimer();
+	std::unique_ptr<Scene> scene;
+	try {
+		scene.reset(new Scene(args.scene));
+	} catch (std::exception const& e) {
+		std::cerr << e.what() << std::endl;
+		return BATCH_SCENE_ERROR;
+	}
+	timer.endCpuTimer();
+	float load_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	RenderState& state = scene->state;
+	Camera const& cam = state.camera;
+	int iterations = args.iterations > 0 ? args.iterations : state.iterations;
+	if (iterations <= 0) {
+		std::cerr << "the scene sets no iteration count, pass --iterations" << std::endl;
+		return BATCH_BAD_ARGS;
+	}
+	std::string output = args.output.empty() ? state.imageName + ".png" : args.output;
+
+	g_renderState = &state;
+	g_mainJunks.cameraPosition = cam.position;
+	g_mainJunks.ogLookAt = cam.lookAt;
+	g_mainJunks.zoom = glm::length(cam.position - cam.lookAt);
+	width = cam.resolution.x;
+	height = cam.resolution.y;
+
+	PathTracer::setBackend(args.backend);
+	PathTracer::setAccelType(args.accel);
+
+	timer.startCpuTimer();
+	PathTracer::pathtraceInit(scene.get(), &state);
+	timer.endCpuTimer();
+	float init_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	// the first iteration also builds the acceleration structure if init did not
+	timer.startCpuTimer();
+	int iter = 0;
+	while (iter < iterations) {
+		iter = PathTracer::pathtrace(iter);
+	}
+	timer.endCpuTimer();
+	float render_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	timer.startCpuTimer();
+	bool saved = saveImage(state, iter, output);
+	timer.endCpuTimer();
+	float save_ms = timer.getCpuElapsedTimeForPreviousOperation();
+
+	PathTracer::pathtraceFree(nullptr);
+	if (args.backend == CUDA_BACKEND) {
+		cudaDeviceReset();
+	}
+
+	std::cout << std::fixed << std::setprecision(2)
+		<< "scene      " << args.scene << " (" << width << "x" << height << ", " << scene->geoms.size() << " geoms)\n"
+		<< "backend    " << (args.backend == CUDA_BACKEND ? "cuda" : "cpu") << "\n"
+		<< "load       " << load_ms << " ms\n"
+		<< "init       " << init_ms << " ms\n"
+		<< "render     " << render_ms << " ms, " << iter << " iterations, " << render_ms / iter << " ms/iteration\n"
+		<< "save       " << save_ms << " ms\n"
+		<< "total      " << load_ms + init_ms + render_ms + save_ms << " ms" << std::endl;
+	for (auto const& entry : PathTracer::GetProfileData()) {
+		std::cout << "  " << entry.first << ": " << entry.second.get_ave_time() << " ms average" << std::endl;
+	}
+
+	return saved ? BATCH_OK : BATCH_WRITE_ERROR;
+}
@@ -14,20 +14,83 @@
 #define LARGE_FLOAT (float)(1e10)
 #define SMALL_FLOAT (float)(-1e10)
 #define OCTREE_BOX_EPS 0.001f
-#define OCTREE_DEPTH 3
+// default octree termination criteria, a scene can override them with an OCTREE block
+#define OCTREE_DEPTH 6
+#define OCTREE_MAX_LEAF_SIZE 8
+#define OCTREE_MIN_EXTENT 0.01f
+#define OCTREE_TRAVERSAL_COST 1.0f
+#define OCTREE_INTERSECT_COST 1.0f
+// hard limit on the octree depth, bounds the GPU traversal stack
+#define OCTREE_MAX_DEPTH 12
+#define OCTREE_STACK_SIZE(depth) (7 * (depth) + 1)
 #define OCTREE_MESH_ONLY
+// slots of the per-ray set of recently tested octree leaf entries, a power of 2
+#define OCTREE_MAILBOX_SIZE 8
+// octree children with at least this many candidate primitives are built on another thread
+#define OCTREE_PARALLEL_THRESHOLD 4096
+
+// binned SAH BVH parameters
+#define BVH_NUM_BINS 16
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 64
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECT_COST 1.0f
+// subtrees with at least this many primitives are built on another thread
+#define BVH_PARALLEL_THRESHOLD 4096
+// a refit BVH is rebuilt once its SAH cost grows past this factor of the cost right after its build
+#define BVH_REFIT_MAX_SAH_DRIFT 1.3f
+// scenes with at least this many primitives build the scene BVH with the linear (LBVH) builder instead of the SAH
+#define LBVH_MIN_PRIMS (1 << 20)
+// spatial split BVH (SBVH): extra references allowed, as a fraction of the primitive count
+#define SBVH_MAX_DUPLICATION 0.3f
+// spatial splits are only tried where the children of the best object split overlap by this fraction of the root area
+#define SBVH_MIN_OVERLAP 1e-5f
+
+// SAH k-d tree parameters
+#define KDTREE_TRAVERSAL_COST 1.0f
+#define KDTREE_INTERSECT_COST 1.5f
+// cost factor of splits that leave one child empty
+#define KDTREE_EMPTY_BONUS 0.8f
+// the depth limit is 8 + 1.3 log2(primitives) up to this, the rope traversal needs no stack
+#define KDTREE_MAX_DEPTH 40
+// subtrees with at least this many references are built on another thread
+#define KDTREE_PARALLEL_THRESHOLD 4096
+
+// bits per axis of the quantized ray direction in the ray sort key, at most 10
+#define RAY_SORT_DIR_BITS 4
+
+// rays per pixel & ray length as a fraction of the world diagonal of the ambient occlusion debug texture
+#define AO_DEBUG_SAMPLES 16
+#define AO_DEBUG_RADIUS 0.1f
+
+// side in pixels of the square tiles the host backend schedules on its threads
+#define HOST_TILE_SIZE 16
 
 // impl switches
 #define COMPACTION
 // #define SORT_MAT
+// with SORT_MAT, shades the paths through the sorted keys instead of gathering them into material order
+// #define SORT_MAT_PERMUTE
+// bins the paths into one queue per material type after each bounce & shades every queue with its own kernel
+// #define WAVEFRONT_SHADE
 #define AABB_CULLING
 #define OCTREE_CULLING
+// acceleration structures test leaf triangles from a buffer of precomputed edges
+#define BAKED_TRIANGLES
+// built octrees & BVHs are saved to disk and reused when the same scene is loaded again
+#define ACCEL_CACHE
+#define ACCEL_CACHE_DIR "accel_cache"
+#define ACCEL_CACHE_MAX_BYTES (1ull << 30)
 // #define DEPTH_OF_FIELD
 
 // #define ANTI_ALIAS_JITTER
 // #define FAKE_SHADE
 
 #define PROFILE
+// counts the nodes & primitives each ray visits on the GPU, adds atomics to the intersection kernel
+// #define TRAVERSAL_STATS
+// runs host-side checks of the acceleration structures on startup
+// #define UNIT_TEST
 
 #define DENOISE
 #define DENOISE_GBUF_OPTIMIZATION
@@ -38,4 +101,7 @@
 #define CACHE_FIRST_BOUNCE
 #if (defined(CACHE_FIRST_BOUNCE) && defined(ANTI_ALIAS_JITTER)) || (defined(CACHE_FIRST_BOUNCE) && defined(DEPTH_OF_FIELD)) 
 #error "ANTI_ALIAS_JITTER or CACHE_FIRST_BOUNCE cannot be used with CACHE_FIRST_BOUNCE"
+#endif
+#if defined(SORT_MAT) && defined(WAVEFRONT_SHADE)
+#error "SORT_MAT and WAVEFRONT_SHADE both order the shading, pick one"
 #endif
\ No newline at end of file
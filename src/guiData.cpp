@@ -10,6 +10,9 @@ GuiDataContainer::GuiDataContainer() :
     octree_depth_filter(-1),
     octree_intersection_cnt(0),
     test_tree(nullptr),
+    test_tree_empty_space(0),
+    accel_type(0),
+    edit_geom(0),
     desc(Denoiser::FilterType::ATROUS, glm::min(60, width), glm::ivec2(width, height), 0.5f, 0.5f, 0.5f)
 {
     denoiser_options.is_on = false;
@@ -32,6 +35,9 @@ void GuiDataContainer::Reset() {
         delete test_tree;
         test_tree = nullptr;
     }
+    test_tree_empty_space = 0;
+    accel_report.clear();
+    edit_geom = 0;
 
     cur_scene.clear();
 }
@@ -21,6 +21,10 @@ public:
     int octree_depth_filter;
     int octree_intersection_cnt;
     octree* test_tree;
+    float test_tree_empty_space; // of test_tree, computed when it is made
+    int accel_type;
+    int edit_geom; // geom moved by the transform editor
+    std::string accel_report;
     Denoiser::ParamDesc desc;
 
     std::string img_data_file;
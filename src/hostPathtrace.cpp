@@ -0,0 +1,417 @@
+#include "hostPathtrace.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+#include "utilities.h"
+#include "intersections.cuh"
+#include "interactions.h"
+#include "shadeQueues.h"
+#include "threadPool.h"
+#include "Octree/octree.h"
+#include "BVH/bvh.h"
+#include "BVH/tlas.h"
+#include "BVH/lbvh.h"
+#include "KDTree/kdtree.h"
+#include "Denoise/denoise.h"
+#include "Cache/accel_cache.h"
+#include "Profile/timer.h"
+#include "consts.h"
+
+static RenderState* renderState = nullptr;
+static Scene* hst_scene = nullptr;
+static std::string cur_scene = "";
+
+// host views of the textures, so that the resolve samples them like the texture objects
+static std::vector<TextureGPU> hst_texs;
+static MeshInfo mesh_info;
+static std::vector<uchar4> pixels;
+static TraversalCounters trav_counters;
+
+// host structures, built lazily for the selected type like the GPU ones
+static std::unique_ptr<octree> hst_octree;
+static std::vector<char> octree_image;
+static std::vector<BakedTriangle> octree_baked;
+static std::unique_ptr<bvh> hst_bvh;
+static std::vector<BakedTriangle> bvh_baked;
+static std::unique_ptr<bvh> hst_sbvh;
+static std::vector<BakedTriangle> sbvh_baked;
+static std::unique_ptr<tlas> hst_tlas;
+static std::vector<BakedTriangle> tlas_baked;
+static std::unique_ptr<kdtree> hst_kdtree;
+static std::vector<BakedTriangle> kdtree_baked;
+
+// views of the structure traced this frame, the traversals are the same code the kernels run
+struct hostAccelView {
+	AccelType type;
+	octreeView octree;
+	bvhView bvh;
+	tlasView tlas;
+	kdView kdtree;
+
+	bool search(Ray const& ray, HitInfo& hit, TraversalStats* stats) const {
+#ifdef OCTREE_CULLING
+		if (type == BVH || type == SBVH) {
+			return bvh.intersect(ray, hit, stats);
+		} else if (type == TWO_LEVEL) {
+			return tlas.intersect(ray, hit, stats);
+		} else if (type == KDTREE) {
+			return kdtree.intersect(ray, hit, stats);
+		}
+		return octree.intersect(ray, hit, stats);
+#else
+		return sceneHitTest(hst_scene->geoms.data(), mesh_info.compact_prims, hst_scene->geoms.size(),
+			mesh_info.meshes, mesh_info.tris, mesh_info.vertices, ray, hit);
+#endif // OCTREE_CULLING
+	}
+};
+
+static std::vector<BakedTriangle> bake(std::vector<leaf_data> const& prims) {
+#ifdef BAKED_TRIANGLES
+	return hst_scene->bakeTriangles(prims);
+#else
+	return {};
+#endif // BAKED_TRIANGLES
+}
+static BakedTriangle const* bakedData(std::vector<BakedTriangle> const& baked) {
+	return baked.empty() ? nullptr : baked.data();
+}
+
+static void buildAccel(AccelType type) {
+#ifdef OCTREE_CULLING
+	if (type == OCTREE && !hst_octree) {
+		hst_octree = loadOrBuild<octree>(AccelCache::octreeKey(*hst_scene, hst_scene->octree_settings), OCTREE, []() {
+			return std::make_unique<octree>(*hst_scene, hst_scene->world_AABB, hst_scene->octree_settings);
+		});
+		octree_image = hst_octree->image();
+		octree_baked = bake(hst_octree->leaves());
+	} else if (type == BVH && !hst_bvh) {
+		hst_bvh = loadOrBuild<bvh>(AccelCache::bvhKey(*hst_scene), BVH, []() {
+			if (bvh::num_world_prims(*hst_scene) >= LBVH_MIN_PRIMS) {
+				return buildLBVH(*hst_scene);
+			}
+			return std::make_unique<bvh>(*hst_scene);
+		});
+		bvh_baked = bake(hst_bvh->prims());
+	} else if (type == SBVH && !hst_sbvh) {
+		hst_sbvh = loadOrBuild<bvh>(AccelCache::sbvhKey(*hst_scene, SpatialSplitSettings()), SBVH, []() {
+			return std::make_unique<bvh>(*hst_scene, SpatialSplitSettings());
+		});
+		sbvh_baked = bake(hst_sbvh->prims());
+	} else if (type == TWO_LEVEL && !hst_tlas) {
+		hst_tlas = std::make_unique<tlas>(*hst_scene);
+		tlas_baked = bake(hst_tlas->blas_prims());
+	} else if (type == KDTREE && !hst_kdtree) {
+		hst_kdtree = loadOrBuild<kdtree>(AccelCache::kdtreeKey(*hst_scene), KDTREE, []() {
+			return std::make_unique<kdtree>(*hst_scene);
+		});
+		kdtree_baked = bake(hst_kdtree->prims());
+	}
+#endif // OCTREE_CULLING
+}
+
+static void freeAccel() {
+	hst_octree.reset();
+	octree_image.clear();
+	octree_baked.clear();
+	hst_bvh.reset();
+	bvh_baked.clear();
+	hst_sbvh.reset();
+	sbvh_baked.clear();
+	hst_tlas.reset();
+	tlas_baked.clear();
+	hst_kdtree.reset();
+	kdtree_baked.clear();
+}
+
+static hostAccelView accelView(AccelType type) {
+	hostAccelView ret = {};
+	ret.type = type;
+#ifdef OCTREE_CULLING
+	if (type == BVH) {
+		ret.bvh = hst_bvh->view(*hst_scene, bakedData(bvh_baked));
+	} else if (type == SBVH) {
+		ret.bvh = hst_sbvh->view(*hst_scene, bakedData(sbvh_baked));
+	} else if (type == TWO_LEVEL) {
+		ret.tlas = hst_tlas->view(*hst_scene, bakedData(tlas_baked));
+	} else if (type == KDTREE) {
+		ret.kdtree = hst_kdtree->view(*hst_scene, bakedData(kdtree_baked));
+	} else {
+		ret.octree = octree::view(octree_image, *hst_scene, bakedData(octree_baked));
+	}
+#endif // OCTREE_CULLING
+	return ret;
+}
+
+void HostPathTracer::pathtraceInit(Scene* scene, RenderState* state, bool force_change) {
+	if (!scene) throw;
+	bool scene_changed = force_change || cur_scene != scene->filename;
+	hst_scene = scene;
+	cur_scene = scene->filename;
+	renderState = state;
+
+	Camera const& cam = hst_scene->state.camera;
+	pixels.assign((size_t)cam.resolution.x * cam.resolution.y, make_uchar4(0, 0, 0, 0));
+
+	if (scene_changed) {
+		// the scene owns every array, the MeshInfo only points into them
+		for (Texture const& hst_tex : scene->textures) {
+			hst_texs.push_back(TextureGPU::host_view(hst_tex));
+		}
+		mesh_info.vertices = scene->vertices.data();
+		mesh_info.normals = scene->normals.data();
+		mesh_info.uvs = scene->uvs.data();
+		mesh_info.texs = hst_texs.empty() ? nullptr : hst_texs.data();
+		mesh_info.tris = scene->triangles.data();
+		mesh_info.meshes = scene->meshes.data();
+		mesh_info.tangents = scene->tangents.data();
+		mesh_info.materials = scene->materials.data();
+		mesh_info.compact_prims = scene->compact_prims.data();
+	}
+}
+
+void HostPathTracer::pathtraceFree(Scene* scene, bool force_change) {
+	bool scene_changed = force_change || !scene || cur_scene != scene->filename;
+
+	pixels.clear();
+	if (scene_changed) {
+		freeAccel();
+		hst_texs.clear();
+		mesh_info = MeshInfo();
+	}
+}
+
+// closest hit of a ray with its surface attributes resolved, a miss is left as the default intersection
+static ShadeableIntersection intersectRay(hostAccelView const& accel, Ray const& ray, TraversalCounters& counters) {
+	HitInfo hit;
+#ifdef TRAVERSAL_STATS
+	TraversalStats stats;
+	accel.search(ray, hit, &stats);
+	++counters.num_rays;
+	counters.nodes_visited += stats.nodes_visited;
+	counters.prims_tested += stats.prims_tested;
+	counters.prims_skipped += stats.prims_skipped;
+#else
+	(void)counters;
+	accel.search(ray, hit, nullptr);
+#endif // TRAVERSAL_STATS
+
+	ShadeableIntersection inters;
+	if (hit.valid()) {
+		intersFromHit(inters, ray, hit, mesh_info, hst_scene->geoms.data());
+	}
+	return inters;
+}
+
+// traces the path of one pixel to its end, the same segments the kernels trace bounce by bounce
+static color_t tracePath(hostAccelView const& accel, int iter, int x, int y, TraversalCounters& counters) {
+	Camera const& cam = hst_scene->state.camera;
+	int traceDepth = hst_scene->state.traceDepth;
+	int index = x + (y * cam.resolution.x);
+	Span<Light> lights(hst_scene->lights.size(), hst_scene->lights.data());
+
+	PathSegment path;
+	path.init(traceDepth, index, cameraRay(cam, iter, traceDepth, x, y));
+	for (int depth = 0; depth < traceDepth && path.remainingBounces > 0; ++depth) {
+		ShadeableIntersection inters = intersectRay(accel, path.ray, counters);
+		// seeded per bounce, a path never moves to another slot here
+		thrust::default_random_engine rng = makeSeededRandomEngine(iter, index, depth);
+		shadeSegment(path, inters, mesh_info.materials, lights, rng);
+	}
+	// like finalGather, paths cut off by the depth limit still contribute
+	return path.color;
+}
+
+#if defined(SORT_MAT) || defined(WAVEFRONT_SHADE)
+// buffers of traceTile, reused by the tiles a thread runs
+struct TileBuffers {
+	std::vector<PathSegment> paths;
+	std::vector<ShadeableIntersection> inters;
+	std::vector<uint64_t> keys;
+	std::vector<int> queue_data; // counts, offsets & heads of the shading queues
+	std::vector<int> queue_slots;
+	ShadeQueues queues;
+
+	void resize(int n) {
+		inters.resize(n);
+		queue_data.resize(3 * NUM_SHADE_QUEUES);
+		queue_slots.resize(n);
+		queues.bind(queue_data.data(), queue_slots.data());
+	}
+};
+
+// traces the paths of a tile bounce by bounce, each bounce is shaded in the order the kernels shade it:
+// in material order with the packed keys of SORT_MAT, or queue by queue with the ShadeQueues of WAVEFRONT_SHADE
+// every path keeps the seeds of tracePath, so the image does not change, only the shading order does
+static void traceTile(hostAccelView const& accel, int iter, int x0, int y0, int x1, int y1, TraversalCounters& counters,
+	TileBuffers& buf) {
+	Camera const& cam = hst_scene->state.camera;
+	int traceDepth = hst_scene->state.traceDepth;
+	Span<Light> lights(hst_scene->lights.size(), hst_scene->lights.data());
+
+	std::vector<PathSegment>& paths = buf.paths;
+	std::vector<ShadeableIntersection>& inters = buf.inters;
+	paths.clear();
+	for (int y = y0; y < y1; ++y) {
+		for (int x = x0; x < x1; ++x) {
+			PathSegment path;
+			path.init(traceDepth, x + (y * cam.resolution.x), cameraRay(cam, iter, traceDepth, x, y));
+			paths.push_back(path);
+		}
+	}
+	buf.resize(paths.size());
+
+	for (int depth = 0; depth < traceDepth; ++depth) {
+		int num_live = 0;
+		for (int i = 0; i < (int)paths.size(); ++i) {
+			if (paths[i].remainingBounces > 0) {
+				inters[i] = intersectRay(accel, paths[i].ray, counters);
+				++num_live;
+			}
+		}
+		if (!num_live) {
+			break;
+		}
+
+#ifdef WAVEFRONT_SHADE
+		ShadeQueues& queues = buf.queues;
+		queues.clear();
+		for (int i = 0; i < (int)paths.size(); ++i) {
+			if (paths[i].remainingBounces > 0) {
+				queues.count(ShadeQueues::queueOf(inters[i].t, inters[i].materialId, mesh_info.materials));
+			}
+		}
+		queues.scan();
+		for (int i = 0; i < (int)paths.size(); ++i) {
+			if (paths[i].remainingBounces > 0) {
+				queues.push(ShadeQueues::queueOf(inters[i].t, inters[i].materialId, mesh_info.materials), i);
+			}
+		}
+		for (int q = 0; q < NUM_SHADE_QUEUES; ++q) {
+			for (int j = queues.offsets[q]; j < queues.offsets[q] + queues.counts[q]; ++j) {
+				PathSegment& path = paths[queues.slots[j]];
+				thrust::default_random_engine rng = makeSeededRandomEngine(iter, path.pixelIndex, depth);
+				shadeQueuedSegment(q, path, inters[queues.slots[j]], mesh_info.materials, lights, rng);
+			}
+		}
+#else
+		std::vector<uint64_t>& keys = buf.keys;
+		keys.clear();
+		for (int i = 0; i < (int)paths.size(); ++i) {
+			if (paths[i].remainingBounces > 0) {
+				keys.push_back(MaterialSortKey::make(inters[i].materialId, i));
+			}
+		}
+		std::sort(keys.begin(), keys.end());
+		for (uint64_t key : keys) {
+			PathSegment& path = paths[MaterialSortKey::index(key)];
+			thrust::default_random_engine rng = makeSeededRandomEngine(iter, path.pixelIndex, depth);
+			shadeSegment(path, inters[MaterialSortKey::index(key)], mesh_info.materials, lights, rng);
+		}
+#endif // WAVEFRONT_SHADE
+	}
+}
+#endif // SORT_MAT || WAVEFRONT_SHADE
+
+int HostPathTracer::pathtrace(int iter) {
+	Profiling::Timer timer;
+	timer.startCpuTimer();
+
+	AccelType accel_type = PathTracer::getAccelType();
+	buildAccel(accel_type);
+	hostAccelView accel = accelView(accel_type);
+
+	Camera const& cam = hst_scene->state.camera;
+	int tiles_x = DIV_UP(cam.resolution.x, HOST_TILE_SIZE);
+	int tiles_y = DIV_UP(cam.resolution.y, HOST_TILE_SIZE);
+	std::vector<glm::vec3>& image = renderState->image;
+	RadianceToRGBA to_rgba(iter + 1);
+
+	// tiles near the geometry cost far more than the ones seeing only background, stealing evens them out
+	ThreadPool& pool = ThreadPool::instance();
+	std::vector<TraversalCounters> counters(pool.size(), TraversalCounters());
+	parallelForStealing(pool, (size_t)tiles_x * tiles_y, [&](size_t worker, size_t tile) {
+		int x0 = (int)(tile % tiles_x) * HOST_TILE_SIZE;
+		int y0 = (int)(tile / tiles_x) * HOST_TILE_SIZE;
+		int x1 = std::min(x0 + HOST_TILE_SIZE, cam.resolution.x);
+		int y1 = std::min(y0 + HOST_TILE_SIZE, cam.resolution.y);
+#if defined(SORT_MAT) || defined(WAVEFRONT_SHADE)
+		thread_local TileBuffers buf;
+		traceTile(accel, iter, x0, y0, x1, y1, counters[worker], buf);
+		for (PathSegment const& path : buf.paths) {
+			image[path.pixelIndex] += path.color;
+			pixels[path.pixelIndex] = to_rgba(image[path.pixelIndex]);
+		}
+#else
+		for (int y = y0; y < y1; ++y) {
+			for (int x = x0; x < x1; ++x) {
+				int index = x + (y * cam.resolution.x);
+				image[index] += tracePath(accel, iter, x, y, counters[worker]);
+				pixels[index] = to_rgba(image[index]);
+			}
+		}
+#endif // SORT_MAT || WAVEFRONT_SHADE
+	});
+
+	trav_counters = TraversalCounters();
+	for (TraversalCounters const& c : counters) {
+		trav_counters.num_rays += c.num_rays;
+		trav_counters.nodes_visited += c.nodes_visited;
+		trav_counters.prims_tested += c.prims_tested;
+		trav_counters.prims_skipped += c.prims_skipped;
+	}
+
+	timer.endCpuTimer();
+	PathTracer::GetProfileData()["frame (host)"].add_time(timer.getCpuElapsedTimeForPreviousOperation());
+	return iter + 1;
+}
+
+// refits a scene BVH after a geom moved, or frees it to be rebuilt if it degraded too much
+static void refitBVH(std::string const& name, int geom_id, std::unique_ptr<bvh>& hst, std::vector<BakedTriangle>& baked) {
+	if (!hst) {
+		return;
+	}
+	int touched = hst->refit(*hst_scene, geom_id);
+	float drift = hst->sah_drift();
+	if (drift > BVH_REFIT_MAX_SAH_DRIFT) {
+		std::cout << name << " SAH drift " << drift << ", rebuilding" << std::endl;
+		hst.reset();
+		baked.clear();
+	} else {
+		baked = bake(hst->prims());
+		std::cout << name << " refit " << touched << " nodes, SAH drift " << drift << std::endl;
+	}
+}
+
+void HostPathTracer::updateGeomTransform(int geom_id, glm::vec3 const& translation, glm::vec3 const& rotation, glm::vec3 const& scale) {
+	// the geoms, compact prims & lights are read straight from the scene, only the structures need updating
+	hst_scene->setTransform(geom_id, translation, rotation, scale);
+
+	hst_octree.reset();
+	octree_image.clear();
+	octree_baked.clear();
+	hst_kdtree.reset();
+	kdtree_baked.clear();
+	refitBVH("BVH", geom_id, hst_bvh, bvh_baked);
+	refitBVH("SBVH", geom_id, hst_sbvh, sbvh_baked);
+	if (hst_tlas) {
+		int touched = hst_tlas->refit(*hst_scene, geom_id);
+		float drift = hst_tlas->sah_drift();
+		if (drift > BVH_REFIT_MAX_SAH_DRIFT) {
+			std::cout << "TLAS SAH drift " << drift << ", rebuilding" << std::endl;
+			hst_tlas.reset();
+			tlas_baked.clear();
+		} else {
+			std::cout << "TLAS refit " << touched << " nodes, SAH drift " << drift << std::endl;
+		}
+	}
+}
+
+std::vector<uchar4> const& HostPathTracer::getPixels() {
+	return pixels;
+}
+
+TraversalCounters const& HostPathTracer::GetTraversalCounters() {
+	return trav_counters;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+#include <vector_types.h>
+#include "scene.h"
+#include "pathtrace.h"
+
+/// <summary>
+/// CPU implementation of the PathTracer contract, selected with HOST_BACKEND;
+/// each path is traced to the end by one thread with the same __host__ __device__ traversal & shading code as the kernels,
+/// image tiles are balanced over the thread pool with work stealing
+/// </summary>
+namespace HostPathTracer {
+	void pathtraceInit(Scene* scene, RenderState* state, bool force_change = false);
+	void pathtraceFree(Scene* scene, bool force_change = false);
+	// accumulates one sample per pixel into the render state image, returns the new iteration
+	int pathtrace(int iteration);
+	void updateGeomTransform(int geom_id, glm::vec3 const& translation, glm::vec3 const& rotation, glm::vec3 const& scale);
+
+	// the accumulated image as 8 bit RGBA after the last pathtrace, laid out like the PBO
+	std::vector<uchar4> const& getPixels();
+	// all zeros unless TRAVERSAL_STATS is defined
+	TraversalCounters const& GetTraversalCounters();
+}
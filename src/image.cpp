@@ -1,11 +1,11 @@
 #include <iostream>
+#include <cassert>
 #include <glm/glm.hpp>
 #include <stb_image.h>
 #include <stb_image_write.h>
 #include <vector_types.h>
 #include "utilities.h"
 #include "image.h"
-#include "main.h"
 
 Image::Image(int x, int y) :
         xSize(x),
@@ -53,7 +53,7 @@ void Image::setPixel(int x, int y, const glm::vec3 &pixel) {
     pixels[(y * xSize) + x] = pixel;
 }
 
-void Image::savePNG(const std::string &baseFilename) const {
+bool Image::savePNG(const std::string &baseFilename) const {
     unsigned char *bytes = new unsigned char[3 * size_t(xSize) * ySize];
     for (int y = 0; y < ySize; y++) {
         for (int x = 0; x < xSize; x++) { 
@@ -66,14 +66,24 @@ void Image::savePNG(const std::string &baseFilename) const {
     }
 
     std::string filename = baseFilename + ".png";
-    stbi_write_png(filename.c_str(), xSize, ySize, 3, bytes, xSize * 3);
-    std::cout << "Saved " << filename << "." << std::endl;
+    bool ok = stbi_write_png(filename.c_str(), xSize, ySize, 3, bytes, xSize * 3);
+    if (ok) {
+        std::cout << "Saved " << filename << "." << std::endl;
+    } else {
+        std::cerr << "Failed to save " << filename << "." << std::endl;
+    }
 
     delete[] bytes;
+    return ok;
 }
 
-void Image::saveHDR(const std::string &baseFilename) const {
+bool Image::saveHDR(const std::string &baseFilename) const {
     std::string filename = baseFilename + ".hdr";
-    stbi_write_hdr(filename.c_str(), xSize, ySize, 3, (const float *) pixels);
-    std::cout << "Saved " + filename + "." << std::endl;
+    bool ok = stbi_write_hdr(filename.c_str(), xSize, ySize, 3, (const float *) pixels);
+    if (ok) {
+        std::cout << "Saved " + filename + "." << std::endl;
+    } else {
+        std::cerr << "Failed to save " + filename + "." << std::endl;
+    }
+    return ok;
 }
\ No newline at end of file
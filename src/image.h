@@ -18,6 +18,7 @@ public:
 
     glm::vec3 const* getPixels() const { return pixels; }
     void setPixel(int x, int y, const glm::vec3 &pixel);
-    void savePNG(const std::string &baseFilename) const;
-    void saveHDR(const std::string &baseFilename) const;
+    // both return false if the file could not be written
+    bool savePNG(const std::string &baseFilename) const;
+    bool saveHDR(const std::string &baseFilename) const;
 };
\ No newline at end of file
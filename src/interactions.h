@@ -4,24 +4,32 @@
 #include "utilities.h"
 #include <thrust/random.h>
 #include <glm/gtc/epsilon.hpp>
+#include <glm/gtx/norm.hpp>
 #include "scene.h"
 
-__device__ bool feq(float a, float b) {
+// shared by the CUDA kernels & the host backend, so that both draw the same random numbers for a pixel
+__host__ __device__ inline
+thrust::default_random_engine makeSeededRandomEngine(int iter, int index, int depth) {
+    int h = utilhash((1 << 31) | (depth << 22) | iter) ^ utilhash(index);
+    return thrust::default_random_engine(h);
+}
+
+__host__ __device__ inline bool feq(float a, float b) {
     a -= b;
     return a <= EPSILON && a >= -EPSILON;
 }
 
-__device__ bool is_zero(glm::vec3 const& vec) {
+__host__ __device__ inline bool is_zero(glm::vec3 const& vec) {
     return glm::length2(vec) <= EPSILON * EPSILON;
 }
 
-__device__ __forceinline__
+__host__ __device__ __forceinline__
 glm::vec3 face_forward(glm::vec3 const& N, glm::vec3 const& dir) {
     return glm::dot(N, dir) < 0 ? -N : N;
 }
 
 template<typename T>
-__device__ __forceinline__
+__host__ __device__ __forceinline__
 void dev_swap(T& a, T& b) {
     T tmp = a;
     a = b;
@@ -32,7 +40,7 @@ void dev_swap(T& a, T& b) {
  * Computes t20 cosine-weighted random direction in t20 hemisphere.
  * Used for diffuse lighting.
  */
-__device__ glm::vec3 calculateRandomDirectionInHemisphere(
+__host__ __device__ inline glm::vec3 calculateRandomDirectionInHemisphere(
     glm::vec3 normal, thrust::default_random_engine& rng) {
     thrust::uniform_real_distribution<float> u01(0, 1);
 
@@ -46,9 +54,9 @@ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
     // Peter Kutz.
 
     glm::vec3 directionNotNormal;
-    if (abs(normal.x) < SQRT_OF_ONE_THIRD) {
+    if (glm::abs(normal.x) < SQRT_OF_ONE_THIRD) {
         directionNotNormal = glm::vec3(1, 0, 0);
-    } else if (abs(normal.y) < SQRT_OF_ONE_THIRD) {
+    } else if (glm::abs(normal.y) < SQRT_OF_ONE_THIRD) {
         directionNotNormal = glm::vec3(0, 1, 0);
     } else {
         directionNotNormal = glm::vec3(0, 0, 1);
@@ -61,12 +69,12 @@ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
         glm::normalize(glm::cross(normal, perpendicularDirection1));
 
     return up * normal
-        + cos(around) * over * perpendicularDirection1
-        + sin(around) * over * perpendicularDirection2;
+        + glm::cos(around) * over * perpendicularDirection1
+        + glm::sin(around) * over * perpendicularDirection2;
 }
 
 // reference: https://raytracing.github.io/books/RayTracingInOneWeekend.html
-__device__ float schlick_frensnel(float cosine, float eta) {
+__host__ __device__ inline float schlick_frensnel(float cosine, float eta) {
     // Schlick's approximation
     float t0 = 1 - glm::min(cosine, 1.0f);
     float r0 = (1 - eta) / (1 + eta);
@@ -75,7 +83,7 @@ __device__ float schlick_frensnel(float cosine, float eta) {
 }
 
 // reference: https://github.com/mmp/pbrt-v3/blob/master/src/core/reflection.cpp
-__device__ color_t fresnel_conductor(float cosine, color_t const& eta) {
+__host__ __device__ inline color_t fresnel_conductor(float cosine, color_t const& eta) {
     cosine = glm::clamp(cosine, -1.0f, 1.0f);
 
     float c2 = cosine * cosine;
@@ -92,7 +100,7 @@ __device__ color_t fresnel_conductor(float cosine, color_t const& eta) {
     return 0.5f * (Rp + Rs);
 }
 // reference: https://github.com/mmp/pbrt-v3/blob/master/src/core/reflection.cpp
-__device__ float fresnel_dielectric(float cosine, float etaI, float etaT) {
+__host__ __device__ inline float fresnel_dielectric(float cosine, float etaI, float etaT) {
     cosine = glm::clamp(cosine, -1.0f, 1.0f);
     if (cosine < 0.f) {
         dev_swap(etaI, etaT);
@@ -114,7 +122,7 @@ __device__ float fresnel_dielectric(float cosine, float etaI, float etaT) {
 struct SamplePointSpace {
     glm::mat3x3 l2w, w2l; // local to world
 
-    __device__ SamplePointSpace(glm::vec3 const& n) {
+    __host__ __device__ SamplePointSpace(glm::vec3 const& n) {
         // constructs an orthonormal coordinate system
         // with +z direction same as n
 
@@ -148,10 +156,10 @@ struct SamplePointSpace {
         // inverse same as transpose
         w2l = glm::transpose(l2w);
     }
-    __device__ __forceinline__ glm::vec3 world_to_local(glm::vec3 const& v) {
+    __host__ __device__ __forceinline__ glm::vec3 world_to_local(glm::vec3 const& v) {
         return w2l * v;
     }
-    __device__ __forceinline__ glm::vec3 local_to_world(glm::vec3 const& v) {
+    __host__ __device__ __forceinline__ glm::vec3 local_to_world(glm::vec3 const& v) {
         return l2w * v;
     }
 };
@@ -165,7 +173,7 @@ struct BSDF {
     thrust::default_random_engine& rng;
     color_t reflectance;
 
-    __device__ BSDF(Material const& m, ShadeableIntersection const& inters, thrust::default_random_engine& rng)
+    __host__ __device__ BSDF(Material const& m, ShadeableIntersection const& inters, thrust::default_random_engine& rng)
         : m(m), type(m.type), is_delta(feq(m.roughness, 0)), rng(rng) {
         if (m.textures.diffuse != -1) {
             reflectance = inters.tex_color;
@@ -174,13 +182,13 @@ struct BSDF {
         }
     }
 
-    __device__ __forceinline__ float abs_cos_theta(glm::vec3 const& wi) const {
+    __host__ __device__ __forceinline__ float abs_cos_theta(glm::vec3 const& wi) const {
         return glm::abs(wi.z);
     }
-    __device__ __forceinline__ float cos_theta(glm::vec3 const& wi) const {
+    __host__ __device__ __forceinline__ float cos_theta(glm::vec3 const& wi) const {
         return wi.z;
     }
-    __device__ __forceinline__ float same_hemisphere(glm::vec3 const& w, glm::vec3 const& wp) const {
+    __host__ __device__ __forceinline__ float same_hemisphere(glm::vec3 const& w, glm::vec3 const& wp) const {
         return w.z * wp.z > 0;
     }
 
@@ -189,10 +197,10 @@ struct BSDF {
     // https://agraphicsguy.wordpress.com/2015/11/01/sampling-microfacet-brdf/
     // http://graphicrants.blogspot.com/2013/08/specular-brdf-reference.html
     // https://sites.cs.ucsb.edu/~lingqi/teaching/resources/GAMES202_Lecture_10.pdf
-    __device__ __forceinline__ float microfacet_pdf(glm::vec3 const& wh) const {
+    __host__ __device__ __forceinline__ float microfacet_pdf(glm::vec3 const& wh) const {
         return ggx_D(wh) * abs_cos_theta(wh);
     }
-    __device__ __forceinline__ glm::vec3 sample_ggx(glm::vec3 const& wo) const {
+    __host__ __device__ __forceinline__ glm::vec3 sample_ggx(glm::vec3 const& wo) const {
         thrust::uniform_real_distribution<float> u01(0,1);
         float r1 = u01(rng);
         float r2 = u01(rng);
@@ -203,7 +211,7 @@ struct BSDF {
         return glm::reflect(-wo, wm);
     }
     // ggx distribution
-    __device__ __forceinline__ float ggx_D(glm::vec3 const& wh) const {
+    __host__ __device__ __forceinline__ float ggx_D(glm::vec3 const& wh) const {
         if (cos_theta(wh) < 0) {
             return 0;
         }
@@ -213,20 +221,20 @@ struct BSDF {
         return a2 / (PI * t * t);
     }
     // shadowing factor
-    __device__ __forceinline__ float ggx_G1(glm::vec3 const& v) const {
+    __host__ __device__ __forceinline__ float ggx_G1(glm::vec3 const& v) const {
         float cosine = abs_cos_theta(v);
         float cos2 = cosine * cosine;
         float a2 = m.roughness * m.roughness;
         return 2 * cosine / (cosine + sqrtf(a2 + (1 - a2) * cos2));
     }
-    __device__ __forceinline__ float ggx_G(glm::vec3 const& wo, glm::vec3 const& wi) const {
+    __host__ __device__ __forceinline__ float ggx_G(glm::vec3 const& wo, glm::vec3 const& wi) const {
         glm::vec3 wh = glm::normalize(wi + wo);
         if (!same_hemisphere(wh, wo) || !same_hemisphere(wh, wi)) {
             return 0;
         }
         return ggx_G1(wo) * ggx_G1(wi);
     }
-    __device__ color_t sample_f(glm::vec3 const& wo, glm::vec3& wi, float& pdf) const {
+    __host__ __device__ color_t sample_f(glm::vec3 const& wo, glm::vec3& wi, float& pdf) const {
         float etaI = 1, etaT = m.ior, F;
         glm::vec3 wh; // half vector
         color_t tmp;
@@ -353,7 +361,7 @@ struct BSDF {
  */
 
 #define OFFSET_EPS 0.001f
-__device__
+__host__ __device__ inline
 void scatterRay(
     PathSegment& path,
     ShadeableIntersection const& inters,
@@ -414,4 +422,81 @@ void scatterRay(
     path.color *= color;
     ray.origin = intersect + OFFSET_EPS * wi;
     ray.direction = glm::normalize(wi);
-}
\ No newline at end of file
+}
+// ray through pixel (x, y), the first segment of its path
+__host__ __device__ inline
+Ray cameraRay(Camera const& cam, int iter, int traceDepth, int x, int y) {
+    Ray cam_ray;
+    cam_ray.origin = cam.position;
+
+#ifdef ANTI_ALIAS_JITTER
+    // randomly jitter the ray
+    int index = x + (y * cam.resolution.x);
+    thrust::default_random_engine rng = makeSeededRandomEngine(iter, index, traceDepth);
+    thrust::uniform_real_distribution<float> udist(-0.5f, 0.5f);
+    x += udist(rng);
+    y += udist(rng);
+#endif // ANTI_ALIAS
+
+    cam_ray.direction = glm::normalize(cam.view
+        - cam.right * cam.pixelLength.x * ((float)x - (float)cam.resolution.x * 0.5f)
+        - cam.up * cam.pixelLength.y * ((float)y - (float)cam.resolution.y * 0.5f)
+    );
+    return cam_ray;
+}
+
+// whether a path goes on from its closest hit, misses & lights end it
+__host__ __device__ inline
+bool segmentScatters(float t, int materialId, Material const* materials) {
+    return t > 0.0f && !(materials[materialId].emittance > 0.0f);
+}
+
+// ends a path at a miss or a light
+__host__ __device__ inline
+void finishSegment(
+    PathSegment& path,
+    ShadeableIntersection const& intersection,
+    Material const* materials) {
+
+    if (intersection.t > 0.0f) {
+        // If the material indicates that the object was a light, "light" the ray
+        Material const& material = materials[intersection.materialId];
+        path.color *= (material.diffuse * material.emittance);
+    } else {
+        path.color = BACKGROUND_COLOR;
+    }
+    path.terminate();
+}
+
+// shades one path segment at its closest hit, either ends the path or scatters it into the next segment
+__host__ __device__ inline
+void shadeSegment(
+    PathSegment& path,
+    ShadeableIntersection const& intersection,
+    Material const* materials,
+    Span<Light> const& lights,
+    thrust::default_random_engine& rng) {
+
+    if (segmentScatters(intersection.t, intersection.materialId, materials)) {
+        Material material = materials[intersection.materialId];
+        scatterRay(path, intersection, material, lights, rng);
+    } else {
+        finishSegment(path, intersection, materials);
+    }
+}
+
+// shadeSegment for a path known to scatter off a material of type T
+// the type is a compile time constant, so the branches of the BSDF on it fold away
+template<Material::Type T>
+__host__ __device__ inline
+void scatterSegmentOfType(
+    PathSegment& path,
+    ShadeableIntersection const& intersection,
+    Material const* materials,
+    Span<Light> const& lights,
+    thrust::default_random_engine& rng) {
+
+    Material material = materials[intersection.materialId];
+    material.type = T;
+    scatterRay(path, intersection, material, lights, rng);
+}
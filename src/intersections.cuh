@@ -109,6 +109,76 @@ __host__ __device__ inline bool AABBRayIntersect(AABB const& aabb, Ray const& r,
 
     return true;
 }
+// slab test that also reports where the ray enters and leaves the box
+// t_near is clamped to 0 if the ray starts inside the box
+__host__ __device__ inline bool AABBRayRange(AABB const& aabb, Ray const& r, float& t_near, float& t_far) {
+    t_near = 0;
+    t_far = LARGE_FLOAT;
+
+#pragma unroll
+    for (int i = 0; i < 3; ++i) {
+        if (fabsf(r.direction[i]) < EPSILON) {
+            if (r.origin[i] < aabb.min()[i] || r.origin[i] > aabb.max()[i]) {
+                return false;
+            }
+        } else {
+            float inv_d = 1.0f / r.direction[i];
+            float t0 = (aabb.min()[i] - r.origin[i]) * inv_d;
+            float t1 = (aabb.max()[i] - r.origin[i]) * inv_d;
+            if (t0 > t1) {
+                float tmp = t0;
+                t0 = t1;
+                t1 = tmp;
+            }
+            t_near = fmax(t0, t_near);
+            t_far = fmin(t1, t_far);
+            if (t_near > t_far) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// ray prepared once for the many box tests of a traversal:
+/// the slabs are multiplied by the inverse direction instead of divided by the direction,
+/// and the sign bits pick the entry & exit plane of each slab without a compare and swap
+/// </summary>
+struct TraversalRay {
+    glm::vec3 origin;
+    glm::vec3 inv_dir;
+    int sign[3]; // 1 if the direction is negative along the axis
+};
+__host__ __device__ inline TraversalRay makeTraversalRay(Ray const& r) {
+    TraversalRay ret;
+    ret.origin = r.origin;
+#pragma unroll
+    for (int i = 0; i < 3; ++i) {
+        // a ray parallel to a slab (same cut off as AABBRayRange(AABB, Ray)) gets an infinite inverse:
+        // the slab then contains the whole ray or none of it, and a ray starting on a plane makes 0 * inf = NaN,
+        // which the selects in the slab tests ignore, so the planes count as inside like in AABBRayRange(AABB, Ray)
+        ret.inv_dir[i] = fabsf(r.direction[i]) < EPSILON ? copysignf(INFINITY, r.direction[i]) : 1.0f / r.direction[i];
+        ret.sign[i] = ret.inv_dir[i] < 0;
+    }
+    return ret;
+}
+// branchless version of AABBRayRange(AABB, Ray), same results for the same ray
+__host__ __device__ inline bool AABBRayRange(AABB const& aabb, TraversalRay const& r, float& t_near, float& t_far) {
+    t_near = 0;
+    t_far = LARGE_FLOAT;
+
+#pragma unroll
+    for (int i = 0; i < 3; ++i) {
+        float t0 = ((r.sign[i] ? aabb.max()[i] : aabb.min()[i]) - r.origin[i]) * r.inv_dir[i];
+        float t1 = ((r.sign[i] ? aabb.min()[i] : aabb.max()[i]) - r.origin[i]) * r.inv_dir[i];
+        // plain selects compile to single min / max instructions, unlike fmax & fmin,
+        // and keep the running bound if the product is NaN
+        t_near = t0 > t_near ? t0 : t_near;
+        t_far = t1 < t_far ? t1 : t_far;
+    }
+    return t_near <= t_far;
+}
 __host__ __device__ inline bool AABBPointIntersect(AABB const& aabb, glm::vec3 const& point) {
     bool contained = true;
 #pragma unroll
@@ -135,7 +205,7 @@ __host__ __device__ inline bool AABBTriangleIntersect(AABB const& a, glm::vec3 c
     // reduce to a loose & inaccurate AABB-AABB test instead
     // because I run out of time trying to debug this
     // this function is only used by the octree anyways
-    glm::vec3 min_tri(FLT_MAX), max_tri(FLT_MIN);
+    glm::vec3 min_tri(FLT_MAX), max_tri(-FLT_MAX);
     for (int i = 0; i < 3; ++i) {
         min_tri = glm::min(min_tri, tri_verts[i]);
         max_tri = glm::max(max_tri, tri_verts[i]);
@@ -198,7 +268,7 @@ __host__ __device__ inline bool AABBTriangleIntersect(AABB const& a, glm::vec3 c
  * @param outside            Output param for whether the ray came from outside.
  * @return                   Ray parameter `t` value. -1 if no intersection.
  */
-__host__ __device__ inline float boxIntersectionTest(Geom box, Ray r, ShadeableIntersection& inters) {
+__host__ __device__ inline float boxIntersectionTest(Geom const& box, Ray const& r, ShadeableIntersection& inters) {
     Ray q;
     q.origin = multiplyMV(box.inverseTransform, glm::vec4(r.origin, 1.0f));
     q.direction = glm::normalize(multiplyMV(box.inverseTransform, glm::vec4(r.direction, 0.0f)));
@@ -253,7 +323,7 @@ __host__ __device__ inline float boxIntersectionTest(Geom box, Ray r, ShadeableI
  * @param outside            Output param for whether the ray came from outside.
  * @return                   Ray parameter `t` value. -1 if no intersection.
  */
-__host__ __device__ inline float sphereIntersectionTest(Geom sphere, Ray r, ShadeableIntersection& inters) {
+__host__ __device__ inline float sphereIntersectionTest(Geom const& sphere, Ray const& r, ShadeableIntersection& inters) {
 #ifdef USE_GLM_RAY_SPHERE
     glm::vec3 ro = multiplyMV(sphere.inverseTransform, glm::vec4(r.origin, 1.0f));
     glm::vec3 rd = glm::normalize(multiplyMV(sphere.inverseTransform, glm::vec4(r.direction, 0.0f)));
@@ -314,7 +384,8 @@ __host__ __device__ inline float sphereIntersectionTest(Geom sphere, Ray r, Shad
 }
 
 // fills the ShadeableIntersection from triangle hit information
-__device__ inline float intersFromTriangle(
+// a resolve without textures (meshInfo.texs == nullptr) skips bump mapping & texture colors
+__host__ __device__ inline float intersFromTriangle(
     ShadeableIntersection& inters,
     Ray const& ray,
     float hit_t,
@@ -372,7 +443,7 @@ __device__ inline float intersFromTriangle(
 
     // record normal info
     // use bump mapping if applicable
-    if (mat_id != -1 && has_uv &&
+    if (meshInfo.texs && mat_id != -1 && has_uv &&
         materials[mat_id].textures.bump != -1) {
         glm::vec3 tans[3];
         glm::vec3 bitans[3];
@@ -412,7 +483,7 @@ __device__ inline float intersFromTriangle(
         inters.materialId = mat_id;
         // use texture color if applicable
         Material const& mat = materials[mat_id];
-        if (mat.textures.diffuse != -1) {
+        if (meshInfo.texs && mat.textures.diffuse != -1) {
             inters.tex_color = meshInfo.texs[mat.textures.diffuse].sample(uv);
         }
     }
@@ -428,7 +499,7 @@ __device__ inline float intersFromTriangle(
  * @param outside            Output param for whether the ray came from outside.
  * @return                   Ray parameter `t` value. -1 if no intersection.
  */
-__device__ inline float meshIntersectionTest(Geom mesh, Ray r, MeshInfo meshInfo, ShadeableIntersection& inters) {
+__host__ __device__ inline float meshIntersectionTest(Geom mesh, Ray r, MeshInfo meshInfo, ShadeableIntersection& inters) {
 
     glm::vec3 ro = multiplyMV(mesh.inverseTransform, glm::vec4(r.origin, 1.0f));
     glm::vec3 rd = glm::normalize(multiplyMV(mesh.inverseTransform, glm::vec4(r.direction, 0.0f)));
@@ -464,4 +535,313 @@ __device__ inline float meshIntersectionTest(Geom mesh, Ray r, MeshInfo meshInfo
         return -1;
     }
     return inters.t = intersFromTriangle(inters, r, t_min, meshInfo, mesh, tris[idx], glm::vec2(barycoord));
-}
\ No newline at end of file
+}
+
+/**
+ * Test intersection between a ray and one triangle of a transformed mesh,
+ * without computing any surface attributes.
+ *
+ * @param t                  Output param for the world space distance of the hit.
+ * @param barycoord          Output param for the barycentric coord of the hit.
+ * @return                   whether the triangle is hit.
+ */
+__host__ __device__ inline bool triangleHitTest(
+    Geom const& mesh,
+    Ray const& r,
+    Vertex const* verts,
+    Triangle const& tri,
+    float& t,
+    glm::vec2& barycoord)
+{
+    // the local direction is left unnormalized so that t stays in world units
+    glm::vec3 ro = multiplyMV(mesh.inverseTransform, glm::vec4(r.origin, 1.0f));
+    glm::vec3 rd = multiplyMV(mesh.inverseTransform, glm::vec4(r.direction, 0.0f));
+    glm::vec3 tmp_barycoord;
+
+    if (glm::intersectRayTriangle(ro, rd, verts[tri.verts[0]], verts[tri.verts[1]], verts[tri.verts[2]], tmp_barycoord)) {
+        t = tmp_barycoord.z;
+        barycoord = glm::vec2(tmp_barycoord);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Test intersection between a ray and a baked triangle, no transform or vertex gather needed.
+ * Same test as glm::intersectRayTriangle on the untransformed triangle, backfaces are culled like it does;
+ * the winding stored in e1.w corrects the sign of the determinant for mirrored transforms.
+ *
+ * @param r                  Ray in the space the triangle was baked in, its direction does not have to be normalized.
+ * @param t                  Output param for the distance of the hit, in units of the ray direction.
+ * @param barycoord          Output param for the barycentric coord of the hit.
+ * @return                   whether the triangle is hit.
+ */
+__host__ __device__ inline bool bakedTriangleHitTest(
+    BakedTriangle const& tri,
+    Ray const& r,
+    float& t,
+    glm::vec2& barycoord)
+{
+    glm::vec3 e1(tri.e1), e2(tri.e2);
+    glm::vec3 p = glm::cross(r.direction, e2);
+    // the object space determinant has the sign of the world space one times the winding of the transform
+    float a = glm::dot(e1, p);
+    if (a * tri.e1.w < FLT_EPSILON) {
+        return false;
+    }
+    float f = 1.0f / a;
+    glm::vec3 s = r.origin - glm::vec3(tri.v0);
+    float u = f * glm::dot(s, p);
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+    glm::vec3 q = glm::cross(s, e1);
+    float v = f * glm::dot(r.direction, q);
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+    t = f * glm::dot(e2, q);
+    barycoord = glm::vec2(u, v);
+    return t >= 0.0f;
+}
+
+/**
+ * Test intersection between a ray and a sphere or cube geom,
+ * without keeping any surface attributes.
+ *
+ * @return                   Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ inline float primitiveHitTest(Geom const& geom, Ray const& r) {
+    ShadeableIntersection tmp;
+    if (geom.type == CUBE) {
+        return boxIntersectionTest(geom, r, tmp);
+    } else if (geom.type == SPHERE) {
+        return sphereIntersectionTest(geom, r, tmp);
+    }
+    return -1;
+}
+
+/**
+ * Test intersection between a ray and the compact form of a sphere or cube geom.
+ * Only reads the part of the CompactPrim its type needs. Same hits as primitiveHitTest,
+ * including the pull back of getPointOnRay, except that a ray starting inside a cube misses it
+ * instead of hitting it at an infinite distance.
+ *
+ * @return                   Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ inline float compactHitTest(CompactPrim const& prim, Ray const& r) {
+    glm::vec3 ro = r.origin, rd = r.direction;
+    glm::vec3 lo(-PRIM_CUBE_EXTENT), hi(PRIM_CUBE_EXTENT);
+    float radius = PRIM_SPHERE_RADIUS;
+    glm::vec3 local_rd; // direction in the object space of the Geom, only for the pull back
+    switch (prim.type) {
+    case COMPACT_SPHERE:
+        ro -= glm::vec3(prim.rows[0]);
+        radius = prim.rows[0].w;
+        local_rd = rd * (PRIM_SPHERE_RADIUS / radius);
+        break;
+    case COMPACT_AXIS_BOX:
+        lo = glm::vec3(prim.rows[0]);
+        hi = glm::vec3(prim.rows[1]);
+        local_rd = rd * (2 * PRIM_CUBE_EXTENT) / (hi - lo);
+        break;
+    case COMPACT_AFFINE_SPHERE:
+    case COMPACT_AFFINE_BOX:
+        // the object space direction is left unnormalized so that t stays in world units
+        for (int i = 0; i < 3; ++i) {
+            ro[i] = glm::dot(prim.rows[i], glm::vec4(r.origin, 1.0f));
+            rd[i] = glm::dot(prim.rows[i], glm::vec4(r.direction, 0.0f));
+        }
+        local_rd = rd;
+        break;
+    default:
+        return -1;
+    }
+
+    float t;
+    if (prim.type == COMPACT_AXIS_BOX || prim.type == COMPACT_AFFINE_BOX) {
+        glm::vec3 t1 = (lo - ro) / rd;
+        glm::vec3 t2 = (hi - ro) / rd;
+        glm::vec3 ta = glm::min(t1, t2), tb = glm::max(t1, t2);
+        float t_near = glm::max(glm::max(ta.x, ta.y), ta.z);
+        float t_far = glm::min(glm::min(tb.x, tb.y), tb.z);
+        if (t_far < t_near || t_near <= 0) {
+            return -1;
+        }
+        t = t_near;
+    } else {
+        // the nearer root, or the farther one if the ray starts inside
+        float a = glm::dot(rd, rd);
+        float b = glm::dot(ro, rd);
+        float radicand = b * b - a * (glm::dot(ro, ro) - radius * radius);
+        if (radicand < 0) {
+            return -1;
+        }
+        float root = sqrt(radicand);
+        float t_near = (-b - root) / a, t_far = (-b + root) / a;
+        if (t_far <= 0) {
+            return -1;
+        }
+        t = t_near > 0 ? t_near : t_far;
+    }
+    // getPointOnRay backs off 0.0001 along the normalized object space direction
+    return t - .0001f * glm::length(r.direction) / glm::length(local_rd);
+}
+
+/**
+ * Test intersection between a ray and a primitive stored in an acceleration structure leaf,
+ * i.e. a triangle of a mesh geom or a whole sphere / cube geom if triangle_id is -1.
+ *
+ * @param baked              Optional world space triangle of this reference, skips the transform & vertex gather.
+ * @param hit                In: the closest hit so far. Out: updated if this primitive is closer.
+ * @return                   whether the hit was updated.
+ */
+__host__ __device__ inline bool leafHitTest(
+    leaf_data const& prim,
+    Geom const* geoms,
+    CompactPrim const* compact,
+    Triangle const* tris,
+    Vertex const* verts,
+    Ray const& r,
+    HitInfo& hit,
+    BakedTriangle const* baked = nullptr)
+{
+    float t;
+    glm::vec2 bary(0);
+    if (prim.triangle_id == -1) {
+        t = compactHitTest(compact[prim.geom_id], r);
+        if (t <= 0) {
+            return false;
+        }
+    } else if (baked) {
+        if (!bakedTriangleHitTest(*baked, r, t, bary)) {
+            return false;
+        }
+    } else if (!triangleHitTest(geoms[prim.geom_id], r, verts, tris[prim.triangle_id], t, bary)) {
+        return false;
+    }
+    if (t >= hit.t) {
+        return false;
+    }
+
+    hit.t = t;
+    hit.geom_id = prim.geom_id;
+    hit.triangle_id = prim.triangle_id;
+    hit.bary = bary;
+    return true;
+}
+
+/**
+ * Find the closest hit by testing every primitive of the scene.
+ *
+ * @param hit                In: the closest hit so far. Out: the closest hit.
+ * @return                   whether the hit was updated.
+ */
+__host__ __device__ inline bool sceneHitTest(
+    Geom const* geoms,
+    CompactPrim const* compact,
+    int num_geoms,
+    Mesh const* meshes,
+    Triangle const* tris,
+    Vertex const* verts,
+    Ray const& r,
+    HitInfo& hit)
+{
+    bool any_hit = false;
+    for (int i = 0; i < num_geoms; ++i) {
+        // the compact test is about as cheap as the bounds test, and does not touch the Geom
+        if (compact[i].type != COMPACT_NONE) {
+            any_hit |= leafHitTest(leaf_data(-1, i), geoms, compact, tris, verts, r, hit);
+            continue;
+        }
+        Geom const& geom = geoms[i];
+#ifdef AABB_CULLING
+        if (!AABBRayIntersect(geom.bounds, r, nullptr)) {
+            continue;
+        }
+#endif // AABB_CULLING
+
+        // transform the ray once per mesh, the local direction is left unnormalized so that t stays in world units
+        glm::vec3 ro = multiplyMV(geom.inverseTransform, glm::vec4(r.origin, 1.0f));
+        glm::vec3 rd = multiplyMV(geom.inverseTransform, glm::vec4(r.direction, 0.0f));
+        for (int j = meshes[geom.meshid].tri_start; j < meshes[geom.meshid].tri_end; ++j) {
+            glm::vec3 barycoord;
+            if (glm::intersectRayTriangle(ro, rd, verts[tris[j].verts[0]], verts[tris[j].verts[1]], verts[tris[j].verts[2]], barycoord)
+                && barycoord.z < hit.t) {
+                hit.t = barycoord.z;
+                hit.geom_id = i;
+                hit.triangle_id = j;
+                hit.bary = glm::vec2(barycoord);
+                any_hit = true;
+            }
+        }
+    }
+    return any_hit;
+}
+
+/**
+ * Visibility test by testing the primitives of the scene until the first hit before tmax.
+ *
+ * @param tmax               Distance along the ray past which hits are ignored, e.g. the distance to a light.
+ * @return                   whether anything is hit before tmax.
+ */
+__host__ __device__ inline bool sceneOcclusionTest(
+    Geom const* geoms,
+    CompactPrim const* compact,
+    int num_geoms,
+    Mesh const* meshes,
+    Triangle const* tris,
+    Vertex const* verts,
+    Ray const& r,
+    float tmax)
+{
+    for (int i = 0; i < num_geoms; ++i) {
+        if (compact[i].type != COMPACT_NONE) {
+            float t = compactHitTest(compact[i], r);
+            if (t > 0 && t < tmax) {
+                return true;
+            }
+            continue;
+        }
+        Geom const& geom = geoms[i];
+#ifdef AABB_CULLING
+        if (!AABBRayIntersect(geom.bounds, r, nullptr)) {
+            continue;
+        }
+#endif // AABB_CULLING
+
+        glm::vec3 ro = multiplyMV(geom.inverseTransform, glm::vec4(r.origin, 1.0f));
+        glm::vec3 rd = multiplyMV(geom.inverseTransform, glm::vec4(r.direction, 0.0f));
+        for (int j = meshes[geom.meshid].tri_start; j < meshes[geom.meshid].tri_end; ++j) {
+            glm::vec3 barycoord;
+            if (glm::intersectRayTriangle(ro, rd, verts[tris[j].verts[0]], verts[tris[j].verts[1]], verts[tris[j].verts[2]], barycoord)
+                && barycoord.z < tmax) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// fills the ShadeableIntersection from the closest hit found by a traversal
+// this is the only place surface attributes are computed, once per path
+__host__ __device__ inline float intersFromHit(
+    ShadeableIntersection& inters,
+    Ray const& ray,
+    HitInfo const& hit,
+    MeshInfo const& meshInfo,
+    Geom const* geoms)
+{
+    Geom const& geom = geoms[hit.geom_id];
+    if (hit.triangle_id == -1) {
+        if (geom.type == CUBE) {
+            return boxIntersectionTest(geom, ray, inters);
+        } else {
+            return sphereIntersectionTest(geom, ray, inters);
+        }
+    }
+
+    // intersFromTriangle works with a normalized local ray
+    float local_t = hit.t * glm::length(multiplyMV(geom.inverseTransform, glm::vec4(ray.direction, 0.0f)));
+    return intersFromTriangle(inters, ray, local_t, meshInfo, geom, meshInfo.tris[hit.triangle_id], hit.bary);
+}
@@ -43,6 +43,13 @@ int main(int argc, char** argv) {
 
 	height = width = 800;
 
+	// --cpu renders with the host backend, e.g. on machines without a CUDA device
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--cpu")) {
+			PathTracer::setBackend(HOST_BACKEND);
+		}
+	}
+
 	// Initialize ImGui Data
 	Preview::InitImguiData();
 	// Initialize CUDA and GL components
@@ -54,7 +61,7 @@ int main(int argc, char** argv) {
 	// GL bufs
 	Preview::initBufs();
 
-	PathTracer::unitTest();
+	PathTracer::unitTest(*g_scene);
 
 	// GLFW main loop
 	Preview::mainLoop();
@@ -142,6 +149,10 @@ bool switchScene(char const* path, bool force) {
 
 
 
+void restartRender() {
+	camchanged = true;
+}
+
 void runCuda() {
 	PathTracer::beginFrame(pbo);
 
@@ -172,7 +183,9 @@ void runCuda() {
 		PathTracer::endFrame();
 		ImageUtils::SaveImage(g_renderState);
 		PathTracer::pathtraceFree(nullptr);
-		cudaDeviceReset();
+		if (PathTracer::getBackend() == CUDA_BACKEND) {
+			cudaDeviceReset();
+		}
 		exit(EXIT_SUCCESS);
 	}
 }
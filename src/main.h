@@ -34,6 +34,8 @@ extern int g_iteration;
 
 bool switchScene(Scene* scene, int start_iter, bool from_save, bool force);
 bool switchScene(char const* path, bool force = false);
+// clears the accumulated image, e.g. after the scene was edited in place
+void restartRender();
 void runCuda();
 void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
 void mousePositionCallback(GLFWwindow* window, double xpos, double ypos);
@@ -4,14 +4,21 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/norm.hpp>
 
+// HEADLESS builds have no GL context, frames are only read back into the render state
+#ifndef HEADLESS
 #include <GL/glew.h>
 #include <cuda_gl_interop.h>
+#endif // HEADLESS
 
 #include <cmath>
 #include <thrust/execution_policy.h>
 #include <thrust/device_ptr.h>
 #include <thrust/partition.h>
 #include <thrust/remove.h>
+#include <thrust/copy.h>
+#include <thrust/gather.h>
+#include <thrust/iterator/transform_iterator.h>
+#include <thrust/iterator/zip_iterator.h>
 
 #include <thrust/random.h>
 #include <thrust/transform.h>
@@ -24,12 +31,21 @@
 #include "pathtrace.h"
 #include "intersections.cuh"
 #include "interactions.h"
+#include "shadeQueues.h"
 #include "rendersave.h"
 #include "Collision/AABB.h"
 #include "Octree/octree.h"
+#include "BVH/bvh.h"
+#include "BVH/tlas.h"
+#include "BVH/lbvh.h"
+#include "KDTree/kdtree.h"
 #include "consts.h"
 #include "Denoise/denoise.cuh"
 #include "Profile/pathtracer_profile.h"
+#include "Profile/accel_profile.h"
+#include "Cache/accel_cache.h"
+#include "hostPathtrace.h"
+#include "ColorConsole/color.hpp"
 
 void checkCUDAErrorFn(const char* msg, const char* file, int line) {
 #ifndef NDEBUG
@@ -51,35 +67,215 @@ void checkCUDAErrorFn(const char* msg, const char* file, int line) {
 #endif
 }
 
-__host__ __device__
-thrust::default_random_engine makeSeededRandomEngine(int iter, int index, int depth) {
-	int h = utilhash((1 << 31) | (depth << 22) | iter) ^ utilhash(index);
-	return thrust::default_random_engine(h);
-}
+void PathTracer::unitTest(Scene const& scene) {
+#ifdef UNIT_TEST
+	Profiling::AccelReport reports[] = {
+		Profiling::ProfileBVH(scene, 4096),
+		Profiling::ProfileTLAS(scene, 4096),
+		Profiling::ProfileOctree(scene, 4096, true),
+		Profiling::ProfileKDTree(scene, 4096),
+	};
+	for (Profiling::AccelReport const& report : reports) {
+		std::cout << report.to_string() << std::endl;
+		if (report.mismatches) {
+			std::cerr << dye::red(report.name + " traversal disagrees with brute force") << std::endl;
+		} else {
+			std::cout << dye::green(report.name + " traversal matches brute force") << std::endl;
+		}
+	}
+
+	for (Profiling::WideBVHReport const& report : Profiling::ProfileWideBVH(scene, 4096)) {
+		std::cout << report.to_string() << std::endl;
+		if (report.mismatches) {
+			std::cerr << dye::red(report.name + " hits differ from the binary BVH") << std::endl;
+		}
+	}
+
+	Profiling::LBVHReport lbvh_report = Profiling::ProfileLBVH(scene, 4096);
+	std::cout << lbvh_report.to_string() << std::endl;
+	if (lbvh_report.lbvh.mismatches) {
+		std::cerr << dye::red("LBVH traversal disagrees with brute force") << std::endl;
+	}
+
+	Profiling::SpatialSplitReport sbvh_report = Profiling::ProfileSBVH(scene, SpatialSplitSettings(), 4096);
+	std::cout << sbvh_report.to_string() << std::endl;
+	if (sbvh_report.sbvh.mismatches) {
+		std::cerr << dye::red("SBVH traversal disagrees with brute force") << std::endl;
+	}
+
+	for (Profiling::MailboxReport const& report : Profiling::ProfileMailbox(scene, 4096)) {
+		std::cout << report.to_string() << std::endl;
+		if (report.mismatches) {
+			std::cerr << dye::red(report.name + " traversal with mailboxing disagrees with brute force") << std::endl;
+		}
+	}
 
-void PathTracer::unitTest() {  }
+	for (Profiling::OcclusionReport const& report : Profiling::ProfileOcclusion(scene, 4096)) {
+		std::cout << report.to_string() << std::endl;
+		if (report.mismatches) {
+			std::cerr << dye::red(report.name + " occlusion disagrees with its closest hit") << std::endl;
+		}
+	}
+
+	Profiling::ResolveReport resolve_report = Profiling::ProfileResolve(scene, 4096);
+	std::cout << resolve_report.to_string() << std::endl;
+	if (resolve_report.mismatches) {
+		std::cerr << dye::red("resolved hit attributes differ from the per-geom intersection tests") << std::endl;
+	}
+
+	Profiling::PrimitiveReport primitive_report = Profiling::ProfilePrimitives(scene, 4096);
+	std::cout << primitive_report.to_string() << std::endl;
+	if (primitive_report.mismatches) {
+		std::cerr << dye::red("compact primitive tests differ from the Geom tests") << std::endl;
+	}
+
+	Profiling::SlabReport slab_report = Profiling::ProfileSlabs(scene, 256);
+	std::cout << slab_report.to_string() << std::endl;
+	if (slab_report.mismatches) {
+		std::cerr << dye::red("slab tests with the traversal ray differ from AABBRayRange") << std::endl;
+	}
+
+	Profiling::TriangleReport triangle_report = Profiling::ProfileBakedTriangles(scene, 256);
+	std::cout << triangle_report.to_string() << std::endl;
+	if (triangle_report.mismatches) {
+		std::cerr << dye::red("baked triangle tests differ from the original tests") << std::endl;
+	}
+
+	Profiling::BuildReport build_report = Profiling::ProfileOctreeBuild(scene, scene.octree_settings.max_depth);
+	std::cout << build_report.to_string() << std::endl;
+	if (!build_report.matches) {
+		std::cerr << dye::red("octree build differs from the reference build") << std::endl;
+	}
+
+	Profiling::PathLayoutReport layout_report = Profiling::ProfilePathLayouts(scene, 1 << 16, 8);
+	std::cout << layout_report.to_string() << std::endl;
+	if (layout_report.mismatches) {
+		std::cerr << dye::red("SoA path buffers differ from the AoS buffers") << std::endl;
+	}
+
+	for (Profiling::MaterialSortReport const& report : Profiling::ProfileMaterialSort(scene, 1 << 16, 8)) {
+		std::cout << report.to_string() << std::endl;
+		if (report.mismatches) {
+			std::cerr << dye::red("paths shaded through the material keys differ from the gathered paths") << std::endl;
+		}
+	}
 
+	Profiling::ShadeQueueReport queue_report = Profiling::ProfileShadeQueues(scene, 1 << 16, 8);
+	std::cout << queue_report.to_string() << std::endl;
+	if (queue_report.mismatches) {
+		std::cerr << dye::red("wavefront shading differs from shadeSegment") << std::endl;
+	}
+#endif // UNIT_TEST
+}
+
+static RenderBackend backend = CUDA_BACKEND;
 static RenderState* renderState = nullptr;
 static Scene* hst_scene = nullptr;
 static std::string cur_scene = "";
 
 static Span<glm::vec3>             dev_image;
 static Span<Geom>                  dev_geoms;
-static Span<PathSegment>           dev_paths;
-static Span<ShadeableIntersection> dev_intersections;
+static PathSegmentSoA              dev_paths;
+static ShadeableIntersectionSoA    dev_intersections;
+// closest hit of each path, written by the traversal and resolved into dev_intersections
+static Span<HitInfo> dev_hits;
+// compaction & the material sort write the reordered paths here, then the two buffers are swapped
+static PathSegmentSoA dev_paths_back;
+#ifdef SORT_MAT
+#ifndef SORT_MAT_PERMUTE
+static ShadeableIntersectionSoA dev_intersections_back;
+#endif // SORT_MAT_PERMUTE
+// packed (material id, path slot) keys, see MaterialSortKey
+static Span<uint64_t> dev_mat_keys;
+#endif // SORT_MAT
+#ifdef WAVEFRONT_SHADE
+// counts, offsets & heads of the shading queues, NUM_SHADE_QUEUES each, then the queued path slots
+static Span<int> dev_queue_data;
+static Span<int> dev_queue_slots;
+static ShadeQueues dev_queues;
+// host copy of the counts & offsets, the launches of the queue kernels are sized from it
+static int hst_queue_data[3 * NUM_SHADE_QUEUES];
+static ShadeQueues hst_queues;
+#endif // WAVEFRONT_SHADE
 
 // static variables for device memory, any extra info you need, etc
 // ...
-static Span<ShadeableIntersection> dev_cached_intersections;
+static ShadeableIntersectionSoA dev_cached_intersections;
 static Span<Light> dev_lights;
 static MeshInfo dev_mesh_info;
 
 static std::vector<TextureGPU> dev_texs;
 
+static PathSegmentSoA makePathSegments(int n) {
+	PathSegmentSoA ret;
+	ret.origin = make_span<glm::vec3>(n);
+	ret.direction = make_span<glm::vec3>(n);
+	ret.color = make_span<color_t>(n);
+	ret.pixelIndex = make_span<int>(n);
+	ret.remainingBounces = make_span<int>(n);
+	ret.count = n;
+	return ret;
+}
+static void freePathSegments(PathSegmentSoA& paths) {
+	FREE(paths.origin);
+	FREE(paths.direction);
+	FREE(paths.color);
+	FREE(paths.pixelIndex);
+	FREE(paths.remainingBounces);
+	paths = PathSegmentSoA();
+}
+static ShadeableIntersectionSoA makeIntersections(int n) {
+	ShadeableIntersectionSoA ret;
+	ret.t = make_span<float>(n);
+	ret.surfaceNormal = make_span<glm::vec3>(n);
+	ret.hitPoint = make_span<glm::vec3>(n);
+	ret.materialId = make_span<int>(n);
+	ret.uv = make_span<glm::vec2>(n);
+	ret.tex_color = make_span<color_t>(n);
+	ret.count = n;
+	return ret;
+}
+static void freeIntersections(ShadeableIntersectionSoA& inters) {
+	FREE(inters.t);
+	FREE(inters.surfaceNormal);
+	FREE(inters.hitPoint);
+	FREE(inters.materialId);
+	FREE(inters.uv);
+	FREE(inters.tex_color);
+	inters = ShadeableIntersectionSoA();
+}
+
+// iterators over whole records of the SoA buffers, for the thrust passes that move every field
+typedef thrust::zip_iterator<thrust::tuple<glm::vec3*, glm::vec3*, color_t*, int*, int*>> PathSegmentIterator;
+typedef thrust::zip_iterator<thrust::tuple<float*, glm::vec3*, glm::vec3*, int*, glm::vec2*, color_t*>> IntersectionIterator;
+static PathSegmentIterator pathIterator(PathSegmentSoA const& paths) {
+	return thrust::make_zip_iterator(thrust::make_tuple(
+		paths.origin, paths.direction, paths.color, paths.pixelIndex, paths.remainingBounces));
+}
+static IntersectionIterator intersIterator(ShadeableIntersectionSoA const& inters) {
+	return thrust::make_zip_iterator(thrust::make_tuple(
+		inters.t, inters.surfaceNormal, inters.hitPoint, inters.materialId, inters.uv, inters.tex_color));
+}
+
 static std::unique_ptr<octree> tree;
 static std::unique_ptr<octreeGPU> dev_tree;
-
-static GLuint s_pbo_id = 0;
+static octreeGPU const null_tree;
+static std::unique_ptr<bvh> hst_bvh;
+static bvhGPU dev_bvh;
+static std::unique_ptr<bvh> hst_sbvh;
+static bvhGPU dev_sbvh;
+static std::unique_ptr<tlas> hst_tlas;
+static tlasGPU dev_tlas;
+static std::unique_ptr<kdtree> hst_kdtree;
+static kdtreeGPU dev_kdtree;
+static AccelType accel_type = OCTREE;
+static Span<TraversalCounters> dev_trav_counters;
+static bool sort_rays = false;
+// sort keys of the rays of a bounce, only allocated while ray sorting is on
+static Span<uint64_t> dev_ray_keys;
+static TraversalCounters hst_trav_counters;
+
+static unsigned int s_pbo_id = 0;
 static uchar4* s_pbo_dptr = nullptr;
 
 // pathtracer state
@@ -99,18 +295,133 @@ std::unordered_map<std::string, Profiling::ProfileData>&
 PathTracer::GetProfileData() {
 	return s_prof_data;
 }
+TraversalCounters const& PathTracer::GetTraversalCounters() {
+	if (backend == HOST_BACKEND) {
+		return HostPathTracer::GetTraversalCounters();
+	}
+	return hst_trav_counters;
+}
+
+void PathTracer::setBackend(RenderBackend type) {
+	backend = type;
+}
+RenderBackend PathTracer::getBackend() {
+	return backend;
+}
 
 void PathTracer::beginFrame(unsigned int pbo_id) {
+#ifndef HEADLESS
 	s_pbo_id = pbo_id;
+	if (backend == HOST_BACKEND) {
+		return;
+	}
 	CHECK_CUDA(cudaGLMapBufferObject((void**)&s_pbo_dptr, s_pbo_id));
+#endif // HEADLESS
 }
 
 void PathTracer::endFrame() {
+#ifndef HEADLESS
+	if (backend == HOST_BACKEND) {
+		// the PBO is not registered with CUDA, the host pixels are uploaded through GL
+		std::vector<uchar4> const& pixels = HostPathTracer::getPixels();
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s_pbo_id);
+		glBufferSubData(GL_PIXEL_UNPACK_BUFFER, 0, pixels.size() * sizeof(uchar4), pixels.data());
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return;
+	}
 	CHECK_CUDA(cudaGLUnmapBufferObject(s_pbo_id));
+#endif // HEADLESS
+}
+
+// builds the selected acceleration structure for the current scene, if it's not built yet
+static void buildAccel() {
+#ifdef OCTREE_CULLING
+	if (accel_type == OCTREE && !dev_tree) {
+		tree = loadOrBuild<octree>(AccelCache::octreeKey(*hst_scene, hst_scene->octree_settings), OCTREE, []() {
+			return std::make_unique<octree>(*hst_scene, hst_scene->world_AABB, hst_scene->octree_settings);
+		});
+#ifdef BAKED_TRIANGLES
+		dev_tree = std::make_unique<octreeGPU>(*tree, dev_mesh_info, dev_geoms, hst_scene->bakeTriangles(tree->leaves()));
+#else
+		dev_tree = std::make_unique<octreeGPU>(*tree, dev_mesh_info, dev_geoms);
+#endif // BAKED_TRIANGLES
+	} else if (accel_type == BVH && !hst_bvh) {
+		hst_bvh = loadOrBuild<bvh>(AccelCache::bvhKey(*hst_scene), BVH, []() {
+			// the SAH build takes seconds on millions of triangles
+			if (bvh::num_world_prims(*hst_scene) >= LBVH_MIN_PRIMS) {
+				std::cout << "using the linear BVH builder for " << bvh::num_world_prims(*hst_scene) << " primitives" << std::endl;
+				return buildLBVH(*hst_scene);
+			}
+			return std::make_unique<bvh>(*hst_scene);
+		});
+#ifdef BAKED_TRIANGLES
+		dev_bvh = bvhGPU(*hst_bvh, dev_mesh_info, dev_geoms, hst_scene->bakeTriangles(hst_bvh->prims()));
+#else
+		dev_bvh = bvhGPU(*hst_bvh, dev_mesh_info, dev_geoms);
+#endif // BAKED_TRIANGLES
+	} else if (accel_type == SBVH && !hst_sbvh) {
+		hst_sbvh = loadOrBuild<bvh>(AccelCache::sbvhKey(*hst_scene, SpatialSplitSettings()), SBVH, []() {
+			std::unique_ptr<bvh> ret = std::make_unique<bvh>(*hst_scene, SpatialSplitSettings());
+			size_t num_prims = bvh::num_world_prims(*hst_scene);
+			std::cout << "SBVH: " << ret->spatial_splits() << " spatial splits, "
+				<< ret->num_prims() - num_prims << " extra references for " << num_prims << " primitives" << std::endl;
+			return ret;
+		});
+#ifdef BAKED_TRIANGLES
+		dev_sbvh = bvhGPU(*hst_sbvh, dev_mesh_info, dev_geoms, hst_scene->bakeTriangles(hst_sbvh->prims()));
+#else
+		dev_sbvh = bvhGPU(*hst_sbvh, dev_mesh_info, dev_geoms);
+#endif // BAKED_TRIANGLES
+	} else if (accel_type == TWO_LEVEL && !hst_tlas) {
+		hst_tlas = std::make_unique<tlas>(*hst_scene);
+#ifdef BAKED_TRIANGLES
+		dev_tlas = tlasGPU(*hst_tlas, dev_mesh_info, dev_geoms, hst_scene->bakeTriangles(hst_tlas->blas_prims()));
+#else
+		dev_tlas = tlasGPU(*hst_tlas, dev_mesh_info, dev_geoms);
+#endif // BAKED_TRIANGLES
+	} else if (accel_type == KDTREE && !hst_kdtree) {
+		hst_kdtree = loadOrBuild<kdtree>(AccelCache::kdtreeKey(*hst_scene), KDTREE, []() {
+			return std::make_unique<kdtree>(*hst_scene);
+		});
+#ifdef BAKED_TRIANGLES
+		dev_kdtree = kdtreeGPU(*hst_kdtree, dev_mesh_info, dev_geoms, hst_scene->bakeTriangles(hst_kdtree->prims()));
+#else
+		dev_kdtree = kdtreeGPU(*hst_kdtree, dev_mesh_info, dev_geoms);
+#endif // BAKED_TRIANGLES
+	}
+#endif // OCTREE_CULLING
+}
+
+static void freeAccel() {
+	dev_tree.reset();
+	tree.reset();
+	if (hst_bvh) {
+		dev_bvh.free();
+		hst_bvh.reset();
+	}
+	if (hst_sbvh) {
+		dev_sbvh.free();
+		hst_sbvh.reset();
+	}
+	if (hst_tlas) {
+		dev_tlas.free();
+		hst_tlas.reset();
+	}
+	if (hst_kdtree) {
+		dev_kdtree.free();
+		hst_kdtree.reset();
+	}
 }
 
 void PathTracer::pathtraceInit(Scene* scene, RenderState* state, bool force_change) {
 	if (!scene) throw;
+	if (backend == HOST_BACKEND) {
+		// kept for saveRenderState
+		hst_scene = scene;
+		renderState = state;
+		HostPathTracer::pathtraceInit(scene, state, force_change);
+		return;
+	}
 	bool scene_changed = force_change || cur_scene != scene->filename;
 	hst_scene = scene;
 	cur_scene = scene->filename;
@@ -120,13 +431,32 @@ void PathTracer::pathtraceInit(Scene* scene, RenderState* state, bool force_chan
 	const int pixelcount = cam.resolution.x * cam.resolution.y;
 
 	dev_image = make_span(state->image);
-	dev_paths = make_span<PathSegment>(pixelcount);
-	dev_intersections = make_span<ShadeableIntersection>(pixelcount);
+	dev_paths = makePathSegments(pixelcount);
+	dev_intersections = makeIntersections(pixelcount);
+	dev_hits = make_span<HitInfo>(pixelcount);
 #ifdef CACHE_FIRST_BOUNCE
-	dev_cached_intersections = make_span<ShadeableIntersection>(pixelcount);
+	dev_cached_intersections = makeIntersections(pixelcount);
 #endif // CACHE_FIRST_BOUNCE
+#if defined(COMPACTION) || defined(SORT_MAT)
+	dev_paths_back = makePathSegments(pixelcount);
+#endif // COMPACTION || SORT_MAT
+#ifdef SORT_MAT
+#ifndef SORT_MAT_PERMUTE
+	dev_intersections_back = makeIntersections(pixelcount);
+#endif // SORT_MAT_PERMUTE
+	dev_mat_keys = make_span<uint64_t>(pixelcount);
+#endif // SORT_MAT
+#ifdef WAVEFRONT_SHADE
+	dev_queue_data = make_span<int>(3 * NUM_SHADE_QUEUES);
+	dev_queue_slots = make_span<int>(pixelcount);
+	dev_queues.bind(dev_queue_data.get(), dev_queue_slots.get());
+	hst_queues.bind(hst_queue_data, nullptr);
+#endif // WAVEFRONT_SHADE
 
 	denoise_image = make_span(state->image);
+#ifdef TRAVERSAL_STATS
+	dev_trav_counters = make_span<TraversalCounters>(1);
+#endif // TRAVERSAL_STATS
 
 	if (scene_changed) {
 		denoise_buffers.init(cam.resolution.x, cam.resolution.y);
@@ -140,32 +470,51 @@ void PathTracer::pathtraceInit(Scene* scene, RenderState* state, bool force_chan
 		dev_mesh_info.meshes = make_span(scene->meshes);
 		dev_mesh_info.tangents = make_span(scene->tangents);
 		dev_mesh_info.materials = make_span(scene->materials);
+		dev_mesh_info.compact_prims = make_span(scene->compact_prims);
 
 		for (Texture const& hst_tex : scene->textures) {
 			TextureGPU dev_tex(hst_tex);
 			dev_texs.push_back(dev_tex);
 		}
 		dev_mesh_info.texs = make_span(dev_texs);
-#ifdef OCTREE_CULLING
-		tree = std::make_unique<octree>(*scene, scene->world_AABB, OCTREE_DEPTH);
-		dev_tree = std::make_unique<octreeGPU>(*tree, dev_mesh_info, dev_geoms);
-#endif // OCTREE_CULLING
+		buildAccel();
 	}
     checkCUDAError("pathtraceInit");
 }
 
 void PathTracer::pathtraceFree(Scene* scene, bool force_change) {
+	if (backend == HOST_BACKEND) {
+		HostPathTracer::pathtraceFree(scene, force_change);
+		return;
+	}
 	bool scene_changed = force_change || !scene || cur_scene != scene->filename;
 
 	FREE(dev_image);
-	FREE(dev_paths);
-	FREE(dev_intersections);
+	freePathSegments(dev_paths);
+	freeIntersections(dev_intersections);
+	FREE(dev_hits);
 #ifdef CACHE_FIRST_BOUNCE
-	FREE(dev_cached_intersections);
+	freeIntersections(dev_cached_intersections);
 #endif // CACHE_FIRST_BOUNCE
+	freePathSegments(dev_paths_back);
+#ifdef SORT_MAT
+#ifndef SORT_MAT_PERMUTE
+	freeIntersections(dev_intersections_back);
+#endif // SORT_MAT_PERMUTE
+	FREE(dev_mat_keys);
+#endif // SORT_MAT
+#ifdef WAVEFRONT_SHADE
+	FREE(dev_queue_data);
+	FREE(dev_queue_slots);
+	dev_queues = ShadeQueues();
+#endif // WAVEFRONT_SHADE
 	FREE(denoise_image);
+	FREE(dev_trav_counters);
+	FREE(dev_ray_keys);
+	dev_ray_keys = Span<uint64_t>();
 
 	if (scene_changed) {
+		freeAccel();
 		denoise_buffers.free();
 
 		FREE(dev_geoms);
@@ -177,6 +526,7 @@ void PathTracer::pathtraceFree(Scene* scene, bool force_change) {
 		FREE(dev_mesh_info.meshes);
 		FREE(dev_mesh_info.tangents);
 		FREE(dev_mesh_info.materials);
+		FREE(dev_mesh_info.compact_prims);
 		for (TextureGPU& tex : dev_texs) {
 			tex.free();
 		}
@@ -194,144 +544,178 @@ void PathTracer::pathtraceFree(Scene* scene, bool force_change) {
 * motion blur - jitter rays "in time"
 * lens effect - jitter ray origin positions based on a lens
 */
-__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegment* pathSegments)
+__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegmentSoA pathSegments)
 {
 	int x = (blockIdx.x * blockDim.x) + threadIdx.x;
 	int y = (blockIdx.y * blockDim.y) + threadIdx.y;
 
 	if (x < cam.resolution.x && y < cam.resolution.y) {
 		int index = x + (y * cam.resolution.x);
-		Ray cam_ray;
-		cam_ray.origin = cam.position;
-
-#ifdef ANTI_ALIAS_JITTER
-		// randomly jitter the ray
-		thrust::default_random_engine rng = makeSeededRandomEngine(iter, index, traceDepth);
-		thrust::uniform_real_distribution<float> udist(-0.5f, 0.5f);
-		x += udist(rng);
-		y += udist(rng);
-#endif // ANTI_ALIAS
-
-		cam_ray.direction = glm::normalize(cam.view
-			- cam.right * cam.pixelLength.x * ((float)x - (float)cam.resolution.x * 0.5f)
-			- cam.up * cam.pixelLength.y * ((float)y - (float)cam.resolution.y * 0.5f)
-		);
+		PathSegment segment;
+		segment.init(traceDepth, index, cameraRay(cam, iter, traceDepth, x, y));
+		pathSegments.store(index, segment);
+	}
+}
 
-		pathSegments[index].init(traceDepth, index, cam_ray);
+// sort key of a ray: its quantized direction, then the Morton code of its origin in the scene bounds
+// rays that are close in both end up next to each other and traverse the same nodes
+__global__ void computeRayKeys(
+	PathSegmentSoA paths,
+	glm::vec3 world_min,
+	glm::vec3 inv_extent,
+	uint64_t* keys)
+{
+	int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+	if (path_index >= paths.size()) {
+		return;
 	}
+	Ray const ray = paths.ray(path_index);
+	float dir_res = (float)(1 << RAY_SORT_DIR_BITS);
+	glm::uvec3 dir = glm::uvec3(glm::clamp((ray.direction * 0.5f + 0.5f) * dir_res, glm::vec3(0), glm::vec3(dir_res - 1)));
+	uint64_t dir_code = (LBVH::expandBits(dir.x) << 2) | (LBVH::expandBits(dir.y) << 1) | LBVH::expandBits(dir.z);
+	keys[path_index] = (dir_code << 30) | LBVH::mortonCode((ray.origin - world_min) * inv_extent);
+}
+
+// visibility test for shadow & ambient occlusion rays, through the same structure computeIntersections uses
+// used by the ambient occlusion debug texture
+__device__ bool traceOcclusion(
+	Ray const& ray,
+	float tmax,
+	Span<Geom> geoms,
+	MeshInfo meshInfo,
+	AccelType accel_type,
+	octreeGPU const& octree,
+	bvhGPU const& bvh,
+	tlasGPU const& tlas,
+	kdtreeGPU const& kdtree)
+{
+#ifdef OCTREE_CULLING
+	if (accel_type == BVH || accel_type == SBVH) {
+		return bvh.occluded(ray, tmax);
+	} else if (accel_type == TWO_LEVEL) {
+		return tlas.occluded(ray, tmax);
+	} else if (accel_type == KDTREE) {
+		return kdtree.occluded(ray, tmax);
+	}
+	return octree.occluded(ray, tmax);
+#else
+	return sceneOcclusionTest(geoms, meshInfo.compact_prims, geoms.size(), meshInfo.meshes, meshInfo.tris, meshInfo.vertices, ray, tmax);
+#endif // OCTREE_CULLING
 }
 
 // computeIntersections handles generating ray intersections ONLY.
 // Generating new rays is handled in your shader(s).
-// Feel free to modify the code below.
+// only the closest hit is recorded, resolveIntersections computes its surface attributes
 __global__ void computeIntersections(
 	int offset,
-	Span<PathSegment> paths,
+	PathSegmentSoA paths,
 	Span<Geom> geoms,
-	ShadeableIntersection* intersections,
+	HitInfo* hits,
 	MeshInfo meshInfo,
-	ShadeableIntersection* cache_intersections,
-	octreeGPU octree)
+	AccelType accel_type,
+	octreeGPU octree,
+	bvhGPU bvh,
+	tlasGPU tlas,
+	kdtreeGPU kdtree,
+	TraversalCounters* counters)
 {
 	int path_index = offset + blockIdx.x * blockDim.x + threadIdx.x;
 	if (path_index >= paths.size()) {
 		return;
 	}
-	PathSegment path = paths[path_index];
-
 #ifndef COMPACTION
-	if (path.remainingBounces <= 0) {
+	if (paths.remainingBounces[path_index] <= 0) {
 		return;
 	}
 #endif // COMPACTION
-	assert(path.remainingBounces > 0);
-	ShadeableIntersection& inters = intersections[path_index];
+	assert(paths.remainingBounces[path_index] > 0);
+	Ray const ray = paths.ray(path_index);
+	HitInfo hit;
 
 #ifdef OCTREE_CULLING
-	if (!octree.search(inters, path.ray)) {
-		inters.t = -1;
+	TraversalStats stats;
+	TraversalStats* pstats = counters ? &stats : nullptr;
+	if (accel_type == BVH || accel_type == SBVH) {
+		bvh.search(hit, ray, pstats);
+	} else if (accel_type == TWO_LEVEL) {
+		tlas.search(hit, ray, pstats);
+	} else if (accel_type == KDTREE) {
+		kdtree.search(hit, ray, pstats);
+	} else {
+		octree.search(hit, ray, pstats);
+	}
+	if (counters) {
+		atomicAdd(&counters->num_rays, 1ull);
+		atomicAdd(&counters->nodes_visited, (unsigned long long)stats.nodes_visited);
+		atomicAdd(&counters->prims_tested, (unsigned long long)stats.prims_tested);
+		atomicAdd(&counters->prims_skipped, (unsigned long long)stats.prims_skipped);
 	}
 #else
-	float t_min = FLT_MAX;
-	inters.t = -1;
-
-
-	for (int i = 0; i < geoms.size(); i++) {
-		Geom& geom = geoms[i];
-
-#ifdef AABB_CULLING
-		if (!AABBRayIntersect(geom.bounds, path.ray, nullptr))
-			continue;
-#endif // AABB_CULLING
+	sceneHitTest(geoms, meshInfo.compact_prims, geoms.size(), meshInfo.meshes, meshInfo.tris, meshInfo.vertices, ray, hit);
+#endif // OCTREE_CULLING
 
-		float t;
-		ShadeableIntersection tmp;
+	hits[path_index] = hit;
+}
 
-		if (geom.type == CUBE) {
-			t = boxIntersectionTest(geom, path.ray, tmp);
-		} else if (geom.type == SPHERE) {
-			t = sphereIntersectionTest(geom, path.ray, tmp);
-		} else if (geom.type == MESH) {
-			t = meshIntersectionTest(geom, path.ray, meshInfo, tmp);
-		}
-		// add more intersection tests here... triangle? metaball? CSG?
+// computes normal, uv & texture color once per path, from the closest hit
+__global__ void resolveIntersections(
+	PathSegmentSoA paths,
+	Span<Geom> geoms,
+	HitInfo const* hits,
+	MeshInfo meshInfo,
+	ShadeableIntersectionSoA intersections,
+	ShadeableIntersectionSoA cache_intersections)
+{
+	int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+	if (path_index >= paths.size()) {
+		return;
+	}
+#ifndef COMPACTION
+	if (paths.remainingBounces[path_index] <= 0) {
+		return;
+	}
+#endif // COMPACTION
 
-		// Compute the minimum t from the intersection tests to determine what
-		// scene geometry object was hit first.
-		if (t > 0.0f && t_min > t) {
-			t_min = t;
-			inters = tmp;
-		}
+	ShadeableIntersection inters;
+	HitInfo const hit = hits[path_index];
+	if (hit.valid()) {
+		intersFromHit(inters, paths.ray(path_index), hit, meshInfo, geoms);
 	}
-#endif // OCTREE_CULLING
+	intersections.store(path_index, inters);
 
-	if (cache_intersections) {
-		cache_intersections[path_index] = inters;
+	if (cache_intersections.size()) {
+		cache_intersections.store(path_index, inters);
 	}
 }
 
 __global__ void shadeMaterial(
 	int iter,
-	Span<PathSegment> paths,
+	PathSegmentSoA paths,
 	Span<Light> lights,
-	ShadeableIntersection* shadeableIntersections,
-	Material* materials) 
+	ShadeableIntersectionSoA shadeableIntersections,
+	Material* materials,
+	uint64_t const* order)
 {
     int idx = blockIdx.x * blockDim.x + threadIdx.x;
 	if (idx >= paths.size()) {
 		return;
 	}
-
-	PathSegment& path = paths[idx];
+	// with a material order, neighboring threads shade paths of the same material wherever they are stored
+	// the RNG still follows the thread, like for paths gathered into that order
+	int path_index = order ? MaterialSortKey::index(order[idx]) : idx;
 
 #ifndef COMPACTION
-	if (path.remainingBounces <= 0) {
+	if (paths.remainingBounces[path_index] <= 0) {
 		return;
 	}
 #endif // COMPACTION
 
+	PathSegment path = paths.load(path_index);
 	assert(path.remainingBounces > 0);
 
-
-	ShadeableIntersection intersection = shadeableIntersections[idx];
-	if (intersection.t > 0.0f) {
-		thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, 0);
-		thrust::uniform_real_distribution<float> u01(0, 1);
-
-		Material material = materials[intersection.materialId];
-		glm::vec3 materialColor = material.diffuse;
-
-		// If the material indicates that the object was a light, "light" the ray
-		if (material.emittance > 0.0f) {
-			path.color *= (materialColor * material.emittance);
-			path.terminate();
-		} else {
-			scatterRay(path, intersection, material, lights, rng);
-		}
-	} else {
-		path.color = BACKGROUND_COLOR;
-		path.terminate();
-	}
+	thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, 0);
+	shadeSegment(path, shadeableIntersections.load(path_index), materials, lights, rng);
+	paths.store(path_index, path);
 }
 
 // LOOK: "fake" shader demonstrating what you might do with the info in
@@ -345,16 +729,18 @@ __global__ void shadeMaterial(
 // bump mapping.
 __global__ void shadeFakeMaterial(
 	int iter,
-	Span<PathSegment> paths,
+	PathSegmentSoA paths,
 	Span<Light> lights,
-	ShadeableIntersection* shadeableIntersections,
-	Material* materials) 
+	ShadeableIntersectionSoA shadeableIntersections,
+	Material* materials,
+	uint64_t const* order)
 {
 	int idx = blockIdx.x * blockDim.x + threadIdx.x;
 	if (idx < paths.size())
 	{
-		PathSegment& path = paths[idx];
-		ShadeableIntersection intersection = shadeableIntersections[idx];
+		int path_index = order ? MaterialSortKey::index(order[idx]) : idx;
+		PathSegment path = paths.load(path_index);
+		ShadeableIntersection intersection = shadeableIntersections.load(path_index);
 
 #ifndef COMPACTION
 		if (path.remainingBounces <= 0) {
@@ -397,19 +783,154 @@ __global__ void shadeFakeMaterial(
 		}
 
 		path.terminate();
+		paths.store(path_index, path);
 	}
 }
 
 // Add the current iteration's output to the overall image
-__global__ void finalGather(int numPixels, glm::vec3* image, PathSegment* iterationPaths) {
+// with COMPACTION only the paths still in flight are left, the others were added by retirePaths
+__global__ void finalGather(PathSegmentSoA iterationPaths, glm::vec3* image) {
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < iterationPaths.size()) {
+		image[iterationPaths.pixelIndex[index]] += iterationPaths.color[index];
+	}
+}
+
+// adds the paths that terminated this bounce to the image before compaction drops them
+__global__ void retirePaths(PathSegmentSoA paths, glm::vec3* image) {
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < paths.size() && paths.remainingBounces[index] <= 0) {
+		image[paths.pixelIndex[index]] += paths.color[index];
+	}
+}
+
+#ifdef SORT_MAT
+__global__ void computeMaterialKeys(ShadeableIntersectionSoA inters, uint64_t* keys) {
 	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
 
-	if (index < numPixels) {
-		PathSegment iterationPath = iterationPaths[index];
-		image[iterationPath.pixelIndex] += iterationPath.color;
+	if (index < inters.size()) {
+		keys[index] = MaterialSortKey::make(inters.materialId[index], index);
 	}
 }
 
+// orders the paths by material so that neighboring threads run the same BSDF
+// only the packed 8 byte keys are radix sorted, instead of whole intersections as keys & paths as values
+// with SORT_MAT_PERMUTE nothing is moved, the sorted keys are returned & shadeMaterial reads the paths through them
+// otherwise every field is gathered once into the back buffers, the cached first bounce keeps the camera ray order
+// & a sorted copy of it is shaded instead
+static uint64_t const* sortByMaterial(int num_paths, ShadeableIntersectionSoA& inters) {
+	computeMaterialKeys KERN_PARAM(DIV_UP(num_paths, BLOCK_SIZE), BLOCK_SIZE) (inters.prefix(num_paths), dev_mat_keys.get());
+	thrust::sort(thrust::device, dev_mat_keys.get(), dev_mat_keys.get() + num_paths);
+
+#ifdef SORT_MAT_PERMUTE
+	return dev_mat_keys.get();
+#else
+	bool sort_cache = inters.t != dev_intersections.t;
+	thrust::transform_iterator<MaterialSortKey, uint64_t*> perm(dev_mat_keys.get(), MaterialSortKey());
+	thrust::gather(thrust::device, perm, perm + num_paths, pathIterator(dev_paths), pathIterator(dev_paths_back));
+	thrust::gather(thrust::device, perm, perm + num_paths, intersIterator(inters), intersIterator(dev_intersections_back));
+	std::swap(dev_paths, dev_paths_back);
+	inters = dev_intersections_back.prefix(num_paths);
+	if (!sort_cache) {
+		std::swap(dev_intersections, dev_intersections_back);
+	}
+	return nullptr;
+#endif // SORT_MAT_PERMUTE
+}
+#endif // SORT_MAT
+
+#ifdef WAVEFRONT_SHADE
+// first pass of the binning, sizes the queues
+__global__ void countShadeQueues(PathSegmentSoA paths, ShadeableIntersectionSoA inters, Material const* materials, ShadeQueues queues) {
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index >= paths.size()) {
+		return;
+	}
+#ifndef COMPACTION
+	if (paths.remainingBounces[index] <= 0) {
+		return;
+	}
+#endif // COMPACTION
+	queues.count(ShadeQueues::queueOf(inters.t[index], inters.materialId[index], materials));
+}
+
+// second pass of the binning, appends each path to its queue once the offsets are known
+__global__ void fillShadeQueues(PathSegmentSoA paths, ShadeableIntersectionSoA inters, Material const* materials, ShadeQueues queues) {
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index >= paths.size()) {
+		return;
+	}
+#ifndef COMPACTION
+	if (paths.remainingBounces[index] <= 0) {
+		return;
+	}
+#endif // COMPACTION
+	queues.push(ShadeQueues::queueOf(inters.t[index], inters.materialId[index], materials), index);
+}
+
+// shadeMaterial specialized for the paths of one queue, every thread of a warp runs the same BSDF
+template<int Queue>
+__global__ void shadeQueue(
+	int iter,
+	int first,
+	int count,
+	int const* slots,
+	PathSegmentSoA paths,
+	Span<Light> lights,
+	ShadeableIntersectionSoA shadeableIntersections,
+	Material* materials)
+{
+	int idx = blockIdx.x * blockDim.x + threadIdx.x;
+	if (idx >= count) {
+		return;
+	}
+	int path_index = slots[first + idx];
+	PathSegment path = paths.load(path_index);
+	assert(path.remainingBounces > 0);
+
+	// seeded by the path slot like shadeMaterial, the queues only change which thread shades a path
+	thrust::default_random_engine rng = makeSeededRandomEngine(iter, path_index, 0);
+	shadeQueuedSegment(Queue, path, shadeableIntersections.load(path_index), materials, lights, rng);
+	paths.store(path_index, path);
+}
+
+typedef void (*ShadeQueueKernel)(int, int, int, int const*, PathSegmentSoA, Span<Light>, ShadeableIntersectionSoA, Material*);
+static ShadeQueueKernel const shade_queue_kernels[NUM_SHADE_QUEUES] = {
+	shadeQueue<Material::Type::DIFFUSE>,
+	shadeQueue<Material::Type::GLOSSY>,
+	shadeQueue<Material::Type::REFL>,
+	shadeQueue<Material::Type::TRANSPARENT>,
+	shadeQueue<Material::Type::REFR>,
+	shadeQueue<Material::Type::SUBSURFACE>,
+	shadeQueue<SHADE_QUEUE_FINISHED>,
+};
+
+// bins the paths into the shading queues & shades each non-empty queue with its kernel
+// the counts are scanned on the host, which needs them anyway to size the launches
+static void shadeWavefront(PathTracer::ProfileHelper& profiling, int iter, int num_paths, ShadeableIntersectionSoA const& inters) {
+	ZERO(dev_queues.counts, NUM_SHADE_QUEUES);
+	profiling.call(countShadeQueues, DIV_UP(num_paths, BLOCK_SIZE), BLOCK_SIZE,
+		dev_paths.prefix(num_paths), inters, dev_mesh_info.materials, dev_queues);
+	D2H(hst_queues.counts, dev_queues.counts, NUM_SHADE_QUEUES);
+	hst_queues.scan();
+	// the offsets & the zeroed heads, they are next to each other
+	H2D(dev_queues.offsets, hst_queues.offsets, 2 * NUM_SHADE_QUEUES);
+	profiling.call(fillShadeQueues, DIV_UP(num_paths, BLOCK_SIZE), BLOCK_SIZE,
+		dev_paths.prefix(num_paths), inters, dev_mesh_info.materials, dev_queues);
+
+	for (int q = 0; q < NUM_SHADE_QUEUES; ++q) {
+		int count = hst_queues.counts[q];
+		if (count) {
+			profiling.call(shade_queue_kernels[q], DIV_UP(count, BLOCK_SIZE), BLOCK_SIZE,
+				iter, hst_queues.offsets[q], count, dev_queues.slots,
+				dev_paths.prefix(num_paths), dev_lights, inters, dev_mesh_info.materials);
+		}
+	}
+}
+#endif // WAVEFRONT_SHADE
+
 /**
  * Wrapper for the __global__ call that sets up the kernel calls and does a ton
  * of memory management
@@ -418,13 +939,19 @@ __global__ void finalGather(int numPixels, glm::vec3* image, PathSegment* iterat
  */
 int PathTracer::pathtrace(int iter) {
 	cur_iter = iter;
+	if (backend == HOST_BACKEND) {
+		if (!render_paused) {
+			cur_iter = HostPathTracer::pathtrace(iter);
+		}
+		return cur_iter;
+	}
 	ProfileHelper frame_profiling("frame");
 	const int traceDepth = hst_scene->state.traceDepth;
 	const Camera& cam = hst_scene->state.camera;
 	const int pixelcount = cam.resolution.x * cam.resolution.y;
 
 	if (render_paused) {
-		if (enable_denoise) {
+		if (enable_denoise && s_pbo_dptr) {
 			frame_profiling.begin();
 			{
 				thrust::transform(
@@ -455,6 +982,11 @@ int PathTracer::pathtrace(int iter) {
 		return iter;
 	}
 
+	buildAccel();
+	if (dev_trav_counters) {
+		ZERO(dev_trav_counters.get(), 1);
+	}
+
     // 2D block for generating ray from camera
 	dim3 blk_per_grid2d(DIV_UP(cam.resolution.x, 8), DIV_UP(cam.resolution.y, 8));
 	dim3 blk_sz2d(8,8);
@@ -466,12 +998,11 @@ int PathTracer::pathtrace(int iter) {
     // --- PathSegment Tracing Stage ---
     // Shoot ray into scene, bounce between objects, push shading chunks
 
-	for (int depth = 0, num_paths = pixelcount; num_paths > 0 && depth < traceDepth; ++depth) {
-		// clean shading chunks
-		MEMSET(dev_intersections, 0, num_paths);
-
-		ShadeableIntersection* dev_cached_inters;
-		ShadeableIntersection* dev_inters;
+	int num_paths = pixelcount;
+	for (int depth = 0; num_paths > 0 && depth < traceDepth; ++depth) {
+		// every live path stores its intersection, no need to clear the buffer
+		ShadeableIntersectionSoA dev_cached_inters;
+		ShadeableIntersectionSoA dev_inters;
 
 		// tracing
 #ifdef CACHE_FIRST_BOUNCE
@@ -482,17 +1013,41 @@ int PathTracer::pathtrace(int iter) {
 		} else if (!depth) {
 			// use cached bounces for the first depth
 			dev_inters = dev_cached_intersections;
-			dev_cached_inters = nullptr;
 		} else {
 			// intersect as usual
 			dev_inters = dev_intersections;
-			dev_cached_inters = nullptr;
 		}
 #else
 		dev_inters = dev_intersections;
-		dev_cached_inters = nullptr;
 #endif
 
+		// camera rays are coherent already, and the cached first bounce relies on their order
+		bool sort_bounce = sort_rays && depth > 0;
+		if (sort_bounce) {
+			if (!dev_ray_keys) {
+				dev_ray_keys = make_span<uint64_t>(pixelcount);
+			}
+			ProfileHelper sort_profiling("ray sort, bounce " + std::to_string(depth));
+			glm::vec3 extent = glm::max(hst_scene->world_AABB.max() - hst_scene->world_AABB.min(), glm::vec3(1e-6f));
+			frame_profiling.begin();
+			sort_profiling.begin();
+			{
+				computeRayKeys KERN_PARAM(DIV_UP(num_paths, BLOCK_SIZE), BLOCK_SIZE) (
+					dev_paths.prefix(num_paths),
+					hst_scene->world_AABB.min(),
+					1.f / extent,
+					dev_ray_keys.get()
+				);
+				thrust::sort_by_key(thrust::device, dev_ray_keys.get(), dev_ray_keys.get() + num_paths, pathIterator(dev_paths));
+			}
+			sort_profiling.end();
+			frame_profiling.end();
+			checkCUDAError("sort rays");
+		}
+		// sorted and unsorted traversal times are kept apart so that they can be compared bounce by bounce
+		ProfileHelper trace_profiling("traversal, bounce " + std::to_string(depth) + (sort_bounce ? " (sorted rays)" : ""));
+
+		trace_profiling.begin();
 		// split dev_paths [0 : num_paths] into chunks
 #ifndef MAX_INTERSECTION_TEST_SIZE // if not defined, launch all paths at once
 #define MAX_INTERSECTION_TEST_SIZE num_paths
@@ -504,18 +1059,34 @@ int PathTracer::pathtrace(int iter) {
 
 			frame_profiling.call(computeIntersections, DIV_UP(size, BLOCK_SIZE), BLOCK_SIZE,
 				i,
-				dev_paths.subspan(0, num_paths),
+				dev_paths.prefix(num_paths),
 				dev_geoms,
-				dev_inters,
+				dev_hits.get(),
 				dev_mesh_info,
-				dev_cached_inters,
-				*dev_tree
+				accel_type,
+				dev_tree ? *dev_tree : null_tree,
+				accel_type == SBVH ? dev_sbvh : dev_bvh,
+				dev_tlas,
+				dev_kdtree,
+				dev_trav_counters.get()
 			);
 
 			checkCUDAError(std::string("trace one bounce, inters size = " +
 				std::to_string(MAX_INTERSECTION_TEST_SIZE)).c_str());
 			cudaDeviceSynchronize();
 		}
+		trace_profiling.end();
+
+		frame_profiling.call(resolveIntersections, DIV_UP(num_paths, BLOCK_SIZE), BLOCK_SIZE,
+			dev_paths.prefix(num_paths),
+			dev_geoms,
+			dev_hits.get(),
+			dev_mesh_info,
+			dev_inters,
+			dev_cached_inters
+		);
+		checkCUDAError("resolve intersections");
+		cudaDeviceSynchronize();
 
 #ifdef DENOISE
 		// initialize position and normal buffers for denoising
@@ -532,27 +1103,49 @@ int PathTracer::pathtrace(int iter) {
 
 		// --- Shading Stage ---
 		// Shade path segments based on intersections and generate new rays by evaluating the BSDF.
+		uint64_t const* mat_order = nullptr;
 #ifdef SORT_MAT
-		thrust::sort_by_key(thrust::device, dev_inters, dev_inters + num_paths, dev_paths.get());
+		frame_profiling.begin();
+		{
+			mat_order = sortByMaterial(num_paths, dev_inters);
+		}
+		frame_profiling.end();
 #endif
 
+#if defined(WAVEFRONT_SHADE) && !defined(FAKE_SHADE)
+		shadeWavefront(frame_profiling, iter, num_paths, dev_inters);
+#else
 #ifdef FAKE_SHADE
 #define shadeMaterial shadeFakeMaterial
 #endif
 		frame_profiling.call(shadeMaterial, DIV_UP(num_paths, BLOCK_SIZE), BLOCK_SIZE,
 			iter,
-			dev_paths.subspan(0, num_paths),
+			dev_paths.prefix(num_paths),
 			dev_lights,
 			dev_inters,
-			dev_mesh_info.materials
+			dev_mesh_info.materials,
+			mat_order
 		);
+#endif // WAVEFRONT_SHADE
 		checkCUDAError("shadeMaterial");
 		cudaDeviceSynchronize();
 
 #ifdef COMPACTION
+		// the finished paths go to the image, the live ones are copied in order to the back buffer
+		// copy_if reads the remaining bounces as its stencil & moves only the records that are kept
+		frame_profiling.call(retirePaths, DIV_UP(num_paths, BLOCK_SIZE), BLOCK_SIZE,
+			dev_paths.prefix(num_paths),
+			dev_image.get()
+		);
 		frame_profiling.begin();
 		{
-			num_paths = thrust::partition(thrust::device, dev_paths.get(), dev_paths.get() + num_paths, PathSegment::PartitionRule()) - dev_paths.get();
+			PathSegmentIterator live_begin = pathIterator(dev_paths_back);
+			num_paths = thrust::copy_if(thrust::device,
+				pathIterator(dev_paths), pathIterator(dev_paths) + num_paths,
+				dev_paths.remainingBounces,
+				live_begin,
+				PathSegmentSoA::LiveRule()) - live_begin;
+			std::swap(dev_paths, dev_paths_back);
 		}
 		frame_profiling.end();
 #endif // COMPACTION
@@ -563,16 +1156,23 @@ int PathTracer::pathtrace(int iter) {
 #endif
 	}
 	
+	if (dev_trav_counters) {
+		D2H(&hst_trav_counters, dev_trav_counters.get(), 1);
+	}
+
 	// Assemble this iteration and apply it to the image
-	frame_profiling.call(finalGather, DIV_UP(pixelcount, BLOCK_SIZE), BLOCK_SIZE,
-		pixelcount, dev_image, dev_paths
-	);
+	if (num_paths > 0) {
+		frame_profiling.call(finalGather, DIV_UP(num_paths, BLOCK_SIZE), BLOCK_SIZE,
+			dev_paths.prefix(num_paths), dev_image.get()
+		);
+	}
 	cudaDeviceSynchronize();
 	++cur_iter;
 
 	// ----- write raytraced image to PBO ------
+	// skipped if no PBO is mapped, e.g. by the batch renderer
 	// denoise
-	if (enable_denoise) {
+	if (enable_denoise && s_pbo_dptr) {
 		frame_profiling.begin();
 		{
 			thrust::transform(
@@ -598,7 +1198,7 @@ int PathTracer::pathtrace(int iter) {
 			);
 		}
 		frame_profiling.end();
-	} else {
+	} else if (s_pbo_dptr) {
 		frame_profiling.begin();
 		{
 			thrust::transform(
@@ -639,7 +1239,83 @@ void PathTracer::disableDenoise() {
 	enable_denoise = false;
 }
 octreeGPU PathTracer::getTree() {
-	return *dev_tree;
+	return dev_tree ? *dev_tree : null_tree;
+}
+void PathTracer::setAccelType(AccelType type) {
+	// built lazily at the next frame
+	accel_type = type;
+}
+AccelType PathTracer::getAccelType() {
+	return accel_type;
+}
+void PathTracer::setRaySorting(bool enabled) {
+	sort_rays = enabled;
+	if (!sort_rays && dev_ray_keys) {
+		FREE(dev_ray_keys);
+		dev_ray_keys = Span<uint64_t>();
+	}
+}
+bool PathTracer::getRaySorting() {
+	return sort_rays;
+}
+// refits a scene BVH after a geom moved, or frees it to be rebuilt if it degraded too much
+static void refitBVH(std::string const& name, int geom_id, std::unique_ptr<bvh>& hst, bvhGPU& dev) {
+	if (!hst) {
+		return;
+	}
+	int touched = hst->refit(*hst_scene, geom_id);
+	float drift = hst->sah_drift();
+	if (drift > BVH_REFIT_MAX_SAH_DRIFT) {
+		std::cout << dye::yellow(name + " SAH drift " + std::to_string(drift) + ", rebuilding") << std::endl;
+		dev.free();
+		hst.reset();
+	} else {
+#ifdef BAKED_TRIANGLES
+		dev.update(*hst, hst_scene->bakeTriangles(hst->prims()));
+#else
+		dev.update(*hst);
+#endif // BAKED_TRIANGLES
+		std::cout << name << " refit " << touched << " nodes, SAH drift " << drift << std::endl;
+	}
+}
+void PathTracer::updateGeomTransform(int geom_id, glm::vec3 const& translation, glm::vec3 const& rotation, glm::vec3 const& scale) {
+	if (backend == HOST_BACKEND) {
+		HostPathTracer::updateGeomTransform(geom_id, translation, rotation, scale);
+		return;
+	}
+	hst_scene->setTransform(geom_id, translation, rotation, scale);
+	H2D(dev_geoms.get() + geom_id, &hst_scene->geoms[geom_id], 1);
+	H2D(dev_mesh_info.compact_prims + geom_id, &hst_scene->compact_prims[geom_id], 1);
+	// the number of lights does not change
+	if (dev_lights.size()) {
+		H2D(dev_lights.get(), hst_scene->lights.data(), dev_lights.size());
+	}
+
+	// every structure built so far is kept up to date, not only the active one
+	// the octree & the k-d tree subdivide space, so they cannot be refit
+	dev_tree.reset();
+	tree.reset();
+	if (hst_kdtree) {
+		dev_kdtree.free();
+		hst_kdtree.reset();
+	}
+	refitBVH("BVH", geom_id, hst_bvh, dev_bvh);
+	// the refit bounds the whole moved triangles, so the clipped references of the SBVH stay correct but get looser
+	refitBVH("SBVH", geom_id, hst_sbvh, dev_sbvh);
+	if (hst_tlas) {
+		int touched = hst_tlas->refit(*hst_scene, geom_id);
+		float drift = hst_tlas->sah_drift();
+		if (drift > BVH_REFIT_MAX_SAH_DRIFT) {
+			std::cout << dye::yellow("TLAS SAH drift " + std::to_string(drift) + ", rebuilding") << std::endl;
+			dev_tlas.free();
+			hst_tlas.reset();
+		} else {
+			dev_tlas.update_top(*hst_tlas);
+			std::cout << "TLAS refit " << touched << " nodes, SAH drift " << drift << std::endl;
+		}
+	}
+	buildAccel();
+	checkCUDAError("updateGeomTransform");
 }
 uchar4 const* PathTracer::getPBO() {
 	return s_pbo_dptr;
@@ -671,7 +1347,53 @@ __global__ void kern_visualize_pos(
 	pbo[idx] = Denoiser::DecodePosRGBA(inv_view, inv_proj, glm::ivec2(x, y), res)(gbuf[idx]);
 }
 #endif
+
+// ambient occlusion of the first hit of each pixel, through the occlusion query of the structure being traced
+// the normal is turned towards the camera, a hit on a back face is shaded like its front face
+__global__ void kern_visualize_ao(
+	uchar4* pbo,
+	int iter,
+	glm::vec3 cam_pos,
+	float radius,
+	ShadeableIntersectionSoA inters,
+	Span<Geom> geoms,
+	MeshInfo meshInfo,
+	AccelType accel_type,
+	octreeGPU octree,
+	bvhGPU bvh,
+	tlasGPU tlas,
+	kdtreeGPU kdtree)
+{
+	int idx = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (idx >= inters.size()) {
+		return;
+	}
+	if (!inters.valid(idx)) {
+		pbo[idx] = make_uchar4(0, 0, 0, 0);
+		return;
+	}
+
+	glm::vec3 pos = inters.hitPoint[idx];
+	glm::vec3 normal = inters.surfaceNormal[idx];
+	if (glm::dot(normal, pos - cam_pos) > 0) {
+		normal = -normal;
+	}
+	thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, 0);
+	int unoccluded = 0;
+	for (int i = 0; i < AO_DEBUG_SAMPLES; ++i) {
+		Ray ray;
+		ray.direction = calculateRandomDirectionInHemisphere(normal, rng);
+		ray.origin = pos + OFFSET_EPS * ray.direction;
+		unoccluded += !traceOcclusion(ray, radius, geoms, meshInfo, accel_type, octree, bvh, tlas, kdtree);
+	}
+	unsigned char c = (unsigned char)(255 * unoccluded / AO_DEBUG_SAMPLES);
+	pbo[idx] = make_uchar4(c, c, c, 0);
+}
+
 void PathTracer::debugTexture(DebugTextureType type) {
+	if (backend == HOST_BACKEND) {
+		return;
+	}
 	Camera const& cam = hst_scene->state.camera;
 	int pixelcount = cam.resolution.x * cam.resolution.y;
 
@@ -701,6 +1423,30 @@ void PathTracer::debugTexture(DebugTextureType type) {
 		thrust::transform(thrust::device, tex, tex + pixelcount, s_pbo_dptr, 
 			PosToRGBA(hst_scene->world_AABB.min(), hst_scene->world_AABB.max()));
 #endif
+	} else if (type == DebugTextureType::AO_BUF) {
+		// the first bounce is kept in camera ray order by the cache, or is the last one traced when the texture is on
+#ifdef CACHE_FIRST_BOUNCE
+		ShadeableIntersectionSoA inters = dev_cached_intersections;
+#else
+		ShadeableIntersectionSoA inters = dev_intersections;
+#endif // CACHE_FIRST_BOUNCE
+		buildAccel();
+		float radius = AO_DEBUG_RADIUS * glm::length(hst_scene->world_AABB.max() - hst_scene->world_AABB.min());
+		kern_visualize_ao KERN_PARAM(DIV_UP(pixelcount, BLOCK_SIZE), BLOCK_SIZE) (
+			s_pbo_dptr,
+			cur_iter,
+			cam.position,
+			radius,
+			inters.prefix(pixelcount),
+			dev_geoms,
+			dev_mesh_info,
+			accel_type,
+			dev_tree ? *dev_tree : null_tree,
+			accel_type == SBVH ? dev_sbvh : dev_bvh,
+			dev_tlas,
+			dev_kdtree
+		);
+		checkCUDAError("kern_visualize_ao");
 	} else {
 		texture_debug_active = false;
 		return;
@@ -10,16 +10,45 @@ namespace Denoiser {
 	struct ParamDesc;
 }
 
+enum AccelType {
+	OCTREE,
+	BVH,
+	TWO_LEVEL,
+	SBVH, // scene BVH with spatial splits
+	KDTREE,
+	NUM_ACCEL_TYPES
+};
+
+// where the frames are rendered, chosen at startup before the first pathtraceInit
+enum RenderBackend {
+	CUDA_BACKEND,
+	HOST_BACKEND, // multithreaded CPU path tracer, runs without a GPU
+	NUM_BACKENDS
+};
+
+// GPU traversal counters summed over every ray of the last frame
+struct TraversalCounters {
+	unsigned long long num_rays;
+	unsigned long long nodes_visited;
+	unsigned long long prims_tested;
+	unsigned long long prims_skipped;
+};
+
 enum DebugTextureType {
 	NONE,
 	NORM_BUF,
 	POS_BUF,
 	DIFFUSE_BUF,
+	AO_BUF,
 	NUM_OPTIONS
 };
 
 namespace PathTracer {
-	void unitTest();
+	void unitTest(Scene const& scene);
+	// every call below is forwarded to HostPathTracer with HOST_BACKEND, which leaves CUDA untouched
+	// denoising, debug textures & ray sorting are only implemented by the CUDA backend
+	void setBackend(RenderBackend backend);
+	RenderBackend getBackend();
 	void pathtraceInit(Scene* scene, RenderState* state, bool force_change = false);
 	void pathtraceFree(Scene* scene, bool force_change = false);
 	int pathtrace(int iteration);
@@ -30,6 +59,15 @@ namespace PathTracer {
 
 	bool isPaused();
 	octreeGPU getTree();
+	void setAccelType(AccelType type);
+	// moves one geom without reloading the scene, BVHs are refit and rebuilt once they degrade too much
+	// the octree & the k-d tree are always rebuilt; the caller restarts the accumulation
+	void updateGeomTransform(int geom_id, glm::vec3 const& translation, glm::vec3 const& rotation, glm::vec3 const& scale);
+	AccelType getAccelType();
+	// reorders the rays of every bounce after the first by origin & direction before they are traced
+	void setRaySorting(bool enabled);
+	bool getRaySorting();
+	// device pointer, nullptr with the host backend
 	uchar4 const* getPBO();
 
 	void setDenoise(Denoiser::ParamDesc const& param);
@@ -39,4 +77,6 @@ namespace PathTracer {
 	void endFrame();
 
 	std::unordered_map<std::string, Profiling::ProfileData>& GetProfileData();
+	// all zeros unless TRAVERSAL_STATS is defined
+	TraversalCounters const& GetTraversalCounters();
 }
\ No newline at end of file
@@ -15,6 +15,7 @@
 #include "Collision/DebugDrawer.h"
 #include "Octree/octree.h"
 #include "Denoise/denoise.h"
+#include "Profile/accel_profile.h"
 
 #include <thrust/execution_policy.h>
 
@@ -90,7 +91,9 @@ static GLuint initShader() {
 static void deletePBO(GLuint* pbo) {
 	if (pbo) {
 		// unregister this buffer object with CUDA
-		cudaGLUnregisterBufferObject(*pbo);
+		if (PathTracer::getBackend() == CUDA_BACKEND) {
+			cudaGLUnregisterBufferObject(*pbo);
+		}
 
 		glBindBuffer(GL_ARRAY_BUFFER, *pbo);
 		glDeleteBuffers(1, pbo);
@@ -114,7 +117,9 @@ static void cleanupCuda() {
 }
 
 static void initCuda() {
-	cudaGLSetGLDevice(0);
+	if (PathTracer::getBackend() == CUDA_BACKEND) {
+		cudaGLSetGLDevice(0);
+	}
 
 	// Clean up on program exit
 	atexit(cleanupCuda);
@@ -134,7 +139,10 @@ static void initPBO() {
 
 	// Allocate data for the buffer. 4-channel 8-bit image
 	glBufferData(GL_PIXEL_UNPACK_BUFFER, size_tex_data, NULL, GL_DYNAMIC_COPY);
-	cudaGLRegisterBufferObject(pbo);
+	// the host backend writes the buffer through GL instead
+	if (PathTracer::getBackend() == CUDA_BACKEND) {
+		cudaGLRegisterBufferObject(pbo);
+	}
 
 }
 
@@ -231,9 +239,39 @@ static void RenderMainMenu() {
 			std::cerr << "failed to save\n";
 		}
 	}
+	static constexpr char const* accel_options[AccelType::NUM_ACCEL_TYPES] = {
+		"Octree",
+		"BVH",
+		"BVH (Two-Level)",
+		"BVH (Spatial Splits)",
+		"k-d Tree (Ropes)",
+	};
+	if (ImGui::Combo("Acceleration Structure", &guiData->accel_type, accel_options, AccelType::NUM_ACCEL_TYPES)) {
+		PathTracer::setAccelType((AccelType)guiData->accel_type);
+	}
+
+	bool sort_rays = PathTracer::getRaySorting();
+	if (ImGui::Checkbox("Sort Rays Before Traversal", &sort_rays)) {
+		PathTracer::setRaySorting(sort_rays);
+	}
+
 	if (ImGui::Button("Reload Scene")) {
 		switchScene(guiData->cur_scene.c_str(), true);
 	}
+
+	if (g_scene && g_scene->geoms.size()) {
+		ImGui::SliderInt("Edit Geom", &guiData->edit_geom, 0, g_scene->geoms.size() - 1);
+		guiData->edit_geom = glm::clamp(guiData->edit_geom, 0, (int)g_scene->geoms.size() - 1);
+		Geom const& geom = g_scene->geoms[guiData->edit_geom];
+		glm::vec3 translation = geom.translation, rotation = geom.rotation, scale = geom.scale;
+		bool changed = ImGui::DragFloat3("Translation", &translation.x, 0.05f);
+		changed |= ImGui::DragFloat3("Rotation", &rotation.x, 0.5f);
+		changed |= ImGui::DragFloat3("Scale", &scale.x, 0.01f);
+		if (changed) {
+			PathTracer::updateGeomTransform(guiData->edit_geom, translation, rotation, scale);
+			restartRender();
+		}
+	}
 	if (PathTracer::isPaused()) {
 		if (ImGui::Button("Resume Render")) {
 			PathTracer::togglePause();
@@ -257,6 +295,7 @@ static void RenderDenoiserMenu() {
 		"Show Normal Buffer",
 		"Show Position Buffer",
 		"Show Diffuse Buffer",
+		"Show Ambient Occlusion",
 	};
 
 	auto& ops = guiData->denoiser_options;
@@ -282,7 +321,9 @@ static void RenderDenoiserMenu() {
 	}
 
 	if (guiData->CheckBox("Display PSNR value")) {
-		if (guiData->ref_img) {
+		if (!PathTracer::getPBO()) {
+			ImGui::Text("PSNR needs the CUDA backend");
+		} else if (guiData->ref_img) {
 			DebugDrawer::DrawImage(guiData->ref_img_file.c_str(), 256, 256);
 			Image img1{ width, height, PathTracer::getPBO() };
 
@@ -313,6 +354,15 @@ static void RenderDenoiserMenu() {
 }
 
 static void RenderProfilingStats() {
+	TraversalCounters const& counters = PathTracer::GetTraversalCounters();
+	if (counters.num_rays) {
+		ImGui::Text("rays = %llu, nodes/ray = %.2f, prims/ray = %.2f", counters.num_rays,
+			(double)counters.nodes_visited / counters.num_rays, (double)counters.prims_tested / counters.num_rays);
+		if (counters.prims_skipped) {
+			ImGui::Text("repeated tests skipped/ray = %.2f", (double)counters.prims_skipped / counters.num_rays);
+		}
+	}
+
 	auto& data = PathTracer::GetProfileData();
 	if (ImGui::BeginTable("profile data", 3)) {
 		for (auto it = data.begin(); it != data.end(); ++it) {
@@ -333,7 +383,7 @@ static void RenderProfilingStats() {
 }
 
 static void RenderDebugMenu() {
-	if (ImGui::Button("Write PBO to Image")) {
+	if (PathTracer::getPBO() && ImGui::Button("Write PBO to Image")) {
 		ImageUtils::SaveImage(PathTracer::getPBO());
 	}
 
@@ -345,30 +395,108 @@ static void RenderDebugMenu() {
 
 	ImGui::Text("Octree Test");
 	{
-		ImGui::SliderInt("Octree Depth", &guiData->octree_depth, 0, 20);
+		ImGui::SliderInt("Octree Depth", &guiData->octree_depth, 0, OCTREE_MAX_DEPTH);
 		if (ImGui::Button("Generate Octree")) {
 			if (guiData->test_tree) {
 				delete guiData->test_tree;
 				guiData->test_tree = nullptr;
 			}
 
-			guiData->test_tree = new octree(*g_scene, g_scene->world_AABB, guiData->octree_depth);
+			// the scene's termination criteria, with the depth limit from the slider
+			OctreeSettings settings = g_scene->octree_settings;
+			settings.max_depth = guiData->octree_depth;
+			guiData->test_tree = new octree(*g_scene, g_scene->world_AABB, settings);
+			guiData->test_tree_empty_space = guiData->test_tree->empty_space(g_scene->world_AABB);
 		}
-		if (ImGui::Button("Pull Octree From GPU")) {
+		if (PathTracer::getBackend() == CUDA_BACKEND && ImGui::Button("Pull Octree From GPU")) {
 			if (guiData->test_tree) {
 				delete guiData->test_tree;
 				guiData->test_tree = nullptr;
 			}
 
 			guiData->test_tree = new octree(PathTracer::getTree());
+			guiData->test_tree_empty_space = guiData->test_tree->empty_space(g_scene->world_AABB);
 		}
 		if (guiData->test_tree) {
+			ImGui::Text("Empty space cut from the cells = %.1f%% of their surface area", 100.f * guiData->test_tree_empty_space);
 			if (ImGui::Button("Destroy Octree")) {
 				delete guiData->test_tree;
 				guiData->test_tree = nullptr;
 			}
 		}
 	}
+	ImGui::Text("Acceleration Structure Test");
+	{
+		if (ImGui::Button("Profile BVH on Host")) {
+			guiData->accel_report = Profiling::ProfileBVH(*g_scene, 1 << 14).to_string();
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Profile Wide BVH on Host")) {
+			guiData->accel_report.clear();
+			for (Profiling::WideBVHReport const& report : Profiling::ProfileWideBVH(*g_scene, 1 << 14)) {
+				guiData->accel_report += report.to_string() + "\n\n";
+			}
+		}
+		if (ImGui::Button("Profile Linear BVH Build on Host")) {
+			guiData->accel_report = Profiling::ProfileLBVH(*g_scene, 1 << 14).to_string();
+		}
+		if (ImGui::Button("Profile Spatial Split BVH on Host")) {
+			guiData->accel_report = Profiling::ProfileSBVH(*g_scene, SpatialSplitSettings(), 1 << 14).to_string();
+		}
+		if (ImGui::Button("Profile Octree Mailboxing on Host")) {
+			guiData->accel_report.clear();
+			for (Profiling::MailboxReport const& report : Profiling::ProfileMailbox(*g_scene, 1 << 14)) {
+				guiData->accel_report += report.to_string() + "\n\n";
+			}
+		}
+		if (ImGui::Button("Profile Occlusion Queries on Host")) {
+			guiData->accel_report.clear();
+			for (Profiling::OcclusionReport const& report : Profiling::ProfileOcclusion(*g_scene, 1 << 14)) {
+				guiData->accel_report += report.to_string() + "\n\n";
+			}
+		}
+		if (ImGui::Button("Compare Octree, BVH & k-d Tree on Host")) {
+			guiData->accel_report.clear();
+			for (Profiling::AccelReport const& report : Profiling::ProfileStaticAccels(*g_scene, 1 << 14)) {
+				guiData->accel_report += report.to_string() + "\n\n";
+			}
+		}
+		if (ImGui::Button("Profile Two-Level BVH on Host")) {
+			guiData->accel_report = Profiling::ProfileTLAS(*g_scene, 1 << 14).to_string();
+		}
+		if (ImGui::Button("Profile Octree on Host")) {
+			guiData->accel_report =
+				Profiling::ProfileOctree(*g_scene, 1 << 14, false).to_string() + "\n\n" +
+				Profiling::ProfileOctree(*g_scene, 1 << 14, true).to_string();
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Benchmark Octree Build")) {
+			guiData->accel_report = Profiling::ProfileOctreeBuild(*g_scene, g_scene->octree_settings.max_depth).to_string();
+		}
+		if (ImGui::Button("Profile Hit Resolve on Host")) {
+			guiData->accel_report = Profiling::ProfileResolve(*g_scene, 1 << 14).to_string();
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Benchmark Baked Triangles")) {
+			guiData->accel_report = Profiling::ProfileBakedTriangles(*g_scene, 1 << 10).to_string();
+		}
+		if (ImGui::Button("Benchmark Compact Primitives")) {
+			guiData->accel_report = Profiling::ProfilePrimitives(*g_scene, 1 << 14).to_string();
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Benchmark Slab Tests")) {
+			guiData->accel_report = Profiling::ProfileSlabs(*g_scene, 1 << 10).to_string();
+		}
+		if (ImGui::Button("Profile Refit of the Edited Geom")) {
+			guiData->accel_report.clear();
+			for (Profiling::RefitReport const& report : Profiling::ProfileRefit(*g_scene, guiData->edit_geom, glm::vec3(1, 0, 0), 1 << 12)) {
+				guiData->accel_report += report.to_string() + "\n\n";
+			}
+		}
+		if (guiData->accel_report.size()) {
+			ImGui::Text("%s", guiData->accel_report.c_str());
+		}
+	}
 	if (draw_coord_frame) {
 		float x = g_scene->world_AABB.min().x + 1.f;
 		float y = g_scene->world_AABB.min().y + 1.f;
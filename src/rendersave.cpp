@@ -1,4 +1,5 @@
-#include "main.h"
+#include "rendersave.h"
+#include "camState.h"
 #include "utilities.h"
 #include <fstream>
 #include <glm/glm.hpp>
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <cstring>
+#include <stdexcept>
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <glm/gtc/epsilon.hpp>
@@ -27,13 +28,13 @@ Scene::Scene(std::string filename, bool load_render_state) : filename(filename)
     fp_in.open(filename);
     if (!fp_in.is_open()) {
         std::cerr << dye::red("Error reading from file - aborting!") << std::endl;
-        throw;
+        throw std::runtime_error("cannot open scene file " + filename);
     }
 
     // saves each geom's min & max vertices
     std::unordered_map<int, std::pair<glm::vec3, glm::vec3>> geom_id_to_extremes;
     int attrib_flags = 0;
-    glm::vec3 world_min(FLT_MAX), world_max(FLT_MIN);
+    glm::vec3 world_min(FLT_MAX), world_max(-FLT_MAX);
     while (fp_in.good()) {
         std::string line;
         utilityCore::safeGetline(fp_in, line);
@@ -43,7 +44,7 @@ Scene::Scene(std::string filename, bool load_render_state) : filename(filename)
                 attrib_flags |= 1;
                 if (!loadGeom()) {
                     std::cerr << dye::red("Error Loading Geoms") << std::endl;
-                    throw;
+                    throw std::runtime_error("cannot load the geoms of " + filename);
                 } else {
                     world_min = glm::min(world_min, geoms.back().bounds.min());
                     world_max = glm::max(world_max, geoms.back().bounds.max());
@@ -51,13 +52,15 @@ Scene::Scene(std::string filename, bool load_render_state) : filename(filename)
             } else if (tokens[0] == "CAMERA" && load_render_state) {
                 attrib_flags |= 1 << 1;
                 loadCamera();
+            } else if (tokens[0] == "OCTREE") {
+                loadOctreeSettings();
             }
         }
     }
 
     if (load_render_state && attrib_flags != 3) {
         std::cerr << dye::red("Scene " + filename + " is Malformed") << std::endl;
-        throw;
+        throw std::runtime_error("malformed scene " + filename);
     }
 
     // calculate world AABB
@@ -197,7 +200,11 @@ bool Scene::loadGeom() {
                 std::cerr << dye::red("ERROR: unrecognized object type\nat line: ") << line << std::endl;
                 return false;
             }
-            if (tokens[0] == "obj") {
+            if (tokens[0] == "obj" && obj_to_id.count(tokens[1])) {
+                // the file is already loaded, so the geom becomes another instance of its mesh
+                std::cout << "Instancing obj mesh " << tokens[1] << std::endl;
+                newGeom.meshid = obj_to_id[tokens[1]];
+            } else if (tokens[0] == "obj") {
                 std::cout << "Loading obj mesh " << tokens[1] << std::endl;
                 size_t pos = tokens[1].find_last_of('/');
                 if (pos == std::string::npos) {
@@ -409,6 +416,7 @@ bool Scene::loadGeom() {
 
                 newGeom.meshid = meshes.size();
                 meshes.emplace_back(triangles_start, triangles.size());
+                obj_to_id[tokens[1]] = newGeom.meshid;
 
                 
 
@@ -469,43 +477,53 @@ bool Scene::loadGeom() {
     newGeom.inverseTransform = glm::inverse(newGeom.transform);
     newGeom.invTranspose = glm::inverseTranspose(newGeom.transform);
 
+    addLight(newGeom);
+    computeBounds(newGeom);
+    geoms.push_back(newGeom);
+    compact_prims.push_back(compactForm(newGeom));
+    return true;
+}
+
+void Scene::addLight(Geom const& geom) {
     // record lights, for now primitives only
-    if (newGeom.type != MESH) {
-        Material const& mat = materials[newGeom.materialid];
+    if (geom.type != MESH) {
+        Material const& mat = materials[geom.materialid];
         if (mat.emittance > 0) {
             Light light;
             light.color = mat.diffuse;
             light.intensity = mat.emittance / MAX_EMITTANCE;
-            light.position = newGeom.translation;
+            light.position = geom.translation;
             lights.emplace_back(light);
         }
     }
-    // compute AABB
-    glm::vec3 geom_min = glm::vec3(FLT_MAX), geom_max = glm::vec3(FLT_MIN);
-    if (newGeom.type == CUBE) {
+}
+
+void Scene::computeBounds(Geom& geom) const {
+    glm::vec3 geom_min = glm::vec3(FLT_MAX), geom_max = glm::vec3(-FLT_MAX);
+    if (geom.type == CUBE) {
         constexpr float vals[] = { -PRIM_CUBE_EXTENT, PRIM_CUBE_EXTENT };
         for (float x : vals) {
             for (float y : vals) {
                 for (float z : vals) {
-                    glm::vec3 vert = glm::vec3(newGeom.transform * glm::vec4(x, y, z, 1));
+                    glm::vec3 vert = glm::vec3(geom.transform * glm::vec4(x, y, z, 1));
                     geom_min = glm::min(geom_min, vert);
                     geom_max = glm::max(geom_max, vert);
                 }
             }
         }
-    } else if (newGeom.type == SPHERE) {
-        glm::vec3 center = glm::vec3(newGeom.transform * glm::vec4(0, 0, 0, 1));
-        geom_min = center - glm::vec3(PRIM_SPHERE_RADIUS) * newGeom.scale;
-        geom_max = center + glm::vec3(PRIM_SPHERE_RADIUS) * newGeom.scale;
-    } else if (newGeom.type == MESH) {
-        for (int i = meshes[newGeom.meshid].tri_start; i < meshes[newGeom.meshid].tri_end; ++i) {
+    } else if (geom.type == SPHERE) {
+        glm::vec3 center = glm::vec3(geom.transform * glm::vec4(0, 0, 0, 1));
+        geom_min = center - glm::vec3(PRIM_SPHERE_RADIUS) * geom.scale;
+        geom_max = center + glm::vec3(PRIM_SPHERE_RADIUS) * geom.scale;
+    } else if (geom.type == MESH) {
+        for (int i = meshes[geom.meshid].tri_start; i < meshes[geom.meshid].tri_end; ++i) {
             glm::vec3 verts[] = {
                 vertices[triangles[i].verts[0]],
                 vertices[triangles[i].verts[1]],
                 vertices[triangles[i].verts[2]]
             };
             for (glm::vec3 const& vert : verts) {
-                glm::vec3 world_vert = glm::vec3(newGeom.transform * glm::vec4(vert, 1));
+                glm::vec3 world_vert = glm::vec3(geom.transform * glm::vec4(vert, 1));
                 geom_min = glm::min(geom_min, world_vert);
                 geom_max = glm::max(geom_max, world_vert);
             }
@@ -514,9 +532,57 @@ bool Scene::loadGeom() {
         std::cerr << dye::red("WTF?\n");
         exit(77777);
     }
-    newGeom.bounds = AABB(geom_min, geom_max);
-    geoms.push_back(newGeom);
-    return true;
+    geom.bounds = AABB(geom_min, geom_max);
+}
+
+CompactPrim Scene::compactForm(Geom const& geom) {
+    CompactPrim ret;
+    ret.type = COMPACT_NONE;
+    if (geom.type == MESH) {
+        return ret;
+    }
+
+    glm::vec3 scale = glm::abs(geom.scale);
+    if (geom.type == SPHERE && scale.x == scale.y && scale.y == scale.z) {
+        ret.type = COMPACT_SPHERE;
+        ret.rows[0] = glm::vec4(glm::vec3(geom.transform[3]), PRIM_SPHERE_RADIUS * scale.x);
+    } else if (geom.type == CUBE && geom.rotation == glm::vec3(0)) {
+        ret.type = COMPACT_AXIS_BOX;
+        ret.rows[0] = glm::vec4(geom.translation - PRIM_CUBE_EXTENT * scale, 0);
+        ret.rows[1] = glm::vec4(geom.translation + PRIM_CUBE_EXTENT * scale, 0);
+    } else {
+        ret.type = geom.type == SPHERE ? COMPACT_AFFINE_SPHERE : COMPACT_AFFINE_BOX;
+        glm::mat4 rows = glm::transpose(geom.inverseTransform);
+        for (int i = 0; i < 3; ++i) {
+            ret.rows[i] = rows[i];
+        }
+    }
+    return ret;
+}
+
+void Scene::setTransform(int geom_id, glm::vec3 const& translation, glm::vec3 const& rotation, glm::vec3 const& scale) {
+    Geom& geom = geoms[geom_id];
+    geom.translation = translation;
+    geom.rotation = rotation;
+    geom.scale = scale;
+    geom.transform = utilityCore::buildTransformationMatrix(translation, rotation, scale);
+    geom.inverseTransform = glm::inverse(geom.transform);
+    geom.invTranspose = glm::inverseTranspose(geom.transform);
+    computeBounds(geom);
+    compact_prims[geom_id] = compactForm(geom);
+
+    // lights are recorded in geom order
+    lights.clear();
+    for (Geom const& g : geoms) {
+        addLight(g);
+    }
+
+    glm::vec3 world_min(FLT_MAX), world_max(-FLT_MAX);
+    for (Geom const& g : geoms) {
+        world_min = glm::min(world_min, g.bounds.min());
+        world_max = glm::max(world_max, g.bounds.max());
+    }
+    world_AABB = AABB(world_min, world_max);
 }
 
 void Scene::loadCamera() {
@@ -565,12 +631,12 @@ void Scene::loadCamera() {
     float fovx = (atan(xscaled) * 180) / PI;
     camera.fov = glm::vec2(fovx, fovy);
 
+    camera.view = glm::normalize(camera.lookAt - camera.position);
     camera.right = glm::normalize(glm::cross(camera.view, camera.up));
+    camera.up = glm::cross(camera.right, camera.view);
     camera.pixelLength = glm::vec2(2 * xscaled / (float)camera.resolution.x,
                                    2 * yscaled / (float)camera.resolution.y);
 
-    camera.view = glm::normalize(camera.lookAt - camera.position);
-
     //set up render camera stuff
     int arraylen = camera.resolution.x * camera.resolution.y;
     state.image.resize(arraylen);
@@ -619,4 +685,65 @@ int Scene::loadMaterial(std::string mtl_file) {
         mtl_to_id[mtl_file] = materials.size() - 1;
         return materials.size() - 1;
     }
-}
\ No newline at end of file
+}
+
+// optional per-scene octree settings, every line may be omitted:
+// OCTREE
+// MAX_DEPTH       8
+// MAX_LEAF_SIZE   8
+// MIN_EXTENT      0.01
+// SAH             1
+// TRAVERSAL_COST  1
+// INTERSECT_COST  1
+void Scene::loadOctreeSettings() {
+    std::cout << "Loading Octree Settings ..." << std::endl;
+    OctreeSettings& settings = octree_settings;
+
+    std::string line;
+    utilityCore::safeGetline(fp_in, line);
+    while (!line.empty() && fp_in.good()) {
+        std::vector<std::string> tokens = utilityCore::tokenizeString(line);
+        if (tokens[0] == "MAX_DEPTH") {
+            settings.max_depth = atoi(tokens[1].c_str());
+            if (settings.max_depth > OCTREE_MAX_DEPTH) {
+                std::cerr << dye::yellow("octree depth is limited to " + std::to_string(OCTREE_MAX_DEPTH)) << std::endl;
+            }
+        } else if (tokens[0] == "MAX_LEAF_SIZE") {
+            settings.max_leaf_size = atoi(tokens[1].c_str());
+        } else if (tokens[0] == "MIN_EXTENT") {
+            settings.min_extent = atof(tokens[1].c_str());
+        } else if (tokens[0] == "SAH") {
+            settings.sah_termination = atoi(tokens[1].c_str()) != 0;
+        } else if (tokens[0] == "TRAVERSAL_COST") {
+            settings.traversal_cost = atof(tokens[1].c_str());
+        } else if (tokens[0] == "INTERSECT_COST") {
+            settings.intersect_cost = atof(tokens[1].c_str());
+        } else {
+            std::cerr << dye::yellow("unknown octree setting " + tokens[0]) << std::endl;
+        }
+
+        utilityCore::safeGetline(fp_in, line);
+    }
+}
+
+std::vector<BakedTriangle> Scene::bakeTriangles(std::vector<leaf_data> const& refs) const {
+    std::vector<BakedTriangle> ret(refs.size(), BakedTriangle{});
+    for (size_t i = 0; i < refs.size(); ++i) {
+        if (refs[i].triangle_id == -1) {
+            continue;
+        }
+        glm::mat4 transform(1.0f);
+        if (refs[i].geom_id != -1) {
+            transform = geoms[refs[i].geom_id].transform;
+        }
+        glm::vec3 v[3];
+        for (int x = 0; x < 3; ++x) {
+            v[x] = glm::vec3(transform * glm::vec4(vertices[triangles[refs[i].triangle_id].verts[x]], 1.0f));
+        }
+        float winding = glm::determinant(glm::mat3(transform)) < 0 ? -1.0f : 1.0f;
+        ret[i].v0 = glm::vec4(v[0], 0.0f);
+        ret[i].e1 = glm::vec4(v[1] - v[0], winding);
+        ret[i].e2 = glm::vec4(v[2] - v[0], 0.0f);
+    }
+    return ret;
+}
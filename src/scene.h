@@ -17,13 +17,27 @@ private:
     int loadMaterial(std::string materialid);
     bool loadGeom();
     void loadCamera();
+    void loadOctreeSettings();
+    void addLight(Geom const& geom);
+    void computeBounds(Geom& geom) const;
+    static CompactPrim compactForm(Geom const& geom);
 public:
+    // moves one geom, its bounds, lights & the world bounds follow
+    // acceleration structures have to be refit or rebuilt afterwards
+    void setTransform(int geom_id, glm::vec3 const& translation, glm::vec3 const& rotation, glm::vec3 const& scale);
+
+    // precomputed triangles of leaf references, in the same order; primitive references are left empty
+    // references with a geom are baked in world space, the others (geom_id == -1) in object space
+    std::vector<BakedTriangle> bakeTriangles(std::vector<leaf_data> const& refs) const;
+
     Scene(std::string filename, bool load_render_state = true);
     ~Scene();
     
     std::string filename;
 
     std::vector<Geom> geoms;
+    // compact world space forms of the sphere & cube geoms for the intersection loops, parallel to geoms
+    std::vector<CompactPrim> compact_prims;
     std::vector<Material> materials;
     std::vector<Light> lights;
 
@@ -42,7 +56,9 @@ public:
     // caches
     std::unordered_map<std::string, int> tex_name_to_id;
     std::unordered_map<std::string, int> mtl_to_id;
+    std::unordered_map<std::string, int> obj_to_id; // meshes are shared by every geom loading the same file
 
     RenderState state;
     AABB world_AABB;
+    OctreeSettings octree_settings;
 };
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <cuda_runtime.h>
@@ -34,12 +35,44 @@ struct Texture {
     int pixel_width;
     int pixel_height;
     std::vector<unsigned char> pixels;
+
+    // host counterpart of the texture object of TextureGPU:
+    // wrapped, bilinearly filtered, texels decoded from sRGB before filtering
+    color_t sample(glm::vec2 const& uv) const {
+        float x = (uv.x - floorf(uv.x)) * pixel_width - 0.5f;
+        float y = (uv.y - floorf(uv.y)) * pixel_height - 0.5f;
+        int x0 = (int)floorf(x), y0 = (int)floorf(y);
+        float ax = x - x0, ay = y - y0;
+        color_t ret(0);
+        for (int j = 0; j < 2; ++j) {
+            for (int i = 0; i < 2; ++i) {
+                float weight = (i ? ax : 1 - ax) * (j ? ay : 1 - ay);
+                ret += weight * texel((x0 + i + pixel_width) % pixel_width, (y0 + j + pixel_height) % pixel_height);
+            }
+        }
+        return ret;
+    }
+    color_t texel(int x, int y) const {
+        unsigned char const* p = &pixels[((size_t)y * pixel_width + x) * channel];
+        return color_t(srgb_to_linear(p[0]), srgb_to_linear(p[1]), srgb_to_linear(p[2]));
+    }
+    static float srgb_to_linear(unsigned char c) {
+        static std::vector<float> const table = []() {
+            std::vector<float> ret(256);
+            for (int i = 0; i < 256; ++i) {
+                float s = i / 255.f;
+                ret[i] = s <= 0.04045f ? s / 12.92f : powf((s + 0.055f) / 1.055f, 2.4f);
+            }
+            return ret;
+        }();
+        return table[c];
+    }
 };
 
 struct TextureGPU {
     __host__
     TextureGPU(Texture const& hst_tex) :
-        pixel_width(hst_tex.pixel_width), pixel_height(hst_tex.pixel_height), dev_arr(nullptr), tex(0) {
+        pixel_width(hst_tex.pixel_width), pixel_height(hst_tex.pixel_height), dev_arr(nullptr), tex(0), hst_tex(nullptr) {
         //reference: https://docs.nvidia.com/cuda/cuda-c-programming-guide/index.html#texture-object-api
 
         cudaChannelFormatDesc desc = cudaCreateChannelDesc<uchar4>();
@@ -61,27 +94,39 @@ struct TextureGPU {
 
         CHECK_CUDA(cudaCreateTextureObject(&tex, &res_desc, &tex_desc, 0));
     }
+    // no device copy, only sampled on the host by the host backend
+    __host__
+    static TextureGPU host_view(Texture const& hst_tex) {
+        TextureGPU ret;
+        ret.pixel_width = hst_tex.pixel_width;
+        ret.pixel_height = hst_tex.pixel_height;
+        ret.hst_tex = &hst_tex;
+        return ret;
+    }
     __host__
     void free() {
         CHECK_CUDA(cudaFreeArray(dev_arr));
         CHECK_CUDA(cudaDestroyTextureObject(tex));
     }
 
-    __device__ color_t sample(glm::vec2 const& uv) {
-#ifndef __CUDA_ARCH__
-#define f(x,y,z) color_t(1,0,0)
-#else
-#define f(x,y,z) tex2D<float4>(x,y,z)
-#endif
-        auto col = f(tex, uv.x, uv.y);
+    __host__ __device__ color_t sample(glm::vec2 const& uv) const {
+#ifdef __CUDA_ARCH__
+        float4 col = tex2D<float4>(tex, uv.x, uv.y);
         return color_t(col.x, col.y, col.z);
-#undef f
+#else
+        return hst_tex ? hst_tex->sample(uv) : color_t(1, 0, 0);
+#endif // __CUDA_ARCH__
     }
 
     int pixel_width;
     int pixel_height;
     cudaArray_t dev_arr;
     cudaTextureObject_t tex;
+    Texture const* hst_tex; // only set by host_view
+
+private:
+    __host__
+    TextureGPU() : pixel_width(0), pixel_height(0), dev_arr(nullptr), tex(0), hst_tex(nullptr) { }
 };
 
 
@@ -168,6 +213,23 @@ struct Geom {
     glm::mat4 invTranspose;
 };
 
+enum CompactPrimType {
+    COMPACT_NONE,          // meshes have no compact form
+    COMPACT_SPHERE,        // uniformly scaled sphere
+    COMPACT_AXIS_BOX,      // unrotated cube
+    COMPACT_AFFINE_SPHERE,
+    COMPACT_AFFINE_BOX
+};
+
+// world space form of a sphere or cube geom, all that the closest hit search reads of it
+// COMPACT_SPHERE:        rows[0] = center & radius
+// COMPACT_AXIS_BOX:      rows[0].xyz = min corner, rows[1].xyz = max corner
+// COMPACT_AFFINE_*:      rows = world to object transform, the object space shape is the same as the Geom's
+struct CompactPrim {
+    glm::vec4 rows[3];
+    int type;
+};
+
 struct RenderState {
     Camera camera;
     unsigned int iterations;
@@ -231,6 +293,205 @@ struct ShadeableIntersection {
     }
 };
 
+// structure of arrays storage of PathSegments, one array per field
+// a pass loads only the fields it uses, e.g. compaction only reads remainingBounces
+// the pointers are either all host or all device pointers, the owner allocates & frees them
+struct PathSegmentSoA {
+    // stencil predicate of compaction, on remainingBounces
+    struct LiveRule {
+        __host__ __device__ bool operator()(int remainingBounces) const {
+            return remainingBounces > 0;
+        }
+    };
+
+    glm::vec3* origin;
+    glm::vec3* direction;
+    color_t* color;
+    int* pixelIndex;
+    int* remainingBounces;
+    int count;
+
+    __host__ __device__ PathSegmentSoA()
+        : origin(nullptr), direction(nullptr), color(nullptr), pixelIndex(nullptr), remainingBounces(nullptr), count(0) { }
+
+    __host__ __device__ int size() const {
+        return count;
+    }
+    __host__ __device__ Ray ray(int i) const {
+        Ray r;
+        r.origin = origin[i];
+        r.direction = direction[i];
+        return r;
+    }
+    __host__ __device__ PathSegment load(int i) const {
+        PathSegment seg;
+        seg.ray = ray(i);
+        seg.color = color[i];
+        seg.pixelIndex = pixelIndex[i];
+        seg.remainingBounces = remainingBounces[i];
+        return seg;
+    }
+    __host__ __device__ void store(int i, PathSegment const& seg) const {
+        origin[i] = seg.ray.origin;
+        direction[i] = seg.ray.direction;
+        color[i] = seg.color;
+        pixelIndex[i] = seg.pixelIndex;
+        remainingBounces[i] = seg.remainingBounces;
+    }
+    // the first n paths
+    __host__ __device__ PathSegmentSoA prefix(int n) const {
+        PathSegmentSoA ret = *this;
+        ret.count = n;
+        return ret;
+    }
+};
+
+// structure of arrays storage of ShadeableIntersections, same conventions as PathSegmentSoA
+// a miss only writes t = -1 & materialId = -1, the surface attributes are left as they are
+struct ShadeableIntersectionSoA {
+    float* t;
+    glm::vec3* surfaceNormal;
+    glm::vec3* hitPoint;
+    int* materialId;
+    glm::vec2* uv;
+    color_t* tex_color;
+    int count;
+
+    __host__ __device__ ShadeableIntersectionSoA()
+        : t(nullptr), surfaceNormal(nullptr), hitPoint(nullptr), materialId(nullptr), uv(nullptr), tex_color(nullptr), count(0) { }
+
+    __host__ __device__ int size() const {
+        return count;
+    }
+    __host__ __device__ bool valid(int i) const {
+        return t[i] >= 0.f;
+    }
+    __host__ __device__ ShadeableIntersection load(int i) const {
+        ShadeableIntersection inters;
+        inters.t = t[i];
+        inters.materialId = materialId[i];
+        if (inters.t >= 0.f) {
+            inters.surfaceNormal = surfaceNormal[i];
+            inters.hitPoint = hitPoint[i];
+            inters.uv = uv[i];
+            inters.tex_color = tex_color[i];
+        }
+        return inters;
+    }
+    __host__ __device__ void store(int i, ShadeableIntersection const& inters) const {
+        t[i] = inters.t;
+        materialId[i] = inters.t >= 0.f ? inters.materialId : -1;
+        if (inters.t >= 0.f) {
+            surfaceNormal[i] = inters.surfaceNormal;
+            hitPoint[i] = inters.hitPoint;
+            uv[i] = inters.uv;
+            tex_color[i] = inters.tex_color;
+        }
+    }
+    __host__ __device__ ShadeableIntersectionSoA prefix(int n) const {
+        ShadeableIntersectionSoA ret = *this;
+        ret.count = n;
+        return ret;
+    }
+};
+
+// sort key of the material sort, the material id in the high word & the path slot in the low word
+// a key-only sort of them groups the paths by material, ties keep their slot order,
+// the low words are then the permutation to gather or shade the paths through
+// misses (material -1) wrap to the largest id and end up last
+struct MaterialSortKey {
+    __host__ __device__ static uint64_t make(int materialId, int index) {
+        return ((uint64_t)(uint32_t)materialId << 32) | (uint32_t)index;
+    }
+    __host__ __device__ static int materialId(uint64_t key) {
+        return (int)(uint32_t)(key >> 32);
+    }
+    __host__ __device__ static int index(uint64_t key) {
+        return (int)(uint32_t)key;
+    }
+    // key to path slot, for the gather
+    __host__ __device__ int operator()(uint64_t key) const {
+        return index(key);
+    }
+};
+
+// minimal record of the closest hit found while traversing an acceleration structure
+// attributes (normal, uv, texture color) are resolved from it afterwards
+struct HitInfo {
+    float t;         // world space distance along the ray
+    int geom_id;
+    int triangle_id; // -1 if the geom is a primitive
+    glm::vec2 bary;  // barycentric coord, only used by triangles
+
+    __host__ __device__ HitInfo() : t(FLT_MAX), geom_id(-1), triangle_id(-1), bary(0) { }
+    __host__ __device__ bool valid() const {
+        return geom_id != -1;
+    }
+};
+
+// reference to one primitive stored in the leaves of an acceleration structure
+struct leaf_data {
+    leaf_data() = default;
+    __host__ __device__ leaf_data(int triangle_id, int geom_id)
+        : triangle_id(triangle_id), geom_id(geom_id) {}
+    int triangle_id; // -1 if the geom is a primitive
+    int geom_id; // geom that this triangle belongs to
+};
+
+// triangle of a leaf reference with its edges precomputed, stored in the same order as the references
+// so that a leaf test is one contiguous load without any vertex indirection
+// world space for static geometry, object space for bottom-level trees
+struct BakedTriangle {
+    glm::vec4 v0;
+    glm::vec4 e1; // w: -1 if the baking transform flips the winding, 1 otherwise
+    glm::vec4 e2;
+};
+
+/// <summary>
+/// when the octree builder stops subdividing a node
+/// defaults come from consts.h, a scene may override them with an OCTREE block
+/// </summary>
+struct OctreeSettings {
+    int max_depth;        // clamped to OCTREE_MAX_DEPTH
+    int max_leaf_size;    // nodes with at most this many primitives become leaves
+    float min_extent;     // nodes whose children would be thinner than this become leaves
+    bool sah_termination; // whether to stop when splitting is estimated to cost more than the leaf
+    float traversal_cost;
+    float intersect_cost;
+
+    OctreeSettings() : max_depth(OCTREE_DEPTH), max_leaf_size(OCTREE_MAX_LEAF_SIZE), min_extent(OCTREE_MIN_EXTENT),
+        sah_termination(true), traversal_cost(OCTREE_TRAVERSAL_COST), intersect_cost(OCTREE_INTERSECT_COST) { }
+
+    // subdivides every non-empty node down to a fixed depth
+    static OctreeSettings fixed_depth(int depth) {
+        OctreeSettings ret;
+        ret.max_depth = depth;
+        ret.max_leaf_size = 0;
+        ret.min_extent = 0;
+        ret.sah_termination = false;
+        return ret;
+    }
+};
+
+/// <summary>
+/// how far the spatial split BVH builder may duplicate triangle references
+/// </summary>
+struct SpatialSplitSettings {
+    float max_duplication; // memory budget, extra references as a fraction of the primitive count
+    float min_overlap;     // overlap of the object split children, relative to the root area, that enables spatial splits
+
+    SpatialSplitSettings() : max_duplication(SBVH_MAX_DUPLICATION), min_overlap(SBVH_MIN_OVERLAP) { }
+};
+
+// per-ray counters used to measure traversal cost
+struct TraversalStats {
+    int nodes_visited;
+    int prims_tested;
+    int prims_skipped; // tests avoided because the ray already tested the primitive in another leaf
+
+    __host__ __device__ TraversalStats() : nodes_visited(0), prims_tested(0), prims_skipped(0) { }
+};
+
 // Stored in the scene structure
 // automatically generated from objects with emittance > 0 
 // to provide info about lights in the scene
@@ -288,4 +549,5 @@ struct MeshInfo {
     glm::vec4* tangents;
     Mesh* meshes;
     Material* materials;
+    CompactPrim* compact_prims; // parallel to the geoms
 };
\ No newline at end of file
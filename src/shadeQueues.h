@@ -0,0 +1,106 @@
+#pragma once
+
+#include "sceneStructs.h"
+#include "interactions.h"
+
+// queues of the wavefront shading stage, one per Material::Type for the paths that scatter,
+// followed by one for the paths that end at this hit (misses & lights)
+enum ShadeQueueId {
+	SHADE_QUEUE_FINISHED = Material::Type::INVALID,
+	NUM_SHADE_QUEUES
+};
+
+/// <summary>
+/// bins the path slots by the shading they need, so that each queue is shaded by its own specialized kernel
+/// filled in two passes: count() every path, scan() the counts into offsets, then push() every path again;
+/// the arrays are either all host or all device arrays, the owner allocates & frees them
+/// on the device push() appends with atomics, the order within a queue is arbitrary;
+/// on the host the queues are filled by one thread & keep the slot order
+/// </summary>
+struct ShadeQueues {
+	int* counts;  // NUM_SHADE_QUEUES, paths in each queue
+	int* offsets; // NUM_SHADE_QUEUES, first entry of each queue in slots
+	int* heads;   // NUM_SHADE_QUEUES, entries pushed so far, zeroed by scan()
+	int* slots;   // path slots grouped by queue
+
+	__host__ __device__ ShadeQueues() : counts(nullptr), offsets(nullptr), heads(nullptr), slots(nullptr) { }
+
+	// lays the counts, offsets & heads out back to back in data, 3 * NUM_SHADE_QUEUES ints
+	__host__ __device__ void bind(int* data, int* slots) {
+		counts = data;
+		offsets = data + NUM_SHADE_QUEUES;
+		heads = data + 2 * NUM_SHADE_QUEUES;
+		this->slots = slots;
+	}
+
+	__host__ __device__ static int queueOf(float t, int materialId, Material const* materials) {
+		return segmentScatters(t, materialId, materials) ? (int)materials[materialId].type : (int)SHADE_QUEUE_FINISHED;
+	}
+
+	__host__ __device__ void count(int queue) {
+		fetchAdd(counts + queue, 1);
+	}
+	// exclusive prefix sum of the counts, NUM_SHADE_QUEUES entries are too few to do it in parallel
+	__host__ __device__ void scan() {
+		int sum = 0;
+		for (int q = 0; q < NUM_SHADE_QUEUES; ++q) {
+			offsets[q] = sum;
+			heads[q] = 0;
+			sum += counts[q];
+		}
+	}
+	__host__ __device__ void push(int queue, int slot) {
+		slots[offsets[queue] + fetchAdd(heads + queue, 1)] = slot;
+	}
+	__host__ __device__ void clear() {
+		for (int q = 0; q < NUM_SHADE_QUEUES; ++q) {
+			counts[q] = 0;
+		}
+	}
+
+private:
+	__host__ __device__ static int fetchAdd(int* p, int val) {
+#ifdef __CUDA_ARCH__
+		return atomicAdd(p, val);
+#else
+		int old = *p;
+		*p += val;
+		return old;
+#endif // __CUDA_ARCH__
+	}
+};
+
+// shades a path taken from a queue, the host counterpart of the kernel launched for each queue
+__host__ __device__ inline
+void shadeQueuedSegment(
+	int queue,
+	PathSegment& path,
+	ShadeableIntersection const& intersection,
+	Material const* materials,
+	Span<Light> const& lights,
+	thrust::default_random_engine& rng) {
+
+	switch (queue) {
+	case Material::Type::DIFFUSE:
+		scatterSegmentOfType<Material::Type::DIFFUSE>(path, intersection, materials, lights, rng);
+		break;
+	case Material::Type::GLOSSY:
+		scatterSegmentOfType<Material::Type::GLOSSY>(path, intersection, materials, lights, rng);
+		break;
+	case Material::Type::REFL:
+		scatterSegmentOfType<Material::Type::REFL>(path, intersection, materials, lights, rng);
+		break;
+	case Material::Type::TRANSPARENT:
+		scatterSegmentOfType<Material::Type::TRANSPARENT>(path, intersection, materials, lights, rng);
+		break;
+	case Material::Type::REFR:
+		scatterSegmentOfType<Material::Type::REFR>(path, intersection, materials, lights, rng);
+		break;
+	case Material::Type::SUBSURFACE:
+		scatterSegmentOfType<Material::Type::SUBSURFACE>(path, intersection, materials, lights, rng);
+		break;
+	default:
+		finishSegment(path, intersection, materials);
+		break;
+	}
+}
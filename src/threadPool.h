@@ -0,0 +1,207 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// a minimal fixed-size pool of host worker threads
+/// used by the acceleration structure builders
+/// </summary>
+class ThreadPool {
+	std::vector<std::thread> _workers;
+	std::deque<std::function<void()>> _tasks;
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	bool _stop;
+
+	void worker_loop() {
+		while (true) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_cv.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+				if (_stop && _tasks.empty()) {
+					return;
+				}
+				task = std::move(_tasks.front());
+				_tasks.pop_front();
+			}
+			task();
+		}
+	}
+public:
+	explicit ThreadPool(unsigned num_threads) : _stop(false) {
+		if (!num_threads) {
+			num_threads = 1;
+		}
+		for (unsigned i = 0; i < num_threads; ++i) {
+			_workers.emplace_back([this]() { worker_loop(); });
+		}
+	}
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_cv.notify_all();
+		for (std::thread& t : _workers) {
+			t.join();
+		}
+	}
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool(ThreadPool&&) = delete;
+
+	// pool shared by the whole application, sized to the hardware
+	static ThreadPool& instance() {
+		static ThreadPool pool(std::thread::hardware_concurrency());
+		return pool;
+	}
+
+	size_t size() const {
+		return _workers.size();
+	}
+	void submit(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_tasks.emplace_back(std::move(task));
+		}
+		_cv.notify_one();
+	}
+	// runs one queued task on the calling thread
+	// returns false if there was nothing to run
+	bool run_pending() {
+		std::function<void()> task;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_tasks.empty()) {
+				return false;
+			}
+			task = std::move(_tasks.back());
+			_tasks.pop_back();
+		}
+		task();
+		return true;
+	}
+};
+
+/// <summary>
+/// a set of tasks that can be waited on together;
+/// the waiting thread helps draining the pool, so tasks may spawn and wait on nested groups
+/// </summary>
+class TaskGroup {
+	ThreadPool& _pool;
+	std::atomic<int> _pending;
+public:
+	explicit TaskGroup(ThreadPool& pool = ThreadPool::instance()) : _pool(pool), _pending(0) { }
+	~TaskGroup() {
+		wait();
+	}
+	TaskGroup(TaskGroup const&) = delete;
+	TaskGroup(TaskGroup&&) = delete;
+
+	template<typename Func>
+	void run(Func func) {
+		++_pending;
+		_pool.submit([this, func]() {
+			func();
+			--_pending;
+		});
+	}
+	void wait() {
+		while (_pending.load()) {
+			if (!_pool.run_pending()) {
+				std::this_thread::yield();
+			}
+		}
+	}
+};
+
+/// <summary>
+/// splits [0, count) into at most num_chunks contiguous chunks and runs func(chunk, begin, end) for each of them on the pool
+/// </summary>
+/// <returns> number of chunks, chunk indices passed to func are below it </returns>
+template<typename Func>
+size_t parallelFor(ThreadPool& pool, size_t count, size_t num_chunks, Func const& func) {
+	num_chunks = std::max<size_t>(1, std::min(num_chunks, count));
+	size_t chunk_size = (count + num_chunks - 1) / num_chunks;
+	num_chunks = count ? (count + chunk_size - 1) / chunk_size : 1;
+	TaskGroup group(pool);
+	for (size_t c = 0; c < num_chunks; ++c) {
+		size_t begin = c * chunk_size, end = std::min(count, begin + chunk_size);
+		group.run([&func, c, begin, end]() {
+			func(c, begin, end);
+		});
+	}
+	group.wait();
+	return num_chunks;
+}
+
+/// <summary>
+/// per-worker deques of item indices for parallelForStealing;
+/// the owner takes items from the front of its deque, a worker whose deque is empty steals from the back of the others
+/// </summary>
+class StealingQueues {
+	struct queue {
+		std::mutex mutex;
+		std::deque<size_t> items;
+	};
+	std::vector<queue> _queues;
+public:
+	// worker w starts with the w-th contiguous run of [0, count), neighbouring items stay on the same worker
+	StealingQueues(size_t num_workers, size_t count) : _queues(num_workers) {
+		for (size_t w = 0; w < num_workers; ++w) {
+			for (size_t i = count * w / num_workers; i < count * (w + 1) / num_workers; ++i) {
+				_queues[w].items.push_back(i);
+			}
+		}
+	}
+	StealingQueues(StealingQueues const&) = delete;
+	StealingQueues(StealingQueues&&) = delete;
+
+	// returns false once every deque is empty, no items are added after construction
+	bool take(size_t worker, size_t& item) {
+		for (size_t i = 0; i < _queues.size(); ++i) {
+			queue& q = _queues[(worker + i) % _queues.size()];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (q.items.empty()) {
+				continue;
+			}
+			if (i == 0) {
+				item = q.items.front();
+				q.items.pop_front();
+			} else {
+				item = q.items.back();
+				q.items.pop_back();
+			}
+			return true;
+		}
+		return false;
+	}
+};
+
+/// <summary>
+/// runs func(worker, item) for every item of [0, count) with one worker per pool thread;
+/// unlike parallelFor the items are balanced while they run, which suits items of very different costs such as image tiles
+/// </summary>
+/// <returns> number of workers, worker indices passed to func are below it </returns>
+template<typename Func>
+size_t parallelForStealing(ThreadPool& pool, size_t count, Func const& func) {
+	size_t num_workers = std::max<size_t>(1, std::min(pool.size(), count));
+	StealingQueues queues(num_workers, count);
+	TaskGroup group(pool);
+	for (size_t w = 0; w < num_workers; ++w) {
+		group.run([&func, &queues, w]() {
+			size_t item;
+			while (queues.take(w, item)) {
+				func(w, item);
+			}
+		});
+	}
+	group.wait();
+	return num_workers;
+}
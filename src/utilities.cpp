@@ -8,11 +8,12 @@
 #include <glm/gtc/matrix_inverse.hpp>
 #include <iostream>
 #include <cstdio>
-#include "main.h"
 #include "utilities.h"
 
 #ifdef _WIN32
 #include <Windows.h>
+#else
+#include <dirent.h>
 #endif // _WIN32
 
 std::vector<std::string> utilityCore::getFilesInDir(char const* dir) {
@@ -37,7 +38,14 @@ std::vector<std::string> utilityCore::getFilesInDir(char const* dir) {
         ::FindClose(hFind);
     }
 #else
-    assert(!"unsupported platform")
+    if (DIR* d = opendir(dir)) {
+        while (dirent* entry = readdir(d)) {
+            if (entry->d_type != DT_DIR) {
+                names.emplace_back(std::string(dir) + entry->d_name);
+            }
+        }
+        closedir(d);
+    }
 #endif
     return names;
 }